@@ -0,0 +1,545 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * A benchmark of limit_req zone lookups from several worker processes,
+ * with the zone in one part and split into shards.
+ *
+ * It is built against a configured tree by
+ *
+ *     make -f misc/GNUmakefile limit-req-bench
+ *
+ * and runs
+ *
+ *     objs/ngx_http_limit_req_bench [workers [shards [iterations]]]
+ *
+ * Each worker process looks up random keys from a set of clients in
+ * a shared zone, the same way ngx_http_limit_req_lookup() does: under
+ * the zone mutex, or under the mutex of the shard selected by the key hash.
+ * The zone is split into nested slab pools as limit_req_zone does with
+ * the "shards" parameter.  Differences are only seen on several CPUs.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+#define NGX_LIMIT_REQ_BENCH_ZONE     (16 * 1024 * 1024)
+#define NGX_LIMIT_REQ_BENCH_CLIENTS  100000
+#define NGX_LIMIT_REQ_BENCH_RATE     10000
+
+
+/* as in ngx_http_limit_req_module.c */
+
+typedef struct {
+    u_char                       color;
+    u_char                       dummy;
+    u_short                      len;
+    ngx_queue_t                  queue;
+    ngx_msec_t                   last;
+    ngx_uint_t                   excess;
+    ngx_uint_t                   count;
+    u_char                       data[1];
+} ngx_limit_req_bench_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                 rbtree;
+    ngx_rbtree_node_t            sentinel;
+    ngx_queue_t                  queue;
+} ngx_limit_req_bench_shctx_t;
+
+
+typedef struct {
+    ngx_limit_req_bench_shctx_t  *sh;
+    ngx_slab_pool_t              *shpool;
+} ngx_limit_req_bench_shard_t;
+
+
+static ngx_int_t ngx_limit_req_bench_init(ngx_shm_t *shm,
+    ngx_limit_req_bench_shard_t *shards, ngx_uint_t nshards);
+static ngx_int_t ngx_limit_req_bench_run(ngx_limit_req_bench_shard_t *shards,
+    ngx_uint_t nshards, ngx_int_t workers, ngx_int_t n);
+static ngx_int_t ngx_limit_req_bench_worker(
+    ngx_limit_req_bench_shard_t *shards, ngx_uint_t nshards, ngx_int_t n);
+static ngx_int_t ngx_limit_req_bench_lookup(ngx_limit_req_bench_shard_t *shard,
+    ngx_uint_t hash, ngx_str_t *key, ngx_msec_t now);
+static void ngx_limit_req_bench_expire(ngx_limit_req_bench_shard_t *shard,
+    ngx_uint_t n, ngx_msec_t now);
+static void ngx_limit_req_bench_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static uint64_t ngx_limit_req_bench_time(void);
+
+
+static ngx_log_t      ngx_limit_req_bench_log;
+static ngx_cycle_t    ngx_limit_req_bench_cycle;
+
+volatile ngx_cycle_t  *ngx_cycle = &ngx_limit_req_bench_cycle;
+
+ngx_pid_t             ngx_pid;
+ngx_int_t             ngx_ncpu;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t                     workers, shards, n, i;
+    ngx_shm_t                     shm;
+    ngx_limit_req_bench_shard_t  *sh;
+
+    workers = (argc > 1) ? ngx_atoi((u_char *) argv[1], ngx_strlen(argv[1]))
+                         : 4;
+    shards = (argc > 2) ? ngx_atoi((u_char *) argv[2], ngx_strlen(argv[2]))
+                        : 16;
+    n = (argc > 3) ? ngx_atoi((u_char *) argv[3], ngx_strlen(argv[3]))
+                   : 1000000;
+
+    if (workers <= 0 || shards <= 0 || shards > 64 || n <= 0) {
+        fprintf(stderr, "usage: %s [workers [shards [iterations]]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    ngx_limit_req_bench_cycle.log = &ngx_limit_req_bench_log;
+
+    ngx_pid = getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ngx_pagesize = getpagesize();
+    for (i = ngx_pagesize; i >>= 1; ngx_pagesize_shift++) { /* void */ }
+
+    ngx_slab_sizes_init();
+
+    sh = malloc(shards * sizeof(ngx_limit_req_bench_shard_t));
+    if (sh == NULL) {
+        return 1;
+    }
+
+    /* the unsharded zone first, then the same zone in shards */
+
+    for (i = 1; ; i = shards) {
+
+        ngx_memzero(&shm, sizeof(ngx_shm_t));
+
+        shm.size = NGX_LIMIT_REQ_BENCH_ZONE;
+        shm.log = &ngx_limit_req_bench_log;
+        ngx_str_set(&shm.name, "bench");
+
+        if (ngx_shm_alloc(&shm) != NGX_OK
+            || ngx_limit_req_bench_init(&shm, sh, i) != NGX_OK)
+        {
+            fprintf(stderr, "zone initialization failed\n");
+            return 1;
+        }
+
+        if (ngx_limit_req_bench_run(sh, i, workers, n) != NGX_OK) {
+            return 1;
+        }
+
+        ngx_shm_free(&shm);
+
+        if (i == shards) {
+            break;
+        }
+    }
+
+    free(sh);
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_limit_req_bench_init(ngx_shm_t *shm, ngx_limit_req_bench_shard_t *shards,
+    ngx_uint_t nshards)
+{
+    size_t                        size;
+    ngx_uint_t                    i;
+    ngx_slab_pool_t              *shpool, *sp;
+    ngx_limit_req_bench_shctx_t  *sh;
+
+    /* as ngx_init_zone_pool() and ngx_http_limit_req_init_zone() do */
+
+    shpool = (ngx_slab_pool_t *) shm->addr;
+
+    shpool->end = shm->addr + shm->size;
+    shpool->min_shift = 3;
+    shpool->addr = shm->addr;
+
+    if (ngx_shmtx_create(&shpool->mutex, &shpool->lock, NULL) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_slab_init(shpool);
+
+    size = shpool->pfree / nshards * ngx_pagesize;
+
+    for (i = 0; i < nshards; i++) {
+
+        if (nshards == 1) {
+            sp = shpool;
+
+        } else {
+            sp = ngx_slab_add_pool(shpool, size);
+            if (sp == NULL) {
+                return NGX_ERROR;
+            }
+        }
+
+        sh = ngx_slab_alloc(sp, sizeof(ngx_limit_req_bench_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_limit_req_bench_insert_value);
+
+        ngx_queue_init(&sh->queue);
+
+        shards[i].sh = sh;
+        shards[i].shpool = sp;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_limit_req_bench_run(ngx_limit_req_bench_shard_t *shards,
+    ngx_uint_t nshards, ngx_int_t workers, ngx_int_t n)
+{
+    int        status;
+    uint64_t   elapsed;
+    ngx_int_t  i, rc;
+    ngx_pid_t  pid;
+
+    elapsed = ngx_limit_req_bench_time();
+
+    for (i = 0; i < workers; i++) {
+
+        pid = fork();
+
+        if (pid == -1) {
+            fprintf(stderr, "fork() failed\n");
+            return NGX_ERROR;
+        }
+
+        if (pid == 0) {
+            ngx_pid = getpid();
+            srandom(ngx_pid);
+
+            exit(ngx_limit_req_bench_worker(shards, nshards, n) == NGX_OK
+                 ? 0 : 1);
+        }
+    }
+
+    rc = NGX_OK;
+
+    for (i = 0; i < workers; i++) {
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        {
+            rc = NGX_ERROR;
+        }
+    }
+
+    elapsed = ngx_limit_req_bench_time() - elapsed;
+
+    if (rc != NGX_OK) {
+        fprintf(stderr, "%d shards: a worker failed\n", (int) nshards);
+        return NGX_ERROR;
+    }
+
+    printf("%2d shards, %2d workers: %7.1f ns/lookup, "
+           "%6.2f M lookups/s\n",
+           (int) nshards, (int) workers,
+           (double) elapsed / n,
+           elapsed ? (double) workers * n * 1000 / elapsed : 0.0);
+
+    /* not to be repeated by the next workers */
+
+    fflush(stdout);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_limit_req_bench_worker(ngx_limit_req_bench_shard_t *shards,
+    ngx_uint_t nshards, ngx_int_t n)
+{
+    uint32_t    addr;
+    ngx_str_t   key;
+    ngx_int_t   i;
+    ngx_uint_t  hash;
+    ngx_msec_t  now;
+
+    /* $binary_remote_addr of the clients */
+
+    key.len = sizeof(uint32_t);
+    key.data = (u_char *) &addr;
+
+    now = 0;
+
+    for (i = 0; i < n; i++) {
+
+        if (i % 1000 == 0) {
+            now = (ngx_msec_t) (ngx_limit_req_bench_time() / 1000000);
+        }
+
+        addr = 0x0a000000 + random() % NGX_LIMIT_REQ_BENCH_CLIENTS;
+
+        hash = ngx_crc32_short(key.data, key.len);
+
+        if (ngx_limit_req_bench_lookup(&shards[hash % nshards], hash, &key,
+                                       now)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_limit_req_bench_lookup(ngx_limit_req_bench_shard_t *shard,
+    ngx_uint_t hash, ngx_str_t *key, ngx_msec_t now)
+{
+    size_t                       size;
+    ngx_int_t                    rc, excess;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_limit_req_bench_node_t  *lr;
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
+
+    node = shard->sh->rbtree.root;
+    sentinel = shard->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_limit_req_bench_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, lr->data, key->len, (size_t) lr->len);
+
+        if (rc == 0) {
+            ngx_queue_remove(&lr->queue);
+            ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
+
+            ms = (ngx_msec_int_t) (now - lr->last);
+
+            if (ms < 0) {
+                ms = 0;
+            }
+
+            excess = lr->excess - NGX_LIMIT_REQ_BENCH_RATE * ms / 1000 + 1000;
+
+            if (excess < 0) {
+                excess = 0;
+            }
+
+            lr->excess = excess;
+
+            if (ms) {
+                lr->last = now;
+            }
+
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+
+            return NGX_OK;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_limit_req_bench_node_t, data)
+           + key->len;
+
+    ngx_limit_req_bench_expire(shard, 1, now);
+
+    node = ngx_slab_alloc_locked(shard->shpool, size);
+
+    if (node == NULL) {
+        ngx_limit_req_bench_expire(shard, 0, now);
+
+        node = ngx_slab_alloc_locked(shard->shpool, size);
+        if (node == NULL) {
+            ngx_shmtx_unlock(&shard->shpool->mutex);
+            fprintf(stderr, "could not allocate node\n");
+            return NGX_ERROR;
+        }
+    }
+
+    node->key = hash;
+
+    lr = (ngx_limit_req_bench_node_t *) &node->color;
+
+    lr->len = (u_short) key->len;
+    lr->excess = 0;
+    lr->last = now;
+    lr->count = 0;
+
+    ngx_memcpy(lr->data, key->data, key->len);
+
+    ngx_rbtree_insert(&shard->sh->rbtree, node);
+
+    ngx_queue_insert_head(&shard->sh->queue, &lr->queue);
+
+    ngx_shmtx_unlock(&shard->shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_limit_req_bench_expire(ngx_limit_req_bench_shard_t *shard, ngx_uint_t n,
+    ngx_msec_t now)
+{
+    ngx_int_t                    excess;
+    ngx_queue_t                 *q;
+    ngx_msec_int_t               ms;
+    ngx_rbtree_node_t           *node;
+    ngx_limit_req_bench_node_t  *lr;
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&shard->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&shard->sh->queue);
+
+        lr = ngx_queue_data(q, ngx_limit_req_bench_node_t, queue);
+
+        if (n++ != 0) {
+
+            ms = (ngx_msec_int_t) (now - lr->last);
+            ms = ngx_abs(ms);
+
+            if (ms < 60000) {
+                return;
+            }
+
+            excess = lr->excess - NGX_LIMIT_REQ_BENCH_RATE * ms / 1000;
+
+            if (excess > 0) {
+                return;
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&shard->sh->rbtree, node);
+
+        ngx_slab_free_locked(shard->shpool, node);
+    }
+}
+
+
+static void
+ngx_limit_req_bench_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_limit_req_bench_node_t   *lrn, *lrnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lrn = (ngx_limit_req_bench_node_t *) &node->color;
+            lrnt = (ngx_limit_req_bench_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lrn->data, lrnt->data, lrn->len, lrnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static uint64_t
+ngx_limit_req_bench_time(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* ngx_pstrdup() is not used, and the slab debug point stops the benchmark */
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    return NULL;
+}
+
+
+void
+ngx_debug_point(void)
+{
+    abort();
+}
+
+
+/* errors are only logged if the zone runs out of memory */
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, va_list args)
+
+#endif
+{
+}
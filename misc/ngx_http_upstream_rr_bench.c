@@ -0,0 +1,380 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+/*
+ * A benchmark of round-robin peer selection in an upstream shared zone
+ * from several worker processes.
+ *
+ * It is built against a configured tree by
+ *
+ *     make -f misc/GNUmakefile upstream-rr-bench
+ *
+ * and runs
+ *
+ *     objs/ngx_http_upstream_rr_bench [workers [peers [iterations]]]
+ *
+ * Each worker process selects a peer and releases it, the same way
+ * ngx_http_upstream_get_round_robin_peer() and the free handler do:
+ * with current weights in peers under the exclusive lock of the peers,
+ * and with current weights of each worker process under the shared lock.
+ * Running it with 1, 2, 4... workers shows how selection scales with
+ * the number of CPUs.  The resulting distribution is checked against
+ * the weights of peers.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_connect.h>
+
+
+#define NGX_UPSTREAM_RR_BENCH_MAX_PEERS  64
+
+
+/* the fields used by the selection, as in ngx_http_upstream_rr_peer_t */
+
+typedef struct {
+    ngx_int_t                      current_weight;
+    ngx_int_t                      effective_weight;
+    ngx_int_t                      weight;
+
+    ngx_uint_t                     conns;
+    ngx_uint_t                     max_conns;
+
+    ngx_atomic_t                   lock;
+
+    ngx_atomic_t                   selected;
+} ngx_upstream_rr_bench_peer_t;
+
+
+typedef struct {
+    ngx_atomic_t                   rwlock;
+    ngx_uint_t                     number;
+    ngx_int_t                      total_weight;
+    ngx_int_t                     *worker_weights;
+    ngx_upstream_rr_bench_peer_t   peer[NGX_UPSTREAM_RR_BENCH_MAX_PEERS];
+} ngx_upstream_rr_bench_peers_t;
+
+
+static ngx_int_t ngx_upstream_rr_bench_run(ngx_upstream_rr_bench_peers_t *peers,
+    ngx_int_t workers, ngx_int_t n);
+static ngx_int_t ngx_upstream_rr_bench_worker(
+    ngx_upstream_rr_bench_peers_t *peers, ngx_int_t n);
+static ngx_upstream_rr_bench_peer_t *ngx_upstream_rr_bench_get_peer(
+    ngx_upstream_rr_bench_peers_t *peers, ngx_int_t *weights);
+static void ngx_upstream_rr_bench_free_peer(
+    ngx_upstream_rr_bench_peers_t *peers, ngx_upstream_rr_bench_peer_t *peer);
+static uint64_t ngx_upstream_rr_bench_time(void);
+
+
+static ngx_log_t      ngx_upstream_rr_bench_log;
+
+volatile ngx_cycle_t  *ngx_cycle;
+
+ngx_uint_t            ngx_worker;
+ngx_int_t             ngx_ncpu;
+
+
+int ngx_cdecl
+main(int argc, char *const *argv)
+{
+    ngx_int_t                       workers, npeers, n, i, m;
+    ngx_shm_t                       shm;
+    ngx_upstream_rr_bench_peers_t  *peers;
+
+    workers = (argc > 1) ? ngx_atoi((u_char *) argv[1], ngx_strlen(argv[1]))
+                         : 4;
+    npeers = (argc > 2) ? ngx_atoi((u_char *) argv[2], ngx_strlen(argv[2]))
+                        : 8;
+    n = (argc > 3) ? ngx_atoi((u_char *) argv[3], ngx_strlen(argv[3]))
+                   : 1000000;
+
+    if (workers <= 0 || npeers <= 1
+        || npeers > NGX_UPSTREAM_RR_BENCH_MAX_PEERS || n <= 0)
+    {
+        fprintf(stderr, "usage: %s [workers [peers [iterations]]]\n",
+                argv[0]);
+        return 1;
+    }
+
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ngx_memzero(&shm, sizeof(ngx_shm_t));
+
+    shm.size = ngx_align(sizeof(ngx_upstream_rr_bench_peers_t),
+                         NGX_CPU_CACHE_LINE)
+               + ngx_event_peer_weights_size(npeers) * workers;
+    shm.log = &ngx_upstream_rr_bench_log;
+    ngx_str_set(&shm.name, "bench");
+
+    if (ngx_shm_alloc(&shm) != NGX_OK) {
+        fprintf(stderr, "zone allocation failed\n");
+        return 1;
+    }
+
+    /* the exclusive lock first, then the per-worker weights */
+
+    for (m = 0; m < 2; m++) {
+
+        ngx_memzero(shm.addr, shm.size);
+
+        peers = (ngx_upstream_rr_bench_peers_t *) shm.addr;
+
+        peers->number = npeers;
+
+        for (i = 0; i < npeers; i++) {
+            peers->peer[i].weight = i % 3 + 1;
+            peers->peer[i].effective_weight = peers->peer[i].weight;
+            peers->total_weight += peers->peer[i].weight;
+        }
+
+        if (m) {
+            peers->worker_weights = (ngx_int_t *)
+                (shm.addr + ngx_align(sizeof(ngx_upstream_rr_bench_peers_t),
+                                      NGX_CPU_CACHE_LINE));
+        }
+
+        if (ngx_upstream_rr_bench_run(peers, workers, n) != NGX_OK) {
+            return 1;
+        }
+    }
+
+    ngx_shm_free(&shm);
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_upstream_rr_bench_run(ngx_upstream_rr_bench_peers_t *peers,
+    ngx_int_t workers, ngx_int_t n)
+{
+    int        status;
+    double     expected;
+    uint64_t   elapsed;
+    ngx_int_t  i, rc;
+    ngx_pid_t  pid;
+
+    elapsed = ngx_upstream_rr_bench_time();
+
+    for (i = 0; i < workers; i++) {
+
+        pid = fork();
+
+        if (pid == -1) {
+            fprintf(stderr, "fork() failed\n");
+            return NGX_ERROR;
+        }
+
+        if (pid == 0) {
+            ngx_worker = i;
+
+            exit(ngx_upstream_rr_bench_worker(peers, n) == NGX_OK ? 0 : 1);
+        }
+    }
+
+    rc = NGX_OK;
+
+    for (i = 0; i < workers; i++) {
+        if (wait(&status) == -1 || !WIFEXITED(status)
+            || WEXITSTATUS(status) != 0)
+        {
+            rc = NGX_ERROR;
+        }
+    }
+
+    elapsed = ngx_upstream_rr_bench_time() - elapsed;
+
+    if (rc != NGX_OK) {
+        fprintf(stderr, "a worker failed\n");
+        return NGX_ERROR;
+    }
+
+    /*
+     * the smooth weighted round-robin selects each peer exactly
+     * in proportion to its weight, give or take a round of selections
+     * in each worker process
+     */
+
+    for (i = 0; i < (ngx_int_t) peers->number; i++) {
+        expected = (double) workers * n * peers->peer[i].weight
+                   / peers->total_weight;
+
+        if (ngx_abs((double) peers->peer[i].selected - expected)
+            > (double) workers * peers->total_weight)
+        {
+            fprintf(stderr, "peer %d: selected %lu times, expected %.0f\n",
+                    (int) i, (unsigned long) peers->peer[i].selected,
+                    expected);
+            return NGX_ERROR;
+        }
+    }
+
+    printf("%-10s %2d workers, %2d peers: %7.1f ns/selection, "
+           "%6.2f M selections/s\n",
+           peers->worker_weights ? "per worker" : "exclusive",
+           (int) workers, (int) peers->number,
+           (double) elapsed / n,
+           elapsed ? (double) workers * n * 1000 / elapsed : 0.0);
+
+    /* not to be repeated by the next workers */
+
+    fflush(stdout);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_upstream_rr_bench_worker(ngx_upstream_rr_bench_peers_t *peers,
+    ngx_int_t n)
+{
+    ngx_int_t                      i, *weights;
+    ngx_uint_t                     selected[NGX_UPSTREAM_RR_BENCH_MAX_PEERS];
+    ngx_upstream_rr_bench_peer_t  *peer;
+
+    weights = NULL;
+
+    if (peers->worker_weights) {
+        weights = ngx_event_peer_worker_weights(peers->worker_weights,
+                                                peers->number);
+    }
+
+    ngx_memzero(selected, sizeof(selected));
+
+    for (i = 0; i < n; i++) {
+
+        peer = ngx_upstream_rr_bench_get_peer(peers, weights);
+        if (peer == NULL) {
+            return NGX_ERROR;
+        }
+
+        selected[peer - peers->peer]++;
+
+        ngx_upstream_rr_bench_free_peer(peers, peer);
+    }
+
+    for (i = 0; i < (ngx_int_t) peers->number; i++) {
+        (void) ngx_atomic_fetch_add(&peers->peer[i].selected, selected[i]);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_upstream_rr_bench_peer_t *
+ngx_upstream_rr_bench_get_peer(ngx_upstream_rr_bench_peers_t *peers,
+    ngx_int_t *weights)
+{
+    ngx_int_t                      total, *current, *best_current;
+    ngx_uint_t                     i;
+    ngx_upstream_rr_bench_peer_t  *peer, *best;
+
+    if (weights) {
+        ngx_rwlock_rlock(&peers->rwlock);
+
+    } else {
+        ngx_rwlock_wlock(&peers->rwlock);
+    }
+
+    best = NULL;
+    best_current = NULL;
+    total = 0;
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->max_conns && peer->conns >= peer->max_conns) {
+            continue;
+        }
+
+        current = weights ? &weights[i] : &peer->current_weight;
+
+        *current += peer->effective_weight;
+        total += peer->effective_weight;
+
+        if (peer->effective_weight < peer->weight) {
+            ngx_rwlock_wlock(&peer->lock);
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            ngx_rwlock_unlock(&peer->lock);
+        }
+
+        if (best == NULL || *current > *best_current) {
+            best = peer;
+            best_current = current;
+        }
+    }
+
+    if (best) {
+        *best_current -= total;
+
+        ngx_rwlock_wlock(&best->lock);
+        best->conns++;
+        ngx_rwlock_unlock(&best->lock);
+    }
+
+    ngx_rwlock_unlock(&peers->rwlock);
+
+    return best;
+}
+
+
+static void
+ngx_upstream_rr_bench_free_peer(ngx_upstream_rr_bench_peers_t *peers,
+    ngx_upstream_rr_bench_peer_t *peer)
+{
+    ngx_rwlock_rlock(&peers->rwlock);
+    ngx_rwlock_wlock(&peer->lock);
+
+    peer->conns--;
+
+    ngx_rwlock_unlock(&peer->lock);
+    ngx_rwlock_unlock(&peers->rwlock);
+}
+
+
+static uint64_t
+ngx_upstream_rr_bench_time(void)
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* ngx_pstrdup() is not used */
+
+void *
+ngx_pnalloc(ngx_pool_t *pool, size_t size)
+{
+    return NULL;
+}
+
+
+/* errors are only logged if the zone cannot be allocated */
+
+#if (NGX_HAVE_VARIADIC_MACROS)
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, ...)
+
+#else
+
+void
+ngx_log_error_core(ngx_uint_t level, ngx_log_t *log, ngx_err_t err,
+    const char *fmt, va_list args)
+
+#endif
+{
+}
@@ -1057,6 +1057,31 @@ ngx_configure_listening_sockets(ngx_cycle_t *cycle)
 
 #endif
 
+#if (NGX_HAVE_UDP_GRO)
+
+        /*
+         * sockets kept over a reload or inherited on binary upgrade
+         * may still have GRO enabled by the previous configuration
+         */
+
+        if (ls[i].type == SOCK_DGRAM
+            && (ls[i].batch || ls[i].previous || ls[i].inherited))
+        {
+            value = ls[i].batch ? 1 : 0;
+
+            if (setsockopt(ls[i].fd, SOL_UDP, UDP_GRO,
+                           (const void *) &value, sizeof(int))
+                == -1)
+            {
+                ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_socket_errno,
+                              "setsockopt(UDP_GRO) "
+                              "for %V failed, ignored",
+                              &ls[i].addr_text);
+            }
+        }
+
+#endif
+
 #if (NGX_HAVE_IP_MTU_DISCOVER)
 
         if (ls[i].quic && ls[i].sockaddr->sa_family == AF_INET) {
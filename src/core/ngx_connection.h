@@ -28,6 +28,7 @@ struct ngx_listening_s {
     int                 backlog;
     int                 rcvbuf;
     int                 sndbuf;
+    int                 batch;
 #if (NGX_HAVE_KEEPALIVE_TUNABLE)
     int                 keepidle;
     int                 keepintvl;
@@ -48,6 +49,7 @@ struct ngx_listening_s {
 
     ngx_listening_t    *previous;
     ngx_connection_t   *connection;
+    void               *recv_batch;  /* ngx_udp_batch_t */
 
     ngx_rbtree_t        rbtree;
     ngx_rbtree_node_t   sentinel;
@@ -162,6 +162,60 @@ ngx_slab_init(ngx_slab_pool_t *pool)
     pool->log_nomem = 1;
     pool->log_ctx = &pool->zero;
     pool->zero = '\0';
+
+    pool->next = NULL;
+}
+
+
+ngx_slab_pool_t *
+ngx_slab_add_pool(ngx_slab_pool_t *pool, size_t size)
+{
+    ngx_slab_pool_t  *sp;
+
+    /*
+     * a nested pool is allocated from the pages of the parent pool
+     * and has its own mutex, so it can be used to split a shared zone
+     * into independently locked parts
+     */
+
+    size = ngx_align(size, ngx_pagesize);
+
+    sp = ngx_slab_alloc(pool, size);
+    if (sp == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(sp, sizeof(ngx_slab_pool_t));
+
+    sp->end = (u_char *) sp + size;
+    sp->min_shift = pool->min_shift;
+    sp->addr = sp;
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+    if (ngx_shmtx_create(&sp->mutex, &sp->lock, NULL) != NGX_OK) {
+        ngx_slab_free(pool, sp);
+        return NULL;
+    }
+
+#else
+
+    /* file locks are not created for nested pools */
+
+    sp->mutex = pool->mutex;
+
+#endif
+
+    ngx_slab_init(sp);
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    sp->next = pool->next;
+    pool->next = sp;
+
+    ngx_shmtx_unlock(&pool->mutex);
+
+    return sp;
 }
 
 
@@ -31,7 +31,9 @@ typedef struct {
 } ngx_slab_stat_t;
 
 
-typedef struct {
+typedef struct ngx_slab_pool_s  ngx_slab_pool_t;
+
+struct ngx_slab_pool_s {
     ngx_shmtx_sh_t    lock;
 
     size_t            min_size;
@@ -56,11 +58,14 @@ typedef struct {
 
     void             *data;
     void             *addr;
-} ngx_slab_pool_t;
+
+    ngx_slab_pool_t  *next;
+};
 
 
 void ngx_slab_sizes_init(void);
 void ngx_slab_init(ngx_slab_pool_t *pool);
+ngx_slab_pool_t *ngx_slab_add_pool(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_alloc(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_alloc_locked(ngx_slab_pool_t *pool, size_t size);
 void *ngx_slab_calloc(ngx_slab_pool_t *pool, size_t size);
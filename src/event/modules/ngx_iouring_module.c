@@ -0,0 +1,1116 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <linux/io_uring.h>
+
+
+/*
+ * The module uses io_uring multishot poll requests to get readiness
+ * notifications, so the rest of nginx still works with nonblocking sockets
+ * exactly as with epoll.  All changes to the interest set, cancellations,
+ * and file AIO reads are queued to the submission ring and are passed
+ * to the kernel along with waiting for completions in a single
+ * io_uring_enter() call per event loop iteration.
+ *
+ * The user_data of a request is a pointer with the two low bits used:
+ * bit 0 is the connection instance, bit 1 marks file AIO requests.
+ * Internal requests, such as cancellations, use zero user_data.
+ */
+
+#define NGX_IOURING_AIO       0x2
+#define NGX_IOURING_MASK      0x3
+
+
+typedef struct {
+    ngx_uint_t                entries;
+} ngx_iouring_conf_t;
+
+
+typedef struct {
+    void                     *sq_ring;
+    size_t                    sq_ring_size;
+    void                     *cq_ring;
+    size_t                    cq_ring_size;
+    struct io_uring_sqe      *sqes;
+    size_t                    sqes_size;
+
+    volatile uint32_t        *sq_head;
+    volatile uint32_t        *sq_tail;
+    uint32_t                  sq_mask;
+    uint32_t                  sq_entries;
+    uint32_t                  sq_local_tail;
+
+    volatile uint32_t        *cq_head;
+    volatile uint32_t        *cq_tail;
+    uint32_t                  cq_mask;
+    struct io_uring_cqe      *cqes;
+
+    ngx_uint_t                cancel_all;   /* unsigned  cancel_all:1; */
+} ngx_iouring_ring_t;
+
+
+static ngx_int_t ngx_iouring_init(ngx_cycle_t *cycle, ngx_msec_t timer);
+static ngx_int_t ngx_iouring_ring_init(ngx_cycle_t *cycle,
+    ngx_iouring_conf_t *iucf);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_iouring_notify_init(ngx_log_t *log);
+static void ngx_iouring_notify_handler(ngx_event_t *ev);
+#endif
+static void ngx_iouring_done(ngx_cycle_t *cycle);
+static struct io_uring_sqe *ngx_iouring_get_sqe(ngx_log_t *log);
+static ngx_int_t ngx_iouring_submit(ngx_log_t *log);
+static ngx_int_t ngx_iouring_poll(ngx_connection_t *c, uint32_t events,
+    ngx_uint_t level, ngx_log_t *log);
+static ngx_int_t ngx_iouring_cancel(ngx_connection_t *c, ngx_log_t *log);
+static ngx_int_t ngx_iouring_add_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_iouring_del_event(ngx_event_t *ev, ngx_int_t event,
+    ngx_uint_t flags);
+static ngx_int_t ngx_iouring_add_connection(ngx_connection_t *c);
+static ngx_int_t ngx_iouring_del_connection(ngx_connection_t *c,
+    ngx_uint_t flags);
+#if (NGX_HAVE_EVENTFD)
+static ngx_int_t ngx_iouring_notify(ngx_event_handler_pt handler);
+#endif
+static ngx_int_t ngx_iouring_process_events(ngx_cycle_t *cycle,
+    ngx_msec_t timer, ngx_uint_t flags);
+static void ngx_iouring_process_poll(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe, ngx_uint_t flags);
+#if (NGX_HAVE_FILE_AIO)
+static void ngx_iouring_process_aio(ngx_cycle_t *cycle,
+    struct io_uring_cqe *cqe);
+#endif
+
+static void *ngx_iouring_create_conf(ngx_cycle_t *cycle);
+static char *ngx_iouring_init_conf(ngx_cycle_t *cycle, void *conf);
+
+
+static int                  ring_fd = -1;
+static ngx_iouring_ring_t   ring;
+
+#if (NGX_HAVE_EVENTFD)
+static int                  notify_fd = -1;
+static ngx_event_t          notify_event;
+static ngx_connection_t     notify_conn;
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+ngx_uint_t                  ngx_iouring_aio;
+#endif
+
+static ngx_str_t      iouring_name = ngx_string("io_uring");
+
+static ngx_command_t  ngx_iouring_commands[] = {
+
+    { ngx_string("io_uring_entries"),
+      NGX_EVENT_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      0,
+      offsetof(ngx_iouring_conf_t, entries),
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_event_module_t  ngx_iouring_module_ctx = {
+    &iouring_name,
+    ngx_iouring_create_conf,             /* create configuration */
+    ngx_iouring_init_conf,               /* init configuration */
+
+    {
+        ngx_iouring_add_event,           /* add an event */
+        ngx_iouring_del_event,           /* delete an event */
+        ngx_iouring_add_event,           /* enable an event */
+        ngx_iouring_del_event,           /* disable an event */
+        ngx_iouring_add_connection,      /* add an connection */
+        ngx_iouring_del_connection,      /* delete an connection */
+#if (NGX_HAVE_EVENTFD)
+        ngx_iouring_notify,              /* trigger a notify */
+#else
+        NULL,                            /* trigger a notify */
+#endif
+        ngx_iouring_process_events,      /* process the events */
+        ngx_iouring_init,                /* init the events */
+        ngx_iouring_done,                /* done the events */
+    }
+};
+
+ngx_module_t  ngx_iouring_module = {
+    NGX_MODULE_V1,
+    &ngx_iouring_module_ctx,             /* module context */
+    ngx_iouring_commands,                /* module directives */
+    NGX_EVENT_MODULE,                    /* module type */
+    NULL,                                /* init master */
+    NULL,                                /* init module */
+    NULL,                                /* init process */
+    NULL,                                /* init thread */
+    NULL,                                /* exit thread */
+    NULL,                                /* exit process */
+    NULL,                                /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+/*
+ * We call io_uring_setup() and io_uring_enter() directly as syscalls
+ * instead of liburing usage, much like it is done for Linux AIO.
+ */
+
+static int
+io_uring_setup(u_int entries, struct io_uring_params *p)
+{
+    return syscall(SYS_io_uring_setup, entries, p);
+}
+
+
+static int
+io_uring_enter(int fd, u_int to_submit, u_int min_complete, u_int flags,
+    void *arg, size_t argsz)
+{
+    return syscall(SYS_io_uring_enter, fd, to_submit, min_complete, flags,
+                   arg, argsz);
+}
+
+
+static ngx_int_t
+ngx_iouring_init(ngx_cycle_t *cycle, ngx_msec_t timer)
+{
+    ngx_iouring_conf_t  *iucf;
+
+    iucf = ngx_event_get_conf(cycle->conf_ctx, ngx_iouring_module);
+
+    if (ring_fd == -1) {
+        if (ngx_iouring_ring_init(cycle, iucf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+#if (NGX_HAVE_EVENTFD)
+        if (ngx_iouring_notify_init(cycle->log) != NGX_OK) {
+            ngx_iouring_module_ctx.actions.notify = NULL;
+        }
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+        ngx_iouring_aio = 1;
+#endif
+    }
+
+    ngx_io = ngx_os_io;
+
+    ngx_event_actions = ngx_iouring_module_ctx.actions;
+
+    ngx_event_flags = NGX_USE_CLEAR_EVENT
+                      |NGX_USE_GREEDY_EVENT
+                      |NGX_USE_EPOLL_EVENT;
+
+#if (NGX_HAVE_EPOLLRDHUP)
+    ngx_use_epoll_rdhup = 1;
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_ring_init(ngx_cycle_t *cycle, ngx_iouring_conf_t *iucf)
+{
+    u_char                  *p;
+    uint32_t                 i, *array;
+    ngx_err_t                err;
+    struct io_uring_params   params;
+
+    ngx_memzero(&params, sizeof(struct io_uring_params));
+
+    params.flags = IORING_SETUP_CLAMP|IORING_SETUP_SUBMIT_ALL
+                   |IORING_SETUP_COOP_TASKRUN;
+
+    ring_fd = io_uring_setup(iucf->entries, &params);
+
+    /* IORING_ASYNC_CANCEL_ALL appeared along with the flags in Linux 5.19 */
+
+    ring.cancel_all = 1;
+
+    if (ring_fd == -1 && ngx_errno == NGX_EINVAL) {
+
+        /* IORING_SETUP_SUBMIT_ALL and IORING_SETUP_COOP_TASKRUN, Linux 5.19 */
+
+        ngx_memzero(&params, sizeof(struct io_uring_params));
+
+        params.flags = IORING_SETUP_CLAMP;
+
+        ring_fd = io_uring_setup(iucf->entries, &params);
+
+        ring.cancel_all = 0;
+    }
+
+    if (ring_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "io_uring_setup() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d sq:%uD cq:%uD",
+                   ring_fd, params.sq_entries, params.cq_entries);
+
+    if (!(params.features & IORING_FEAT_NODROP)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring does not support IORING_FEAT_NODROP");
+        goto failed;
+    }
+
+    /* timeouts are passed with IORING_ENTER_EXT_ARG, Linux 5.11 */
+
+    if (!(params.features & IORING_FEAT_EXT_ARG)) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "io_uring does not support IORING_FEAT_EXT_ARG, "
+                      "Linux 5.11 or newer is required");
+        goto failed;
+    }
+
+    ring.sq_ring_size = params.sq_off.array
+                        + params.sq_entries * sizeof(uint32_t);
+    ring.cq_ring_size = params.cq_off.cqes
+                        + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.sq_ring_size = ngx_max(ring.sq_ring_size, ring.cq_ring_size);
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+
+    if (ring.sq_ring == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQ_RING) failed");
+        ring.sq_ring = NULL;
+        goto failed;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+
+    } else {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ|PROT_WRITE,
+                            MAP_SHARED|MAP_POPULATE, ring_fd,
+                            IORING_OFF_CQ_RING);
+
+        if (ring.cq_ring == MAP_FAILED) {
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                          "mmap(IORING_OFF_CQ_RING) failed");
+            ring.cq_ring = NULL;
+            goto failed;
+        }
+    }
+
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+
+    if (ring.sqes == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "mmap(IORING_OFF_SQES) failed");
+        ring.sqes = NULL;
+        goto failed;
+    }
+
+    p = ring.sq_ring;
+
+    ring.sq_head = (uint32_t *) (p + params.sq_off.head);
+    ring.sq_tail = (uint32_t *) (p + params.sq_off.tail);
+    ring.sq_mask = *(uint32_t *) (p + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+
+    /* the submission queue entries are always used in order */
+
+    array = (uint32_t *) (p + params.sq_off.array);
+
+    for (i = 0; i < params.sq_entries; i++) {
+        array[i] = i;
+    }
+
+    p = ring.cq_ring;
+
+    ring.cq_head = (uint32_t *) (p + params.cq_off.head);
+    ring.cq_tail = (uint32_t *) (p + params.cq_off.tail);
+    ring.cq_mask = *(uint32_t *) (p + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (p + params.cq_off.cqes);
+
+    return NGX_OK;
+
+failed:
+
+    err = ngx_errno;
+
+    ngx_iouring_done(cycle);
+
+    ngx_set_errno(err);
+
+    return NGX_ERROR;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_iouring_notify_init(ngx_log_t *log)
+{
+#if (NGX_HAVE_SYS_EVENTFD_H)
+    notify_fd = eventfd(0, 0);
+#else
+    notify_fd = syscall(SYS_eventfd, 0);
+#endif
+
+    if (notify_fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, log, ngx_errno, "eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "notify eventfd: %d", notify_fd);
+
+    notify_event.handler = ngx_iouring_notify_handler;
+    notify_event.log = log;
+    notify_event.active = 1;
+
+    notify_conn.fd = notify_fd;
+    notify_conn.read = &notify_event;
+    notify_conn.log = log;
+
+    if (ngx_iouring_poll(&notify_conn, EPOLLIN, 0, log) != NGX_OK) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_notify_handler(ngx_event_t *ev)
+{
+    ssize_t               n;
+    uint64_t              count;
+    ngx_err_t             err;
+    ngx_event_handler_pt  handler;
+
+    if (++ev->index == NGX_MAX_UINT32_VALUE) {
+        ev->index = 0;
+
+        n = read(notify_fd, &count, sizeof(uint64_t));
+
+        err = ngx_errno;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                       "read() eventfd %d: %z count:%uL", notify_fd, n, count);
+
+        if ((size_t) n != sizeof(uint64_t)) {
+            ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                          "read() eventfd %d failed", notify_fd);
+        }
+    }
+
+    handler = (ngx_event_handler_pt) (uintptr_t) ev->data;
+    handler(ev);
+}
+
+#endif
+
+
+static void
+ngx_iouring_done(ngx_cycle_t *cycle)
+{
+    if (ring.sqes) {
+        if (munmap(ring.sqes, ring.sqes_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQES) failed");
+        }
+    }
+
+    if (ring.cq_ring && ring.cq_ring != ring.sq_ring) {
+        if (munmap(ring.cq_ring, ring.cq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_CQ_RING) failed");
+        }
+    }
+
+    if (ring.sq_ring) {
+        if (munmap(ring.sq_ring, ring.sq_ring_size) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "munmap(IORING_OFF_SQ_RING) failed");
+        }
+    }
+
+    if (ring_fd != -1 && close(ring_fd) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                      "io_uring close() failed");
+    }
+
+    ring_fd = -1;
+
+    ngx_memzero(&ring, sizeof(ngx_iouring_ring_t));
+
+#if (NGX_HAVE_EVENTFD)
+
+    if (notify_fd != -1) {
+
+        if (close(notify_fd) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, ngx_errno,
+                          "eventfd close() failed");
+        }
+
+        notify_fd = -1;
+    }
+
+#endif
+
+#if (NGX_HAVE_FILE_AIO)
+    ngx_iouring_aio = 0;
+#endif
+}
+
+
+static struct io_uring_sqe *
+ngx_iouring_get_sqe(ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    if (ring.sq_local_tail - *ring.sq_head >= ring.sq_entries) {
+
+        /* the submission queue is full */
+
+        if (ngx_iouring_submit(log) != NGX_OK) {
+            return NULL;
+        }
+
+        if (ring.sq_local_tail - *ring.sq_head >= ring.sq_entries) {
+            ngx_log_error(NGX_LOG_ALERT, log, 0,
+                          "io_uring submission queue overflow");
+            return NULL;
+        }
+    }
+
+    sqe = &ring.sqes[ring.sq_local_tail & ring.sq_mask];
+
+    ngx_memzero(sqe, sizeof(struct io_uring_sqe));
+
+    ring.sq_local_tail++;
+
+    return sqe;
+}
+
+
+static ngx_int_t
+ngx_iouring_submit(ngx_log_t *log)
+{
+    int        n;
+    uint32_t   to_submit;
+    ngx_err_t  err;
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = ring.sq_local_tail;
+
+    to_submit = ring.sq_local_tail - *ring.sq_head;
+
+    if (to_submit == 0) {
+        return NGX_OK;
+    }
+
+    n = io_uring_enter(ring_fd, to_submit, 0, 0, NULL, 0);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring submit: %uD, submitted: %d", to_submit, n);
+
+    if (n == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_EINTR || err == NGX_EAGAIN || err == NGX_EBUSY) {
+            return NGX_OK;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, log, err, "io_uring_enter() failed");
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_poll(ngx_connection_t *c, uint32_t events, ngx_uint_t level,
+    ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring poll: fd:%d ev:%08XD level:%ui",
+                   c->fd, events, level);
+
+    sqe = ngx_iouring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = c->fd;
+    sqe->poll32_events = events;
+    sqe->user_data = (uint64_t) ((uintptr_t) c | c->read->instance);
+
+    /*
+     * multishot poll requests are always edge-triggered, so level-triggered
+     * events are emulated with oneshot requests armed again after each
+     * notification
+     */
+
+    if (!level) {
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_cancel(ngx_connection_t *c, ngx_log_t *log)
+{
+    struct io_uring_sqe  *sqe;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "io_uring cancel: fd:%d", c->fd);
+
+    sqe = ngx_iouring_get_sqe(log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * unlike epoll, a poll request holds a reference to the file,
+     * so it must be cancelled explicitly even if the socket is closed;
+     * there is at most one poll request per connection, so without
+     * IORING_ASYNC_CANCEL_ALL it is cancelled by user_data
+     */
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) ((uintptr_t) c | c->read->instance);
+    sqe->user_data = 0;
+
+    if (ring.cancel_all) {
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_add_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        events = EPOLLIN|EPOLLRDHUP;
+
+        if (e->active) {
+            events |= EPOLLOUT;
+        }
+
+    } else {
+        e = c->read;
+        events = EPOLLOUT;
+
+        if (e->active) {
+            events |= EPOLLIN|EPOLLRDHUP;
+        }
+    }
+
+    /*
+     * a multishot poll request cannot be modified atomically,
+     * so it is cancelled and added again with the new events
+     */
+
+    if (ev->active || e->active) {
+        if (ngx_iouring_cancel(c, ev->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+    if (flags & NGX_EXCLUSIVE_EVENT) {
+        events &= ~EPOLLRDHUP;
+        events |= EPOLLEXCLUSIVE;
+    }
+#endif
+
+    /*
+     * the trigger mode is kept per connection in the oneshot flag
+     * of the read event, since a single poll request serves both events
+     * and has to be armed again in the same mode
+     */
+
+    c->read->oneshot = (flags & NGX_CLEAR_EVENT) ? 0 : 1;
+
+    if (ngx_iouring_poll(c, events, c->read->oneshot, ev->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_event(ngx_event_t *ev, ngx_int_t event, ngx_uint_t flags)
+{
+    uint32_t           events;
+    ngx_event_t       *e;
+    ngx_connection_t  *c;
+
+    c = ev->data;
+
+    if (event == NGX_READ_EVENT) {
+        e = c->write;
+        events = EPOLLOUT;
+
+    } else {
+        e = c->read;
+        events = EPOLLIN|EPOLLRDHUP;
+    }
+
+    if (ngx_iouring_cancel(c, ev->log) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ev->active = 0;
+
+    if ((flags & NGX_CLOSE_EVENT) || !e->active) {
+        return NGX_OK;
+    }
+
+    return ngx_iouring_poll(c, events, c->read->oneshot, ev->log);
+}
+
+
+static ngx_int_t
+ngx_iouring_add_connection(ngx_connection_t *c)
+{
+    c->read->oneshot = 0;
+
+    if (ngx_iouring_poll(c, EPOLLIN|EPOLLOUT|EPOLLRDHUP, 0, c->log)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    c->read->active = 1;
+    c->write->active = 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_iouring_del_connection(ngx_connection_t *c, ngx_uint_t flags)
+{
+    if (c->read->active || c->write->active) {
+        if (ngx_iouring_cancel(c, c->log) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    c->read->active = 0;
+    c->write->active = 0;
+
+    return NGX_OK;
+}
+
+
+#if (NGX_HAVE_EVENTFD)
+
+static ngx_int_t
+ngx_iouring_notify(ngx_event_handler_pt handler)
+{
+    static uint64_t inc = 1;
+
+    notify_event.data = (void *) (uintptr_t) handler;
+
+    if ((size_t) write(notify_fd, &inc, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        ngx_log_error(NGX_LOG_ALERT, notify_event.log, ngx_errno,
+                      "write() to eventfd %d failed", notify_fd);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static ngx_int_t
+ngx_iouring_process_events(ngx_cycle_t *cycle, ngx_msec_t timer,
+    ngx_uint_t flags)
+{
+    int                              n;
+    uint32_t                         head, tail, to_submit, wait;
+    ngx_uint_t                       level, enter_flags;
+    ngx_err_t                        err;
+    struct timespec                  ts;
+    struct io_uring_cqe             *cqe;
+    struct io_uring_getevents_arg    arg, *parg;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring timer: %M", timer);
+
+    ngx_memory_barrier();
+
+    *ring.sq_tail = ring.sq_local_tail;
+
+    to_submit = ring.sq_local_tail - *ring.sq_head;
+
+    /* do not wait if there are completions already */
+
+    wait = (*ring.cq_tail == *ring.cq_head) ? 1 : 0;
+
+    enter_flags = IORING_ENTER_GETEVENTS;
+    parg = NULL;
+
+    if (wait && timer != NGX_TIMER_INFINITE) {
+
+        ts.tv_sec = timer / 1000;
+        ts.tv_nsec = (timer % 1000) * 1000000;
+
+        ngx_memzero(&arg, sizeof(struct io_uring_getevents_arg));
+        arg.ts = (uint64_t) (uintptr_t) &ts;
+
+        enter_flags |= IORING_ENTER_EXT_ARG;
+        parg = &arg;
+    }
+
+    n = io_uring_enter(ring_fd, to_submit, wait, enter_flags, parg,
+                       parg ? sizeof(struct io_uring_getevents_arg) : 0);
+
+    err = (n == -1) ? ngx_errno : 0;
+
+    if (flags & NGX_UPDATE_TIME || ngx_event_timer_alarm) {
+        ngx_time_update();
+    }
+
+    if (err) {
+        if (err == NGX_EINTR) {
+
+            if (ngx_event_timer_alarm) {
+                ngx_event_timer_alarm = 0;
+                return NGX_OK;
+            }
+
+            level = NGX_LOG_INFO;
+
+        } else if (err == ETIME || err == NGX_EBUSY || err == NGX_EAGAIN) {
+
+            /* the timeout expired or the completion queue is overflown */
+
+            level = 0;
+
+        } else {
+            level = NGX_LOG_ALERT;
+        }
+
+        if (level) {
+            ngx_log_error(level, cycle->log, err, "io_uring_enter() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    head = *ring.cq_head;
+    tail = *ring.cq_tail;
+
+    ngx_memory_barrier();
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: submitted:%d of %uD, completions:%uD",
+                   n, to_submit, tail - head);
+
+    while (head != tail) {
+
+        cqe = &ring.cqes[head & ring.cq_mask];
+
+        if (cqe->user_data) {
+
+#if (NGX_HAVE_FILE_AIO)
+            if (cqe->user_data & NGX_IOURING_AIO) {
+                ngx_iouring_process_aio(cycle, cqe);
+
+            } else
+#endif
+            {
+                ngx_iouring_process_poll(cycle, cqe, flags);
+            }
+
+        } else if (cqe->res < 0 && cqe->res != -NGX_ENOENT
+                   && cqe->res != -EALREADY)
+        {
+            ngx_log_error(NGX_LOG_ALERT, cycle->log, -cqe->res,
+                          "io_uring cancel failed");
+        }
+
+        head++;
+
+        if (head == tail) {
+
+            /* the handlers may have queued more completions */
+
+            ngx_memory_barrier();
+
+            *ring.cq_head = head;
+
+            tail = *ring.cq_tail;
+
+            ngx_memory_barrier();
+        }
+    }
+
+    *ring.cq_head = head;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_iouring_process_poll(ngx_cycle_t *cycle, struct io_uring_cqe *cqe,
+    ngx_uint_t flags)
+{
+    uint32_t           revents, events;
+    ngx_int_t          instance;
+    ngx_event_t       *rev, *wev;
+    ngx_queue_t       *queue;
+    ngx_connection_t  *c;
+
+    c = (ngx_connection_t *) (uintptr_t) cqe->user_data;
+
+    instance = (uintptr_t) c & 1;
+    c = (ngx_connection_t *) ((uintptr_t) c & (uintptr_t) ~NGX_IOURING_MASK);
+
+    rev = c->read;
+
+    if (c->fd == -1 || rev->instance != instance) {
+
+        /*
+         * the stale event from a file descriptor
+         * that was just closed in this iteration
+         */
+
+        ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring: stale event %p", c);
+        return;
+    }
+
+    if (cqe->res < 0) {
+
+        if (cqe->res == -NGX_ECANCELED) {
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_ALERT, cycle->log, -cqe->res,
+                      "io_uring poll on fd:%d failed", c->fd);
+
+        revents = EPOLLERR;
+
+    } else {
+        revents = cqe->res;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring: fd:%d ev:%04XD f:%XD d:%p",
+                   c->fd, revents, cqe->flags, cqe->user_data);
+
+    wev = c->write;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res >= 0) {
+
+        /*
+         * the oneshot poll request is completed, or the multishot one
+         * was terminated, arm it again
+         */
+
+        events = 0;
+
+        if (rev->active) {
+            events |= EPOLLIN|EPOLLRDHUP;
+
+#if (NGX_HAVE_EPOLLEXCLUSIVE)
+            if (rev->accept && ngx_use_exclusive_accept) {
+                events = EPOLLIN|EPOLLEXCLUSIVE;
+            }
+#endif
+        }
+
+        if (wev && wev->active) {
+            events |= EPOLLOUT;
+        }
+
+        if (events) {
+            (void) ngx_iouring_poll(c, events, rev->oneshot, cycle->log);
+        }
+    }
+
+    if (revents & (EPOLLERR|EPOLLHUP)) {
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                       "io_uring poll error on fd:%d ev:%04XD",
+                       c->fd, revents);
+
+        /*
+         * if the error events were returned, add EPOLLIN and EPOLLOUT
+         * to handle the events at least in one active handler
+         */
+
+        revents |= EPOLLIN|EPOLLOUT;
+    }
+
+    if ((revents & EPOLLIN) && rev->active) {
+
+        if (revents & EPOLLRDHUP) {
+            rev->pending_eof = 1;
+        }
+
+        rev->ready = 1;
+        rev->available = -1;
+
+        if (flags & NGX_POST_EVENTS) {
+            queue = rev->accept ? &ngx_posted_accept_events
+                                : &ngx_posted_events;
+
+            ngx_post_event(rev, queue);
+
+        } else {
+            rev->handler(rev);
+        }
+    }
+
+    if ((revents & EPOLLOUT) && wev && wev->active) {
+
+        if (c->fd == -1 || wev->instance != instance) {
+
+            /*
+             * the stale event from a file descriptor
+             * that was just closed in this iteration
+             */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                           "io_uring: stale event %p", c);
+            return;
+        }
+
+        wev->ready = 1;
+#if (NGX_THREADS)
+        wev->complete = 1;
+#endif
+
+        if (flags & NGX_POST_EVENTS) {
+            ngx_post_event(wev, &ngx_posted_events);
+
+        } else {
+            wev->handler(wev);
+        }
+    }
+}
+
+
+#if (NGX_HAVE_FILE_AIO)
+
+static void
+ngx_iouring_process_aio(ngx_cycle_t *cycle, struct io_uring_cqe *cqe)
+{
+    ngx_event_t      *e;
+    ngx_event_aio_t  *aio;
+
+    e = (ngx_event_t *) (uintptr_t)
+                            (cqe->user_data & ~((uint64_t) NGX_IOURING_MASK));
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, cycle->log, 0,
+                   "io_uring aio: %p res:%d", e, cqe->res);
+
+    e->complete = 1;
+    e->active = 0;
+    e->ready = 1;
+
+    aio = e->data;
+    aio->res = cqe->res;
+
+    ngx_post_event(e, &ngx_posted_events);
+}
+
+
+ngx_int_t
+ngx_iouring_aio_read(ngx_event_aio_t *aio, u_char *buf, size_t size,
+    off_t offset)
+{
+    struct io_uring_sqe  *sqe;
+
+    sqe = ngx_iouring_get_sqe(aio->event.log);
+    if (sqe == NULL) {
+        return NGX_ERROR;
+    }
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = aio->fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = size;
+    sqe->off = offset;
+    sqe->user_data = (uint64_t) (uintptr_t) &aio->event | NGX_IOURING_AIO;
+
+    return NGX_OK;
+}
+
+#endif
+
+
+static void *
+ngx_iouring_create_conf(ngx_cycle_t *cycle)
+{
+    ngx_iouring_conf_t  *iucf;
+
+    iucf = ngx_palloc(cycle->pool, sizeof(ngx_iouring_conf_t));
+    if (iucf == NULL) {
+        return NULL;
+    }
+
+    iucf->entries = NGX_CONF_UNSET;
+
+    return iucf;
+}
+
+
+static char *
+ngx_iouring_init_conf(ngx_cycle_t *cycle, void *conf)
+{
+    ngx_iouring_conf_t *iucf = conf;
+
+    ngx_conf_init_uint_value(iucf->entries, 1024);
+
+    return NGX_CONF_OK;
+}
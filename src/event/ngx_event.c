@@ -267,16 +267,19 @@ ngx_process_events_and_timers(ngx_cycle_t *cycle)
 ngx_int_t
 ngx_handle_read_event(ngx_event_t *rev, ngx_uint_t flags)
 {
-#if (NGX_QUIC)
-
     ngx_connection_t  *c;
 
     c = rev->data;
 
-    if (c->quic) {
+    if (c->shared) {
+        /* the socket belongs to another connection */
         return NGX_OK;
     }
 
+#if (NGX_QUIC)
+    if (c->quic) {
+        return NGX_OK;
+    }
 #endif
 
     if (ngx_event_flags & NGX_USE_CLEAR_EVENT) {
@@ -351,6 +354,10 @@ ngx_handle_write_event(ngx_event_t *wev, size_t lowat)
 
     c = wev->data;
 
+    if (c->shared) {
+        return NGX_OK;
+    }
+
 #if (NGX_QUIC)
     if (c->quic) {
         return NGX_OK;
@@ -434,3 +434,18 @@ ngx_event_get_peer(ngx_peer_connection_t *pc, void *data)
 {
     return NGX_OK;
 }
+
+
+ngx_int_t *
+ngx_event_peer_alloc_weights(ngx_slab_pool_t *shpool, ngx_uint_t number)
+{
+    ngx_core_conf_t  *ccf;
+
+    /* the pool is locked by the caller */
+
+    ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                           ngx_core_module);
+
+    return ngx_slab_calloc_locked(shpool, ngx_event_peer_weights_size(number)
+                                          * ccf->worker_processes);
+}
@@ -70,8 +70,23 @@ struct ngx_peer_connection_s {
 };
 
 
+/*
+ * current weights of round-robin balancers in shared zones are kept
+ * for each worker process, in its own cache lines
+ */
+
+#define ngx_event_peer_weights_size(number)                                   \
+    ngx_align((number) * sizeof(ngx_int_t), NGX_CPU_CACHE_LINE)
+
+#define ngx_event_peer_worker_weights(weights, number)                        \
+    ((ngx_int_t *) ((u_char *) (weights)                                      \
+                    + ngx_worker * ngx_event_peer_weights_size(number)))
+
+
 ngx_int_t ngx_event_connect_peer(ngx_peer_connection_t *pc);
 ngx_int_t ngx_event_get_peer(ngx_peer_connection_t *pc, void *data);
+ngx_int_t *ngx_event_peer_alloc_weights(ngx_slab_pool_t *shpool,
+    ngx_uint_t number);
 
 
 #endif /* _NGX_EVENT_CONNECT_H_INCLUDED_ */
@@ -12,6 +12,68 @@
 
 #if !(NGX_WIN32)
 
+#if (NGX_HAVE_ADDRINFO_CMSG || NGX_HAVE_UDP_GRO)
+#define NGX_UDP_RECV_CMSG            1
+#endif
+
+#if (NGX_HAVE_ADDRINFO_CMSG)
+#define NGX_UDP_ADDRINFO_CMSG_SIZE   CMSG_SPACE(sizeof(ngx_addrinfo_t))
+#else
+#define NGX_UDP_ADDRINFO_CMSG_SIZE   0
+#endif
+
+#if (NGX_HAVE_UDP_GRO)
+#define NGX_UDP_GRO_CMSG_SIZE        CMSG_SPACE(sizeof(int))
+#else
+#define NGX_UDP_GRO_CMSG_SIZE        0
+#endif
+
+
+#if (NGX_HAVE_RECVMMSG)
+
+typedef struct mmsghdr      ngx_udp_mmsghdr_t;
+
+#else
+
+typedef struct {
+    struct msghdr           msg_hdr;
+    unsigned int            msg_len;
+} ngx_udp_mmsghdr_t;
+
+#endif
+
+
+typedef struct {
+    ngx_sockaddr_t          sockaddr;
+    struct iovec            iov;
+#if (NGX_UDP_RECV_CMSG)
+    u_char                  control[NGX_UDP_ADDRINFO_CMSG_SIZE
+                                    + NGX_UDP_GRO_CMSG_SIZE];
+#endif
+    u_char                  buffer[65535];
+} ngx_udp_recv_buf_t;
+
+
+typedef struct {
+    ngx_udp_mmsghdr_t      *msgs;
+    ngx_udp_recv_buf_t     *bufs;
+    ngx_uint_t              nmsgs;
+    ngx_uint_t              next;
+
+    /* the socket received from, if the batch is shared */
+    ngx_listening_t        *listening;
+
+    /* current message, possibly coalesced by GRO */
+    struct msghdr          *msg;
+    u_char                 *pos;
+    u_char                 *last;
+    size_t                  segment;
+} ngx_udp_batch_t;
+
+
+static ngx_udp_batch_t *ngx_udp_get_batch(ngx_listening_t *ls,
+    ngx_log_t *log);
+static void ngx_udp_batch_init(ngx_udp_batch_t *r, ngx_uint_t n);
 static void ngx_close_accepted_udp_connection(ngx_connection_t *c);
 static ssize_t ngx_udp_shared_recv(ngx_connection_t *c, u_char *buf,
     size_t size);
@@ -21,27 +83,32 @@ static ngx_connection_t *ngx_lookup_udp_connection(ngx_listening_t *ls,
     struct sockaddr *local_sockaddr, socklen_t local_socklen);
 
 
+/*
+ * listening sockets without the "batch" parameter receive a single message
+ * at a time, so they share one buffer; others have their own, as datagrams
+ * may be left there until the next read event
+ */
+
+static ngx_udp_batch_t     ngx_udp_batch;
+static ngx_udp_mmsghdr_t   ngx_udp_msg;
+static ngx_udp_recv_buf_t  ngx_udp_buf;
+
+
 void
 ngx_event_recvmsg(ngx_event_t *ev)
 {
+    u_char            *buffer;
     ssize_t            n;
     ngx_buf_t          buf;
     ngx_log_t         *log;
-    ngx_err_t          err;
     socklen_t          socklen, local_socklen;
     ngx_event_t       *rev, *wev;
-    struct iovec       iov[1];
-    struct msghdr      msg;
-    ngx_sockaddr_t     sa, lsa;
+    struct msghdr     *msg;
+    ngx_sockaddr_t     lsa;
     struct sockaddr   *sockaddr, *local_sockaddr;
     ngx_listening_t   *ls;
     ngx_event_conf_t  *ecf;
     ngx_connection_t  *c, *lc;
-    static u_char      buffer[65535];
-
-#if (NGX_HAVE_ADDRINFO_CMSG)
-    u_char             msg_control[CMSG_SPACE(sizeof(ngx_addrinfo_t))];
-#endif
 
     if (ev->timedout) {
         if (ngx_enable_accept_events((ngx_cycle_t *) ngx_cycle) != NGX_OK) {
@@ -65,51 +132,22 @@ ngx_event_recvmsg(ngx_event_t *ev)
                    "recvmsg on %V, ready: %d", &ls->addr_text, ev->available);
 
     do {
-        ngx_memzero(&msg, sizeof(struct msghdr));
-
-        iov[0].iov_base = (void *) buffer;
-        iov[0].iov_len = sizeof(buffer);
-
-        msg.msg_name = (void *) &sa;
-        msg.msg_namelen = sizeof(ngx_sockaddr_t);
-        msg.msg_iov = iov;
-        msg.msg_iovlen = 1;
-
-#if (NGX_HAVE_ADDRINFO_CMSG)
-        if (ls->wildcard) {
-            msg.msg_control = (void *) &msg_control;
-            msg.msg_controllen = sizeof(msg_control);
-
-            ngx_memzero(&msg_control, sizeof(msg_control));
-        }
-#endif
-
-        n = recvmsg(lc->fd, &msg, 0);
-
-        if (n == -1) {
-            err = ngx_socket_errno;
-
-            if (err == NGX_EAGAIN) {
-                ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
-                               "recvmsg() not ready");
-                return;
-            }
-
-            ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmsg() failed");
+        n = ngx_udp_recvmsg(ev, &buffer, &msg);
 
+        if (n < 0) {
             return;
         }
 
 #if (NGX_HAVE_ADDRINFO_CMSG)
-        if (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
+        if (msg->msg_flags & (MSG_TRUNC|MSG_CTRUNC)) {
             ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
                           "recvmsg() truncated data");
             continue;
         }
 #endif
 
-        sockaddr = (void *) msg.msg_name;
-        socklen = msg.msg_namelen;
+        sockaddr = (void *) msg->msg_name;
+        socklen = msg->msg_namelen;
 
         if (socklen > (socklen_t) sizeof(ngx_sockaddr_t)) {
             socklen = sizeof(ngx_sockaddr_t);
@@ -123,8 +161,8 @@ ngx_event_recvmsg(ngx_event_t *ev)
              */
 
             socklen = sizeof(struct sockaddr);
-            ngx_memzero(&sa, sizeof(struct sockaddr));
-            sa.sockaddr.sa_family = ls->sockaddr->sa_family;
+            ngx_memzero(sockaddr, sizeof(struct sockaddr));
+            sockaddr->sa_family = ls->sockaddr->sa_family;
         }
 
         local_sockaddr = ls->sockaddr;
@@ -138,9 +176,9 @@ ngx_event_recvmsg(ngx_event_t *ev)
             ngx_memcpy(&lsa, local_sockaddr, local_socklen);
             local_sockaddr = &lsa.sockaddr;
 
-            for (cmsg = CMSG_FIRSTHDR(&msg);
+            for (cmsg = CMSG_FIRSTHDR(msg);
                  cmsg != NULL;
-                 cmsg = CMSG_NXTHDR(&msg, cmsg))
+                 cmsg = CMSG_NXTHDR(msg, cmsg))
             {
                 if (ngx_get_srcaddr_cmsg(cmsg, local_sockaddr) == NGX_OK) {
                     break;
@@ -344,7 +382,271 @@ ngx_event_recvmsg(ngx_event_t *ev)
             ev->available -= n;
         }
 
-    } while (ev->available);
+    } while (ev->available || ngx_udp_recv_pending(ev));
+}
+
+
+ssize_t
+ngx_udp_recvmsg(ngx_event_t *ev, u_char **buf, struct msghdr **msg)
+{
+    int                 n;
+    size_t              size;
+    ngx_err_t           err;
+    ngx_uint_t          i, batch;
+    struct msghdr      *m;
+    ngx_udp_batch_t     *r;
+    ngx_connection_t   *lc;
+    ngx_udp_mmsghdr_t  *mmsg;
+
+#if (NGX_HAVE_UDP_GRO)
+    int                 segment;
+    struct cmsghdr     *cmsg;
+#endif
+
+    lc = ev->data;
+
+    r = ngx_udp_get_batch(lc->listening, ev->log);
+    if (r == NULL) {
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+
+        if (r->pos < r->last) {
+
+            /* the next datagram of a message coalesced by GRO */
+
+            size = r->last - r->pos;
+
+            if (r->segment && size > r->segment) {
+                size = r->segment;
+            }
+
+            *buf = r->pos;
+            *msg = r->msg;
+
+            r->pos += size;
+
+            return size;
+        }
+
+        if (r->next < r->nmsgs) {
+            mmsg = &r->msgs[r->next++];
+
+            r->msg = &mmsg->msg_hdr;
+            r->pos = mmsg->msg_hdr.msg_iov[0].iov_base;
+            r->last = r->pos + mmsg->msg_len;
+            r->segment = 0;
+
+#if (NGX_HAVE_UDP_GRO)
+
+            for (cmsg = CMSG_FIRSTHDR(r->msg);
+                 cmsg != NULL;
+                 cmsg = CMSG_NXTHDR(r->msg, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP
+                    && cmsg->cmsg_type == UDP_GRO)
+                {
+                    ngx_memcpy(&segment, CMSG_DATA(cmsg), sizeof(int));
+                    r->segment = segment;
+                    break;
+                }
+            }
+
+#endif
+
+            if (mmsg->msg_len == 0) {
+                *buf = r->pos;
+                *msg = r->msg;
+
+                return 0;
+            }
+
+            continue;
+        }
+
+        batch = ngx_max(lc->listening->batch, 1);
+
+        for (i = 0; i < batch; i++) {
+            m = &r->msgs[i].msg_hdr;
+
+            m->msg_namelen = sizeof(ngx_sockaddr_t);
+            m->msg_flags = 0;
+
+#if (NGX_UDP_RECV_CMSG)
+            m->msg_controllen = sizeof(r->bufs[i].control);
+            ngx_memzero(r->bufs[i].control, sizeof(r->bufs[i].control));
+#endif
+        }
+
+#if (NGX_HAVE_RECVMMSG)
+
+        if (batch > 1) {
+            n = recvmmsg(lc->fd, r->msgs, batch, 0, NULL);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err == NGX_EAGAIN) {
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                                   "recvmmsg() not ready");
+                    return NGX_AGAIN;
+                }
+
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err,
+                              "recvmmsg() failed");
+                return NGX_ERROR;
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ev->log, 0,
+                           "recvmmsg: %d messages", n);
+
+        } else
+
+#endif
+        {
+            n = recvmsg(lc->fd, &r->msgs[0].msg_hdr, 0);
+
+            if (n == -1) {
+                err = ngx_socket_errno;
+
+                if (err == NGX_EAGAIN) {
+                    ngx_log_debug0(NGX_LOG_DEBUG_EVENT, ev->log, err,
+                                   "recvmsg() not ready");
+                    return NGX_AGAIN;
+                }
+
+                ngx_log_error(NGX_LOG_ALERT, ev->log, err, "recvmsg() failed");
+                return NGX_ERROR;
+            }
+
+            r->msgs[0].msg_len = n;
+            n = 1;
+        }
+
+        r->nmsgs = n;
+        r->next = 0;
+        r->pos = NULL;
+        r->last = NULL;
+    }
+}
+
+
+ngx_uint_t
+ngx_udp_recv_pending(ngx_event_t *ev)
+{
+    ngx_udp_batch_t   *r;
+    ngx_listening_t   *ls;
+    ngx_connection_t  *lc;
+
+    lc = ev->data;
+    ls = lc->listening;
+
+    if (ls->batch == 0) {
+        r = &ngx_udp_batch;
+
+        if (r->listening != ls) {
+            return 0;
+        }
+
+    } else {
+        r = ls->recv_batch;
+
+        if (r == NULL) {
+            return 0;
+        }
+    }
+
+    return (r->pos < r->last || r->next < r->nmsgs);
+}
+
+
+static ngx_udp_batch_t *
+ngx_udp_get_batch(ngx_listening_t *ls, ngx_log_t *log)
+{
+    ngx_udp_batch_t  *r;
+
+    if (ls->batch == 0) {
+        r = &ngx_udp_batch;
+
+        if (r->msgs == NULL) {
+            r->msgs = &ngx_udp_msg;
+            r->bufs = &ngx_udp_buf;
+
+            ngx_udp_batch_init(r, 1);
+        }
+
+        if (r->listening != ls) {
+
+            /*
+             * datagrams left from another socket, e.g. segments
+             * of a message coalesced by GRO, are dropped
+             */
+
+            r->listening = ls;
+            r->nmsgs = 0;
+            r->next = 0;
+            r->pos = NULL;
+            r->last = NULL;
+        }
+
+        return r;
+    }
+
+    if (ls->recv_batch) {
+        return ls->recv_batch;
+    }
+
+    r = ngx_pcalloc(ngx_cycle->pool, sizeof(ngx_udp_batch_t));
+    if (r == NULL) {
+        return NULL;
+    }
+
+    r->msgs = ngx_pcalloc(ngx_cycle->pool,
+                          ls->batch * sizeof(ngx_udp_mmsghdr_t));
+    if (r->msgs == NULL) {
+        return NULL;
+    }
+
+    r->bufs = ngx_palloc(ngx_cycle->pool,
+                         ls->batch * sizeof(ngx_udp_recv_buf_t));
+    if (r->bufs == NULL) {
+        return NULL;
+    }
+
+    ngx_udp_batch_init(r, ls->batch);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, log, 0,
+                   "udp batch of %d on %V", ls->batch, &ls->addr_text);
+
+    ls->recv_batch = r;
+
+    return r;
+}
+
+
+static void
+ngx_udp_batch_init(ngx_udp_batch_t *r, ngx_uint_t n)
+{
+    ngx_uint_t           i;
+    struct msghdr       *m;
+    ngx_udp_recv_buf_t  *b;
+
+    for (i = 0; i < n; i++) {
+        b = &r->bufs[i];
+        m = &r->msgs[i].msg_hdr;
+
+        b->iov.iov_base = (void *) b->buffer;
+        b->iov.iov_len = sizeof(b->buffer);
+
+        m->msg_name = (void *) &b->sockaddr;
+        m->msg_iov = &b->iov;
+        m->msg_iovlen = 1;
+
+#if (NGX_UDP_RECV_CMSG)
+        m->msg_control = (void *) b->control;
+#endif
+    }
 }
 
 
@@ -12,6 +12,9 @@
 #include <ngx_core.h>
 
 
+#define NGX_UDP_MAX_BATCH       64
+
+
 #if !(NGX_WIN32)
 
 #if ((NGX_HAVE_MSGHDR_MSG_CONTROL)                                            \
@@ -55,6 +58,8 @@ ngx_int_t ngx_get_srcaddr_cmsg(struct cmsghdr *cmsg,
 #endif
 
 void ngx_event_recvmsg(ngx_event_t *ev);
+ssize_t ngx_udp_recvmsg(ngx_event_t *ev, u_char **buf, struct msghdr **msg);
+ngx_uint_t ngx_udp_recv_pending(ngx_event_t *ev);
 ssize_t ngx_sendmsg(ngx_connection_t *c, struct msghdr *msg, int flags);
 void ngx_udp_rbtree_insert_value(ngx_rbtree_node_t *temp,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
@@ -30,6 +30,8 @@ static ngx_int_t ngx_quic_handle_frames(ngx_connection_t *c,
 
 static void ngx_quic_push_handler(ngx_event_t *ev);
 
+static void ngx_quic_exit_process(ngx_cycle_t *cycle);
+
 
 static ngx_core_module_t  ngx_quic_module_ctx = {
     ngx_string("quic"),
@@ -48,7 +50,7 @@ ngx_module_t  ngx_quic_module = {
     NULL,                                  /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
+    ngx_quic_exit_process,                 /* exit process */
     NULL,                                  /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -308,11 +310,7 @@ ngx_quic_new_connection(ngx_connection_t *c, ngx_quic_conf_t *conf,
     qc->streams.client_max_streams_uni = qc->tp.initial_max_streams_uni;
     qc->streams.client_max_streams_bidi = qc->tp.initial_max_streams_bidi;
 
-    qc->congestion.window = ngx_min(10 * qc->tp.max_udp_payload_size,
-                                    ngx_max(2 * qc->tp.max_udp_payload_size,
-                                            14720));
-    qc->congestion.ssthresh = (size_t) -1;
-    qc->congestion.recovery_start = ngx_current_msec;
+    ngx_quic_init_congestion(qc);
 
     if (pkt->validated && pkt->retried) {
         qc->tp.retry_scid.len = pkt->dcid.len;
@@ -658,6 +656,13 @@ ngx_quic_close_handler(ngx_event_t *ev)
 
     c = ev->data;
 
+    /* a queued datagram could not be sent */
+
+    if (c->write->error) {
+        ngx_quic_close_connection(c, NGX_ERROR);
+        return;
+    }
+
     ngx_quic_close_connection(c, NGX_OK);
 }
 
@@ -1450,3 +1455,16 @@ ngx_quic_shutdown_quic(ngx_connection_t *c)
         ngx_quic_finalize_connection(c, qc->shutdown_code, qc->shutdown_reason);
     }
 }
+
+
+static void
+ngx_quic_exit_process(ngx_cycle_t *cycle)
+{
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+
+    /* the last attempt to send queued datagrams, e.g. on fast shutdown */
+
+    ngx_quic_send_queue_flush();
+
+#endif
+}
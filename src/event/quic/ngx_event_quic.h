@@ -27,6 +27,10 @@
 #define NGX_QUIC_STREAM_SERVER_INITIATED     0x01
 #define NGX_QUIC_STREAM_UNIDIRECTIONAL       0x02
 
+#define NGX_QUIC_CONGESTION_RENO             0
+#define NGX_QUIC_CONGESTION_CUBIC            1
+#define NGX_QUIC_CONGESTION_BBR              2
+
 
 typedef ngx_int_t (*ngx_quic_init_pt)(ngx_connection_t *c);
 typedef void (*ngx_quic_shutdown_pt)(ngx_connection_t *c);
@@ -66,7 +70,10 @@ typedef struct {
 
     ngx_flag_t                     retry;
     ngx_flag_t                     gso_enabled;
+    ngx_flag_t                     sendmmsg_enabled;
     ngx_flag_t                     disable_active_migration;
+    ngx_flag_t                     pacing;
+    ngx_uint_t                     congestion_control;
     ngx_msec_t                     handshake_timeout;
     ngx_msec_t                     idle_timeout;
     ngx_str_t                      host_key;
@@ -0,0 +1,897 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_event_quic_connection.h>
+
+
+/* RFC 9002, 7.7. Pacing: N */
+#define NGX_QUIC_PACING_GAIN                 125 /* percents */
+#define NGX_QUIC_PACING_SLOW_START_GAIN      200 /* percents */
+#define NGX_QUIC_PACING_BURST                10  /* packets */
+
+/* RFC 9438, 4.6. Multiplicative Decrease: beta_cubic */
+#define NGX_QUIC_CUBIC_BETA                  7   /* tenths */
+#define NGX_QUIC_CUBIC_MAX_T                 20000 /* ms */
+
+#define NGX_QUIC_BBR_STARTUP                 0
+#define NGX_QUIC_BBR_DRAIN                   1
+#define NGX_QUIC_BBR_PROBE_BW                2
+
+#define NGX_QUIC_BBR_HIGH_GAIN               289 /* 2 / ln(2), percents */
+#define NGX_QUIC_BBR_DRAIN_GAIN              35  /* percents */
+#define NGX_QUIC_BBR_CWND_GAIN               200 /* percents */
+#define NGX_QUIC_BBR_BETA                    7   /* tenths */
+#define NGX_QUIC_BBR_BW_ROUNDS               10
+#define NGX_QUIC_BBR_FULL_BW_ROUNDS          3
+#define NGX_QUIC_BBR_MIN_WINDOW              4   /* packets */
+
+
+static void ngx_quic_window_pacing_rate(ngx_connection_t *c);
+
+static void ngx_quic_reno_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_reno_lost(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_reno_persistent(ngx_connection_t *c);
+
+static void ngx_quic_cubic_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_cubic_lost(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_cubic_persistent(ngx_connection_t *c);
+static uint64_t ngx_quic_cbrt(uint64_t x);
+
+static void ngx_quic_bbr_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_bbr_max_bw(ngx_quic_congestion_t *cg, uint64_t bw);
+static void ngx_quic_bbr_lost(ngx_connection_t *c, ngx_quic_frame_t *f);
+static void ngx_quic_bbr_persistent(ngx_connection_t *c);
+
+
+static ngx_quic_congestion_ops_t  ngx_quic_reno = {
+    "reno",
+    ngx_quic_reno_ack,
+    ngx_quic_reno_lost,
+    ngx_quic_reno_persistent
+};
+
+
+static ngx_quic_congestion_ops_t  ngx_quic_cubic = {
+    "cubic",
+    ngx_quic_cubic_ack,
+    ngx_quic_cubic_lost,
+    ngx_quic_cubic_persistent
+};
+
+
+static ngx_quic_congestion_ops_t  ngx_quic_bbr = {
+    "bbr",
+    ngx_quic_bbr_ack,
+    ngx_quic_bbr_lost,
+    ngx_quic_bbr_persistent
+};
+
+
+/* indexed by NGX_QUIC_CONGESTION_* */
+
+static ngx_quic_congestion_ops_t  *ngx_quic_congestion[] = {
+    &ngx_quic_reno,
+    &ngx_quic_cubic,
+    &ngx_quic_bbr
+};
+
+
+/* ProbeBW pacing gain cycle, percents */
+
+static ngx_uint_t  ngx_quic_bbr_pacing_gain[] = {
+    125, 75, 100, 100, 100, 100, 100, 100
+};
+
+
+void
+ngx_quic_init_congestion(ngx_quic_connection_t *qc)
+{
+    ngx_quic_congestion_t  *cg;
+
+    cg = &qc->congestion;
+
+    ngx_memzero(cg, sizeof(ngx_quic_congestion_t));
+
+    cg->ops = ngx_quic_congestion[qc->conf->congestion_control];
+
+    cg->window = ngx_min(10 * qc->tp.max_udp_payload_size,
+                         ngx_max(2 * qc->tp.max_udp_payload_size, 14720));
+    cg->ssthresh = (size_t) -1;
+    cg->recovery_start = ngx_current_msec;
+    cg->delivered_time = ngx_current_msec;
+
+    cg->pacing_budget = cg->window;
+    cg->pacing_time = ngx_current_msec;
+}
+
+
+void
+ngx_quic_congestion_sent(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (cg->in_flight == 0) {
+        /* idle periods must not lower delivery rate samples */
+        cg->delivered_time = ngx_current_msec;
+    }
+
+    f->delivered = cg->delivered;
+    f->delivered_time = cg->delivered_time;
+    f->app_limited = cg->app_limited ? 1 : 0;
+
+    cg->in_flight += f->plen;
+}
+
+
+void
+ngx_quic_congestion_app_limited(ngx_connection_t *c)
+{
+    ngx_uint_t              i;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (cg->in_flight >= cg->window) {
+        return;
+    }
+
+    for (i = 0; i < NGX_QUIC_SEND_CTX_LAST; i++) {
+        if (!ngx_queue_empty(&qc->send_ctx[i].frames)) {
+            return;
+        }
+    }
+
+    /*
+     * the sender ran out of data before filling the window, so delivery
+     * rate samples underestimate the path until what is in flight now
+     * has been delivered
+     */
+
+    cg->app_limited = ngx_max(cg->delivered + cg->in_flight, 1);
+}
+
+
+void
+ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_uint_t              blocked;
+    ngx_msec_t              timer;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (f->pnum < qc->rst_pnum) {
+        return;
+    }
+
+    blocked = (cg->in_flight >= cg->window) ? 1 : 0;
+
+    cg->in_flight -= f->plen;
+
+    cg->delivered += f->plen;
+    cg->delivered_time = ngx_current_msec;
+
+    if (cg->app_limited && cg->delivered > cg->app_limited) {
+        cg->app_limited = 0;
+    }
+
+    cg->ops->ack(c, f);
+
+    /* prevent recovery_start from wrapping */
+
+    timer = cg->recovery_start - ngx_current_msec + qc->tp.max_idle_timeout * 2;
+
+    if ((ngx_msec_int_t) timer < 0) {
+        cg->recovery_start = ngx_current_msec - qc->tp.max_idle_timeout * 2;
+    }
+
+    if (blocked && cg->in_flight < cg->window) {
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+}
+
+
+void
+ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_uint_t              blocked;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    if (f->plen == 0) {
+        return;
+    }
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (f->pnum < qc->rst_pnum) {
+        return;
+    }
+
+    blocked = (cg->in_flight >= cg->window) ? 1 : 0;
+
+    cg->in_flight -= f->plen;
+
+    cg->ops->lost(c, f);
+
+    f->plen = 0;
+
+    if (blocked && cg->in_flight < cg->window) {
+        ngx_post_event(&qc->push, &ngx_posted_events);
+    }
+}
+
+
+void
+ngx_quic_persistent_congestion(ngx_connection_t *c)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->ops->persistent(c);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic persistent congestion %s win:%uz",
+                   cg->ops->name, cg->window);
+}
+
+
+ngx_int_t
+ngx_quic_pacing_check(ngx_connection_t *c, size_t size)
+{
+    uint64_t                budget, burst;
+    ngx_msec_t              elapsed, delay;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    if (!qc->conf->pacing || cg->pacing_rate == 0) {
+        return NGX_OK;
+    }
+
+    /*
+     * timers have millisecond resolution, so the burst allowance
+     * covers at least two milliseconds worth of data
+     */
+
+    burst = ngx_max(NGX_QUIC_PACING_BURST * qc->path->mtu,
+                    cg->pacing_rate / 500);
+    burst = ngx_max(burst, size);
+
+    elapsed = ngx_current_msec - cg->pacing_time;
+    cg->pacing_time = ngx_current_msec;
+
+    if (elapsed >= 1000) {
+        budget = burst;
+
+    } else {
+        budget = cg->pacing_budget + cg->pacing_rate * elapsed / 1000;
+    }
+
+    cg->pacing_budget = ngx_min(budget, burst);
+
+    if (cg->pacing_budget >= size) {
+        return NGX_OK;
+    }
+
+    delay = ngx_min((size - cg->pacing_budget) * 1000 / cg->pacing_rate + 1,
+                    1000);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic pacing delay:%M budget:%uz rate:%uL",
+                   delay, cg->pacing_budget, cg->pacing_rate);
+
+    if (!qc->push.timer_set && !qc->closing) {
+        ngx_add_timer(&qc->push, delay);
+    }
+
+    return NGX_AGAIN;
+}
+
+
+void
+ngx_quic_pacing_sent(ngx_connection_t *c, size_t size)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->pacing_budget = (cg->pacing_budget > size)
+                        ? cg->pacing_budget - size : 0;
+}
+
+
+static void
+ngx_quic_window_pacing_rate(ngx_connection_t *c)
+{
+    ngx_msec_t              rtt;
+    ngx_uint_t              gain;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    rtt = ngx_max(qc->avg_rtt, 1);
+
+    gain = (cg->window < cg->ssthresh) ? NGX_QUIC_PACING_SLOW_START_GAIN
+                                       : NGX_QUIC_PACING_GAIN;
+
+    /* window * gain / 100 bytes per rtt milliseconds */
+
+    cg->pacing_rate = (uint64_t) cg->window * gain * 10 / rtt;
+}
+
+
+static void
+ngx_quic_reno_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_msec_t              timer;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    timer = f->send_time - cg->recovery_start;
+
+    if ((ngx_msec_int_t) timer <= 0) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion ack recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+
+        goto done;
+    }
+
+    if (cg->window < cg->ssthresh) {
+        cg->window += f->plen;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion slow start win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+
+    } else {
+        cg->window += qc->tp.max_udp_payload_size * f->plen / cg->window;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion avoidance win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+    }
+
+done:
+
+    ngx_quic_window_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_reno_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    ngx_msec_t              timer;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    timer = f->send_time - cg->recovery_start;
+
+    if ((ngx_msec_int_t) timer <= 0) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion lost recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+        return;
+    }
+
+    cg->recovery_start = ngx_current_msec;
+    cg->window /= 2;
+
+    if (cg->window < qc->tp.max_udp_payload_size * 2) {
+        cg->window = qc->tp.max_udp_payload_size * 2;
+    }
+
+    cg->ssthresh = cg->window;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion lost win:%uz ss:%z if:%uz",
+                   cg->window, cg->ssthresh, cg->in_flight);
+
+    ngx_quic_window_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_reno_persistent(ngx_connection_t *c)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->recovery_start = ngx_current_msec;
+    cg->window = qc->tp.max_udp_payload_size * 2;
+}
+
+
+static void
+ngx_quic_cubic_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    size_t                  mss, target;
+    uint64_t                d;
+    ngx_msec_t              timer;
+    ngx_msec_int_t          t;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    timer = f->send_time - cg->recovery_start;
+
+    if ((ngx_msec_int_t) timer <= 0) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion ack recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+
+        goto done;
+    }
+
+    if (cg->window < cg->ssthresh) {
+        cg->window += f->plen;
+
+        /* congestion avoidance epoch starts where slow start ends */
+
+        cg->w_max = cg->window;
+        cg->w_est = cg->window;
+        cg->k = 0;
+        cg->epoch_start = ngx_current_msec;
+
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion slow start win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+
+        goto done;
+    }
+
+    mss = qc->path->mtu;
+
+    /*
+     * RFC 9438, 4.2. Window Increase Function
+     *
+     * W_cubic(t) = C * (t - K)^3 + W_max, with C = 0.4 segments
+     * per second cubed, and t, K in milliseconds
+     */
+
+    t = (ngx_msec_int_t) (ngx_current_msec - cg->epoch_start)
+        - (ngx_msec_int_t) cg->k;
+
+    t = ngx_max(t, -NGX_QUIC_CUBIC_MAX_T);
+    t = ngx_min(t, NGX_QUIC_CUBIC_MAX_T);
+
+    d = ngx_abs(t);
+    d = d * d * d * mss * 4 / 10000000000;
+
+    if (t >= 0) {
+        target = cg->w_max + d;
+
+    } else {
+        target = (d < cg->w_max) ? cg->w_max - d : 0;
+    }
+
+    target = ngx_min(target, cg->window + cg->window / 2);
+
+    if (target > cg->window) {
+        cg->window += (target - cg->window) * f->plen / cg->window;
+    }
+
+    /*
+     * RFC 9438, 4.3. Reno-Friendly Region
+     *
+     * alpha_cubic = 3 * (1 - beta_cubic) / (1 + beta_cubic) = 9 / 17
+     */
+
+    cg->w_est += (uint64_t) mss * f->plen * 9 / (17 * cg->window);
+
+    if (cg->w_est > cg->window) {
+        cg->window = cg->w_est;
+    }
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion cubic win:%uz max:%uz t:%M if:%uz",
+                   cg->window, cg->w_max, ngx_current_msec - cg->epoch_start,
+                   cg->in_flight);
+
+done:
+
+    ngx_quic_window_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_cubic_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    size_t                  mss;
+    ngx_msec_t              timer;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    timer = f->send_time - cg->recovery_start;
+
+    if ((ngx_msec_int_t) timer <= 0) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion lost recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+        return;
+    }
+
+    mss = qc->path->mtu;
+
+    cg->recovery_start = ngx_current_msec;
+
+    /* RFC 9438, 4.7. Fast Convergence */
+
+    if (cg->window < cg->w_max) {
+        cg->w_max = cg->window * (10 + NGX_QUIC_CUBIC_BETA) / 20;
+
+    } else {
+        cg->w_max = cg->window;
+    }
+
+    cg->window = cg->window * NGX_QUIC_CUBIC_BETA / 10;
+
+    if (cg->window < mss * 2) {
+        cg->window = mss * 2;
+    }
+
+    cg->ssthresh = cg->window;
+    cg->w_est = cg->window;
+    cg->epoch_start = ngx_current_msec;
+
+    /* K = cubic_root((W_max - cwnd) / C), in milliseconds */
+
+    cg->k = (cg->w_max > cg->window)
+            ? ngx_quic_cbrt((uint64_t) (cg->w_max - cg->window)
+                            * 2500000000 / mss)
+            : 0;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion cubic lost win:%uz max:%uz k:%M if:%uz",
+                   cg->window, cg->w_max, cg->k, cg->in_flight);
+
+    ngx_quic_window_pacing_rate(c);
+}
+
+
+static void
+ngx_quic_cubic_persistent(ngx_connection_t *c)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->recovery_start = ngx_current_msec;
+    cg->window = qc->path->mtu * 2;
+}
+
+
+static uint64_t
+ngx_quic_cbrt(uint64_t x)
+{
+    uint64_t   y, b;
+    ngx_int_t  s;
+
+    y = 0;
+
+    for (s = 63; s >= 0; s -= 3) {
+        y += y;
+        b = 3 * y * (y + 1) + 1;
+
+        if ((x >> s) >= b) {
+            x -= b << s;
+            y++;
+        }
+    }
+
+    return y;
+}
+
+
+static void
+ngx_quic_bbr_ack(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    size_t                  mss, bdp, target;
+    uint64_t                bw;
+    ngx_msec_t              rtt, interval;
+    ngx_uint_t              round, gain;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    mss = qc->path->mtu;
+
+    rtt = (qc->min_rtt != NGX_TIMER_INFINITE) ? qc->min_rtt : qc->avg_rtt;
+    rtt = ngx_max(rtt, 1);
+
+    /* delivery rate sample, bytes per second */
+
+    interval = ngx_current_msec - f->delivered_time;
+    interval = ngx_max(interval, 1);
+
+    bw = (cg->delivered - f->delivered) * 1000 / interval;
+
+    round = 0;
+
+    if (f->delivered >= cg->round_delivered) {
+        cg->round_delivered = cg->delivered;
+        cg->round_count++;
+        round = 1;
+    }
+
+    /*
+     * samples taken while the sender had nothing to send only show
+     * how much data there was, so they may raise the estimate but
+     * never lower it
+     */
+
+    if (!f->app_limited || bw >= cg->max_bw) {
+        ngx_quic_bbr_max_bw(cg, bw);
+    }
+
+    bdp = cg->max_bw * rtt / 1000;
+
+    switch (cg->state) {
+
+    case NGX_QUIC_BBR_STARTUP:
+
+        if (!round) {
+            break;
+        }
+
+        if (cg->max_bw >= cg->full_bw + cg->full_bw / 4) {
+            cg->full_bw = cg->max_bw;
+            cg->full_bw_count = 0;
+            break;
+        }
+
+        if (++cg->full_bw_count >= NGX_QUIC_BBR_FULL_BW_ROUNDS) {
+            cg->state = NGX_QUIC_BBR_DRAIN;
+        }
+
+        break;
+
+    case NGX_QUIC_BBR_DRAIN:
+
+        if (cg->in_flight > bdp) {
+            break;
+        }
+
+        /* start the gain cycle at a random phase except the draining one */
+
+        cg->state = NGX_QUIC_BBR_PROBE_BW;
+        cg->cycle = ngx_random() % 7;
+
+        if (cg->cycle) {
+            cg->cycle++;
+        }
+
+        cg->cycle_start = ngx_current_msec;
+
+        break;
+
+    default: /* NGX_QUIC_BBR_PROBE_BW */
+
+        if (ngx_current_msec - cg->cycle_start > rtt) {
+            cg->cycle = (cg->cycle + 1) % (sizeof(ngx_quic_bbr_pacing_gain)
+                                           / sizeof(ngx_uint_t));
+            cg->cycle_start = ngx_current_msec;
+        }
+
+        if (cg->cycle == 0 && cg->inflight_hi) {
+            /* probing for more bandwidth, raise the loss-derived bound */
+            cg->inflight_hi += f->plen;
+        }
+    }
+
+    /* congestion window */
+
+    gain = (cg->state == NGX_QUIC_BBR_PROBE_BW) ? NGX_QUIC_BBR_CWND_GAIN
+                                                : NGX_QUIC_BBR_HIGH_GAIN;
+
+    target = ngx_max(bdp * gain / 100, NGX_QUIC_BBR_MIN_WINDOW * mss);
+
+    if (cg->inflight_hi) {
+        target = ngx_min(target, cg->inflight_hi);
+    }
+
+    if (cg->state == NGX_QUIC_BBR_STARTUP) {
+        cg->window += f->plen;
+
+    } else {
+        cg->window = ngx_min(cg->window + f->plen, target);
+    }
+
+    /* pacing rate */
+
+    switch (cg->state) {
+
+    case NGX_QUIC_BBR_STARTUP:
+        gain = NGX_QUIC_BBR_HIGH_GAIN;
+        break;
+
+    case NGX_QUIC_BBR_DRAIN:
+        gain = NGX_QUIC_BBR_DRAIN_GAIN;
+        break;
+
+    default: /* NGX_QUIC_BBR_PROBE_BW */
+        gain = ngx_quic_bbr_pacing_gain[cg->cycle];
+    }
+
+    if (cg->max_bw) {
+        cg->pacing_rate = cg->max_bw * gain / 100;
+
+    } else {
+        cg->pacing_rate = (uint64_t) cg->window * gain * 10
+                          / ngx_max(qc->avg_rtt, 1);
+    }
+
+    ngx_log_debug5(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion bbr state:%ui bw:%uL win:%uz if:%uz "
+                   "rate:%uL", cg->state, cg->max_bw, cg->window,
+                   cg->in_flight, cg->pacing_rate);
+}
+
+
+static void
+ngx_quic_bbr_max_bw(ngx_quic_congestion_t *cg, uint64_t bw)
+{
+    uint64_t               dt;
+    ngx_quic_bw_sample_t  *s, sample;
+
+    /*
+     * windowed max filter of the bottleneck bandwidth over the last
+     * NGX_QUIC_BBR_BW_ROUNDS round trips; the best, second best and
+     * third best samples from successive subwindows are kept, so an
+     * expired maximum is replaced by the next one in the window
+     */
+
+    s = cg->bw_samples;
+
+    sample.bw = bw;
+    sample.round = cg->round_count;
+
+    if (bw >= s[0].bw
+        || sample.round - s[2].round >= NGX_QUIC_BBR_BW_ROUNDS)
+    {
+        s[0] = sample;
+        s[1] = sample;
+        s[2] = sample;
+
+        goto done;
+    }
+
+    if (bw >= s[1].bw) {
+        s[1] = sample;
+        s[2] = sample;
+
+    } else if (bw >= s[2].bw) {
+        s[2] = sample;
+    }
+
+    dt = sample.round - s[0].round;
+
+    if (dt >= NGX_QUIC_BBR_BW_ROUNDS) {
+        s[0] = s[1];
+        s[1] = s[2];
+        s[2] = sample;
+
+        if (sample.round - s[0].round >= NGX_QUIC_BBR_BW_ROUNDS) {
+            s[0] = s[1];
+            s[1] = s[2];
+        }
+
+    } else if (s[1].round == s[0].round && dt > NGX_QUIC_BBR_BW_ROUNDS / 4) {
+        s[1] = sample;
+        s[2] = sample;
+
+    } else if (s[2].round == s[1].round && dt > NGX_QUIC_BBR_BW_ROUNDS / 2) {
+        s[2] = sample;
+    }
+
+done:
+
+    cg->max_bw = s[0].bw;
+}
+
+
+static void
+ngx_quic_bbr_lost(ngx_connection_t *c, ngx_quic_frame_t *f)
+{
+    size_t                  mss, inflight;
+    ngx_msec_t              timer;
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    timer = f->send_time - cg->recovery_start;
+
+    if ((ngx_msec_int_t) timer <= 0) {
+        ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                       "quic congestion lost recovery win:%uz ss:%z if:%uz",
+                       cg->window, cg->ssthresh, cg->in_flight);
+        return;
+    }
+
+    mss = qc->path->mtu;
+
+    cg->recovery_start = ngx_current_msec;
+
+    /*
+     * a loss episode bounds the amount of data in flight
+     * to a fraction of what was in flight when it happened
+     */
+
+    inflight = cg->in_flight + f->plen;
+
+    cg->inflight_hi = ngx_max(inflight * NGX_QUIC_BBR_BETA / 10,
+                              NGX_QUIC_BBR_MIN_WINDOW * mss);
+
+    cg->window = ngx_min(cg->window, cg->inflight_hi);
+
+    if (cg->state == NGX_QUIC_BBR_STARTUP) {
+        cg->state = NGX_QUIC_BBR_DRAIN;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic congestion bbr lost win:%uz hi:%uz if:%uz",
+                   cg->window, cg->inflight_hi, cg->in_flight);
+}
+
+
+static void
+ngx_quic_bbr_persistent(ngx_connection_t *c)
+{
+    ngx_quic_congestion_t  *cg;
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+    cg = &qc->congestion;
+
+    cg->recovery_start = ngx_current_msec;
+    cg->window = NGX_QUIC_BBR_MIN_WINDOW * qc->path->mtu;
+}
@@ -0,0 +1,35 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_EVENT_QUIC_CONGESTION_H_INCLUDED_
+#define _NGX_EVENT_QUIC_CONGESTION_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+
+typedef struct {
+    const char                       *name;
+    void                            (*ack)(ngx_connection_t *c,
+                                           ngx_quic_frame_t *f);
+    void                            (*lost)(ngx_connection_t *c,
+                                            ngx_quic_frame_t *f);
+    void                            (*persistent)(ngx_connection_t *c);
+} ngx_quic_congestion_ops_t;
+
+
+void ngx_quic_init_congestion(ngx_quic_connection_t *qc);
+void ngx_quic_congestion_ack(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_congestion_lost(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_persistent_congestion(ngx_connection_t *c);
+
+void ngx_quic_congestion_sent(ngx_connection_t *c, ngx_quic_frame_t *f);
+void ngx_quic_congestion_app_limited(ngx_connection_t *c);
+ngx_int_t ngx_quic_pacing_check(ngx_connection_t *c, size_t size);
+void ngx_quic_pacing_sent(ngx_connection_t *c, size_t size);
+
+#endif /* _NGX_EVENT_QUIC_CONGESTION_H_INCLUDED_ */
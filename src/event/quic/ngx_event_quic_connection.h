@@ -37,6 +37,7 @@ typedef struct ngx_quic_keys_s        ngx_quic_keys_t;
 #include <ngx_event_quic_ssl.h>
 #include <ngx_event_quic_tokens.h>
 #include <ngx_event_quic_ack.h>
+#include <ngx_event_quic_congestion.h>
 #include <ngx_event_quic_output.h>
 #include <ngx_event_quic_socket.h>
 
@@ -164,11 +165,46 @@ typedef struct {
 } ngx_quic_streams_t;
 
 
+typedef struct {
+    uint64_t                          bw;
+    uint64_t                          round;
+} ngx_quic_bw_sample_t;
+
+
 typedef struct {
     size_t                            in_flight;
     size_t                            window;
     size_t                            ssthresh;
     ngx_msec_t                        recovery_start;
+
+    ngx_quic_congestion_ops_t        *ops;
+
+    uint64_t                          delivered;
+    ngx_msec_t                        delivered_time;
+    uint64_t                          app_limited;
+
+    /* cubic */
+    size_t                            w_max;
+    size_t                            w_est;
+    ngx_msec_t                        k;
+    ngx_msec_t                        epoch_start;
+
+    /* bbr */
+    ngx_uint_t                        state;
+    ngx_uint_t                        cycle;
+    ngx_msec_t                        cycle_start;
+    uint64_t                          round_delivered;
+    uint64_t                          round_count;
+    uint64_t                          max_bw;
+    ngx_quic_bw_sample_t              bw_samples[3];
+    uint64_t                          full_bw;
+    ngx_uint_t                        full_bw_count;
+    size_t                            inflight_hi;
+
+    /* pacing */
+    uint64_t                          pacing_rate;
+    size_t                            pacing_budget;
+    ngx_msec_t                        pacing_time;
 } ngx_quic_congestion_t;
 
 
@@ -34,6 +34,39 @@
 
 #define NGX_QUIC_SOCKET_RETRY_DELAY      10 /* ms, for NGX_AGAIN on write */
 
+#define NGX_QUIC_SEND_QUEUE_MSGS         64
+#define NGX_QUIC_SEND_QUEUE_SIZE     262144 /* 256K */
+
+
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+
+typedef struct {
+    ngx_connection_t              *connection;
+    ngx_atomic_uint_t              number;
+    ngx_sockaddr_t                 sockaddr;
+    struct iovec                   iov;
+#if (NGX_HAVE_ADDRINFO_CMSG)
+    char                           control[CMSG_SPACE(sizeof(uint16_t))
+                                       + CMSG_SPACE(sizeof(ngx_addrinfo_t))];
+#else
+    char                           control[CMSG_SPACE(sizeof(uint16_t))];
+#endif
+} ngx_quic_send_msg_t;
+
+
+typedef struct {
+    ngx_socket_t                   fd;
+    ngx_uint_t                     sent;
+    ngx_uint_t                     nmsgs;
+    size_t                         size;
+    ngx_event_t                    event;
+    struct mmsghdr                 msgs[NGX_QUIC_SEND_QUEUE_MSGS];
+    ngx_quic_send_msg_t            data[NGX_QUIC_SEND_QUEUE_MSGS];
+    u_char                         buffer[NGX_QUIC_SEND_QUEUE_SIZE];
+} ngx_quic_send_queue_t;
+
+#endif
+
 
 #define ngx_quic_log_packet(log, pkt)                                         \
     ngx_log_debug6(NGX_LOG_DEBUG_EVENT, log, 0,                               \
@@ -54,6 +87,11 @@ static ngx_int_t ngx_quic_create_segments(ngx_connection_t *c);
 static ssize_t ngx_quic_send_segments(ngx_connection_t *c, u_char *buf,
     size_t len, struct sockaddr *sockaddr, socklen_t socklen, size_t segment);
 #endif
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+static ssize_t ngx_quic_send_queue_add(ngx_connection_t *c, u_char *buf,
+    size_t len, struct sockaddr *sockaddr, socklen_t socklen, size_t segment);
+static void ngx_quic_send_queue_handler(ngx_event_t *ev);
+#endif
 static ssize_t ngx_quic_output_packet(ngx_connection_t *c,
     ngx_quic_send_ctx_t *ctx, u_char *data, size_t max, size_t min);
 static void ngx_quic_init_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
@@ -61,10 +99,19 @@ static void ngx_quic_init_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
 static ngx_uint_t ngx_quic_get_padding_level(ngx_connection_t *c);
 static ssize_t ngx_quic_send(ngx_connection_t *c, u_char *buf, size_t len,
     struct sockaddr *sockaddr, socklen_t socklen);
+static ssize_t ngx_quic_send_now(ngx_connection_t *c, u_char *buf, size_t len,
+    struct sockaddr *sockaddr, socklen_t socklen);
 static void ngx_quic_set_packet_number(ngx_quic_header_t *pkt,
     ngx_quic_send_ctx_t *ctx);
 
 
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+
+static ngx_quic_send_queue_t  ngx_quic_send_queue;
+
+#endif
+
+
 ngx_int_t
 ngx_quic_output(ngx_connection_t *c)
 {
@@ -93,6 +140,8 @@ ngx_quic_output(ngx_connection_t *c)
         return NGX_ERROR;
     }
 
+    ngx_quic_congestion_app_limited(c);
+
     if (in_flight == cg->in_flight || qc->closing) {
         /* no ack-eliciting data was sent or we are done */
         return NGX_OK;
@@ -129,6 +178,10 @@ ngx_quic_create_datagrams(ngx_connection_t *c)
 
     while (cg->in_flight < cg->window) {
 
+        if (ngx_quic_pacing_check(c, path->mtu) != NGX_OK) {
+            break;
+        }
+
         p = dst;
 
         len = ngx_quic_path_limit(c, path, path->mtu);
@@ -192,6 +245,8 @@ ngx_quic_create_datagrams(ngx_connection_t *c)
             ngx_quic_commit_send(c, &qc->send_ctx[i]);
         }
 
+        ngx_quic_pacing_sent(c, len);
+
         path->sent += len;
     }
 
@@ -204,13 +259,10 @@ ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
 {
     ngx_queue_t            *q;
     ngx_quic_frame_t       *f;
-    ngx_quic_congestion_t  *cg;
     ngx_quic_connection_t  *qc;
 
     qc = ngx_quic_get_connection(c);
 
-    cg = &qc->congestion;
-
     while (!ngx_queue_empty(&ctx->sending)) {
 
         q = ngx_queue_head(&ctx->sending);
@@ -221,7 +273,7 @@ ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
         if (f->pkt_need_ack && !qc->closing) {
             ngx_queue_insert_tail(&ctx->sent, q);
 
-            cg->in_flight += f->plen;
+            ngx_quic_congestion_sent(c, f);
 
         } else {
             ngx_quic_free_frame(c, f);
@@ -229,7 +281,7 @@ ngx_quic_commit_send(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx)
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_EVENT, c->log, 0,
-                   "quic congestion send if:%uz", cg->in_flight);
+                   "quic congestion send if:%uz", qc->congestion.in_flight);
 }
 
 
@@ -341,7 +393,9 @@ ngx_quic_create_segments(ngx_connection_t *c)
 
         len = ngx_min(segsize, (size_t) (end - p));
 
-        if (len && cg->in_flight + (p - dst) < cg->window) {
+        if (len && cg->in_flight + (p - dst) < cg->window
+            && ngx_quic_pacing_check(c, (p - dst) + len) == NGX_OK)
+        {
 
             n = ngx_quic_output_packet(c, ctx, p, len, len);
             if (n == NGX_ERROR) {
@@ -377,6 +431,8 @@ ngx_quic_create_segments(ngx_connection_t *c)
 
             ngx_quic_commit_send(c, ctx);
 
+            ngx_quic_pacing_sent(c, n);
+
             path->sent += n;
 
             p = dst;
@@ -407,6 +463,17 @@ ngx_quic_send_segments(ngx_connection_t *c, u_char *buf, size_t len,
     char             msg_control[CMSG_SPACE(sizeof(uint16_t))];
 #endif
 
+#if (NGX_HAVE_SENDMMSG)
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc && qc->conf->sendmmsg_enabled) {
+        return ngx_quic_send_queue_add(c, buf, len, sockaddr, socklen,
+                                       segment);
+    }
+#endif
+
     ngx_memzero(&msg, sizeof(struct msghdr));
     ngx_memzero(msg_control, sizeof(msg_control));
 
@@ -687,6 +754,24 @@ ngx_quic_init_packet(ngx_connection_t *c, ngx_quic_send_ctx_t *ctx,
 static ssize_t
 ngx_quic_send(ngx_connection_t *c, u_char *buf, size_t len,
     struct sockaddr *sockaddr, socklen_t socklen)
+{
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+    ngx_quic_connection_t  *qc;
+
+    qc = ngx_quic_get_connection(c);
+
+    if (qc && qc->conf->sendmmsg_enabled) {
+        return ngx_quic_send_queue_add(c, buf, len, sockaddr, socklen, 0);
+    }
+#endif
+
+    return ngx_quic_send_now(c, buf, len, sockaddr, socklen);
+}
+
+
+static ssize_t
+ngx_quic_send_now(ngx_connection_t *c, u_char *buf, size_t len,
+    struct sockaddr *sockaddr, socklen_t socklen)
 {
     ssize_t          n;
     struct iovec     iov;
@@ -696,6 +781,23 @@ ngx_quic_send(ngx_connection_t *c, u_char *buf, size_t len,
     char             msg_control[CMSG_SPACE(sizeof(ngx_addrinfo_t))];
 #endif
 
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+
+    /*
+     * preserve the order of datagrams already queued; if the socket
+     * is not ready to send them, the datagram is queued after them
+     */
+
+    if (ngx_quic_send_queue.nmsgs) {
+        ngx_quic_send_queue_flush();
+
+        if (ngx_quic_send_queue.nmsgs && ngx_quic_send_queue.fd == c->fd) {
+            return ngx_quic_send_queue_add(c, buf, len, sockaddr, socklen, 0);
+        }
+    }
+
+#endif
+
     ngx_memzero(&msg, sizeof(struct msghdr));
 
     iov.iov_base = (void *) buf;
@@ -731,6 +833,233 @@ ngx_quic_send(ngx_connection_t *c, u_char *buf, size_t len,
 }
 
 
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+
+static ssize_t
+ngx_quic_send_queue_add(ngx_connection_t *c, u_char *buf, size_t len,
+    struct sockaddr *sockaddr, socklen_t socklen, size_t segment)
+{
+    u_char                 *p;
+    size_t                  clen;
+    struct msghdr          *msg;
+    struct cmsghdr         *cmsg;
+    ngx_quic_send_msg_t    *m;
+    ngx_quic_send_queue_t  *q;
+#if (NGX_HAVE_UDP_SEGMENT)
+    uint16_t               *valp;
+#endif
+
+    /*
+     * datagrams of all QUIC connections of a worker are collected
+     * here and sent with a single sendmmsg() call when posted events
+     * are processed; the queue is bound to a single socket though,
+     * so it is flushed once a datagram for another socket arrives
+     */
+
+    q = &ngx_quic_send_queue;
+
+    if (q->nmsgs
+        && (q->fd != c->fd
+            || q->nmsgs == NGX_QUIC_SEND_QUEUE_MSGS
+            || q->size + len > NGX_QUIC_SEND_QUEUE_SIZE))
+    {
+        ngx_quic_send_queue_flush();
+
+        /* the socket is not ready, the caller retries later */
+
+        if (q->nmsgs) {
+            return NGX_AGAIN;
+        }
+    }
+
+    if (q->event.handler == NULL) {
+        q->event.handler = ngx_quic_send_queue_handler;
+        q->event.data = q;
+        q->event.log = ngx_cycle->log;
+    }
+
+    q->fd = c->fd;
+
+    m = &q->data[q->nmsgs];
+    msg = &q->msgs[q->nmsgs].msg_hdr;
+
+    p = q->buffer + q->size;
+    ngx_memcpy(p, buf, len);
+
+    ngx_memcpy(&m->sockaddr, sockaddr, socklen);
+
+    m->connection = c;
+    m->number = c->number;
+
+    m->iov.iov_base = (void *) p;
+    m->iov.iov_len = len;
+
+    ngx_memzero(msg, sizeof(struct msghdr));
+    ngx_memzero(m->control, sizeof(m->control));
+
+    msg->msg_iov = &m->iov;
+    msg->msg_iovlen = 1;
+
+    msg->msg_name = (void *) &m->sockaddr;
+    msg->msg_namelen = socklen;
+
+    msg->msg_control = (void *) m->control;
+    msg->msg_controllen = sizeof(m->control);
+
+    cmsg = CMSG_FIRSTHDR(msg);
+    clen = 0;
+
+#if (NGX_HAVE_UDP_SEGMENT)
+    if (segment) {
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+
+        clen += CMSG_SPACE(sizeof(uint16_t));
+
+        valp = (void *) CMSG_DATA(cmsg);
+        *valp = segment;
+
+        cmsg = CMSG_NXTHDR(msg, cmsg);
+    }
+#endif
+
+#if (NGX_HAVE_ADDRINFO_CMSG)
+    if (c->listening && c->listening->wildcard && c->local_sockaddr) {
+        clen += ngx_set_srcaddr_cmsg(cmsg, c->local_sockaddr);
+    }
+#endif
+
+    if (clen) {
+        msg->msg_controllen = clen;
+
+    } else {
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+    }
+
+    q->nmsgs++;
+    q->size += len;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_EVENT, c->log, 0,
+                   "quic send queue add len:%uz seg:%uz msgs:%ui size:%uz",
+                   len, segment, q->nmsgs, q->size);
+
+    if (!q->event.posted && !q->event.timer_set) {
+        ngx_post_event(&q->event, &ngx_posted_events);
+    }
+
+    c->sent += len;
+
+    return len;
+}
+
+
+static void
+ngx_quic_send_queue_handler(ngx_event_t *ev)
+{
+    ev->timedout = 0;
+
+    ngx_quic_send_queue_flush();
+}
+
+
+void
+ngx_quic_send_queue_flush(void)
+{
+    int                     n;
+    ngx_err_t               err;
+    ngx_uint_t              sent;
+    ngx_connection_t       *c;
+    ngx_quic_send_msg_t    *m;
+    ngx_quic_send_queue_t  *q;
+    ngx_quic_connection_t  *qc;
+
+    q = &ngx_quic_send_queue;
+
+    sent = q->sent;
+
+    while (sent < q->nmsgs) {
+
+        n = sendmmsg(q->fd, &q->msgs[sent], q->nmsgs - sent, 0);
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR) {
+                continue;
+            }
+
+            if (err == NGX_EAGAIN) {
+
+                /*
+                 * the rest of the queue is kept and sent again later;
+                 * the timer is not cancelable, so that a worker process
+                 * does not exit before CONNECTION_CLOSE frames are sent
+                 */
+
+                ngx_log_debug1(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, err,
+                               "sendmmsg() not ready, %ui datagrams left",
+                               q->nmsgs - sent);
+
+                q->sent = sent;
+
+                if (!q->event.timer_set) {
+                    ngx_add_timer(&q->event, NGX_QUIC_SOCKET_RETRY_DELAY);
+                }
+
+                return;
+            }
+
+            /*
+             * skip the datagram which failed and send the rest;
+             * the connection which sent it is closed, as it would be
+             * after a failed sendmsg()
+             */
+
+            m = &q->data[sent++];
+            c = m->connection;
+
+            if (c->number != m->number || c->fd == (ngx_socket_t) -1) {
+                ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, err,
+                              "sendmmsg() failed");
+                continue;
+            }
+
+            if (c->write->error) {
+                continue;
+            }
+
+            c->write->error = 1;
+            ngx_connection_error(c, err, "sendmmsg() failed");
+
+            qc = ngx_quic_get_connection(c);
+
+            if (qc) {
+                ngx_post_event(&qc->close, &ngx_posted_events);
+            }
+
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_EVENT, ngx_cycle->log, 0,
+                       "sendmmsg: %d of %ui", n, q->nmsgs - sent);
+
+        sent += n;
+    }
+
+    q->sent = 0;
+    q->nmsgs = 0;
+    q->size = 0;
+
+    if (q->event.timer_set) {
+        ngx_del_timer(&q->event);
+    }
+}
+
+#endif
+
+
 static void
 ngx_quic_set_packet_number(ngx_quic_header_t *pkt, ngx_quic_send_ctx_t *ctx)
 {
@@ -1269,7 +1598,13 @@ ngx_quic_frame_sendto(ngx_connection_t *c, ngx_quic_frame_t *frame,
 
     ctx->pnum++;
 
-    sent = ngx_quic_send(c, res.data, res.len, path->sockaddr, path->socklen);
+    /*
+     * sent directly, bypassing the send queue, to report errors such as
+     * EMSGSIZE for path MTU probes to the caller
+     */
+
+    sent = ngx_quic_send_now(c, res.data, res.len, path->sockaddr,
+                             path->socklen);
     if (sent < 0) {
         ngx_quic_free_frame(c, frame);
         return sent;
@@ -1280,7 +1615,7 @@ ngx_quic_frame_sendto(ngx_connection_t *c, ngx_quic_frame_t *frame,
     if (frame->need_ack && !qc->closing) {
         ngx_queue_insert_tail(&ctx->sent, &frame->queue);
 
-        cg->in_flight += frame->plen;
+        ngx_quic_congestion_sent(c, frame);
 
     } else {
         ngx_quic_free_frame(c, frame);
@@ -37,4 +37,8 @@ ngx_int_t ngx_quic_frame_sendto(ngx_connection_t *c, ngx_quic_frame_t *frame,
 size_t ngx_quic_path_limit(ngx_connection_t *c, ngx_quic_path_t *path,
     size_t size);
 
+#if ((NGX_HAVE_SENDMMSG) && (NGX_HAVE_MSGHDR_MSG_CONTROL))
+void ngx_quic_send_queue_flush(void);
+#endif
+
 #endif /* _NGX_EVENT_QUIC_OUTPUT_H_INCLUDED_ */
@@ -267,10 +267,13 @@ struct ngx_quic_frame_s {
     uint64_t                                    pnum;
     size_t                                      plen;
     ngx_msec_t                                  send_time;
+    uint64_t                                    delivered;
+    ngx_msec_t                                  delivered_time;
     ssize_t                                     len;
     unsigned                                    need_ack:1;
     unsigned                                    pkt_need_ack:1;
     unsigned                                    ignore_congestion:1;
+    unsigned                                    app_limited:1;
 
     ngx_chain_t                                *data;
     union {
@@ -42,13 +42,119 @@
 #define NGX_HTTP_MP4_LAST_ATOM    NGX_HTTP_MP4_CO64_DATA
 
 
+#define NGX_HTTP_MP4_STTS_SEEK     0
+#define NGX_HTTP_MP4_CTTS_SEEK     1
+#define NGX_HTTP_MP4_STSC_SEEK     2
+
+#define NGX_HTTP_MP4_LAST_SEEK     NGX_HTTP_MP4_STSC_SEEK
+
+/* a seek point is kept for every NGX_HTTP_MP4_SEEK_STEP-th table entry */
+#define NGX_HTTP_MP4_SEEK_STEP     64
+
+
+#define NGX_HTTP_MP4_HLS_PLAYLIST   1
+#define NGX_HTTP_MP4_DASH_MANIFEST  2
+#define NGX_HTTP_MP4_INIT_SEGMENT   3
+#define NGX_HTTP_MP4_MEDIA_SEGMENT  4
+
+
 typedef struct {
     size_t                buffer_size;
     size_t                max_buffer_size;
     ngx_flag_t            start_key_frame;
+    ngx_shm_zone_t       *moov_cache;
+    ngx_flag_t            segments;
+    ngx_msec_t            segment_length;
 } ngx_http_mp4_conf_t;
 
 
+typedef struct {
+    ngx_rbtree_t          rbtree;
+    ngx_rbtree_node_t     sentinel;
+    ngx_queue_t           queue;
+} ngx_http_mp4_moov_sh_t;
+
+
+/* a position in the sample tables, see ngx_http_mp4_cursor_t */
+
+typedef struct {
+    uint64_t              dts;
+    off_t                 offset;
+    uint32_t              n;
+    uint32_t              duration;
+    uint32_t              size;
+    uint32_t              cto;
+    uint32_t              key;
+    uint32_t              stts;
+    uint32_t              stts_left;
+    uint32_t              ctts;
+    uint32_t              ctts_left;
+    uint32_t              stss;
+    uint32_t              stsc;
+    uint32_t              chunk;
+    uint32_t              chunk_samples;
+    uint32_t              chunk_left;
+} ngx_http_mp4_mark_t;
+
+
+/*
+ * the index is followed by the segment start times and the end time,
+ * the marks of each track, and the numbers of segments of the tracks
+ */
+
+typedef struct {
+    size_t                size;
+    ngx_msec_t            segment_length;
+    ngx_uint_t            nsegments;
+    ngx_uint_t            ntraks;
+} ngx_http_mp4_index_t;
+
+
+/* the time and the first sample of a table entry */
+
+typedef struct {
+    uint64_t              time;
+    uint64_t              sample;
+} ngx_http_mp4_seek_t;
+
+
+/*
+ * the header of the cached seek points, followed by the number of seek
+ * points of each table of each track, and then by the seek points
+ */
+
+typedef struct {
+    size_t                size;
+    ngx_uint_t            ntraks;
+} ngx_http_mp4_seeks_t;
+
+
+typedef struct {
+    ngx_str_node_t        sn;
+    ngx_queue_t           queue;
+
+    ngx_file_uniq_t       uniq;
+    time_t                mtime;
+    off_t                 size;
+
+    ngx_uint_t            count;
+    ngx_uint_t            mdat_first;   /* unsigned  mdat_first:1; */
+
+    off_t                 moov_offset;
+    off_t                 mdat_offset;
+    uint64_t              mdat_size;
+
+    size_t                moov_size;
+    size_t                ftyp_size;
+
+    /* moov atom data followed by ftyp atom data */
+    u_char               *data;
+
+    ngx_http_mp4_index_t *index;
+    ngx_http_mp4_seeks_t *seeks;
+} ngx_http_mp4_moov_t;
+
+
 typedef struct {
     u_char                chunk[4];
     u_char                samples[4];
@@ -94,10 +200,18 @@ typedef struct {
     uint64_t              end_chunk_samples_size;
     uint64_t              duration;
     uint64_t              prefix;
+    uint64_t              start_dts;
     uint64_t              movie_duration;
     off_t                 start_offset;
     off_t                 end_offset;
 
+    /* the first samples of segments, followed by the end of the track */
+    ngx_http_mp4_mark_t  *marks;
+    ngx_uint_t            nmarks;
+
+    ngx_http_mp4_seek_t  *seek[NGX_HTTP_MP4_LAST_SEEK + 1];
+    ngx_uint_t            nseek[NGX_HTTP_MP4_LAST_SEEK + 1];
+
     size_t                tkhd_size;
     size_t                mdhd_size;
     size_t                hdlr_size;
@@ -145,6 +259,55 @@ typedef struct {
 } ngx_http_mp4_trak_t;
 
 
+typedef struct {
+    ngx_http_mp4_trak_t  *trak;
+
+    uint32_t              samples;
+    uint32_t              n;
+
+    /* the current sample */
+    uint64_t              dts;
+    uint32_t              duration;
+    uint32_t              size;
+    uint32_t              cto;
+    ngx_uint_t            key;          /* unsigned  key:1; */
+    off_t                 offset;
+
+    u_char               *stts;
+    u_char               *stts_end;
+    uint32_t              stts_left;
+
+    u_char               *ctts;
+    u_char               *ctts_end;
+    uint32_t              ctts_left;
+
+    u_char               *stss;
+    u_char               *stss_end;
+
+    u_char               *stsc;
+    u_char               *stsc_end;
+    uint32_t              chunk;
+    uint32_t              chunk_samples;
+    uint32_t              chunk_left;
+
+    u_char               *stsz;
+    uint32_t              uniform_size;
+
+    u_char               *stco;
+    ngx_uint_t            co64;         /* unsigned  co64:1; */
+} ngx_http_mp4_cursor_t;
+
+
+typedef struct {
+    ngx_http_mp4_trak_t    *trak;
+    ngx_http_mp4_cursor_t   cursor;
+
+    uint64_t                time;
+    uint32_t                samples;
+    off_t                   size;
+} ngx_http_mp4_run_t;
+
+
 typedef struct {
     ngx_file_t            file;
 
@@ -167,6 +330,22 @@ typedef struct {
     size_t                ftyp_size;
     size_t                moov_size;
 
+    ngx_file_uniq_t       uniq;
+    time_t                mtime;
+    ngx_uint_t            cached;       /* unsigned  cached:1; */
+    ngx_http_mp4_moov_t  *cache_node;
+    ngx_http_mp4_index_t *index;
+    ngx_http_mp4_seeks_t *seeks;
+
+    ngx_uint_t            fragment;
+    ngx_uint_t            segment;
+    ngx_uint_t            track;
+    ngx_str_t             name;
+    ngx_str_t             content_type;
+    ngx_http_mp4_trak_t  *ref;
+    ngx_array_t           media;
+    ngx_array_t           segments;
+
     ngx_chain_t          *out;
     ngx_chain_t           ftyp_atom;
     ngx_chain_t           moov_atom;
@@ -258,11 +437,32 @@ typedef struct {
 #define ngx_mp4_last_trak(mp4)                                                \
     &((ngx_http_mp4_trak_t *) mp4->trak.elts)[mp4->trak.nelts - 1]
 
+#define ngx_mp4_copy_atom(p, buf)                                             \
+    ngx_cpymem(p, (buf)->pos, (buf)->last - (buf)->pos)
+
 
 static ngx_int_t ngx_http_mp4_handler(ngx_http_request_t *r);
 static ngx_int_t ngx_http_mp4_atofp(u_char *line, size_t n, size_t point);
 
 static ngx_int_t ngx_http_mp4_process(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_read_file(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_cache_lookup(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_moov_t *cn);
+static ngx_int_t ngx_http_mp4_read_cached(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_moov_t *cn);
+static void ngx_http_mp4_cache_moov(ngx_http_mp4_file_t *mp4, size_t size,
+    ngx_uint_t mdat_first);
+static void ngx_http_mp4_cache_store(ngx_http_mp4_file_t *mp4, ngx_int_t rc);
+static ngx_http_mp4_moov_t *
+    ngx_http_mp4_cache_alloc_locked(ngx_shm_zone_t *shm_zone, size_t size);
+static void ngx_http_mp4_cache_free_locked(ngx_shm_zone_t *shm_zone,
+    ngx_http_mp4_moov_t *node);
+static void *ngx_http_mp4_cache_alloc_data(ngx_http_mp4_file_t *mp4,
+    size_t offset, size_t size);
+static ngx_int_t ngx_http_mp4_cache_attach_data(ngx_http_mp4_file_t *mp4,
+    size_t offset, void *data);
+static ngx_http_mp4_moov_t *ngx_http_mp4_cache_node_locked(
+    ngx_http_mp4_file_t *mp4, size_t offset);
 static ngx_int_t ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size);
 static ngx_int_t ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size);
@@ -338,6 +538,15 @@ static ngx_int_t ngx_http_mp4_update_stsc_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak);
 static ngx_int_t ngx_http_mp4_crop_stsc_data(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak, ngx_uint_t start);
+static ngx_int_t ngx_http_mp4_seek_points(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_build_seek(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak);
+static void ngx_http_mp4_seek_count(ngx_http_mp4_trak_t *trak,
+    ngx_uint_t *nseek);
+static ngx_int_t ngx_http_mp4_read_seeks(ngx_http_mp4_file_t *mp4);
+static void ngx_http_mp4_cache_seeks(ngx_http_mp4_file_t *mp4);
+static ngx_uint_t ngx_http_mp4_seek_entry(ngx_http_mp4_trak_t *trak,
+    ngx_uint_t table, ngx_uint_t first, uint64_t value);
 static ngx_int_t ngx_http_mp4_read_stsz_atom(ngx_http_mp4_file_t *mp4,
     uint64_t atom_data_size);
 static ngx_int_t ngx_http_mp4_update_stsz_atom(ngx_http_mp4_file_t *mp4,
@@ -355,7 +564,37 @@ static ngx_int_t ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
 static void ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak, off_t adjustment);
 
+static ngx_int_t ngx_http_mp4_fragment(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_split(ngx_http_mp4_file_t *mp4);
+static uint64_t ngx_http_mp4_segment_time(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t n);
+static ngx_int_t ngx_http_mp4_split_trak(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t last);
+static ngx_int_t ngx_http_mp4_read_index(ngx_http_mp4_file_t *mp4);
+static void ngx_http_mp4_cache_index(ngx_http_mp4_file_t *mp4);
+static uint32_t ngx_http_mp4_track_id(ngx_http_mp4_trak_t *trak);
+static ngx_int_t ngx_http_mp4_hls_playlist(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_dash_manifest(ngx_http_mp4_file_t *mp4);
+static u_char *ngx_http_mp4_codecs(ngx_http_mp4_trak_t *trak, u_char *p);
+static u_char *ngx_http_mp4_find_atom(u_char *p, u_char *last, char *name);
+static ngx_int_t ngx_http_mp4_descriptor(u_char **pos, u_char *last,
+    ngx_uint_t tag);
+static ngx_int_t ngx_http_mp4_init_segment(ngx_http_mp4_file_t *mp4);
+static ngx_int_t ngx_http_mp4_media_segment(ngx_http_mp4_file_t *mp4);
+static void ngx_http_mp4_cursor_init(ngx_http_mp4_cursor_t *cur,
+    ngx_http_mp4_trak_t *trak);
+static ngx_int_t ngx_http_mp4_cursor_next(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_cursor_t *cur);
+static void ngx_http_mp4_cursor_mark(ngx_http_mp4_cursor_t *cur,
+    ngx_http_mp4_mark_t *mark);
+static void ngx_http_mp4_cursor_seek(ngx_http_mp4_cursor_t *cur,
+    ngx_http_mp4_trak_t *trak, ngx_http_mp4_mark_t *mark);
+
 static char *ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char *ngx_http_mp4_moov_cache(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_mp4_cache_init(ngx_shm_zone_t *shm_zone,
+    void *data);
 static void *ngx_http_mp4_create_conf(ngx_conf_t *cf);
 static char *ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child);
 
@@ -390,6 +629,27 @@ static ngx_command_t  ngx_http_mp4_commands[] = {
       offsetof(ngx_http_mp4_conf_t, start_key_frame),
       NULL },
 
+    { ngx_string("mp4_moov_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_mp4_moov_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("mp4_segments"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mp4_conf_t, segments),
+      NULL },
+
+    { ngx_string("mp4_segment_length"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_mp4_conf_t, segment_length),
+      NULL },
+
       ngx_null_command
 };
 
@@ -478,12 +738,13 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
 {
     u_char                    *last;
     size_t                     root;
-    ngx_int_t                  rc, start, end;
-    ngx_uint_t                 level, length;
+    ngx_int_t                  rc, start, end, n;
+    ngx_uint_t                 level, length, fragment, segment, track;
     ngx_str_t                  path, value;
     ngx_log_t                 *log;
     ngx_buf_t                 *b;
     ngx_chain_t                out;
+    ngx_http_mp4_conf_t       *conf;
     ngx_http_mp4_file_t       *mp4;
     ngx_open_file_info_t       of;
     ngx_http_core_loc_conf_t  *clcf;
@@ -580,10 +841,15 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
 
     start = -1;
     length = 0;
+    fragment = 0;
+    segment = 0;
+    track = 0;
     r->headers_out.content_length_n = of.size;
     mp4 = NULL;
     b = NULL;
 
+    conf = ngx_http_get_module_loc_conf(r, ngx_http_mp4_module);
+
     if (r->args.len) {
 
         if (ngx_http_arg(r, (u_char *) "start", 5, &value) == NGX_OK) {
@@ -610,6 +876,59 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
                 }
             }
         }
+
+        if (conf->segments) {
+
+            if (ngx_http_arg(r, (u_char *) "manifest", 8, &value) == NGX_OK) {
+
+                if (value.len == 4 && ngx_strncmp(value.data, "m3u8", 4) == 0)
+                {
+                    fragment = NGX_HTTP_MP4_HLS_PLAYLIST;
+
+                } else if (value.len == 3
+                           && ngx_strncmp(value.data, "mpd", 3) == 0)
+                {
+                    fragment = NGX_HTTP_MP4_DASH_MANIFEST;
+
+                } else {
+                    return NGX_HTTP_NOT_FOUND;
+                }
+
+            } else if (ngx_http_arg(r, (u_char *) "segment", 7, &value)
+                       == NGX_OK)
+            {
+                if (value.len == 4 && ngx_strncmp(value.data, "init", 4) == 0)
+                {
+                    fragment = NGX_HTTP_MP4_INIT_SEGMENT;
+
+                } else {
+                    n = ngx_atoi(value.data, value.len);
+                    if (n <= 0) {
+                        return NGX_HTTP_NOT_FOUND;
+                    }
+
+                    fragment = NGX_HTTP_MP4_MEDIA_SEGMENT;
+                    segment = n;
+                }
+            }
+
+            if (fragment
+                && ngx_http_arg(r, (u_char *) "track", 5, &value) == NGX_OK)
+            {
+                n = ngx_atoi(value.data, value.len);
+                if (n <= 0) {
+                    return NGX_HTTP_NOT_FOUND;
+                }
+
+                track = n;
+            }
+
+            if (fragment) {
+                /* segments are always cut from the whole file */
+                start = 0;
+                length = 0;
+            }
+        }
     }
 
     if (start >= 0) {
@@ -640,11 +959,23 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
         mp4->file.log = r->connection->log;
         mp4->file.directio = of.is_directio;
         mp4->end = of.size;
+        mp4->uniq = of.uniq;
+        mp4->mtime = of.mtime;
         mp4->start = (ngx_uint_t) start;
         mp4->length = length;
+        mp4->fragment = fragment;
+        mp4->segment = segment;
+        mp4->track = track;
         mp4->request = r;
 
-        switch (ngx_http_mp4_process(mp4)) {
+        if (fragment) {
+            rc = ngx_http_mp4_fragment(mp4);
+
+        } else {
+            rc = ngx_http_mp4_process(mp4);
+        }
+
+        switch (rc) {
 
         case NGX_DECLINED:
             if (mp4->buffer) {
@@ -654,6 +985,10 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
             ngx_pfree(r->pool, mp4);
             mp4 = NULL;
 
+            if (fragment) {
+                return NGX_HTTP_NOT_FOUND;
+            }
+
             break;
 
         case NGX_OK:
@@ -690,7 +1025,11 @@ ngx_http_mp4_handler(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    if (ngx_http_set_content_type(r) != NGX_OK) {
+    if (mp4 && mp4->content_type.len) {
+        r->headers_out.content_type_len = mp4->content_type.len;
+        r->headers_out.content_type = mp4->content_type;
+
+    } else if (ngx_http_set_content_type(r) != NGX_OK) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
@@ -799,17 +1138,14 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
     ngx_int_t              rc;
     ngx_uint_t             i, j;
     ngx_chain_t          **prev;
-    ngx_http_mp4_trak_t   *trak;
     ngx_http_mp4_conf_t   *conf;
+    ngx_http_mp4_trak_t   *trak;
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
                    "mp4 start:%ui, length:%ui", mp4->start, mp4->length);
 
-    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
-
-    mp4->buffer_size = conf->buffer_size;
+    rc = ngx_http_mp4_read_file(mp4);
 
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms, mp4->end);
     if (rc != NGX_OK) {
         return rc;
     }
@@ -828,6 +1164,14 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
         return NGX_ERROR;
     }
 
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    if (conf->moov_cache && (mp4->start || mp4->length)) {
+        if (ngx_http_mp4_seek_points(mp4) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
     prev = &mp4->out;
 
     if (mp4->ftyp_atom.buf) {
@@ -947,6 +1291,41 @@ ngx_http_mp4_process(ngx_http_mp4_file_t *mp4)
 }
 
 
+static ngx_int_t
+ngx_http_mp4_read_file(ngx_http_mp4_file_t *mp4)
+{
+    ngx_int_t             rc;
+    ngx_http_mp4_moov_t   cn;
+    ngx_http_mp4_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    mp4->buffer_size = conf->buffer_size;
+
+    rc = NGX_DECLINED;
+
+    if (conf->moov_cache) {
+        rc = ngx_http_mp4_cache_lookup(mp4, &cn);
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    if (rc == NGX_OK) {
+        return ngx_http_mp4_read_cached(mp4, &cn);
+    }
+
+    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_atoms, mp4->end);
+
+    if (mp4->cache_node) {
+        ngx_http_mp4_cache_store(mp4, rc);
+    }
+
+    return rc;
+}
+
+
 typedef struct {
     u_char    size[4];
     u_char    name[4];
@@ -960,400 +1339,900 @@ typedef struct {
 
 
 static ngx_int_t
-ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size)
+ngx_http_mp4_cache_lookup(ngx_http_mp4_file_t *mp4, ngx_http_mp4_moov_t *cn)
 {
-    off_t        end;
-    size_t       atom_header_size;
-    u_char      *atom_header, *atom_name;
-    uint64_t     atom_size;
-    ngx_int_t    rc;
-    ngx_uint_t   n;
+    u_char                  *p;
+    size_t                   size;
+    uint32_t                 hash;
+    ngx_shm_zone_t          *shm_zone;
+    ngx_slab_pool_t         *shpool;
+    ngx_http_mp4_conf_t     *conf;
+    ngx_http_mp4_moov_t     *node;
+    ngx_http_mp4_seeks_t    *seeks;
+    ngx_http_mp4_index_t    *index;
+    ngx_http_mp4_moov_sh_t  *sh;
 
-    end = mp4->offset + atom_data_size;
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    while (mp4->offset < end) {
+    shm_zone = conf->moov_cache;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shm_zone->data;
 
-        if (ngx_http_mp4_read(mp4, sizeof(uint32_t)) != NGX_OK) {
-            return NGX_ERROR;
-        }
+    hash = ngx_crc32_short(mp4->file.name.data, mp4->file.name.len);
 
-        atom_header = mp4->buffer_pos;
-        atom_size = ngx_mp4_get_32value(atom_header);
-        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+    ngx_shmtx_lock(&shpool->mutex);
 
-        if (atom_size == 0) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "mp4 atom end");
-            return NGX_OK;
-        }
+    node = (ngx_http_mp4_moov_t *)
+               ngx_str_rbtree_lookup(&sh->rbtree, &mp4->file.name, hash);
 
-        if (atom_size < sizeof(ngx_mp4_atom_header_t)) {
+    if (node == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
 
-            if (atom_size == 1) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 moov cache miss");
 
-                if (ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header64_t))
-                    != NGX_OK)
-                {
-                    return NGX_ERROR;
-                }
+        return NGX_DECLINED;
+    }
 
-                /* 64-bit atom size */
-                atom_header = mp4->buffer_pos;
-                atom_size = ngx_mp4_get_64value(atom_header + 8);
-                atom_header_size = sizeof(ngx_mp4_atom_header64_t);
+    if (!node->mdat_first
+        && mp4->start == 0 && mp4->length == 0 && !mp4->fragment)
+    {
+        /* the original file is sent, see ngx_http_mp4_read_moov_atom() */
 
-                if (atom_size < sizeof(ngx_mp4_atom_header64_t)) {
-                    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                                  "\"%s\" mp4 atom is too small:%uL",
-                                  mp4->file.name.data, atom_size);
-                    return NGX_ERROR;
-                }
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
 
-            } else {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "\"%s\" mp4 atom is too small:%uL",
-                              mp4->file.name.data, atom_size);
-                return NGX_ERROR;
-            }
+    if (node->uniq != mp4->uniq
+        || node->mtime != mp4->mtime
+        || node->size != mp4->end)
+    {
+        if (node->count == 0) {
+            ngx_http_mp4_cache_free_locked(shm_zone, node);
         }
 
-        if (ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header_t)) != NGX_OK) {
-            return NGX_ERROR;
-        }
+        ngx_shmtx_unlock(&shpool->mutex);
 
-        atom_header = mp4->buffer_pos;
-        atom_name = atom_header + sizeof(uint32_t);
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 moov cache stale");
 
-        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 atom: %*s @%O:%uL",
-                       (size_t) 4, atom_name, mp4->offset, atom_size);
+        return NGX_DECLINED;
+    }
 
-        if (atom_size > (uint64_t) (NGX_MAX_OFF_T_VALUE - mp4->offset)
-            || mp4->offset + (off_t) atom_size > end)
-        {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 atom too large:%uL",
-                          mp4->file.name.data, atom_size);
-            return NGX_ERROR;
-        }
+    if (node->moov_size > conf->buffer_size
+        && node->moov_size > conf->max_buffer_size)
+    {
+        /* let the moov atom be rejected as usual */
 
-        for (n = 0; atom[n].name; n++) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
 
-            if (ngx_strncmp(atom_name, atom[n].name, 4) == 0) {
+    node->count++;
 
-                ngx_mp4_atom_next(mp4, atom_header_size);
+    ngx_queue_remove(&node->queue);
+    ngx_queue_insert_head(&sh->queue, &node->queue);
 
-                rc = atom[n].handler(mp4, atom_size - atom_header_size);
-                if (rc != NGX_OK) {
-                    return rc;
-                }
+    index = node->index;
+    seeks = node->seeks;
 
-                goto next;
-            }
-        }
+    ngx_shmtx_unlock(&shpool->mutex);
 
-        ngx_mp4_atom_next(mp4, atom_size);
+    /*
+     * the node is not freed while referenced, and its data
+     * are not changed, so they are copied without the lock
+     */
 
-    next:
-        continue;
+    *cn = *node;
+
+    size = node->moov_size + node->ftyp_size;
+
+    p = ngx_palloc(mp4->request->pool, size);
+
+    if (p) {
+        ngx_memcpy(p, node->data, size);
     }
 
-    return NGX_OK;
-}
+    /* segment requests use the sample index */
 
+    if (p
+        && index
+        && mp4->fragment
+        && mp4->fragment != NGX_HTTP_MP4_INIT_SEGMENT
+        && index->segment_length == conf->segment_length)
+    {
+        mp4->index = ngx_palloc(mp4->request->pool, index->size);
 
-static ngx_int_t
-ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size)
-{
-    ssize_t  n;
+        if (mp4->index) {
+            ngx_memcpy(mp4->index, index, index->size);
 
-    if (mp4->buffer_pos + size <= mp4->buffer_end) {
-        return NGX_OK;
+        } else {
+            p = NULL;
+        }
     }
 
-    if (mp4->offset + (off_t) mp4->buffer_size > mp4->end) {
-        mp4->buffer_size = (size_t) (mp4->end - mp4->offset);
-    }
+    /* requests with start and end use the seek points */
 
-    if (mp4->buffer_size < size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 file truncated", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    if (p && seeks && !mp4->fragment && (mp4->start || mp4->length)) {
+        mp4->seeks = ngx_palloc(mp4->request->pool, seeks->size);
 
-    if (mp4->buffer == NULL) {
-        mp4->buffer = ngx_palloc(mp4->request->pool, mp4->buffer_size);
-        if (mp4->buffer == NULL) {
-            return NGX_ERROR;
-        }
+        if (mp4->seeks) {
+            ngx_memcpy(mp4->seeks, seeks, seeks->size);
 
-        mp4->buffer_start = mp4->buffer;
+        } else {
+            p = NULL;
+        }
     }
 
-    n = ngx_read_file(&mp4->file, mp4->buffer_start, mp4->buffer_size,
-                      mp4->offset);
+    ngx_shmtx_lock(&shpool->mutex);
 
-    if (n == NGX_ERROR) {
-        return NGX_ERROR;
-    }
+    node->count--;
 
-    if ((size_t) n != mp4->buffer_size) {
-        ngx_log_error(NGX_LOG_CRIT, mp4->file.log, 0,
-                      ngx_read_file_n " read only %z of %z from \"%s\"",
-                      n, mp4->buffer_size, mp4->file.name.data);
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (p == NULL) {
         return NGX_ERROR;
     }
 
-    mp4->buffer_pos = mp4->buffer_start;
-    mp4->buffer_end = mp4->buffer_start + mp4->buffer_size;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 moov cache hit, size:%uz", cn->moov_size);
+
+    mp4->buffer = p;
+    mp4->cached = 1;
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_mp4_read_ftyp_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_cached(ngx_http_mp4_file_t *mp4, ngx_http_mp4_moov_t *cn)
 {
-    u_char     *ftyp_atom;
-    size_t      atom_size;
-    ngx_buf_t  *atom;
+    ngx_int_t  rc;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ftyp atom");
+    /* call the atom handlers as they were called for the file */
 
-    if (atom_data_size > 1024
-        || ngx_mp4_atom_data(mp4) + (size_t) atom_data_size > mp4->buffer_end)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 ftyp atom is too large:%uL",
-                      mp4->file.name.data, atom_data_size);
-        return NGX_ERROR;
-    }
+    if (cn->ftyp_size) {
+        mp4->buffer_pos = mp4->buffer + cn->moov_size;
+        mp4->buffer_end = mp4->buffer_pos + cn->ftyp_size;
 
-    if (mp4->ftyp_atom.buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 ftyp atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+        rc = ngx_http_mp4_read_ftyp_atom(mp4, cn->ftyp_size);
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    if (cn->mdat_first) {
+        mp4->offset = cn->mdat_offset;
 
-    ftyp_atom = ngx_palloc(mp4->request->pool, atom_size);
-    if (ftyp_atom == NULL) {
-        return NGX_ERROR;
+        rc = ngx_http_mp4_read_mdat_atom(mp4, cn->mdat_size);
+        if (rc != NGX_OK) {
+            return rc;
+        }
     }
 
-    ngx_mp4_set_32value(ftyp_atom, atom_size);
-    ngx_mp4_set_atom_name(ftyp_atom, 'f', 't', 'y', 'p');
-
-    /*
-     * only moov atom content is guaranteed to be in mp4->buffer
-     * during sending response, so ftyp atom content should be copied
-     */
-    ngx_memcpy(ftyp_atom + sizeof(ngx_mp4_atom_header_t),
-               ngx_mp4_atom_data(mp4), (size_t) atom_data_size);
+    mp4->buffer_start = mp4->buffer;
+    mp4->buffer_pos = mp4->buffer;
+    mp4->buffer_end = mp4->buffer + cn->moov_size;
+    mp4->buffer_size = cn->moov_size;
+    mp4->offset = cn->moov_offset;
 
-    atom = &mp4->ftyp_atom_buf;
-    atom->temporary = 1;
-    atom->pos = ftyp_atom;
-    atom->last = ftyp_atom + atom_size;
+    rc = ngx_http_mp4_read_moov_atom(mp4, cn->moov_size);
+    if (rc != NGX_OK) {
+        return rc;
+    }
 
-    mp4->ftyp_atom.buf = atom;
-    mp4->ftyp_size = atom_size;
-    mp4->content_length = atom_size;
+    if (!cn->mdat_first) {
+        mp4->offset = cn->mdat_offset;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+        rc = ngx_http_mp4_read_mdat_atom(mp4, cn->mdat_size);
+    }
 
-    return NGX_OK;
+    return rc;
 }
 
 
-/*
- * Small excess buffer to process atoms after moov atom, mp4->buffer_start
- * will be set to this buffer part after moov atom processing.
- */
-#define NGX_HTTP_MP4_MOOV_BUFFER_EXCESS  (4 * 1024)
-
-static ngx_int_t
-ngx_http_mp4_read_moov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static void
+ngx_http_mp4_cache_moov(ngx_http_mp4_file_t *mp4, size_t size,
+    ngx_uint_t mdat_first)
 {
-    ngx_int_t             rc;
-    ngx_uint_t            no_mdat;
-    ngx_buf_t            *atom;
+    u_char               *p;
+    size_t                len, ftyp_size;
+    ngx_shm_zone_t       *shm_zone;
+    ngx_slab_pool_t      *shpool;
     ngx_http_mp4_conf_t  *conf;
+    ngx_http_mp4_moov_t  *node;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom");
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    no_mdat = (mp4->mdat_atom.buf == NULL);
+    shm_zone = conf->moov_cache;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    if (no_mdat && mp4->start == 0 && mp4->length == 0) {
-        /*
-         * send original file if moov atom resides before
-         * mdat atom and client requests integral file
-         */
-        return NGX_DECLINED;
-    }
+    ftyp_size = mp4->ftyp_size ? mp4->ftyp_size - sizeof(ngx_mp4_atom_header_t)
+                               : 0;
 
-    if (mp4->moov_atom.buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 moov atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+    len = sizeof(ngx_http_mp4_moov_t) + mp4->file.name.len + size + ftyp_size;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_http_mp4_cache_alloc_locked(shm_zone, len);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (node == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 moov cache is full");
+        return;
     }
 
-    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+    /* the node is not yet in the tree, so it is filled without the lock */
 
-    if (atom_data_size > mp4->buffer_size) {
+    p = (u_char *) node + sizeof(ngx_http_mp4_moov_t);
 
-        if (atom_data_size > conf->max_buffer_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 moov atom is too large:%uL, "
-                          "you may want to increase mp4_max_buffer_size",
-                          mp4->file.name.data, atom_data_size);
-            return NGX_ERROR;
-        }
+    node->sn.str.len = mp4->file.name.len;
+    node->sn.str.data = p;
+    node->sn.node.key = ngx_crc32_short(mp4->file.name.data,
+                                        mp4->file.name.len);
 
-        ngx_pfree(mp4->request->pool, mp4->buffer);
-        mp4->buffer = NULL;
-        mp4->buffer_pos = NULL;
-        mp4->buffer_end = NULL;
+    p = ngx_cpymem(p, mp4->file.name.data, mp4->file.name.len);
 
-        mp4->buffer_size = (size_t) atom_data_size
-                         + NGX_HTTP_MP4_MOOV_BUFFER_EXCESS * no_mdat;
-    }
+    node->uniq = mp4->uniq;
+    node->mtime = mp4->mtime;
+    node->size = mp4->end;
+    node->count = 0;
+    node->mdat_first = mdat_first;
+    node->moov_offset = mp4->offset;
+    node->moov_size = size;
+    node->ftyp_size = ftyp_size;
+    node->data = p;
+    node->index = NULL;
+    node->seeks = NULL;
 
-    if (ngx_http_mp4_read(mp4, (size_t) atom_data_size) != NGX_OK) {
-        return NGX_ERROR;
+    p = ngx_cpymem(p, mp4->buffer_pos, size);
+
+    if (ftyp_size) {
+        ngx_memcpy(p, mp4->ftyp_atom_buf.pos + sizeof(ngx_mp4_atom_header_t),
+                   ftyp_size);
     }
 
-    mp4->trak.elts = &mp4->traks;
-    mp4->trak.size = sizeof(ngx_http_mp4_trak_t);
-    mp4->trak.nalloc = 2;
-    mp4->trak.pool = mp4->request->pool;
+    mp4->cache_node = node;
+}
 
-    atom = &mp4->moov_atom_buf;
-    atom->temporary = 1;
-    atom->pos = mp4->moov_atom_header;
-    atom->last = mp4->moov_atom_header + 8;
 
-    mp4->moov_atom.buf = &mp4->moov_atom_buf;
+static void
+ngx_http_mp4_cache_store(ngx_http_mp4_file_t *mp4, ngx_int_t rc)
+{
+    size_t                   ftyp_size;
+    ngx_buf_t               *data;
+    ngx_shm_zone_t          *shm_zone;
+    ngx_slab_pool_t         *shpool;
+    ngx_http_mp4_conf_t     *conf;
+    ngx_http_mp4_moov_t     *node, *old;
+    ngx_http_mp4_moov_sh_t  *sh;
 
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_moov_atoms, atom_data_size);
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom done");
+    shm_zone = conf->moov_cache;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shm_zone->data;
 
-    if (no_mdat) {
-        mp4->buffer_start = mp4->buffer_pos;
-        mp4->buffer_size = NGX_HTTP_MP4_MOOV_BUFFER_EXCESS;
+    node = mp4->cache_node;
+    mp4->cache_node = NULL;
 
-        if (mp4->buffer_start + mp4->buffer_size > mp4->buffer_end) {
-            mp4->buffer = NULL;
-            mp4->buffer_pos = NULL;
-            mp4->buffer_end = NULL;
+    ftyp_size = mp4->ftyp_size ? mp4->ftyp_size - sizeof(ngx_mp4_atom_header_t)
+                               : 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    /* the file is cached only if its layout can be reproduced */
+
+    if (rc != NGX_OK
+        || mp4->trak.nelts == 0
+        || mp4->mdat_atom.buf == NULL
+        || ftyp_size != node->ftyp_size)
+    {
+        ngx_slab_free_locked(shpool, node);
+        ngx_shmtx_unlock(&shpool->mutex);
+        return;
+    }
+
+    data = mp4->mdat_data.buf;
+
+    node->mdat_offset = data->file_pos;
+    node->mdat_size = data->file_last - data->file_pos;
+
+    old = (ngx_http_mp4_moov_t *)
+              ngx_str_rbtree_lookup(&sh->rbtree, &node->sn.str,
+                                    node->sn.node.key);
+
+    if (old) {
+        if (old->count) {
+            ngx_slab_free_locked(shpool, node);
+            ngx_shmtx_unlock(&shpool->mutex);
+            return;
         }
 
-    } else {
-        /* skip atoms after moov atom */
-        mp4->offset = mp4->end;
+        ngx_http_mp4_cache_free_locked(shm_zone, old);
     }
 
-    return rc;
+    ngx_rbtree_insert(&sh->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&sh->queue, &node->queue);
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 moov cache store, size:%uz", node->moov_size);
 }
 
 
-static ngx_int_t
-ngx_http_mp4_read_mdat_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static ngx_http_mp4_moov_t *
+ngx_http_mp4_cache_alloc_locked(ngx_shm_zone_t *shm_zone, size_t size)
 {
-    ngx_buf_t  *data;
+    ngx_queue_t             *q;
+    ngx_slab_pool_t         *shpool;
+    ngx_http_mp4_moov_t     *node;
+    ngx_http_mp4_moov_sh_t  *sh;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdat atom");
+    if (size >= shm_zone->shm.size) {
+        return NULL;
+    }
 
-    if (mp4->mdat_atom.buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 mdat atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shm_zone->data;
+
+    for ( ;; ) {
+        node = ngx_slab_alloc_locked(shpool, size);
+        if (node) {
+            return node;
+        }
+
+        /* free the least recently used node which is not referenced */
+
+        for (q = ngx_queue_last(&sh->queue);
+             q != ngx_queue_sentinel(&sh->queue);
+             q = ngx_queue_prev(q))
+        {
+            node = ngx_queue_data(q, ngx_http_mp4_moov_t, queue);
+
+            if (node->count == 0) {
+                break;
+            }
+        }
+
+        if (q == ngx_queue_sentinel(&sh->queue)) {
+            return NULL;
+        }
+
+        ngx_http_mp4_cache_free_locked(shm_zone, node);
     }
+}
 
-    data = &mp4->mdat_data_buf;
-    data->file = &mp4->file;
-    data->in_file = 1;
-    data->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
-    data->last_in_chain = 1;
-    data->file_last = mp4->offset + atom_data_size;
 
-    mp4->mdat_atom.buf = &mp4->mdat_atom_buf;
-    mp4->mdat_atom.next = &mp4->mdat_data;
-    mp4->mdat_data.buf = data;
+static void
+ngx_http_mp4_cache_free_locked(ngx_shm_zone_t *shm_zone,
+    ngx_http_mp4_moov_t *node)
+{
+    ngx_slab_pool_t         *shpool;
+    ngx_http_mp4_moov_sh_t  *sh;
 
-    if (mp4->trak.nelts) {
-        /* skip atoms after mdat atom */
-        mp4->offset = mp4->end;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    sh = shm_zone->data;
 
-    } else {
-        ngx_mp4_atom_next(mp4, atom_data_size);
+    ngx_queue_remove(&node->queue);
+    ngx_rbtree_delete(&sh->rbtree, &node->sn.node);
+
+    if (node->index) {
+        ngx_slab_free_locked(shpool, node->index);
     }
 
-    return NGX_OK;
+    if (node->seeks) {
+        ngx_slab_free_locked(shpool, node->seeks);
+    }
+
+    ngx_slab_free_locked(shpool, node);
 }
 
 
-static size_t
-ngx_http_mp4_update_mdat_atom(ngx_http_mp4_file_t *mp4, off_t start_offset,
-    off_t end_offset)
+static void *
+ngx_http_mp4_cache_alloc_data(ngx_http_mp4_file_t *mp4, size_t offset,
+    size_t size)
 {
-    off_t       atom_data_size;
-    u_char     *atom_header;
-    uint32_t    atom_header_size;
-    uint64_t    atom_size;
-    ngx_buf_t  *atom;
+    void                 *data;
+    ngx_shm_zone_t       *shm_zone;
+    ngx_slab_pool_t      *shpool;
+    ngx_http_mp4_conf_t  *conf;
 
-    atom_data_size = end_offset - start_offset;
-    mp4->mdat_data.buf->file_pos = start_offset;
-    mp4->mdat_data.buf->file_last = end_offset;
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mdat new offset @%O:%O", start_offset, atom_data_size);
+    shm_zone = conf->moov_cache;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    atom_header = mp4->mdat_atom_header;
+    ngx_shmtx_lock(&shpool->mutex);
 
-    if ((uint64_t) atom_data_size
-        > (uint64_t) 0xffffffff - sizeof(ngx_mp4_atom_header_t))
-    {
-        atom_size = 1;
-        atom_header_size = sizeof(ngx_mp4_atom_header64_t);
-        ngx_mp4_set_64value(atom_header + sizeof(ngx_mp4_atom_header_t),
-                            sizeof(ngx_mp4_atom_header64_t) + atom_data_size);
-    } else {
-        atom_size = sizeof(ngx_mp4_atom_header_t) + atom_data_size;
-        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+    if (ngx_http_mp4_cache_node_locked(mp4, offset) == NULL) {
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NULL;
     }
 
-    mp4->content_length += atom_header_size + atom_data_size;
+    data = ngx_slab_alloc_locked(shpool, size);
 
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'a', 't');
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    atom = &mp4->mdat_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_header_size;
+    if (data == NULL) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 moov cache is full");
+    }
 
-    return atom_header_size;
+    return data;
 }
 
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[4];
-    u_char    modification_time[4];
-    u_char    timescale[4];
-    u_char    duration[4];
-    u_char    rate[4];
-    u_char    volume[2];
-    u_char    reserved[10];
-    u_char    matrix[36];
+static ngx_int_t
+ngx_http_mp4_cache_attach_data(ngx_http_mp4_file_t *mp4, size_t offset,
+    void *data)
+{
+    ngx_shm_zone_t       *shm_zone;
+    ngx_slab_pool_t      *shpool;
+    ngx_http_mp4_conf_t  *conf;
+    ngx_http_mp4_moov_t  *node;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    shm_zone = conf->moov_cache;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    node = ngx_http_mp4_cache_node_locked(mp4, offset);
+
+    if (node == NULL) {
+        ngx_slab_free_locked(shpool, data);
+        ngx_shmtx_unlock(&shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    *(void **) ((u_char *) node + offset) = data;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return NGX_OK;
+}
+
+
+static ngx_http_mp4_moov_t *
+ngx_http_mp4_cache_node_locked(ngx_http_mp4_file_t *mp4, size_t offset)
+{
+    uint32_t                 hash;
+    ngx_http_mp4_conf_t     *conf;
+    ngx_http_mp4_moov_t     *node;
+    ngx_http_mp4_moov_sh_t  *sh;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    sh = conf->moov_cache->data;
+
+    hash = ngx_crc32_short(mp4->file.name.data, mp4->file.name.len);
+
+    node = (ngx_http_mp4_moov_t *)
+               ngx_str_rbtree_lookup(&sh->rbtree, &mp4->file.name, hash);
+
+    /*
+     * data built from the moov atom are only added to the node it came
+     * from, and only once; "offset" is that of the pointer to the data
+     */
+
+    if (node == NULL
+        || *(void **) ((u_char *) node + offset)
+        || node->uniq != mp4->uniq
+        || node->mtime != mp4->mtime
+        || node->size != mp4->end)
+    {
+        return NULL;
+    }
+
+    return node;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_atom_handler_t *atom, uint64_t atom_data_size)
+{
+    off_t        end;
+    size_t       atom_header_size;
+    u_char      *atom_header, *atom_name;
+    uint64_t     atom_size;
+    ngx_int_t    rc;
+    ngx_uint_t   n;
+
+    end = mp4->offset + atom_data_size;
+
+    while (mp4->offset < end) {
+
+        if (ngx_http_mp4_read(mp4, sizeof(uint32_t)) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        atom_header = mp4->buffer_pos;
+        atom_size = ngx_mp4_get_32value(atom_header);
+        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+
+        if (atom_size == 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "mp4 atom end");
+            return NGX_OK;
+        }
+
+        if (atom_size < sizeof(ngx_mp4_atom_header_t)) {
+
+            if (atom_size == 1) {
+
+                if (ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header64_t))
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                /* 64-bit atom size */
+                atom_header = mp4->buffer_pos;
+                atom_size = ngx_mp4_get_64value(atom_header + 8);
+                atom_header_size = sizeof(ngx_mp4_atom_header64_t);
+
+                if (atom_size < sizeof(ngx_mp4_atom_header64_t)) {
+                    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                                  "\"%s\" mp4 atom is too small:%uL",
+                                  mp4->file.name.data, atom_size);
+                    return NGX_ERROR;
+                }
+
+            } else {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "\"%s\" mp4 atom is too small:%uL",
+                              mp4->file.name.data, atom_size);
+                return NGX_ERROR;
+            }
+        }
+
+        if (ngx_http_mp4_read(mp4, sizeof(ngx_mp4_atom_header_t)) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        atom_header = mp4->buffer_pos;
+        atom_name = atom_header + sizeof(uint32_t);
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 atom: %*s @%O:%uL",
+                       (size_t) 4, atom_name, mp4->offset, atom_size);
+
+        if (atom_size > (uint64_t) (NGX_MAX_OFF_T_VALUE - mp4->offset)
+            || mp4->offset + (off_t) atom_size > end)
+        {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 atom too large:%uL",
+                          mp4->file.name.data, atom_size);
+            return NGX_ERROR;
+        }
+
+        for (n = 0; atom[n].name; n++) {
+
+            if (ngx_strncmp(atom_name, atom[n].name, 4) == 0) {
+
+                ngx_mp4_atom_next(mp4, atom_header_size);
+
+                rc = atom[n].handler(mp4, atom_size - atom_header_size);
+                if (rc != NGX_OK) {
+                    return rc;
+                }
+
+                goto next;
+            }
+        }
+
+        ngx_mp4_atom_next(mp4, atom_size);
+
+    next:
+        continue;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read(ngx_http_mp4_file_t *mp4, size_t size)
+{
+    ssize_t  n;
+
+    if (mp4->buffer_pos + size <= mp4->buffer_end) {
+        return NGX_OK;
+    }
+
+    if (mp4->offset + (off_t) mp4->buffer_size > mp4->end) {
+        mp4->buffer_size = (size_t) (mp4->end - mp4->offset);
+    }
+
+    if (mp4->buffer_size < size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 file truncated", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (mp4->buffer == NULL) {
+        mp4->buffer = ngx_palloc(mp4->request->pool, mp4->buffer_size);
+        if (mp4->buffer == NULL) {
+            return NGX_ERROR;
+        }
+
+        mp4->buffer_start = mp4->buffer;
+    }
+
+    n = ngx_read_file(&mp4->file, mp4->buffer_start, mp4->buffer_size,
+                      mp4->offset);
+
+    if (n == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if ((size_t) n != mp4->buffer_size) {
+        ngx_log_error(NGX_LOG_CRIT, mp4->file.log, 0,
+                      ngx_read_file_n " read only %z of %z from \"%s\"",
+                      n, mp4->buffer_size, mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    mp4->buffer_pos = mp4->buffer_start;
+    mp4->buffer_end = mp4->buffer_start + mp4->buffer_size;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_ftyp_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char     *ftyp_atom;
+    size_t      atom_size;
+    ngx_buf_t  *atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ftyp atom");
+
+    if (atom_data_size > 1024
+        || ngx_mp4_atom_data(mp4) + (size_t) atom_data_size > mp4->buffer_end)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 ftyp atom is too large:%uL",
+                      mp4->file.name.data, atom_data_size);
+        return NGX_ERROR;
+    }
+
+    if (mp4->ftyp_atom.buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 ftyp atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+
+    ftyp_atom = ngx_palloc(mp4->request->pool, atom_size);
+    if (ftyp_atom == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_mp4_set_32value(ftyp_atom, atom_size);
+    ngx_mp4_set_atom_name(ftyp_atom, 'f', 't', 'y', 'p');
+
+    /*
+     * only moov atom content is guaranteed to be in mp4->buffer
+     * during sending response, so ftyp atom content should be copied
+     */
+    ngx_memcpy(ftyp_atom + sizeof(ngx_mp4_atom_header_t),
+               ngx_mp4_atom_data(mp4), (size_t) atom_data_size);
+
+    atom = &mp4->ftyp_atom_buf;
+    atom->temporary = 1;
+    atom->pos = ftyp_atom;
+    atom->last = ftyp_atom + atom_size;
+
+    mp4->ftyp_atom.buf = atom;
+    mp4->ftyp_size = atom_size;
+    mp4->content_length = atom_size;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Small excess buffer to process atoms after moov atom, mp4->buffer_start
+ * will be set to this buffer part after moov atom processing.
+ */
+#define NGX_HTTP_MP4_MOOV_BUFFER_EXCESS  (4 * 1024)
+
+static ngx_int_t
+ngx_http_mp4_read_moov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    ngx_int_t             rc;
+    ngx_uint_t            no_mdat;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_conf_t  *conf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom");
+
+    no_mdat = (mp4->mdat_atom.buf == NULL);
+
+    if (no_mdat && mp4->start == 0 && mp4->length == 0 && !mp4->fragment) {
+        /*
+         * send original file if moov atom resides before
+         * mdat atom and client requests integral file
+         */
+        return NGX_DECLINED;
+    }
+
+    if (mp4->moov_atom.buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 moov atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+
+    if (atom_data_size > mp4->buffer_size) {
+
+        if (atom_data_size > conf->max_buffer_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 moov atom is too large:%uL, "
+                          "you may want to increase mp4_max_buffer_size",
+                          mp4->file.name.data, atom_data_size);
+            return NGX_ERROR;
+        }
+
+        ngx_pfree(mp4->request->pool, mp4->buffer);
+        mp4->buffer = NULL;
+        mp4->buffer_pos = NULL;
+        mp4->buffer_end = NULL;
+
+        mp4->buffer_size = (size_t) atom_data_size
+                         + NGX_HTTP_MP4_MOOV_BUFFER_EXCESS * no_mdat;
+    }
+
+    if (ngx_http_mp4_read(mp4, (size_t) atom_data_size) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (conf->moov_cache && !mp4->cached) {
+        ngx_http_mp4_cache_moov(mp4, (size_t) atom_data_size, !no_mdat);
+    }
+
+    mp4->trak.elts = &mp4->traks;
+    mp4->trak.size = sizeof(ngx_http_mp4_trak_t);
+    mp4->trak.nalloc = 2;
+    mp4->trak.pool = mp4->request->pool;
+
+    atom = &mp4->moov_atom_buf;
+    atom->temporary = 1;
+    atom->pos = mp4->moov_atom_header;
+    atom->last = mp4->moov_atom_header + 8;
+
+    mp4->moov_atom.buf = &mp4->moov_atom_buf;
+
+    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_moov_atoms, atom_data_size);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 moov atom done");
+
+    if (no_mdat) {
+        mp4->buffer_start = mp4->buffer_pos;
+        mp4->buffer_size = NGX_HTTP_MP4_MOOV_BUFFER_EXCESS;
+
+        if (mp4->buffer_start + mp4->buffer_size > mp4->buffer_end) {
+            mp4->buffer = NULL;
+            mp4->buffer_pos = NULL;
+            mp4->buffer_end = NULL;
+        }
+
+    } else {
+        /* skip atoms after moov atom */
+        mp4->offset = mp4->end;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_mdat_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    ngx_buf_t  *data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdat atom");
+
+    if (mp4->mdat_atom.buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 mdat atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    data = &mp4->mdat_data_buf;
+    data->file = &mp4->file;
+    data->in_file = 1;
+    data->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    data->last_in_chain = 1;
+    data->file_pos = mp4->offset;
+    data->file_last = mp4->offset + atom_data_size;
+
+    mp4->mdat_atom.buf = &mp4->mdat_atom_buf;
+    mp4->mdat_atom.next = &mp4->mdat_data;
+    mp4->mdat_data.buf = data;
+
+    if (mp4->trak.nelts) {
+        /* skip atoms after mdat atom */
+        mp4->offset = mp4->end;
+
+    } else {
+        ngx_mp4_atom_next(mp4, atom_data_size);
+    }
+
+    return NGX_OK;
+}
+
+
+static size_t
+ngx_http_mp4_update_mdat_atom(ngx_http_mp4_file_t *mp4, off_t start_offset,
+    off_t end_offset)
+{
+    off_t       atom_data_size;
+    u_char     *atom_header;
+    uint32_t    atom_header_size;
+    uint64_t    atom_size;
+    ngx_buf_t  *atom;
+
+    atom_data_size = end_offset - start_offset;
+    mp4->mdat_data.buf->file_pos = start_offset;
+    mp4->mdat_data.buf->file_last = end_offset;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mdat new offset @%O:%O", start_offset, atom_data_size);
+
+    atom_header = mp4->mdat_atom_header;
+
+    if ((uint64_t) atom_data_size
+        > (uint64_t) 0xffffffff - sizeof(ngx_mp4_atom_header_t))
+    {
+        atom_size = 1;
+        atom_header_size = sizeof(ngx_mp4_atom_header64_t);
+        ngx_mp4_set_64value(atom_header + sizeof(ngx_mp4_atom_header_t),
+                            sizeof(ngx_mp4_atom_header64_t) + atom_data_size);
+    } else {
+        atom_size = sizeof(ngx_mp4_atom_header_t) + atom_data_size;
+        atom_header_size = sizeof(ngx_mp4_atom_header_t);
+    }
+
+    mp4->content_length += atom_header_size + atom_data_size;
+
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'a', 't');
+
+    atom = &mp4->mdat_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_header_size;
+
+    return atom_header_size;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[4];
+    u_char    modification_time[4];
+    u_char    timescale[4];
+    u_char    duration[4];
+    u_char    rate[4];
+    u_char    volume[2];
+    u_char    reserved[10];
+    u_char    matrix[36];
     u_char    preview_time[4];
     u_char    preview_duration[4];
     u_char    poster_time[4];
@@ -1363,571 +2242,2378 @@ typedef struct {
     u_char    next_track_id[4];
 } ngx_mp4_mvhd_atom_t;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[8];
-    u_char    modification_time[8];
-    u_char    timescale[4];
-    u_char    duration[8];
-    u_char    rate[4];
-    u_char    volume[2];
-    u_char    reserved[10];
-    u_char    matrix[36];
-    u_char    preview_time[4];
-    u_char    preview_duration[4];
-    u_char    poster_time[4];
-    u_char    selection_time[4];
-    u_char    selection_duration[4];
-    u_char    current_time[4];
-    u_char    next_track_id[4];
-} ngx_mp4_mvhd64_atom_t;
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[8];
+    u_char    modification_time[8];
+    u_char    timescale[4];
+    u_char    duration[8];
+    u_char    rate[4];
+    u_char    volume[2];
+    u_char    reserved[10];
+    u_char    matrix[36];
+    u_char    preview_time[4];
+    u_char    preview_duration[4];
+    u_char    poster_time[4];
+    u_char    selection_time[4];
+    u_char    selection_duration[4];
+    u_char    current_time[4];
+    u_char    next_track_id[4];
+} ngx_mp4_mvhd64_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_mvhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                 *atom_header;
+    size_t                  atom_size;
+    uint32_t                timescale;
+    uint64_t                duration, start_time, length_time;
+    ngx_buf_t              *atom;
+    ngx_mp4_mvhd_atom_t    *mvhd_atom;
+    ngx_mp4_mvhd64_atom_t  *mvhd64_atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mvhd atom");
+
+    if (mp4->mvhd_atom.buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 mvhd atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    mvhd_atom = (ngx_mp4_mvhd_atom_t *) atom_header;
+    mvhd64_atom = (ngx_mp4_mvhd64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(atom_header, 'm', 'v', 'h', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_mvhd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 mvhd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (mvhd_atom->version[0] == 0) {
+        /* version 0: 32-bit duration */
+        timescale = ngx_mp4_get_32value(mvhd_atom->timescale);
+        duration = ngx_mp4_get_32value(mvhd_atom->duration);
+
+    } else {
+        /* version 1: 64-bit duration */
+
+        if (ngx_mp4_atom_data_size(ngx_mp4_mvhd64_atom_t) > atom_data_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 mvhd atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        timescale = ngx_mp4_get_32value(mvhd64_atom->timescale);
+        duration = ngx_mp4_get_64value(mvhd64_atom->duration);
+    }
+
+    mp4->timescale = timescale;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mvhd timescale:%uD, duration:%uL, time:%.3fs",
+                   timescale, duration, (double) duration / timescale);
+
+    start_time = (uint64_t) mp4->start * timescale / 1000;
+
+    if (duration < start_time) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 start time exceeds file duration",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    duration -= start_time;
+
+    if (mp4->length) {
+        length_time = (uint64_t) mp4->length * timescale / 1000;
+
+        if (duration > length_time) {
+            duration = length_time;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mvhd new duration:%uL, time:%.3fs",
+                   duration, (double) duration / timescale);
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(mvhd_atom->size, atom_size);
+
+    if (mvhd_atom->version[0] == 0) {
+        ngx_mp4_set_32value(mvhd_atom->duration, duration);
+
+    } else {
+        ngx_mp4_set_64value(mvhd64_atom->duration, duration);
+    }
+
+    atom = &mp4->mvhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    mp4->mvhd_atom.buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_trak_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_end;
+    off_t                 atom_file_end;
+    ngx_int_t             rc;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 trak atom");
+
+    trak = ngx_array_push(&mp4->trak);
+    if (trak == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 't', 'r', 'a', 'k');
+
+    atom = &trak->trak_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_TRAK_ATOM].buf = atom;
+
+    atom_end = mp4->buffer_pos + (size_t) atom_data_size;
+    atom_file_end = mp4->offset + atom_data_size;
+
+    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_trak_atoms, atom_data_size);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 trak atom: %i", rc);
+
+    if (rc == NGX_DECLINED) {
+        /* skip this trak */
+        ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+        mp4->trak.nelts--;
+        mp4->buffer_pos = atom_end;
+        mp4->offset = atom_file_end;
+        return NGX_OK;
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_mp4_update_trak_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t);
+    atom = &trak->trak_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_cmov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                  "\"%s\" mp4 compressed moov atom (cmov) is not supported",
+                  mp4->file.name.data);
+
+    return NGX_ERROR;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[4];
+    u_char    modification_time[4];
+    u_char    track_id[4];
+    u_char    reserved1[4];
+    u_char    duration[4];
+    u_char    reserved2[8];
+    u_char    layer[2];
+    u_char    group[2];
+    u_char    volume[2];
+    u_char    reserved3[2];
+    u_char    matrix[36];
+    u_char    width[4];
+    u_char    height[4];
+} ngx_mp4_tkhd_atom_t;
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[8];
+    u_char    modification_time[8];
+    u_char    track_id[4];
+    u_char    reserved1[4];
+    u_char    duration[8];
+    u_char    reserved2[8];
+    u_char    layer[2];
+    u_char    group[2];
+    u_char    volume[2];
+    u_char    reserved3[2];
+    u_char    matrix[36];
+    u_char    width[4];
+    u_char    height[4];
+} ngx_mp4_tkhd64_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_tkhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                 *atom_header;
+    size_t                  atom_size;
+    uint64_t                duration, start_time, length_time;
+    ngx_buf_t              *atom;
+    ngx_http_mp4_trak_t    *trak;
+    ngx_mp4_tkhd_atom_t    *tkhd_atom;
+    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 tkhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    tkhd_atom = (ngx_mp4_tkhd_atom_t *) atom_header;
+    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(tkhd_atom, 't', 'k', 'h', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_tkhd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 tkhd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (tkhd_atom->version[0] == 0) {
+        /* version 0: 32-bit duration */
+        duration = ngx_mp4_get_32value(tkhd_atom->duration);
+
+    } else {
+        /* version 1: 64-bit duration */
+
+        if (ngx_mp4_atom_data_size(ngx_mp4_tkhd64_atom_t) > atom_data_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 tkhd atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        duration = ngx_mp4_get_64value(tkhd64_atom->duration);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "tkhd duration:%uL, time:%.3fs",
+                   duration, (double) duration / mp4->timescale);
+
+    start_time = (uint64_t) mp4->start * mp4->timescale / 1000;
+
+    if (duration <= start_time) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "tkhd duration is less than start time");
+        return NGX_DECLINED;
+    }
+
+    duration -= start_time;
+
+    if (mp4->length) {
+        length_time = (uint64_t) mp4->length * mp4->timescale / 1000;
+
+        if (duration > length_time) {
+            duration = length_time;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "tkhd new duration:%uL, time:%.3fs",
+                   duration, (double) duration / mp4->timescale);
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 tkhd atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->tkhd_size = atom_size;
+    trak->movie_duration = duration;
+
+    ngx_mp4_set_32value(tkhd_atom->size, atom_size);
+
+    if (tkhd_atom->version[0] == 0) {
+        ngx_mp4_set_32value(tkhd_atom->duration, duration);
+
+    } else {
+        ngx_mp4_set_64value(tkhd64_atom->duration, duration);
+    }
+
+    atom = &trak->tkhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_mdia_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process mdia atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'i', 'a');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_MDIA_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 mdia atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->mdia_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_MDIA_ATOM].buf = atom;
+
+    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_mdia_atoms, atom_data_size);
+}
+
+
+static void
+ngx_http_mp4_update_mdia_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t);
+    atom = &trak->mdia_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[4];
+    u_char    modification_time[4];
+    u_char    timescale[4];
+    u_char    duration[4];
+    u_char    language[2];
+    u_char    quality[2];
+} ngx_mp4_mdhd_atom_t;
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    creation_time[8];
+    u_char    modification_time[8];
+    u_char    timescale[4];
+    u_char    duration[8];
+    u_char    language[2];
+    u_char    quality[2];
+} ngx_mp4_mdhd64_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_mdhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                 *atom_header;
+    size_t                  atom_size;
+    uint32_t                timescale;
+    uint64_t                duration, start_time, length_time;
+    ngx_buf_t              *atom;
+    ngx_http_mp4_trak_t    *trak;
+    ngx_mp4_mdhd_atom_t    *mdhd_atom;
+    ngx_mp4_mdhd64_atom_t  *mdhd64_atom;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    mdhd_atom = (ngx_mp4_mdhd_atom_t *) atom_header;
+    mdhd64_atom = (ngx_mp4_mdhd64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(mdhd_atom, 'm', 'd', 'h', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_mdhd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 mdhd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (mdhd_atom->version[0] == 0) {
+        /* version 0: everything is 32-bit */
+        timescale = ngx_mp4_get_32value(mdhd_atom->timescale);
+        duration = ngx_mp4_get_32value(mdhd_atom->duration);
+
+    } else {
+        /* version 1: 64-bit duration and 32-bit timescale */
+
+        if (ngx_mp4_atom_data_size(ngx_mp4_mdhd64_atom_t) > atom_data_size) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 mdhd atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
+
+        timescale = ngx_mp4_get_32value(mdhd64_atom->timescale);
+        duration = ngx_mp4_get_64value(mdhd64_atom->duration);
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mdhd timescale:%uD, duration:%uL, time:%.3fs",
+                   timescale, duration, (double) duration / timescale);
+
+    start_time = (uint64_t) mp4->start * timescale / 1000;
+
+    if (duration <= start_time) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mdhd duration is less than start time");
+        return NGX_DECLINED;
+    }
+
+    duration -= start_time;
+
+    if (mp4->length) {
+        length_time = (uint64_t) mp4->length * timescale / 1000;
+
+        if (duration > length_time) {
+            duration = length_time;
+        }
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mdhd new duration:%uL, time:%.3fs",
+                   duration, (double) duration / timescale);
+
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 mdhd atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->mdhd_size = atom_size;
+    trak->timescale = timescale;
+    trak->duration = duration;
+
+    ngx_mp4_set_32value(mdhd_atom->size, atom_size);
+
+    atom = &trak->mdhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_mp4_update_mdhd_atom(ngx_http_mp4_file_t *mp4,
+            ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t              *atom;
+    ngx_mp4_mdhd_atom_t    *mdhd_atom;
+    ngx_mp4_mdhd64_atom_t  *mdhd64_atom;
+
+    atom = trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf;
+    if (atom == NULL) {
+        return;
+    }
+
+    mdhd_atom = (ngx_mp4_mdhd_atom_t *) atom->pos;
+    mdhd64_atom = (ngx_mp4_mdhd64_atom_t *) atom->pos;
+
+    if (mdhd_atom->version[0] == 0) {
+        ngx_mp4_set_32value(mdhd_atom->duration, trak->duration);
+
+    } else {
+        ngx_mp4_set_64value(mdhd64_atom->duration, trak->duration);
+    }
+
+    trak->size += trak->mdhd_size;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_hdlr_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 hdlr atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'h', 'd', 'l', 'r');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 hdlr atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->hdlr_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->hdlr_size = atom_size;
+    trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_minf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process minf atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 'm', 'i', 'n', 'f');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_MINF_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 minf atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->minf_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_MINF_ATOM].buf = atom;
+
+    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_minf_atoms, atom_data_size);
+}
+
+
+static void
+ngx_http_mp4_update_minf_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t)
+               + trak->vmhd_size
+               + trak->smhd_size
+               + trak->dinf_size;
+    atom = &trak->minf_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_vmhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 vmhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'v', 'm', 'h', 'd');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf
+        || trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 vmhd/smhd atom in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->vmhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->vmhd_size += atom_size;
+    trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_smhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 smhd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 's', 'm', 'h', 'd');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf
+        || trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 vmhd/smhd atom in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->smhd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->smhd_size += atom_size;
+    trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_dinf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char              *atom_header;
+    size_t               atom_size;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 dinf atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    ngx_mp4_set_32value(atom_header, atom_size);
+    ngx_mp4_set_atom_name(atom_header, 'd', 'i', 'n', 'f');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_DINF_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 dinf atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->dinf_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + atom_size;
+
+    trak->dinf_size += atom_size;
+    trak->out[NGX_HTTP_MP4_DINF_ATOM].buf = atom;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_read_stbl_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header;
+    ngx_buf_t            *atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process stbl atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ngx_mp4_set_atom_name(atom_header, 's', 't', 'b', 'l');
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_STBL_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 stbl atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->stbl_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+
+    trak->out[NGX_HTTP_MP4_STBL_ATOM].buf = atom;
+
+    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_stbl_atoms, atom_data_size);
+}
+
+
+static void
+ngx_http_mp4_update_edts_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t            *atom;
+    ngx_mp4_elst_atom_t  *elst_atom;
+    ngx_mp4_edts_atom_t  *edts_atom;
+
+    if (trak->prefix == 0) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 edts atom update prefix:%uL", trak->prefix);
+
+    edts_atom = &trak->edts_atom;
+    ngx_mp4_set_32value(edts_atom->size, sizeof(ngx_mp4_edts_atom_t)
+                                         + sizeof(ngx_mp4_elst_atom_t));
+    ngx_mp4_set_atom_name(edts_atom, 'e', 'd', 't', 's');
+
+    atom = &trak->edts_atom_buf;
+    atom->temporary = 1;
+    atom->pos = (u_char *) edts_atom;
+    atom->last = (u_char *) edts_atom + sizeof(ngx_mp4_edts_atom_t);
+
+    trak->out[NGX_HTTP_MP4_EDTS_ATOM].buf = atom;
+
+    elst_atom = &trak->elst_atom;
+    ngx_mp4_set_32value(elst_atom->size, sizeof(ngx_mp4_elst_atom_t));
+    ngx_mp4_set_atom_name(elst_atom, 'e', 'l', 's', 't');
+
+    elst_atom->version[0] = 1;
+    elst_atom->flags[0] = 0;
+    elst_atom->flags[1] = 0;
+    elst_atom->flags[2] = 0;
+
+    ngx_mp4_set_32value(elst_atom->entries, 1);
+    ngx_mp4_set_64value(elst_atom->duration, trak->movie_duration);
+    ngx_mp4_set_64value(elst_atom->media_time, trak->prefix);
+    ngx_mp4_set_16value(elst_atom->media_rate, 1);
+    ngx_mp4_set_16value(elst_atom->reserved, 0);
+
+    atom = &trak->elst_atom_buf;
+    atom->temporary = 1;
+    atom->pos = (u_char *) elst_atom;
+    atom->last = (u_char *) elst_atom + sizeof(ngx_mp4_elst_atom_t);
+
+    trak->out[NGX_HTTP_MP4_ELST_ATOM].buf = atom;
+
+    trak->size += sizeof(ngx_mp4_edts_atom_t) + sizeof(ngx_mp4_elst_atom_t);
+}
+
+
+static void
+ngx_http_mp4_update_stbl_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    ngx_buf_t  *atom;
+
+    trak->size += sizeof(ngx_mp4_atom_header_t);
+    atom = &trak->stbl_atom_buf;
+    ngx_mp4_set_32value(atom->pos, trak->size);
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+
+    u_char    media_size[4];
+    u_char    media_name[4];
+} ngx_mp4_stsd_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stsd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table;
+    size_t                atom_size;
+    ngx_buf_t            *atom;
+    ngx_mp4_stsd_atom_t  *stsd_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* sample description atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsd atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stsd_atom = (ngx_mp4_stsd_atom_t *) atom_header;
+    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    atom_table = atom_header + atom_size;
+    ngx_mp4_set_32value(stsd_atom->size, atom_size);
+    ngx_mp4_set_atom_name(stsd_atom, 's', 't', 's', 'd');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsd_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsd atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "stsd entries:%uD, media:%*s",
+                   ngx_mp4_get_32value(stsd_atom->entries),
+                   (size_t) 4, stsd_atom->media_name);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_STSD_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 stsd atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom = &trak->stsd_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    trak->out[NGX_HTTP_MP4_STSD_ATOM].buf = atom;
+    trak->size += atom_size;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_stts_atom_t;
+
+typedef struct {
+    u_char    count[4];
+    u_char    duration[4];
+} ngx_mp4_stts_entry_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stts_atom_t  *stts_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* time-to-sample atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stts atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stts_atom = (ngx_mp4_stts_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stts_atom, 's', 't', 't', 's');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(stts_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 time-to-sample entries:%uD", entries);
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t)
+        + (uint64_t) entries * sizeof(ngx_mp4_stts_entry_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_table = atom_header + sizeof(ngx_mp4_stts_atom_t);
+    atom_end = atom_table + entries * sizeof(ngx_mp4_stts_entry_t);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_STTS_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 stts atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->time_to_sample_entries = entries;
+
+    atom = &trak->stts_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    data = &trak->stts_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STTS_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STTS_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_update_stts_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                atom_size;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stts_atom_t  *stts_atom;
+
+    /*
+     * mdia.minf.stbl.stts updating requires trak->timescale
+     * from mdia.mdhd atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stts atom update");
+
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+
+    if (data == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 stts atoms were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_mp4_crop_stts_data(mp4, trak, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_mp4_crop_stts_data(mp4, trak, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "time-to-sample entries:%uD", trak->time_to_sample_entries);
+
+    atom_size = sizeof(ngx_mp4_stts_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_STTS_ATOM].buf;
+    stts_atom = (ngx_mp4_stts_atom_t *) atom->pos;
+    ngx_mp4_set_32value(stts_atom->size, atom_size);
+    ngx_mp4_set_32value(stts_atom->entries, trak->time_to_sample_entries);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_crop_stts_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t               count, duration, rest, key_prefix;
+    uint64_t               start_time, time, dts, prefix;
+    ngx_buf_t             *data;
+    ngx_uint_t             start_sample, entries, start_sec, first, n;
+    ngx_http_mp4_seek_t   *seek;
+    ngx_mp4_stts_entry_t  *entry, *end;
+
+    if (start) {
+        start_sec = mp4->start;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stts crop start_time:%ui", start_sec);
+
+    } else if (mp4->length) {
+        start_sec = mp4->length;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stts crop end_time:%ui", start_sec);
+
+    } else {
+        return NGX_OK;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+
+    start_time = (uint64_t) start_sec * trak->timescale / 1000 + trak->prefix;
+
+    entries = trak->time_to_sample_entries;
+    start_sample = 0;
+    entry = (ngx_mp4_stts_entry_t *) data->pos;
+    end = (ngx_mp4_stts_entry_t *) data->last;
+
+    /* the time is counted from the start sample of the track */
+
+    time = trak->start_dts + start_time;
+
+    first = entry - (ngx_mp4_stts_entry_t *) trak->stts_atom_buf.last;
+    n = ngx_http_mp4_seek_entry(trak, NGX_HTTP_MP4_STTS_SEEK, first, time);
+
+    if (n) {
+        seek = &trak->seek[NGX_HTTP_MP4_STTS_SEEK][n / NGX_HTTP_MP4_SEEK_STEP];
+
+        start_sample = seek->sample - trak->start_sample;
+        start_time = time - seek->time;
+        entries -= n - first;
+        entry += n - first;
+    }
+
+    while (entry < end) {
+        count = ngx_mp4_get_32value(entry->count);
+        duration = ngx_mp4_get_32value(entry->duration);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "time:%uL, count:%uD, duration:%uD",
+                       start_time, count, duration);
+
+        if (start_time < (uint64_t) count * duration) {
+            start_sample += (ngx_uint_t) (start_time / duration);
+            rest = (uint32_t) (start_time / duration);
+            goto found;
+        }
+
+        start_sample += count;
+        start_time -= (uint64_t) count * duration;
+        entries--;
+        entry++;
+    }
+
+    if (start) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "start time is out mp4 stts samples in \"%s\"",
+                      mp4->file.name.data);
+
+        return NGX_ERROR;
+
+    } else {
+        trak->end_sample = trak->start_sample + start_sample;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "end_sample:%ui", trak->end_sample);
+
+        return NGX_OK;
+    }
+
+found:
+
+    if (start) {
+        dts = time - start_time + (uint64_t) rest * duration;
+        prefix = trak->prefix;
+
+        key_prefix = ngx_http_mp4_seek_key_frame(mp4, trak, start_sample);
+
+        start_sample -= key_prefix;
+
+        while (rest < key_prefix) {
+            trak->prefix += rest * duration;
+            key_prefix -= rest;
+
+            entry--;
+            entries++;
+
+            count = ngx_mp4_get_32value(entry->count);
+            duration = ngx_mp4_get_32value(entry->duration);
+            rest = count;
+        }
+
+        trak->prefix += key_prefix * duration;
+        trak->duration += trak->prefix;
+        trak->start_dts = dts - (trak->prefix - prefix);
+        rest -= key_prefix;
+
+        ngx_mp4_set_32value(entry->count, count - rest);
+        data->pos = (u_char *) entry;
+        trak->time_to_sample_entries = entries;
+        trak->start_sample = start_sample;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "start_sample:%ui, new count:%uD",
+                       trak->start_sample, count - rest);
+
+    } else {
+        ngx_mp4_set_32value(entry->count, rest);
+        data->last = (u_char *) (entry + 1);
+        trak->time_to_sample_entries -= entries - 1;
+        trak->end_sample = trak->start_sample + start_sample;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "end_sample:%ui, new count:%uD",
+                       trak->end_sample, rest);
+    }
+
+    return NGX_OK;
+}
+
+
+static uint32_t
+ngx_http_mp4_seek_key_frame(ngx_http_mp4_file_t *mp4, ngx_http_mp4_trak_t *trak,
+    uint32_t start_sample)
+{
+    uint32_t              key_prefix, sample, *entry;
+    ngx_buf_t            *data;
+    ngx_uint_t            n, half;
+    ngx_http_mp4_conf_t  *conf;
+
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
+    if (!conf->start_key_frame) {
+        return 0;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+    if (data == NULL) {
+        return 0;
+    }
+
+    entry = (uint32_t *) data->pos;
+    n = trak->sync_samples_entries;
+
+    /* the last sync sample at or before the start sample */
+
+    while (n) {
+        half = n / 2;
+
+        /* sync samples starts from 1 */
+        sample = ngx_mp4_get_32value(&entry[half]) - 1;
+
+        if (sample > start_sample) {
+            n = half;
+
+        } else {
+            entry += half + 1;
+            n -= half + 1;
+        }
+    }
+
+    key_prefix = 0;
+
+    if (entry != (uint32_t *) data->pos) {
+        key_prefix = start_sample - (ngx_mp4_get_32value(entry - 1) - 1);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 key frame prefix:%uD", key_prefix);
+
+    return key_prefix;
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_http_mp4_stss_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stss_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char                    *atom_header, *atom_table, *atom_end;
+    uint32_t                   entries;
+    ngx_buf_t                 *atom, *data;
+    ngx_http_mp4_trak_t       *trak;
+    ngx_http_mp4_stss_atom_t  *stss_atom;
+
+    /* sync samples atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stss atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stss_atom = (ngx_http_mp4_stss_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stss_atom, 's', 't', 's', 's');
+
+    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(stss_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sync sample entries:%uD", entries);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_STSS_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 stss atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->sync_samples_entries = entries;
+
+    atom_table = atom_header + sizeof(ngx_http_mp4_stss_atom_t);
+
+    atom = &trak->stss_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t)
+        + (uint64_t) entries * sizeof(uint32_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_end = atom_table + entries * sizeof(uint32_t);
+
+    data = &trak->stss_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STSS_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STSS_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_update_stss_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                     atom_size;
+    uint32_t                   sample, start_sample, *entry, *end;
+    ngx_buf_t                 *atom, *data;
+    ngx_http_mp4_stss_atom_t  *stss_atom;
+
+    /*
+     * mdia.minf.stbl.stss updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stss atom update");
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+    if (data == NULL) {
+        return NGX_OK;
+    }
+
+    ngx_http_mp4_crop_stss_data(mp4, trak, 1);
+    ngx_http_mp4_crop_stss_data(mp4, trak, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sync sample entries:%uD", trak->sync_samples_entries);
+
+    if (trak->sync_samples_entries) {
+        entry = (uint32_t *) data->pos;
+        end = (uint32_t *) data->last;
+
+        start_sample = trak->start_sample;
+
+        while (entry < end) {
+            sample = ngx_mp4_get_32value(entry);
+            sample -= start_sample;
+            ngx_mp4_set_32value(entry, sample);
+            entry++;
+        }
+
+    } else {
+        trak->out[NGX_HTTP_MP4_STSS_DATA].buf = NULL;
+    }
+
+    atom_size = sizeof(ngx_http_mp4_stss_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_STSS_ATOM].buf;
+    stss_atom = (ngx_http_mp4_stss_atom_t *) atom->pos;
+
+    ngx_mp4_set_32value(stss_atom->size, atom_size);
+    ngx_mp4_set_32value(stss_atom->entries, trak->sync_samples_entries);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_mp4_crop_stss_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t     sample, start_sample, *entry;
+    ngx_buf_t   *data;
+    ngx_uint_t   entries, n, half;
+
+    /* sync samples starts from 1 */
+
+    if (start) {
+        start_sample = trak->start_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stss crop start_sample:%uD", start_sample);
+
+    } else if (mp4->length) {
+        start_sample = trak->end_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stss crop end_sample:%uD", start_sample);
+
+    } else {
+        return;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+
+    entries = trak->sync_samples_entries;
+    entry = (uint32_t *) data->pos;
+
+    /* sync samples are sorted, the first one at or after the sample */
+
+    n = entries;
+
+    while (n) {
+        half = n / 2;
+        sample = ngx_mp4_get_32value(&entry[half]);
+
+        if (sample >= start_sample) {
+            n = half;
+
+        } else {
+            entry += half + 1;
+            entries -= half + 1;
+            n -= half + 1;
+        }
+    }
+
+    if (entries) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sync:%uD", ngx_mp4_get_32value(entry));
+
+    } else {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sample is out of mp4 stss atom");
+    }
+
+    if (start) {
+        data->pos = (u_char *) entry;
+        trak->sync_samples_entries = entries;
+
+    } else {
+        data->last = (u_char *) entry;
+        trak->sync_samples_entries -= entries;
+    }
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_ctts_atom_t;
+
+typedef struct {
+    u_char    count[4];
+    u_char    offset[4];
+} ngx_mp4_ctts_entry_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_ctts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_ctts_atom_t  *ctts_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* composition offsets atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ctts atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    ctts_atom = (ngx_mp4_ctts_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(ctts_atom, 'c', 't', 't', 's');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(ctts_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "composition offset entries:%uD", entries);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 ctts atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->composition_offset_entries = entries;
+
+    atom_table = atom_header + sizeof(ngx_mp4_ctts_atom_t);
+
+    atom = &trak->ctts_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t)
+        + (uint64_t) entries * sizeof(ngx_mp4_ctts_entry_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_end = atom_table + entries * sizeof(ngx_mp4_ctts_entry_t);
+
+    data = &trak->ctts_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_mp4_update_ctts_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
+{
+    size_t                atom_size;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_ctts_atom_t  *ctts_atom;
+
+    /*
+     * mdia.minf.stbl.ctts updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 ctts atom update");
+
+    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+
+    if (data == NULL) {
+        return;
+    }
+
+    ngx_http_mp4_crop_ctts_data(mp4, trak, 1);
+    ngx_http_mp4_crop_ctts_data(mp4, trak, 0);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "composition offset entries:%uD",
+                   trak->composition_offset_entries);
+
+    if (trak->composition_offset_entries == 0) {
+        trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = NULL;
+        trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = NULL;
+        return;
+    }
+
+    atom_size = sizeof(ngx_mp4_ctts_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf;
+    ctts_atom = (ngx_mp4_ctts_atom_t *) atom->pos;
+
+    ngx_mp4_set_32value(ctts_atom->size, atom_size);
+    ngx_mp4_set_32value(ctts_atom->entries, trak->composition_offset_entries);
+
+    return;
+}
+
+
+static void
+ngx_http_mp4_crop_ctts_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t               count, start_sample, rest;
+    uint64_t               sample;
+    ngx_buf_t             *data;
+    ngx_uint_t             entries, first, n;
+    ngx_http_mp4_seek_t   *seek;
+    ngx_mp4_ctts_entry_t  *entry, *end;
+
+    /* sync samples starts from 1 */
+
+    if (start) {
+        start_sample = trak->start_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 ctts crop start_sample:%uD", start_sample);
+
+    } else if (mp4->length) {
+        start_sample = trak->end_sample - trak->start_sample + 1;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 ctts crop end_sample:%uD", start_sample);
+
+    } else {
+        return;
+    }
+
+    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+
+    entries = trak->composition_offset_entries;
+    entry = (ngx_mp4_ctts_entry_t *) data->pos;
+    end = (ngx_mp4_ctts_entry_t *) data->last;
+
+    sample = start ? trak->start_sample : trak->end_sample;
+
+    first = entry - (ngx_mp4_ctts_entry_t *) trak->ctts_atom_buf.last;
+    n = ngx_http_mp4_seek_entry(trak, NGX_HTTP_MP4_CTTS_SEEK, first, sample);
+
+    if (n) {
+        seek = &trak->seek[NGX_HTTP_MP4_CTTS_SEEK][n / NGX_HTTP_MP4_SEEK_STEP];
+
+        start_sample = (uint32_t) (sample - seek->sample) + 1;
+        entries -= n - first;
+        entry += n - first;
+    }
+
+    while (entry < end) {
+        count = ngx_mp4_get_32value(entry->count);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sample:%uD, count:%uD, offset:%uD",
+                       start_sample, count, ngx_mp4_get_32value(entry->offset));
+
+        if (start_sample <= count) {
+            rest = start_sample - 1;
+            goto found;
+        }
+
+        start_sample -= count;
+        entries--;
+        entry++;
+    }
+
+    if (start) {
+        data->pos = (u_char *) end;
+        trak->composition_offset_entries = 0;
+    }
+
+    return;
+
+found:
+
+    if (start) {
+        ngx_mp4_set_32value(entry->count, count - rest);
+        data->pos = (u_char *) entry;
+        trak->composition_offset_entries = entries;
+
+    } else {
+        ngx_mp4_set_32value(entry->count, rest);
+        data->last = (u_char *) (entry + 1);
+        trak->composition_offset_entries -= entries - 1;
+    }
+}
+
+
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_stsc_atom_t;
+
+
+static ngx_int_t
+ngx_http_mp4_read_stsc_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+{
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stsc_atom_t  *stsc_atom;
+    ngx_http_mp4_trak_t  *trak;
+
+    /* sample-to-chunk atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsc atom");
+
+    atom_header = ngx_mp4_atom_header(mp4);
+    stsc_atom = (ngx_mp4_stsc_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stsc_atom, 's', 't', 's', 'c');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    entries = ngx_mp4_get_32value(stsc_atom->entries);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample-to-chunk entries:%uD", entries);
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t)
+        + (uint64_t) entries * sizeof(ngx_mp4_stsc_entry_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    atom_table = atom_header + sizeof(ngx_mp4_stsc_atom_t);
+    atom_end = atom_table + entries * sizeof(ngx_mp4_stsc_entry_t);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_STSC_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 stsc atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->sample_to_chunk_entries = entries;
+
+    atom = &trak->stsc_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    data = &trak->stsc_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STSC_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STSC_DATA].buf = data;
+
+    ngx_mp4_atom_next(mp4, atom_data_size);
+
+    return NGX_OK;
+}
 
 
 static ngx_int_t
-ngx_http_mp4_read_mvhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_update_stsc_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
 {
-    u_char                 *atom_header;
-    size_t                  atom_size;
-    uint32_t                timescale;
-    uint64_t                duration, start_time, length_time;
-    ngx_buf_t              *atom;
-    ngx_mp4_mvhd_atom_t    *mvhd_atom;
-    ngx_mp4_mvhd64_atom_t  *mvhd64_atom;
+    size_t                 atom_size;
+    uint32_t               chunk;
+    ngx_buf_t             *atom, *data;
+    ngx_mp4_stsc_atom_t   *stsc_atom;
+    ngx_mp4_stsc_entry_t  *entry, *end;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mvhd atom");
+    /*
+     * mdia.minf.stbl.stsc updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
 
-    if (mp4->mvhd_atom.buf) {
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stsc atom update");
+
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+
+    if (data == NULL) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 mvhd atom in \"%s\"", mp4->file.name.data);
+                      "no mp4 stsc atoms were found in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    mvhd_atom = (ngx_mp4_mvhd_atom_t *) atom_header;
-    mvhd64_atom = (ngx_mp4_mvhd64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(atom_header, 'm', 'v', 'h', 'd');
-
-    if (ngx_mp4_atom_data_size(ngx_mp4_mvhd_atom_t) > atom_data_size) {
+    if (trak->sample_to_chunk_entries == 0) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 mvhd atom too small", mp4->file.name.data);
+                      "zero number of entries in stsc atom in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    if (mvhd_atom->version[0] == 0) {
-        /* version 0: 32-bit duration */
-        timescale = ngx_mp4_get_32value(mvhd_atom->timescale);
-        duration = ngx_mp4_get_32value(mvhd_atom->duration);
+    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 1) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-    } else {
-        /* version 1: 64-bit duration */
+    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
 
-        if (ngx_mp4_atom_data_size(ngx_mp4_mvhd64_atom_t) > atom_data_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 mvhd atom too small",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample-to-chunk entries:%uD",
+                   trak->sample_to_chunk_entries);
+
+    entry = (ngx_mp4_stsc_entry_t *) data->pos;
+    end = (ngx_mp4_stsc_entry_t *) data->last;
+
+    while (entry < end) {
+        chunk = ngx_mp4_get_32value(entry->chunk);
+        chunk -= trak->start_chunk;
+        ngx_mp4_set_32value(entry->chunk, chunk);
+        entry++;
+    }
+
+    atom_size = sizeof(ngx_mp4_stsc_atom_t)
+                + trak->sample_to_chunk_entries * sizeof(ngx_mp4_stsc_entry_t);
+
+    trak->size += atom_size;
+
+    atom = trak->out[NGX_HTTP_MP4_STSC_ATOM].buf;
+    stsc_atom = (ngx_mp4_stsc_atom_t *) atom->pos;
+
+    ngx_mp4_set_32value(stsc_atom->size, atom_size);
+    ngx_mp4_set_32value(stsc_atom->entries, trak->sample_to_chunk_entries);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_mp4_crop_stsc_data(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+{
+    uint32_t               start_sample, chunk, samples, id, next_chunk, n,
+                           prev_samples;
+    uint64_t               sample;
+    ngx_buf_t             *data, *buf;
+    ngx_uint_t             entries, target_chunk, chunk_samples, k, skip;
+    ngx_http_mp4_seek_t   *seek;
+    ngx_mp4_stsc_entry_t  *entry, *end, *first, *table;
+
+    entries = trak->sample_to_chunk_entries - 1;
+
+    if (start) {
+        start_sample = (uint32_t) trak->start_sample;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stsc crop start_sample:%uD", start_sample);
+
+    } else if (mp4->length) {
+        start_sample = (uint32_t) (trak->end_sample - trak->start_sample);
+        samples = 0;
+
+        data = trak->out[NGX_HTTP_MP4_STSC_START].buf;
+
+        if (data) {
+            entry = (ngx_mp4_stsc_entry_t *) data->pos;
+            samples = ngx_mp4_get_32value(entry->samples);
+            entries--;
+
+            if (samples > start_sample) {
+                samples = start_sample;
+                ngx_mp4_set_32value(entry->samples, samples);
+            }
+
+            start_sample -= samples;
         }
 
-        timescale = ngx_mp4_get_32value(mvhd64_atom->timescale);
-        duration = ngx_mp4_get_64value(mvhd64_atom->duration);
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 stsc crop end_sample:%uD, ext_samples:%uD",
+                       start_sample, samples);
+
+    } else {
+        return NGX_OK;
     }
 
-    mp4->timescale = timescale;
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mvhd timescale:%uD, duration:%uL, time:%.3fs",
-                   timescale, duration, (double) duration / timescale);
+    entry = (ngx_mp4_stsc_entry_t *) data->pos;
+    end = (ngx_mp4_stsc_entry_t *) data->last;
 
-    start_time = (uint64_t) mp4->start * timescale / 1000;
+    chunk = ngx_mp4_get_32value(entry->chunk);
+    samples = ngx_mp4_get_32value(entry->samples);
+    id = ngx_mp4_get_32value(entry->id);
+    prev_samples = 0;
 
-    if (duration < start_time) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 start time exceeds file duration",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    sample = start ? trak->start_sample : trak->end_sample;
+
+    table = (ngx_mp4_stsc_entry_t *) trak->stsc_atom_buf.last;
+    k = entry - table;
+    skip = ngx_http_mp4_seek_entry(trak, NGX_HTTP_MP4_STSC_SEEK, k, sample);
+
+    if (skip) {
+        seek = &trak->seek[NGX_HTTP_MP4_STSC_SEEK][skip / NGX_HTTP_MP4_SEEK_STEP];
+
+        start_sample = (uint32_t) (sample - seek->sample);
+        entries -= skip - k;
+
+        entry = &table[skip];
+
+        prev_samples = ngx_mp4_get_32value(entry[-1].samples);
+        chunk = ngx_mp4_get_32value(entry->chunk);
+        samples = ngx_mp4_get_32value(entry->samples);
+        id = ngx_mp4_get_32value(entry->id);
     }
 
-    duration -= start_time;
+    entry++;
 
-    if (mp4->length) {
-        length_time = (uint64_t) mp4->length * timescale / 1000;
+    while (entry < end) {
 
-        if (duration > length_time) {
-            duration = length_time;
+        next_chunk = ngx_mp4_get_32value(entry->chunk);
+
+        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "sample:%uD, chunk:%uD, chunks:%uD, "
+                       "samples:%uD, id:%uD",
+                       start_sample, chunk, next_chunk - chunk, samples, id);
+
+        n = (next_chunk - chunk) * samples;
+
+        if (start_sample < n) {
+            goto found;
         }
+
+        start_sample -= n;
+
+        prev_samples = samples;
+        chunk = next_chunk;
+        samples = ngx_mp4_get_32value(entry->samples);
+        id = ngx_mp4_get_32value(entry->id);
+        entries--;
+        entry++;
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mvhd new duration:%uL, time:%.3fs",
-                   duration, (double) duration / timescale);
+    next_chunk = trak->chunks + 1;
 
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(mvhd_atom->size, atom_size);
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample:%uD, chunk:%uD, chunks:%uD, samples:%uD",
+                   start_sample, chunk, next_chunk - chunk, samples);
+
+    n = (next_chunk - chunk) * samples;
+
+    if (start_sample > n) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "%s time is out mp4 stsc chunks in \"%s\"",
+                      start ? "start" : "end", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+found:
 
-    if (mvhd_atom->version[0] == 0) {
-        ngx_mp4_set_32value(mvhd_atom->duration, duration);
+    entries++;
+    entry--;
 
-    } else {
-        ngx_mp4_set_64value(mvhd64_atom->duration, duration);
+    if (samples == 0) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "zero number of samples in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
     }
 
-    atom = &mp4->mvhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+    target_chunk = chunk - 1;
+    target_chunk += start_sample / samples;
+    chunk_samples = start_sample % samples;
 
-    mp4->mvhd_atom.buf = atom;
+    if (start) {
+        data->pos = (u_char *) entry;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+        trak->sample_to_chunk_entries = entries;
+        trak->start_chunk = target_chunk;
+        trak->start_chunk_samples = chunk_samples;
 
-    return NGX_OK;
-}
+        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 1);
 
+        samples -= chunk_samples;
 
-static ngx_int_t
-ngx_http_mp4_read_trak_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_end;
-    off_t                 atom_file_end;
-    ngx_int_t             rc;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "start_chunk:%ui, start_chunk_samples:%ui",
+                       trak->start_chunk, trak->start_chunk_samples);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 trak atom");
+    } else {
+        if (start_sample) {
+            data->last = (u_char *) (entry + 1);
+            trak->sample_to_chunk_entries -= entries - 1;
+            trak->end_chunk_samples = samples;
 
-    trak = ngx_array_push(&mp4->trak);
-    if (trak == NULL) {
-        return NGX_ERROR;
-    }
+        } else {
+            data->last = (u_char *) entry;
+            trak->sample_to_chunk_entries -= entries;
+            trak->end_chunk_samples = prev_samples;
+        }
 
-    ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
+        if (chunk_samples) {
+            trak->end_chunk = target_chunk + 1;
+            trak->end_chunk_samples = chunk_samples;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 't', 'r', 'a', 'k');
+        } else {
+            trak->end_chunk = target_chunk;
+        }
 
-    atom = &trak->trak_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+        samples = chunk_samples;
+        next_chunk = chunk + 1;
 
-    trak->out[NGX_HTTP_MP4_TRAK_ATOM].buf = atom;
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "end_chunk:%ui, end_chunk_samples:%ui",
+                       trak->end_chunk, trak->end_chunk_samples);
+    }
 
-    atom_end = mp4->buffer_pos + (size_t) atom_data_size;
-    atom_file_end = mp4->offset + atom_data_size;
+    if (chunk_samples && next_chunk - target_chunk == 2) {
 
-    rc = ngx_http_mp4_read_atom(mp4, ngx_http_mp4_trak_atoms, atom_data_size);
+        ngx_mp4_set_32value(entry->samples, samples);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 trak atom: %i", rc);
+    } else if (chunk_samples && start) {
 
-    if (rc == NGX_DECLINED) {
-        /* skip this trak */
-        ngx_memzero(trak, sizeof(ngx_http_mp4_trak_t));
-        mp4->trak.nelts--;
-        mp4->buffer_pos = atom_end;
-        mp4->offset = atom_file_end;
-        return NGX_OK;
-    }
+        first = &trak->stsc_start_chunk_entry;
+        ngx_mp4_set_32value(first->chunk, 1);
+        ngx_mp4_set_32value(first->samples, samples);
+        ngx_mp4_set_32value(first->id, id);
 
-    return rc;
-}
+        buf = &trak->stsc_start_chunk_buf;
+        buf->temporary = 1;
+        buf->pos = (u_char *) first;
+        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
 
+        trak->out[NGX_HTTP_MP4_STSC_START].buf = buf;
 
-static void
-ngx_http_mp4_update_trak_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 2);
 
-    trak->size += sizeof(ngx_mp4_atom_header_t);
-    atom = &trak->trak_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
-}
+        trak->sample_to_chunk_entries++;
 
+    } else if (chunk_samples) {
 
-static ngx_int_t
-ngx_http_mp4_read_cmov_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                  "\"%s\" mp4 compressed moov atom (cmov) is not supported",
-                  mp4->file.name.data);
+        first = &trak->stsc_end_chunk_entry;
+        ngx_mp4_set_32value(first->chunk, trak->end_chunk - trak->start_chunk);
+        ngx_mp4_set_32value(first->samples, samples);
+        ngx_mp4_set_32value(first->id, id);
 
-    return NGX_ERROR;
-}
+        buf = &trak->stsc_end_chunk_buf;
+        buf->temporary = 1;
+        buf->pos = (u_char *) first;
+        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
 
+        trak->out[NGX_HTTP_MP4_STSC_END].buf = buf;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[4];
-    u_char    modification_time[4];
-    u_char    track_id[4];
-    u_char    reserved1[4];
-    u_char    duration[4];
-    u_char    reserved2[8];
-    u_char    layer[2];
-    u_char    group[2];
-    u_char    volume[2];
-    u_char    reserved3[2];
-    u_char    matrix[36];
-    u_char    width[4];
-    u_char    height[4];
-} ngx_mp4_tkhd_atom_t;
+        trak->sample_to_chunk_entries++;
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[8];
-    u_char    modification_time[8];
-    u_char    track_id[4];
-    u_char    reserved1[4];
-    u_char    duration[8];
-    u_char    reserved2[8];
-    u_char    layer[2];
-    u_char    group[2];
-    u_char    volume[2];
-    u_char    reserved3[2];
-    u_char    matrix[36];
-    u_char    width[4];
-    u_char    height[4];
-} ngx_mp4_tkhd64_atom_t;
+    return NGX_OK;
+}
 
 
 static ngx_int_t
-ngx_http_mp4_read_tkhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_seek_points(ngx_http_mp4_file_t *mp4)
 {
-    u_char                 *atom_header;
-    size_t                  atom_size;
-    uint64_t                duration, start_time, length_time;
-    ngx_buf_t              *atom;
-    ngx_http_mp4_trak_t    *trak;
-    ngx_mp4_tkhd_atom_t    *tkhd_atom;
-    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 tkhd atom");
-
-    atom_header = ngx_mp4_atom_header(mp4);
-    tkhd_atom = (ngx_mp4_tkhd_atom_t *) atom_header;
-    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(tkhd_atom, 't', 'k', 'h', 'd');
+    ngx_uint_t            i;
+    ngx_http_mp4_trak_t  *trak;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_tkhd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 tkhd atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+    if (mp4->seeks && ngx_http_mp4_read_seeks(mp4) == NGX_OK) {
+        return NGX_OK;
     }
 
-    if (tkhd_atom->version[0] == 0) {
-        /* version 0: 32-bit duration */
-        duration = ngx_mp4_get_32value(tkhd_atom->duration);
-
-    } else {
-        /* version 1: 64-bit duration */
+    trak = mp4->trak.elts;
 
-        if (ngx_mp4_atom_data_size(ngx_mp4_tkhd64_atom_t) > atom_data_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 tkhd atom too small",
-                          mp4->file.name.data);
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        if (ngx_http_mp4_build_seek(mp4, &trak[i]) != NGX_OK) {
             return NGX_ERROR;
         }
-
-        duration = ngx_mp4_get_64value(tkhd64_atom->duration);
     }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "tkhd duration:%uL, time:%.3fs",
-                   duration, (double) duration / mp4->timescale);
+    ngx_http_mp4_cache_seeks(mp4);
 
-    start_time = (uint64_t) mp4->start * mp4->timescale / 1000;
+    return NGX_OK;
+}
 
-    if (duration <= start_time) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "tkhd duration is less than start time");
-        return NGX_DECLINED;
-    }
 
-    duration -= start_time;
+static ngx_int_t
+ngx_http_mp4_build_seek(ngx_http_mp4_file_t *mp4, ngx_http_mp4_trak_t *trak)
+{
+    uint32_t               count, duration, chunk, next_chunk, samples;
+    uint64_t               time, sample;
+    ngx_uint_t             i, k, n, nseek[NGX_HTTP_MP4_LAST_SEEK + 1];
+    ngx_http_mp4_seek_t   *seek;
+    ngx_mp4_stts_entry_t  *stts;
+    ngx_mp4_ctts_entry_t  *ctts;
+    ngx_mp4_stsc_entry_t  *stsc;
 
-    if (mp4->length) {
-        length_time = (uint64_t) mp4->length * mp4->timescale / 1000;
+    /* the tables are not yet cropped */
 
-        if (duration > length_time) {
-            duration = length_time;
-        }
-    }
+    ngx_http_mp4_seek_count(trak, nseek);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "tkhd new duration:%uL, time:%.3fs",
-                   duration, (double) duration / mp4->timescale);
+    n = 0;
 
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    for (k = 0; k <= NGX_HTTP_MP4_LAST_SEEK; k++) {
+        n += nseek[k];
+    }
 
-    trak = ngx_mp4_last_trak(mp4);
+    if (n == 0) {
+        return NGX_OK;
+    }
 
-    if (trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 tkhd atom in \"%s\"", mp4->file.name.data);
+    seek = ngx_palloc(mp4->request->pool, n * sizeof(ngx_http_mp4_seek_t));
+    if (seek == NULL) {
         return NGX_ERROR;
     }
 
-    trak->tkhd_size = atom_size;
-    trak->movie_duration = duration;
-
-    ngx_mp4_set_32value(tkhd_atom->size, atom_size);
-
-    if (tkhd_atom->version[0] == 0) {
-        ngx_mp4_set_32value(tkhd_atom->duration, duration);
-
-    } else {
-        ngx_mp4_set_64value(tkhd64_atom->duration, duration);
+    for (k = 0; k <= NGX_HTTP_MP4_LAST_SEEK; k++) {
+        trak->seek[k] = seek;
+        trak->nseek[k] = nseek[k];
+        seek += nseek[k];
     }
 
-    atom = &trak->tkhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
-
-    trak->out[NGX_HTTP_MP4_TKHD_ATOM].buf = atom;
+    seek = trak->seek[NGX_HTTP_MP4_STTS_SEEK];
+    stts = (ngx_mp4_stts_entry_t *) trak->stts_atom_buf.last;
+    time = 0;
+    sample = 0;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    for (i = 0; i < trak->time_to_sample_entries; i++) {
 
-    return NGX_OK;
-}
+        if (i % NGX_HTTP_MP4_SEEK_STEP == 0) {
+            seek->time = time;
+            seek->sample = sample;
+            seek++;
+        }
 
+        count = ngx_mp4_get_32value(stts[i].count);
+        duration = ngx_mp4_get_32value(stts[i].duration);
 
-static ngx_int_t
-ngx_http_mp4_read_mdia_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+        time += (uint64_t) count * duration;
+        sample += count;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process mdia atom");
+    seek = trak->seek[NGX_HTTP_MP4_CTTS_SEEK];
+    ctts = (ngx_mp4_ctts_entry_t *) trak->ctts_atom_buf.last;
+    sample = 0;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 'm', 'd', 'i', 'a');
+    for (i = 0; i < trak->composition_offset_entries; i++) {
 
-    trak = ngx_mp4_last_trak(mp4);
+        if (i % NGX_HTTP_MP4_SEEK_STEP == 0) {
+            seek->time = 0;
+            seek->sample = sample;
+            seek++;
+        }
 
-    if (trak->out[NGX_HTTP_MP4_MDIA_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 mdia atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+        sample += ngx_mp4_get_32value(ctts[i].count);
     }
 
-    atom = &trak->mdia_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+    seek = trak->seek[NGX_HTTP_MP4_STSC_SEEK];
+    stsc = (ngx_mp4_stsc_entry_t *) trak->stsc_atom_buf.last;
+    sample = 0;
 
-    trak->out[NGX_HTTP_MP4_MDIA_ATOM].buf = atom;
+    for (i = 0; i < trak->sample_to_chunk_entries; i++) {
 
-    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_mdia_atoms, atom_data_size);
-}
+        if (i % NGX_HTTP_MP4_SEEK_STEP == 0) {
+            seek->time = 0;
+            seek->sample = sample;
+            seek++;
+        }
 
+        chunk = ngx_mp4_get_32value(stsc[i].chunk);
+        samples = ngx_mp4_get_32value(stsc[i].samples);
 
-static void
-ngx_http_mp4_update_mdia_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+        next_chunk = (i + 1 < trak->sample_to_chunk_entries)
+                     ? ngx_mp4_get_32value(stsc[i + 1].chunk)
+                     : trak->chunks + 1;
 
-    trak->size += sizeof(ngx_mp4_atom_header_t);
-    atom = &trak->mdia_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
+        /* as counted by ngx_http_mp4_crop_stsc_data() */
+        sample += (uint32_t) ((next_chunk - chunk) * samples);
+    }
+
+    return NGX_OK;
 }
 
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[4];
-    u_char    modification_time[4];
-    u_char    timescale[4];
-    u_char    duration[4];
-    u_char    language[2];
-    u_char    quality[2];
-} ngx_mp4_mdhd_atom_t;
+static void
+ngx_http_mp4_seek_count(ngx_http_mp4_trak_t *trak, ngx_uint_t *nseek)
+{
+    nseek[NGX_HTTP_MP4_STTS_SEEK] = (trak->time_to_sample_entries
+                                     + NGX_HTTP_MP4_SEEK_STEP - 1)
+                                    / NGX_HTTP_MP4_SEEK_STEP;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    creation_time[8];
-    u_char    modification_time[8];
-    u_char    timescale[4];
-    u_char    duration[8];
-    u_char    language[2];
-    u_char    quality[2];
-} ngx_mp4_mdhd64_atom_t;
+    nseek[NGX_HTTP_MP4_CTTS_SEEK] = (trak->composition_offset_entries
+                                     + NGX_HTTP_MP4_SEEK_STEP - 1)
+                                    / NGX_HTTP_MP4_SEEK_STEP;
+
+    nseek[NGX_HTTP_MP4_STSC_SEEK] = (trak->sample_to_chunk_entries
+                                     + NGX_HTTP_MP4_SEEK_STEP - 1)
+                                    / NGX_HTTP_MP4_SEEK_STEP;
+}
 
 
 static ngx_int_t
-ngx_http_mp4_read_mdhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_seeks(ngx_http_mp4_file_t *mp4)
 {
-    u_char                 *atom_header;
-    size_t                  atom_size;
-    uint32_t                timescale;
-    uint64_t                duration, start_time, length_time;
-    ngx_buf_t              *atom;
-    ngx_http_mp4_trak_t    *trak;
-    ngx_mp4_mdhd_atom_t    *mdhd_atom;
-    ngx_mp4_mdhd64_atom_t  *mdhd64_atom;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 mdhd atom");
+    u_char                *p;
+    ngx_uint_t             i, k, *nseek, count[NGX_HTTP_MP4_LAST_SEEK + 1];
+    ngx_http_mp4_trak_t   *trak;
+    ngx_http_mp4_seeks_t  *seeks;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    mdhd_atom = (ngx_mp4_mdhd_atom_t *) atom_header;
-    mdhd64_atom = (ngx_mp4_mdhd64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(mdhd_atom, 'm', 'd', 'h', 'd');
+    seeks = mp4->seeks;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_mdhd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 mdhd atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+    if (seeks->ntraks != mp4->trak.nelts) {
+        return NGX_DECLINED;
     }
 
-    if (mdhd_atom->version[0] == 0) {
-        /* version 0: everything is 32-bit */
-        timescale = ngx_mp4_get_32value(mdhd_atom->timescale);
-        duration = ngx_mp4_get_32value(mdhd_atom->duration);
+    nseek = (ngx_uint_t *) ((u_char *) seeks + sizeof(ngx_http_mp4_seeks_t));
+    p = (u_char *) (nseek + seeks->ntraks * (NGX_HTTP_MP4_LAST_SEEK + 1));
 
-    } else {
-        /* version 1: 64-bit duration and 32-bit timescale */
+    trak = mp4->trak.elts;
 
-        if (ngx_mp4_atom_data_size(ngx_mp4_mdhd64_atom_t) > atom_data_size) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 mdhd atom too small",
-                          mp4->file.name.data);
-            return NGX_ERROR;
-        }
+    for (i = 0; i < mp4->trak.nelts; i++) {
 
-        timescale = ngx_mp4_get_32value(mdhd64_atom->timescale);
-        duration = ngx_mp4_get_64value(mdhd64_atom->duration);
-    }
+        ngx_http_mp4_seek_count(&trak[i], count);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mdhd timescale:%uD, duration:%uL, time:%.3fs",
-                   timescale, duration, (double) duration / timescale);
+        for (k = 0; k <= NGX_HTTP_MP4_LAST_SEEK; k++) {
+            if (*nseek != count[k]) {
+                return NGX_DECLINED;
+            }
 
-    start_time = (uint64_t) mp4->start * timescale / 1000;
+            trak[i].seek[k] = (ngx_http_mp4_seek_t *) p;
+            trak[i].nseek[k] = *nseek;
 
-    if (duration <= start_time) {
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mdhd duration is less than start time");
-        return NGX_DECLINED;
+            p += *nseek++ * sizeof(ngx_http_mp4_seek_t);
+        }
     }
 
-    duration -= start_time;
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 seek points");
 
-    if (mp4->length) {
-        length_time = (uint64_t) mp4->length * timescale / 1000;
+    return NGX_OK;
+}
 
-        if (duration > length_time) {
-            duration = length_time;
-        }
-    }
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mdhd new duration:%uL, time:%.3fs",
-                   duration, (double) duration / timescale);
+static void
+ngx_http_mp4_cache_seeks(ngx_http_mp4_file_t *mp4)
+{
+    u_char                *p;
+    size_t                 size;
+    ngx_uint_t             i, k;
+    ngx_http_mp4_trak_t   *trak;
+    ngx_http_mp4_seeks_t  *seeks;
 
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+    trak = mp4->trak.elts;
 
-    trak = ngx_mp4_last_trak(mp4);
+    size = sizeof(ngx_http_mp4_seeks_t);
 
-    if (trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 mdhd atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        for (k = 0; k <= NGX_HTTP_MP4_LAST_SEEK; k++) {
+            size += sizeof(ngx_uint_t)
+                    + trak[i].nseek[k] * sizeof(ngx_http_mp4_seek_t);
+        }
     }
 
-    trak->mdhd_size = atom_size;
-    trak->timescale = timescale;
-    trak->duration = duration;
+    seeks = ngx_http_mp4_cache_alloc_data(mp4,
+                                  offsetof(ngx_http_mp4_moov_t, seeks), size);
+    if (seeks == NULL) {
+        return;
+    }
 
-    ngx_mp4_set_32value(mdhd_atom->size, atom_size);
+    /* the seek points are not yet referenced, so they are filled unlocked */
 
-    atom = &trak->mdhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+    seeks->size = size;
+    seeks->ntraks = mp4->trak.nelts;
 
-    trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf = atom;
+    p = (u_char *) seeks + sizeof(ngx_http_mp4_seeks_t);
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        p = ngx_cpymem(p, trak[i].nseek, sizeof(trak[i].nseek));
+    }
 
-    return NGX_OK;
+    for (i = 0; i < mp4->trak.nelts; i++) {
+        for (k = 0; k <= NGX_HTTP_MP4_LAST_SEEK; k++) {
+            p = ngx_cpymem(p, trak[i].seek[k],
+                           trak[i].nseek[k] * sizeof(ngx_http_mp4_seek_t));
+        }
+    }
+
+    if (ngx_http_mp4_cache_attach_data(mp4,
+                                       offsetof(ngx_http_mp4_moov_t, seeks),
+                                       seeks)
+        == NGX_OK)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 moov cache seek points store, size:%uz", size);
+    }
 }
 
 
-static void
-ngx_http_mp4_update_mdhd_atom(ngx_http_mp4_file_t *mp4,
-            ngx_http_mp4_trak_t *trak)
+static ngx_uint_t
+ngx_http_mp4_seek_entry(ngx_http_mp4_trak_t *trak, ngx_uint_t table,
+    ngx_uint_t first, uint64_t value)
 {
-    ngx_buf_t              *atom;
-    ngx_mp4_mdhd_atom_t    *mdhd_atom;
-    ngx_mp4_mdhd64_atom_t  *mdhd64_atom;
+    uint64_t              v;
+    ngx_uint_t            lo, hi, mid, n;
+    ngx_http_mp4_seek_t  *seek;
 
-    atom = trak->out[NGX_HTTP_MP4_MDHD_ATOM].buf;
-    if (atom == NULL) {
-        return;
-    }
+    /*
+     * the last entry with a seek point past the "first" entry, which may
+     * be already cropped, that starts at or before the value: a time for
+     * stts, and a sample otherwise; zero if there is no such entry
+     */
 
-    mdhd_atom = (ngx_mp4_mdhd_atom_t *) atom->pos;
-    mdhd64_atom = (ngx_mp4_mdhd64_atom_t *) atom->pos;
+    seek = trak->seek[table];
 
-    if (mdhd_atom->version[0] == 0) {
-        ngx_mp4_set_32value(mdhd_atom->duration, trak->duration);
+    n = 0;
+    lo = first / NGX_HTTP_MP4_SEEK_STEP + 1;
+    hi = trak->nseek[table];
 
-    } else {
-        ngx_mp4_set_64value(mdhd64_atom->duration, trak->duration);
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        v = (table == NGX_HTTP_MP4_STTS_SEEK) ? seek[mid].time
+                                              : seek[mid].sample;
+
+        if (v <= value) {
+            n = mid;
+            lo = mid + 1;
+
+        } else {
+            hi = mid;
+        }
     }
 
-    trak->size += trak->mdhd_size;
+    return n * NGX_HTTP_MP4_SEEK_STEP;
 }
 
 
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    uniform_size[4];
+    u_char    entries[4];
+} ngx_mp4_stsz_atom_t;
+
+
 static ngx_int_t
-ngx_http_mp4_read_hdlr_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_stsz_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
+    u_char               *atom_header, *atom_table, *atom_end;
+    size_t                atom_size;
+    uint32_t              entries, size;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stsz_atom_t  *stsz_atom;
     ngx_http_mp4_trak_t  *trak;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 hdlr atom");
+    /* sample sizes atom */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsz atom");
 
     atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'h', 'd', 'l', 'r');
+    stsz_atom = (ngx_mp4_stsz_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stsz_atom, 's', 't', 's', 'z');
+
+    if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t) > atom_data_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stsz atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    size = ngx_mp4_get_32value(stsz_atom->uniform_size);
+    entries = ngx_mp4_get_32value(stsz_atom->entries);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "sample uniform size:%uD, entries:%uD", size, entries);
+
+    trak = ngx_mp4_last_trak(mp4);
+
+    if (trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "duplicate mp4 stsz atom in \"%s\"", mp4->file.name.data);
+        return NGX_ERROR;
+    }
+
+    trak->sample_sizes_entries = entries;
+
+    atom_table = atom_header + sizeof(ngx_mp4_stsz_atom_t);
+
+    atom = &trak->stsz_atom_buf;
+    atom->temporary = 1;
+    atom->pos = atom_header;
+    atom->last = atom_table;
+
+    trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf = atom;
+
+    if (size == 0) {
+        if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t)
+            + (uint64_t) entries * sizeof(uint32_t) > atom_data_size)
+        {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "\"%s\" mp4 stsz atom too small",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
-    trak = ngx_mp4_last_trak(mp4);
+        atom_end = atom_table + entries * sizeof(uint32_t);
 
-    if (trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 hdlr atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+        data = &trak->stsz_data_buf;
+        data->temporary = 1;
+        data->pos = atom_table;
+        data->last = atom_end;
 
-    atom = &trak->hdlr_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+        trak->out[NGX_HTTP_MP4_STSZ_DATA].buf = data;
 
-    trak->hdlr_size = atom_size;
-    trak->out[NGX_HTTP_MP4_HDLR_ATOM].buf = atom;
+    } else {
+        /* if size != 0 then all samples are the same size */
+        /* TODO : chunk samples */
+        atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
+        ngx_mp4_set_32value(atom_header, atom_size);
+        trak->size += atom_size;
+    }
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -1936,161 +4622,182 @@ ngx_http_mp4_read_hdlr_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 
 
 static ngx_int_t
-ngx_http_mp4_read_minf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_update_stsz_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
 {
-    u_char               *atom_header;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+    size_t                atom_size;
+    uint32_t             *pos, *end, entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stsz_atom_t  *stsz_atom;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process minf atom");
+    /*
+     * mdia.minf.stbl.stsz updating requires trak->start_sample
+     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 'm', 'i', 'n', 'f');
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stsz atom update");
 
-    trak = ngx_mp4_last_trak(mp4);
+    data = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
 
-    if (trak->out[NGX_HTTP_MP4_MINF_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 minf atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    if (data) {
+        entries = trak->sample_sizes_entries;
 
-    atom = &trak->minf_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
+        if (trak->start_sample > entries) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "start time is out mp4 stsz samples in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
-    trak->out[NGX_HTTP_MP4_MINF_ATOM].buf = atom;
+        entries -= trak->start_sample;
+        data->pos += trak->start_sample * sizeof(uint32_t);
+        end = (uint32_t *) data->pos;
 
-    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_minf_atoms, atom_data_size);
-}
+        if (trak->start_chunk_samples > trak->start_sample) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "too many mp4 start chunk samples in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
+        for (pos = end - trak->start_chunk_samples; pos < end; pos++) {
+            trak->start_chunk_samples_size += ngx_mp4_get_32value(pos);
+        }
 
-static void
-ngx_http_mp4_update_minf_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "chunk samples sizes:%uL",
+                       trak->start_chunk_samples_size);
 
-    trak->size += sizeof(ngx_mp4_atom_header_t)
-               + trak->vmhd_size
-               + trak->smhd_size
-               + trak->dinf_size;
-    atom = &trak->minf_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
-}
+        if (trak->start_chunk_samples_size > (uint64_t) mp4->end) {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "too large mp4 start samples size in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
+        if (mp4->length) {
+            if (trak->end_sample - trak->start_sample > entries) {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "end time is out mp4 stsz samples in \"%s\"",
+                              mp4->file.name.data);
+                return NGX_ERROR;
+            }
 
-static ngx_int_t
-ngx_http_mp4_read_vmhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+            entries = trak->end_sample - trak->start_sample;
+            data->last = data->pos + entries * sizeof(uint32_t);
+            end = (uint32_t *) data->last;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 vmhd atom");
+            if (trak->end_chunk_samples > entries) {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "too many mp4 end chunk samples in \"%s\"",
+                              mp4->file.name.data);
+                return NGX_ERROR;
+            }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'v', 'm', 'h', 'd');
+            for (pos = end - trak->end_chunk_samples; pos < end; pos++) {
+                trak->end_chunk_samples_size += ngx_mp4_get_32value(pos);
+            }
 
-    trak = ngx_mp4_last_trak(mp4);
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "mp4 stsz end_chunk_samples_size:%uL",
+                           trak->end_chunk_samples_size);
 
-    if (trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf
-        || trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 vmhd/smhd atom in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
+            if (trak->end_chunk_samples_size > (uint64_t) mp4->end) {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "too large mp4 end samples size in \"%s\"",
+                              mp4->file.name.data);
+                return NGX_ERROR;
+            }
+        }
 
-    atom = &trak->vmhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+        atom_size = sizeof(ngx_mp4_stsz_atom_t) + (data->last - data->pos);
+        trak->size += atom_size;
 
-    trak->vmhd_size += atom_size;
-    trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf = atom;
+        atom = trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf;
+        stsz_atom = (ngx_mp4_stsz_atom_t *) atom->pos;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+        ngx_mp4_set_32value(stsz_atom->size, atom_size);
+        ngx_mp4_set_32value(stsz_atom->entries, entries);
+    }
 
     return NGX_OK;
 }
 
 
+typedef struct {
+    u_char    size[4];
+    u_char    name[4];
+    u_char    version[1];
+    u_char    flags[3];
+    u_char    entries[4];
+} ngx_mp4_stco_atom_t;
+
+
 static ngx_int_t
-ngx_http_mp4_read_smhd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_stco_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
+    u_char               *atom_header, *atom_table, *atom_end;
+    uint32_t              entries;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stco_atom_t  *stco_atom;
     ngx_http_mp4_trak_t  *trak;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 smhd atom");
+    /* chunk offsets atom */
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 's', 'm', 'h', 'd');
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stco atom");
 
-    trak = ngx_mp4_last_trak(mp4);
+    atom_header = ngx_mp4_atom_header(mp4);
+    stco_atom = (ngx_mp4_stco_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(stco_atom, 's', 't', 'c', 'o');
 
-    if (trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf
-        || trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf)
-    {
+    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t) > atom_data_size) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 vmhd/smhd atom in \"%s\"",
-                      mp4->file.name.data);
+                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    atom = &trak->smhd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
-
-    trak->smhd_size += atom_size;
-    trak->out[NGX_HTTP_MP4_SMHD_ATOM].buf = atom;
-
-    ngx_mp4_atom_next(mp4, atom_data_size);
-
-    return NGX_OK;
-}
-
+    entries = ngx_mp4_get_32value(stco_atom->entries);
 
-static ngx_int_t
-ngx_http_mp4_read_dinf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char              *atom_header;
-    size_t               atom_size;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 dinf atom");
+    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t)
+        + (uint64_t) entries * sizeof(uint32_t) > atom_data_size)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    ngx_mp4_set_32value(atom_header, atom_size);
-    ngx_mp4_set_atom_name(atom_header, 'd', 'i', 'n', 'f');
+    atom_table = atom_header + sizeof(ngx_mp4_stco_atom_t);
+    atom_end = atom_table + entries * sizeof(uint32_t);
 
     trak = ngx_mp4_last_trak(mp4);
 
-    if (trak->out[NGX_HTTP_MP4_DINF_ATOM].buf) {
+    if (trak->out[NGX_HTTP_MP4_STCO_ATOM].buf
+        || trak->out[NGX_HTTP_MP4_CO64_ATOM].buf)
+    {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 dinf atom in \"%s\"", mp4->file.name.data);
+                      "duplicate mp4 stco/co64 atom in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    atom = &trak->dinf_atom_buf;
+    trak->chunks = entries;
+
+    atom = &trak->stco_atom_buf;
     atom->temporary = 1;
     atom->pos = atom_header;
-    atom->last = atom_header + atom_size;
+    atom->last = atom_table;
 
-    trak->dinf_size += atom_size;
-    trak->out[NGX_HTTP_MP4_DINF_ATOM].buf = atom;
+    data = &trak->stco_data_buf;
+    data->temporary = 1;
+    data->pos = atom_table;
+    data->last = atom_end;
+
+    trak->out[NGX_HTTP_MP4_STCO_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_STCO_DATA].buf = data;
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -2099,163 +4806,141 @@ ngx_http_mp4_read_dinf_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 
 
 static ngx_int_t
-ngx_http_mp4_read_stbl_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_update_stco_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak)
 {
-    u_char               *atom_header;
-    ngx_buf_t            *atom;
-    ngx_http_mp4_trak_t  *trak;
+    size_t                atom_size;
+    uint32_t              entries;
+    uint64_t              chunk_offset, samples_size;
+    ngx_buf_t            *atom, *data;
+    ngx_mp4_stco_atom_t  *stco_atom;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "process stbl atom");
+    /*
+     * mdia.minf.stbl.stco updating requires trak->start_chunk
+     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
+     */
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ngx_mp4_set_atom_name(atom_header, 's', 't', 'b', 'l');
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stco atom update");
 
-    trak = ngx_mp4_last_trak(mp4);
+    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
 
-    if (trak->out[NGX_HTTP_MP4_STBL_ATOM].buf) {
+    if (data == NULL) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stbl atom in \"%s\"", mp4->file.name.data);
+                      "no mp4 stco atoms were found in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    atom = &trak->stbl_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_header + sizeof(ngx_mp4_atom_header_t);
-
-    trak->out[NGX_HTTP_MP4_STBL_ATOM].buf = atom;
-
-    return ngx_http_mp4_read_atom(mp4, ngx_http_mp4_stbl_atoms, atom_data_size);
-}
+    if (trak->start_chunk >= trak->chunks) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "start time is out mp4 stco chunks in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
+    data->pos += trak->start_chunk * sizeof(uint32_t);
 
-static void
-ngx_http_mp4_update_edts_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t            *atom;
-    ngx_mp4_elst_atom_t  *elst_atom;
-    ngx_mp4_edts_atom_t  *edts_atom;
+    chunk_offset = ngx_mp4_get_32value(data->pos);
+    samples_size = trak->start_chunk_samples_size;
 
-    if (trak->prefix == 0) {
-        return;
+    if (chunk_offset > (uint64_t) mp4->end - samples_size
+        || chunk_offset + samples_size > NGX_MAX_UINT32_VALUE)
+    {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "too large chunk offset in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 edts atom update prefix:%uL", trak->prefix);
-
-    edts_atom = &trak->edts_atom;
-    ngx_mp4_set_32value(edts_atom->size, sizeof(ngx_mp4_edts_atom_t)
-                                         + sizeof(ngx_mp4_elst_atom_t));
-    ngx_mp4_set_atom_name(edts_atom, 'e', 'd', 't', 's');
+    trak->start_offset = chunk_offset + samples_size;
+    ngx_mp4_set_32value(data->pos, trak->start_offset);
 
-    atom = &trak->edts_atom_buf;
-    atom->temporary = 1;
-    atom->pos = (u_char *) edts_atom;
-    atom->last = (u_char *) edts_atom + sizeof(ngx_mp4_edts_atom_t);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "start chunk offset:%O", trak->start_offset);
 
-    trak->out[NGX_HTTP_MP4_EDTS_ATOM].buf = atom;
+    if (mp4->length) {
 
-    elst_atom = &trak->elst_atom;
-    ngx_mp4_set_32value(elst_atom->size, sizeof(ngx_mp4_elst_atom_t));
-    ngx_mp4_set_atom_name(elst_atom, 'e', 'l', 's', 't');
+        if (trak->end_chunk - trak->start_chunk
+            > trak->chunks - trak->start_chunk)
+        {
+            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                          "end time is out mp4 stco chunks in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
-    elst_atom->version[0] = 1;
-    elst_atom->flags[0] = 0;
-    elst_atom->flags[1] = 0;
-    elst_atom->flags[2] = 0;
+        entries = trak->end_chunk - trak->start_chunk;
+        data->last = data->pos + entries * sizeof(uint32_t);
 
-    ngx_mp4_set_32value(elst_atom->entries, 1);
-    ngx_mp4_set_64value(elst_atom->duration, trak->movie_duration);
-    ngx_mp4_set_64value(elst_atom->media_time, trak->prefix);
-    ngx_mp4_set_16value(elst_atom->media_rate, 1);
-    ngx_mp4_set_16value(elst_atom->reserved, 0);
+        if (entries) {
+            chunk_offset = ngx_mp4_get_32value(data->last - sizeof(uint32_t));
+            samples_size = trak->end_chunk_samples_size;
 
-    atom = &trak->elst_atom_buf;
-    atom->temporary = 1;
-    atom->pos = (u_char *) elst_atom;
-    atom->last = (u_char *) elst_atom + sizeof(ngx_mp4_elst_atom_t);
+            if (chunk_offset > (uint64_t) mp4->end - samples_size
+                || chunk_offset + samples_size > NGX_MAX_UINT32_VALUE)
+            {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "too large chunk offset in \"%s\"",
+                              mp4->file.name.data);
+                return NGX_ERROR;
+            }
 
-    trak->out[NGX_HTTP_MP4_ELST_ATOM].buf = atom;
+            trak->end_offset = chunk_offset + samples_size;
 
-    trak->size += sizeof(ngx_mp4_edts_atom_t) + sizeof(ngx_mp4_elst_atom_t);
-}
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "end chunk offset:%O", trak->end_offset);
+        }
 
+    } else {
+        entries = trak->chunks - trak->start_chunk;
+        trak->end_offset = mp4->mdat_data.buf->file_last;
+    }
 
-static void
-ngx_http_mp4_update_stbl_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    ngx_buf_t  *atom;
+    if (entries == 0) {
+        trak->start_offset = mp4->end;
+        trak->end_offset = 0;
+    }
 
-    trak->size += sizeof(ngx_mp4_atom_header_t);
-    atom = &trak->stbl_atom_buf;
-    ngx_mp4_set_32value(atom->pos, trak->size);
-}
+    atom_size = sizeof(ngx_mp4_stco_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
 
+    atom = trak->out[NGX_HTTP_MP4_STCO_ATOM].buf;
+    stco_atom = (ngx_mp4_stco_atom_t *) atom->pos;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
+    ngx_mp4_set_32value(stco_atom->size, atom_size);
+    ngx_mp4_set_32value(stco_atom->entries, entries);
 
-    u_char    media_size[4];
-    u_char    media_name[4];
-} ngx_mp4_stsd_atom_t;
+    return NGX_OK;
+}
 
 
-static ngx_int_t
-ngx_http_mp4_read_stsd_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+static void
+ngx_http_mp4_adjust_stco_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, int32_t adjustment)
 {
-    u_char               *atom_header, *atom_table;
-    size_t                atom_size;
-    ngx_buf_t            *atom;
-    ngx_mp4_stsd_atom_t  *stsd_atom;
-    ngx_http_mp4_trak_t  *trak;
-
-    /* sample description atom */
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsd atom");
-
-    atom_header = ngx_mp4_atom_header(mp4);
-    stsd_atom = (ngx_mp4_stsd_atom_t *) atom_header;
-    atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-    atom_table = atom_header + atom_size;
-    ngx_mp4_set_32value(stsd_atom->size, atom_size);
-    ngx_mp4_set_atom_name(stsd_atom, 's', 't', 's', 'd');
+    uint32_t    offset, *entry, *end;
+    ngx_buf_t  *data;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsd_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsd atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    /*
+     * moov.trak.mdia.minf.stbl.stco adjustment requires
+     * minimal start offset of all traks and new moov atom size
+     */
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "stsd entries:%uD, media:%*s",
-                   ngx_mp4_get_32value(stsd_atom->entries),
-                   (size_t) 4, stsd_atom->media_name);
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 stco atom adjustment");
 
-    trak = ngx_mp4_last_trak(mp4);
+    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
+    entry = (uint32_t *) data->pos;
+    end = (uint32_t *) data->last;
 
-    if (trak->out[NGX_HTTP_MP4_STSD_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stsd atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+    while (entry < end) {
+        offset = ngx_mp4_get_32value(entry);
+        offset += adjustment;
+        ngx_mp4_set_32value(entry, offset);
+        entry++;
     }
-
-    atom = &trak->stsd_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
-
-    trak->out[NGX_HTTP_MP4_STSD_ATOM].buf = atom;
-    trak->size += atom_size;
-
-    ngx_mp4_atom_next(mp4, atom_data_size);
-
-    return NGX_OK;
 }
 
 
@@ -2265,75 +4950,72 @@ typedef struct {
     u_char    version[1];
     u_char    flags[3];
     u_char    entries[4];
-} ngx_mp4_stts_atom_t;
-
-typedef struct {
-    u_char    count[4];
-    u_char    duration[4];
-} ngx_mp4_stts_entry_t;
+} ngx_mp4_co64_atom_t;
 
 
 static ngx_int_t
-ngx_http_mp4_read_stts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_read_co64_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 {
     u_char               *atom_header, *atom_table, *atom_end;
     uint32_t              entries;
     ngx_buf_t            *atom, *data;
-    ngx_mp4_stts_atom_t  *stts_atom;
+    ngx_mp4_co64_atom_t  *co64_atom;
     ngx_http_mp4_trak_t  *trak;
 
-    /* time-to-sample atom */
+    /* chunk offsets atom */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stts atom");
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 co64 atom");
 
     atom_header = ngx_mp4_atom_header(mp4);
-    stts_atom = (ngx_mp4_stts_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stts_atom, 's', 't', 't', 's');
+    co64_atom = (ngx_mp4_co64_atom_t *) atom_header;
+    ngx_mp4_set_atom_name(co64_atom, 'c', 'o', '6', '4');
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t) > atom_data_size) {
+    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t) > atom_data_size) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    entries = ngx_mp4_get_32value(stts_atom->entries);
+    entries = ngx_mp4_get_32value(co64_atom->entries);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 time-to-sample entries:%uD", entries);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stts_atom_t)
-        + (uint64_t) entries * sizeof(ngx_mp4_stts_entry_t) > atom_data_size)
+    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t)
+        + (uint64_t) entries * sizeof(uint64_t) > atom_data_size)
     {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stts atom too small", mp4->file.name.data);
+                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    atom_table = atom_header + sizeof(ngx_mp4_stts_atom_t);
-    atom_end = atom_table + entries * sizeof(ngx_mp4_stts_entry_t);
+    atom_table = atom_header + sizeof(ngx_mp4_co64_atom_t);
+    atom_end = atom_table + entries * sizeof(uint64_t);
 
     trak = ngx_mp4_last_trak(mp4);
 
-    if (trak->out[NGX_HTTP_MP4_STTS_ATOM].buf) {
+    if (trak->out[NGX_HTTP_MP4_STCO_ATOM].buf
+        || trak->out[NGX_HTTP_MP4_CO64_ATOM].buf)
+    {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stts atom in \"%s\"", mp4->file.name.data);
+                      "duplicate mp4 stco/co64 atom in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    trak->time_to_sample_entries = entries;
+    trak->chunks = entries;
 
-    atom = &trak->stts_atom_buf;
+    atom = &trak->co64_atom_buf;
     atom->temporary = 1;
     atom->pos = atom_header;
     atom->last = atom_table;
 
-    data = &trak->stts_data_buf;
+    data = &trak->co64_data_buf;
     data->temporary = 1;
     data->pos = atom_table;
     data->last = atom_end;
 
-    trak->out[NGX_HTTP_MP4_STTS_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STTS_DATA].buf = data;
+    trak->out[NGX_HTTP_MP4_CO64_ATOM].buf = atom;
+    trak->out[NGX_HTTP_MP4_CO64_DATA].buf = data;
 
     ngx_mp4_atom_next(mp4, atom_data_size);
 
@@ -2342,1603 +5024,1837 @@ ngx_http_mp4_read_stts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
 
 
 static ngx_int_t
-ngx_http_mp4_update_stts_atom(ngx_http_mp4_file_t *mp4,
+ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
     ngx_http_mp4_trak_t *trak)
 {
     size_t                atom_size;
+    uint64_t              entries, chunk_offset, samples_size;
     ngx_buf_t            *atom, *data;
-    ngx_mp4_stts_atom_t  *stts_atom;
+    ngx_mp4_co64_atom_t  *co64_atom;
 
     /*
-     * mdia.minf.stbl.stts updating requires trak->timescale
-     * from mdia.mdhd atom which may reside after mdia.minf
+     * mdia.minf.stbl.co64 updating requires trak->start_chunk
+     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
+     * atom which may reside after mdia.minf
      */
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stts atom update");
+                   "mp4 co64 atom update");
 
-    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
 
     if (data == NULL) {
         ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 stts atoms were found in \"%s\"",
+                      "no mp4 co64 atoms were found in \"%s\"",
                       mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    if (ngx_http_mp4_crop_stts_data(mp4, trak, 1) != NGX_OK) {
+    if (trak->start_chunk >= trak->chunks) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "start time is out mp4 co64 chunks in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    if (ngx_http_mp4_crop_stts_data(mp4, trak, 0) != NGX_OK) {
+    data->pos += trak->start_chunk * sizeof(uint64_t);
+
+    chunk_offset = ngx_mp4_get_64value(data->pos);
+    samples_size = trak->start_chunk_samples_size;
+
+    if (chunk_offset > (uint64_t) mp4->end - samples_size) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "too large chunk offset in \"%s\"",
+                      mp4->file.name.data);
         return NGX_ERROR;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "time-to-sample entries:%uD", trak->time_to_sample_entries);
-
-    atom_size = sizeof(ngx_mp4_stts_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+    trak->start_offset = chunk_offset + samples_size;
+    ngx_mp4_set_64value(data->pos, trak->start_offset);
 
-    atom = trak->out[NGX_HTTP_MP4_STTS_ATOM].buf;
-    stts_atom = (ngx_mp4_stts_atom_t *) atom->pos;
-    ngx_mp4_set_32value(stts_atom->size, atom_size);
-    ngx_mp4_set_32value(stts_atom->entries, trak->time_to_sample_entries);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "start chunk offset:%O", trak->start_offset);
 
-    return NGX_OK;
-}
+    if (mp4->length) {
 
+        if (trak->end_chunk - trak->start_chunk
+            > trak->chunks - trak->start_chunk)
+        {
+            ngx_log_error(NGX_LOG_ALERT, mp4->file.log, 0,
+                          "end time is out mp4 co64 chunks in \"%s\"",
+                          mp4->file.name.data);
+            return NGX_ERROR;
+        }
 
-static ngx_int_t
-ngx_http_mp4_crop_stts_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
-{
-    uint32_t               count, duration, rest, key_prefix;
-    uint64_t               start_time;
-    ngx_buf_t             *data;
-    ngx_uint_t             start_sample, entries, start_sec;
-    ngx_mp4_stts_entry_t  *entry, *end;
+        entries = trak->end_chunk - trak->start_chunk;
+        data->last = data->pos + entries * sizeof(uint64_t);
 
-    if (start) {
-        start_sec = mp4->start;
+        if (entries) {
+            chunk_offset = ngx_mp4_get_64value(data->last - sizeof(uint64_t));
+            samples_size = trak->end_chunk_samples_size;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stts crop start_time:%ui", start_sec);
+            if (chunk_offset > (uint64_t) mp4->end - samples_size) {
+                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                              "too large chunk offset in \"%s\"",
+                              mp4->file.name.data);
+                return NGX_ERROR;
+            }
 
-    } else if (mp4->length) {
-        start_sec = mp4->length;
+            trak->end_offset = chunk_offset + samples_size;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stts crop end_time:%ui", start_sec);
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "end chunk offset:%O", trak->end_offset);
+        }
 
     } else {
-        return NGX_OK;
+        entries = trak->chunks - trak->start_chunk;
+        trak->end_offset = mp4->mdat_data.buf->file_last;
     }
 
-    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+    if (entries == 0) {
+        trak->start_offset = mp4->end;
+        trak->end_offset = 0;
+    }
 
-    start_time = (uint64_t) start_sec * trak->timescale / 1000 + trak->prefix;
+    atom_size = sizeof(ngx_mp4_co64_atom_t) + (data->last - data->pos);
+    trak->size += atom_size;
 
-    entries = trak->time_to_sample_entries;
-    start_sample = 0;
-    entry = (ngx_mp4_stts_entry_t *) data->pos;
-    end = (ngx_mp4_stts_entry_t *) data->last;
+    atom = trak->out[NGX_HTTP_MP4_CO64_ATOM].buf;
+    co64_atom = (ngx_mp4_co64_atom_t *) atom->pos;
 
-    while (entry < end) {
-        count = ngx_mp4_get_32value(entry->count);
-        duration = ngx_mp4_get_32value(entry->duration);
+    ngx_mp4_set_32value(co64_atom->size, atom_size);
+    ngx_mp4_set_32value(co64_atom->entries, entries);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "time:%uL, count:%uD, duration:%uD",
-                       start_time, count, duration);
+    return NGX_OK;
+}
 
-        if (start_time < (uint64_t) count * duration) {
-            start_sample += (ngx_uint_t) (start_time / duration);
-            rest = (uint32_t) (start_time / duration);
-            goto found;
-        }
 
-        start_sample += count;
-        start_time -= (uint64_t) count * duration;
-        entries--;
+static void
+ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
+    ngx_http_mp4_trak_t *trak, off_t adjustment)
+{
+    uint64_t    offset, *entry, *end;
+    ngx_buf_t  *data;
+
+    /*
+     * moov.trak.mdia.minf.stbl.co64 adjustment requires
+     * minimal start offset of all traks and new moov atom size
+     */
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 co64 atom adjustment");
+
+    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
+    entry = (uint64_t *) data->pos;
+    end = (uint64_t *) data->last;
+
+    while (entry < end) {
+        offset = ngx_mp4_get_64value(entry);
+        offset += adjustment;
+        ngx_mp4_set_64value(entry, offset);
         entry++;
     }
+}
 
-    if (start) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "start time is out mp4 stts samples in \"%s\"",
-                      mp4->file.name.data);
 
-        return NGX_ERROR;
+static ngx_int_t
+ngx_http_mp4_fragment(ngx_http_mp4_file_t *mp4)
+{
+    u_char                *p, *last;
+    ngx_int_t              rc;
+    ngx_uint_t             i;
+    ngx_http_request_t    *r;
+    ngx_http_mp4_trak_t   *trak, **media;
 
-    } else {
-        trak->end_sample = trak->start_sample + start_sample;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 fragment:%ui, segment:%ui, track:%ui",
+                   mp4->fragment, mp4->segment, mp4->track);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "end_sample:%ui", trak->end_sample);
+    r = mp4->request;
 
-        return NGX_OK;
+    rc = ngx_http_mp4_read_file(mp4);
+
+    if (rc != NGX_OK) {
+        return rc;
     }
 
-found:
+    if (mp4->mvhd_atom.buf == NULL) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 mvhd atom was found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
-    if (start) {
-        key_prefix = ngx_http_mp4_seek_key_frame(mp4, trak, start_sample);
+    if (ngx_array_init(&mp4->media, r->pool, 2, sizeof(ngx_http_mp4_trak_t *))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-        start_sample -= key_prefix;
+    /* only audio and video tracks with complete sample tables are used */
 
-        while (rest < key_prefix) {
-            trak->prefix += rest * duration;
-            key_prefix -= rest;
+    trak = mp4->trak.elts;
 
-            entry--;
-            entries++;
+    for (i = 0; i < mp4->trak.nelts; i++) {
 
-            count = ngx_mp4_get_32value(entry->count);
-            duration = ngx_mp4_get_32value(entry->duration);
-            rest = count;
+        if ((trak[i].out[NGX_HTTP_MP4_VMHD_ATOM].buf == NULL
+             && trak[i].out[NGX_HTTP_MP4_SMHD_ATOM].buf == NULL)
+            || trak[i].out[NGX_HTTP_MP4_TKHD_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_MDHD_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_HDLR_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_STSD_ATOM].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_STTS_DATA].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_STSC_DATA].buf == NULL
+            || trak[i].out[NGX_HTTP_MP4_STSZ_ATOM].buf == NULL
+            || (trak[i].out[NGX_HTTP_MP4_STCO_DATA].buf == NULL
+                && trak[i].out[NGX_HTTP_MP4_CO64_DATA].buf == NULL)
+            || trak[i].sample_sizes_entries == 0
+            || trak[i].timescale == 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                           "mp4 trak %ui skipped", i);
+            continue;
         }
 
-        trak->prefix += key_prefix * duration;
-        trak->duration += trak->prefix;
-        rest -= key_prefix;
-
-        ngx_mp4_set_32value(entry->count, count - rest);
-        data->pos = (u_char *) entry;
-        trak->time_to_sample_entries = entries;
-        trak->start_sample = start_sample;
+        media = ngx_array_push(&mp4->media);
+        if (media == NULL) {
+            return NGX_ERROR;
+        }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "start_sample:%ui, new count:%uD",
-                       trak->start_sample, count - rest);
+        *media = &trak[i];
 
-    } else {
-        ngx_mp4_set_32value(entry->count, rest);
-        data->last = (u_char *) (entry + 1);
-        trak->time_to_sample_entries -= entries - 1;
-        trak->end_sample = trak->start_sample + start_sample;
+        /* segments are cut at key frames of the first video track */
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "end_sample:%ui, new count:%uD",
-                       trak->end_sample, rest);
+        if (mp4->ref == NULL
+            || (mp4->ref->out[NGX_HTTP_MP4_VMHD_ATOM].buf == NULL
+                && trak[i].out[NGX_HTTP_MP4_VMHD_ATOM].buf))
+        {
+            mp4->ref = &trak[i];
+        }
     }
 
-    return NGX_OK;
-}
-
+    if (mp4->media.nelts == 0) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "no mp4 audio or video tracks were found in \"%s\"",
+                      mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
-static uint32_t
-ngx_http_mp4_seek_key_frame(ngx_http_mp4_file_t *mp4, ngx_http_mp4_trak_t *trak,
-    uint32_t start_sample)
-{
-    uint32_t              key_prefix, sample, *entry, *end;
-    ngx_buf_t            *data;
-    ngx_http_mp4_conf_t  *conf;
+    if (mp4->track > mp4->media.nelts) {
+        return NGX_DECLINED;
+    }
 
-    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
-    if (!conf->start_key_frame) {
-        return 0;
+    if (mp4->fragment == NGX_HTTP_MP4_INIT_SEGMENT) {
+        return ngx_http_mp4_init_segment(mp4);
     }
 
-    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
-    if (data == NULL) {
-        return 0;
+    if (ngx_http_mp4_split(mp4) != NGX_OK) {
+        return NGX_ERROR;
     }
 
-    entry = (uint32_t *) data->pos;
-    end = (uint32_t *) data->last;
+    if (mp4->fragment == NGX_HTTP_MP4_MEDIA_SEGMENT) {
+        return ngx_http_mp4_media_segment(mp4);
+    }
 
-    key_prefix = 0;
+    /* manifests refer to segments relative to the last URI component */
 
-    while (entry < end) {
-        sample = ngx_mp4_get_32value(entry);
+    last = r->uri.data + r->uri.len;
 
-        /* sync samples starts from 1 */
-        sample--;
+    for (p = last; p > r->uri.data && p[-1] != '/'; p--) { /* void */ }
 
-        if (sample > start_sample) {
-            break;
-        }
+    mp4->name.len = (last - p) + 2 * ngx_escape_uri(NULL, p, last - p,
+                                                    NGX_ESCAPE_URI_COMPONENT);
 
-        key_prefix = start_sample - sample;
-        entry++;
+    mp4->name.data = ngx_pnalloc(r->pool, mp4->name.len);
+    if (mp4->name.data == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 key frame prefix:%uD", key_prefix);
-
-    return key_prefix;
-}
+    ngx_escape_uri(mp4->name.data, p, last - p, NGX_ESCAPE_URI_COMPONENT);
 
+    if (mp4->fragment == NGX_HTTP_MP4_HLS_PLAYLIST) {
+        return ngx_http_mp4_hls_playlist(mp4);
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_http_mp4_stss_atom_t;
+    return ngx_http_mp4_dash_manifest(mp4);
+}
 
 
 static ngx_int_t
-ngx_http_mp4_read_stss_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+ngx_http_mp4_split(ngx_http_mp4_file_t *mp4)
 {
-    u_char                    *atom_header, *atom_table, *atom_end;
-    uint32_t                   entries;
-    ngx_buf_t                 *atom, *data;
-    ngx_http_mp4_trak_t       *trak;
-    ngx_http_mp4_stss_atom_t  *stss_atom;
+    uint64_t                *segment, start, length;
+    ngx_int_t                rc;
+    ngx_uint_t               i, last;
+    ngx_http_mp4_conf_t     *conf;
+    ngx_http_mp4_trak_t    **media;
+    ngx_http_mp4_cursor_t    cursor;
+
+    if (mp4->index && ngx_http_mp4_read_index(mp4) == NGX_OK) {
+        return NGX_OK;
+    }
 
-    /* sync samples atom */
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stss atom");
+    if (ngx_array_init(&mp4->segments, mp4->request->pool, 64,
+                       sizeof(uint64_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stss_atom = (ngx_http_mp4_stss_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stss_atom, 's', 't', 's', 's');
+    /*
+     * a new segment is started at the first key frame of the reference
+     * track after the segment length is reached; the segment start times
+     * are followed by the end time of the track
+     */
 
-    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
+    length = (uint64_t) conf->segment_length * mp4->ref->timescale / 1000;
+    start = 0;
+
+    segment = ngx_array_push(&mp4->segments);
+    if (segment == NULL) {
         return NGX_ERROR;
     }
 
-    entries = ngx_mp4_get_32value(stss_atom->entries);
+    *segment = start;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sync sample entries:%uD", entries);
+    ngx_http_mp4_cursor_init(&cursor, mp4->ref);
 
-    trak = ngx_mp4_last_trak(mp4);
+    for ( ;; ) {
+        rc = ngx_http_mp4_cursor_next(mp4, &cursor);
 
-    if (trak->out[NGX_HTTP_MP4_STSS_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stss atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+        if (rc == NGX_DONE) {
+            break;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (cursor.key
+            && cursor.dts > start
+            && cursor.dts - start >= length)
+        {
+            segment = ngx_array_push(&mp4->segments);
+            if (segment == NULL) {
+                return NGX_ERROR;
+            }
+
+            *segment = cursor.dts;
+            start = cursor.dts;
+        }
     }
 
-    trak->sync_samples_entries = entries;
+    if (cursor.dts + cursor.duration > start) {
+        segment = ngx_array_push(&mp4->segments);
+        if (segment == NULL) {
+            return NGX_ERROR;
+        }
 
-    atom_table = atom_header + sizeof(ngx_http_mp4_stss_atom_t);
+    } else {
+        /* the last key frame has zero duration */
+        segment = &((uint64_t *) mp4->segments.elts)[mp4->segments.nelts - 1];
+    }
 
-    atom = &trak->stss_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    *segment = cursor.dts + cursor.duration;
 
-    if (ngx_mp4_atom_data_size(ngx_http_mp4_stss_atom_t)
-        + (uint64_t) entries * sizeof(uint32_t) > atom_data_size)
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 segments:%ui, time:%.3fs",
+                   mp4->segments.nelts - 1,
+                   (double) *segment / mp4->ref->timescale);
+
+    /*
+     * a media segment needs only the positions of its own samples,
+     * unless all of them are cached
+     */
+
+    last = mp4->segments.nelts - 1;
+
+    if (mp4->fragment == NGX_HTTP_MP4_MEDIA_SEGMENT
+        && conf->moov_cache == NULL
+        && mp4->segment < last)
     {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stss atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+        last = mp4->segment;
     }
 
-    atom_end = atom_table + entries * sizeof(uint32_t);
-
-    data = &trak->stss_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    media = mp4->media.elts;
 
-    trak->out[NGX_HTTP_MP4_STSS_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STSS_DATA].buf = data;
+    for (i = 0; i < mp4->media.nelts; i++) {
+        if (ngx_http_mp4_split_trak(mp4, media[i], last) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    if (conf->moov_cache) {
+        ngx_http_mp4_cache_index(mp4);
+    }
 
     return NGX_OK;
 }
 
 
+static uint64_t
+ngx_http_mp4_segment_time(ngx_http_mp4_file_t *mp4, ngx_http_mp4_trak_t *trak,
+    ngx_uint_t n)
+{
+    uint64_t  time;
+
+    time = ((uint64_t *) mp4->segments.elts)[n];
+
+    /* rounded up, so that each sample belongs to exactly one segment */
+
+    return (time * trak->timescale + mp4->ref->timescale - 1)
+           / mp4->ref->timescale;
+}
+
+
 static ngx_int_t
-ngx_http_mp4_update_stss_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+ngx_http_mp4_split_trak(ngx_http_mp4_file_t *mp4, ngx_http_mp4_trak_t *trak,
+    ngx_uint_t last)
 {
-    size_t                     atom_size;
-    uint32_t                   sample, start_sample, *entry, *end;
-    ngx_buf_t                 *atom, *data;
-    ngx_http_mp4_stss_atom_t  *stss_atom;
+    uint64_t               cut;
+    ngx_int_t              rc;
+    ngx_uint_t             k, n;
+    ngx_http_mp4_cursor_t  cursor;
 
     /*
-     * mdia.minf.stbl.stss updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
+     * a segment of the track starts with its first sample at or after
+     * the segment start time of the reference track; segments past the
+     * last sample of the track are not counted, and segments after
+     * the "last" one are not looked for
      */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stss atom update");
-
-    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+    n = mp4->segments.nelts - 1;
 
-    if (data == NULL) {
-        return NGX_OK;
+    trak->marks = ngx_palloc(mp4->request->pool,
+                             (n + 1) * sizeof(ngx_http_mp4_mark_t));
+    if (trak->marks == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_http_mp4_crop_stss_data(mp4, trak, 1);
-    ngx_http_mp4_crop_stss_data(mp4, trak, 0);
+    k = 0;
+    cut = n ? 0 : (uint64_t) -1;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sync sample entries:%uD", trak->sync_samples_entries);
+    ngx_http_mp4_cursor_init(&cursor, trak);
 
-    if (trak->sync_samples_entries) {
-        entry = (uint32_t *) data->pos;
-        end = (uint32_t *) data->last;
+    for ( ;; ) {
+        rc = ngx_http_mp4_cursor_next(mp4, &cursor);
 
-        start_sample = trak->start_sample;
+        if (rc == NGX_DONE) {
+            break;
+        }
 
-        while (entry < end) {
-            sample = ngx_mp4_get_32value(entry);
-            sample -= start_sample;
-            ngx_mp4_set_32value(entry, sample);
-            entry++;
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
         }
 
-    } else {
-        trak->out[NGX_HTTP_MP4_STSS_DATA].buf = NULL;
-    }
+        while (cursor.dts >= cut) {
+            ngx_http_mp4_cursor_mark(&cursor, &trak->marks[k]);
 
-    atom_size = sizeof(ngx_http_mp4_stss_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+            if (k++ == last) {
+                trak->nmarks = last;
+                return NGX_OK;
+            }
 
-    atom = trak->out[NGX_HTTP_MP4_STSS_ATOM].buf;
-    stss_atom = (ngx_http_mp4_stss_atom_t *) atom->pos;
+            cut = (k < n) ? ngx_http_mp4_segment_time(mp4, trak, k)
+                          : (uint64_t) -1;
+        }
+    }
 
-    ngx_mp4_set_32value(stss_atom->size, atom_size);
-    ngx_mp4_set_32value(stss_atom->entries, trak->sync_samples_entries);
+    trak->nmarks = k;
+
+    trak->marks[k].dts = cursor.dts + cursor.duration;
+    trak->marks[k].n = cursor.n + 1;
 
     return NGX_OK;
 }
 
 
-static void
-ngx_http_mp4_crop_stss_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+static ngx_int_t
+ngx_http_mp4_read_index(ngx_http_mp4_file_t *mp4)
 {
-    uint32_t     sample, start_sample, *entry, *end;
-    ngx_buf_t   *data;
-    ngx_uint_t   entries;
+    u_char                *p;
+    ngx_uint_t             i, *nmarks;
+    ngx_http_mp4_trak_t  **media;
+    ngx_http_mp4_index_t  *index;
 
-    /* sync samples starts from 1 */
+    index = mp4->index;
 
-    if (start) {
-        start_sample = trak->start_sample + 1;
+    if (index->ntraks != mp4->media.nelts) {
+        return NGX_DECLINED;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stss crop start_sample:%uD", start_sample);
+    p = (u_char *) index + sizeof(ngx_http_mp4_index_t);
 
-    } else if (mp4->length) {
-        start_sample = trak->end_sample + 1;
+    mp4->segments.elts = p;
+    mp4->segments.nelts = index->nsegments + 1;
+    mp4->segments.size = sizeof(uint64_t);
+    mp4->segments.nalloc = index->nsegments + 1;
+    mp4->segments.pool = mp4->request->pool;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stss crop end_sample:%uD", start_sample);
+    p += (index->nsegments + 1) * sizeof(uint64_t);
 
-    } else {
-        return;
-    }
+    nmarks = (ngx_uint_t *) ((u_char *) index + index->size
+                             - index->ntraks * sizeof(ngx_uint_t));
 
-    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+    media = mp4->media.elts;
 
-    entries = trak->sync_samples_entries;
-    entry = (uint32_t *) data->pos;
-    end = (uint32_t *) data->last;
+    for (i = 0; i < mp4->media.nelts; i++) {
+        media[i]->marks = (ngx_http_mp4_mark_t *) p;
+        media[i]->nmarks = nmarks[i];
 
-    while (entry < end) {
-        sample = ngx_mp4_get_32value(entry);
+        p += (nmarks[i] + 1) * sizeof(ngx_http_mp4_mark_t);
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "sync:%uD", sample);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                   "mp4 index, segments:%ui", index->nsegments);
 
-        if (sample >= start_sample) {
-            goto found;
-        }
+    return NGX_OK;
+}
 
-        entries--;
-        entry++;
-    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample is out of mp4 stss atom");
+static void
+ngx_http_mp4_cache_index(ngx_http_mp4_file_t *mp4)
+{
+    u_char                *p;
+    size_t                 size;
+    ngx_uint_t             i;
+    ngx_http_mp4_conf_t   *conf;
+    ngx_http_mp4_trak_t  **media;
+    ngx_http_mp4_index_t  *index;
 
-found:
+    conf = ngx_http_get_module_loc_conf(mp4->request, ngx_http_mp4_module);
 
-    if (start) {
-        data->pos = (u_char *) entry;
-        trak->sync_samples_entries = entries;
+    media = mp4->media.elts;
 
-    } else {
-        data->last = (u_char *) entry;
-        trak->sync_samples_entries -= entries;
-    }
-}
+    size = sizeof(ngx_http_mp4_index_t)
+           + mp4->segments.nelts * sizeof(uint64_t);
 
+    for (i = 0; i < mp4->media.nelts; i++) {
+        size += (media[i]->nmarks + 1) * sizeof(ngx_http_mp4_mark_t)
+                + sizeof(ngx_uint_t);
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_ctts_atom_t;
+    index = ngx_http_mp4_cache_alloc_data(mp4,
+                                  offsetof(ngx_http_mp4_moov_t, index), size);
+    if (index == NULL) {
+        return;
+    }
 
-typedef struct {
-    u_char    count[4];
-    u_char    offset[4];
-} ngx_mp4_ctts_entry_t;
+    /* the index is not yet referenced, so it is filled without the lock */
 
+    index->size = size;
+    index->segment_length = conf->segment_length;
+    index->nsegments = mp4->segments.nelts - 1;
+    index->ntraks = mp4->media.nelts;
 
-static ngx_int_t
-ngx_http_mp4_read_ctts_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_ctts_atom_t  *ctts_atom;
-    ngx_http_mp4_trak_t  *trak;
+    p = (u_char *) index + sizeof(ngx_http_mp4_index_t);
 
-    /* composition offsets atom */
+    p = ngx_cpymem(p, mp4->segments.elts,
+                   mp4->segments.nelts * sizeof(uint64_t));
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 ctts atom");
+    for (i = 0; i < mp4->media.nelts; i++) {
+        p = ngx_cpymem(p, media[i]->marks,
+                       (media[i]->nmarks + 1) * sizeof(ngx_http_mp4_mark_t));
+    }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    ctts_atom = (ngx_mp4_ctts_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(ctts_atom, 'c', 't', 't', 's');
+    for (i = 0; i < mp4->media.nelts; i++) {
+        p = ngx_cpymem(p, &media[i]->nmarks, sizeof(ngx_uint_t));
+    }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+    if (ngx_http_mp4_cache_attach_data(mp4,
+                                       offsetof(ngx_http_mp4_moov_t, index),
+                                       index)
+        == NGX_OK)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 moov cache index store, size:%uz", size);
     }
+}
 
-    entries = ngx_mp4_get_32value(ctts_atom->entries);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "composition offset entries:%uD", entries);
+static uint32_t
+ngx_http_mp4_track_id(ngx_http_mp4_trak_t *trak)
+{
+    ngx_mp4_tkhd_atom_t    *tkhd_atom;
+    ngx_mp4_tkhd64_atom_t  *tkhd64_atom;
 
-    trak = ngx_mp4_last_trak(mp4);
+    tkhd_atom = (ngx_mp4_tkhd_atom_t *) trak->tkhd_atom_buf.pos;
+    tkhd64_atom = (ngx_mp4_tkhd64_atom_t *) trak->tkhd_atom_buf.pos;
 
-    if (trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 ctts atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
+    if (tkhd_atom->version[0] == 0) {
+        return ngx_mp4_get_32value(tkhd_atom->track_id);
     }
 
-    trak->composition_offset_entries = entries;
+    return ngx_mp4_get_32value(tkhd64_atom->track_id);
+}
+
+
+static ngx_int_t
+ngx_http_mp4_hls_playlist(ngx_http_mp4_file_t *mp4)
+{
+    u_char       *p;
+    size_t        len;
+    uint64_t     *segments, duration, target;
+    uint32_t      timescale;
+    ngx_buf_t    *b;
+    ngx_uint_t    i, n;
+    ngx_chain_t  *cl;
+
+    segments = mp4->segments.elts;
+    n = mp4->segments.nelts - 1;
+    timescale = mp4->ref->timescale;
 
-    atom_table = atom_header + sizeof(ngx_mp4_ctts_atom_t);
+    target = 0;
 
-    atom = &trak->ctts_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    for (i = 0; i < n; i++) {
+        duration = segments[i + 1] - segments[i];
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_ctts_atom_t)
-        + (uint64_t) entries * sizeof(ngx_mp4_ctts_entry_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 ctts atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+        if (target < duration) {
+            target = duration;
+        }
     }
 
-    atom_end = atom_table + entries * sizeof(ngx_mp4_ctts_entry_t);
+    /* segment durations rounded to integer must not exceed target duration */
 
-    data = &trak->ctts_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    target = (target + timescale - 1) / timescale;
 
-    trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = data;
+    len = sizeof("#EXTM3U\n"
+                 "#EXT-X-VERSION:7\n"
+                 "#EXT-X-TARGETDURATION:\n"
+                 "#EXT-X-MEDIA-SEQUENCE:1\n"
+                 "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                 "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                 "#EXT-X-MAP:URI=\"?segment=init&track=\"\n"
+                 "#EXT-X-ENDLIST\n") - 1
+          + NGX_INT64_LEN + mp4->name.len + NGX_INT_T_LEN
+          + n * (sizeof("#EXTINF:.000,\n?segment=&track=\n") - 1
+                 + NGX_INT64_LEN + mp4->name.len + 2 * NGX_INT_T_LEN);
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    b = ngx_create_temp_buf(mp4->request->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-    return NGX_OK;
-}
+    p = ngx_sprintf(b->last, "#EXTM3U\n"
+                             "#EXT-X-VERSION:7\n"
+                             "#EXT-X-TARGETDURATION:%uL\n"
+                             "#EXT-X-MEDIA-SEQUENCE:1\n"
+                             "#EXT-X-PLAYLIST-TYPE:VOD\n"
+                             "#EXT-X-INDEPENDENT-SEGMENTS\n"
+                             "#EXT-X-MAP:URI=\"%V?segment=init",
+                    target, &mp4->name);
 
+    if (mp4->track) {
+        p = ngx_sprintf(p, "&track=%ui", mp4->track);
+    }
 
-static void
-ngx_http_mp4_update_ctts_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
-{
-    size_t                atom_size;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_ctts_atom_t  *ctts_atom;
+    *p++ = '"'; *p++ = '\n';
 
-    /*
-     * mdia.minf.stbl.ctts updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+    for (i = 0; i < n; i++) {
+        duration = (segments[i + 1] - segments[i]) * 1000 / timescale;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 ctts atom update");
+        p = ngx_sprintf(p, "#EXTINF:%uL.%03uL,\n%V?segment=%ui",
+                        duration / 1000, duration % 1000, &mp4->name, i + 1);
 
-    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+        if (mp4->track) {
+            p = ngx_sprintf(p, "&track=%ui", mp4->track);
+        }
 
-    if (data == NULL) {
-        return;
+        *p++ = '\n';
     }
 
-    ngx_http_mp4_crop_ctts_data(mp4, trak, 1);
-    ngx_http_mp4_crop_ctts_data(mp4, trak, 0);
+    b->last = ngx_cpymem(p, "#EXT-X-ENDLIST\n",
+                         sizeof("#EXT-X-ENDLIST\n") - 1);
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "composition offset entries:%uD",
-                   trak->composition_offset_entries);
+    b->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    b->last_in_chain = 1;
 
-    if (trak->composition_offset_entries == 0) {
-        trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf = NULL;
-        trak->out[NGX_HTTP_MP4_CTTS_DATA].buf = NULL;
-        return;
+    cl = ngx_alloc_chain_link(mp4->request->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    atom_size = sizeof(ngx_mp4_ctts_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+    cl->buf = b;
+    cl->next = NULL;
 
-    atom = trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf;
-    ctts_atom = (ngx_mp4_ctts_atom_t *) atom->pos;
+    mp4->out = cl;
+    mp4->content_length = b->last - b->pos;
 
-    ngx_mp4_set_32value(ctts_atom->size, atom_size);
-    ngx_mp4_set_32value(ctts_atom->entries, trak->composition_offset_entries);
+    ngx_str_set(&mp4->content_type, "application/vnd.apple.mpegurl");
 
-    return;
+    return NGX_OK;
 }
 
 
-static void
-ngx_http_mp4_crop_ctts_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
+static ngx_int_t
+ngx_http_mp4_dash_manifest(ngx_http_mp4_file_t *mp4)
 {
-    uint32_t               count, start_sample, rest;
-    ngx_buf_t             *data;
-    ngx_uint_t             entries;
-    ngx_mp4_ctts_entry_t  *entry, *end;
+    u_char                *p, *last, *pos, *end;
+    u_char                 codecs[16];
+    size_t                 len;
+    uint64_t              *segments, duration, target, bytes, bandwidth,
+                           time, next;
+    ngx_buf_t             *b;
+    ngx_uint_t             i, j, k, n, video;
+    ngx_chain_t           *cl;
+    ngx_http_mp4_trak_t   *trak, **media;
+
+    segments = mp4->segments.elts;
+    n = mp4->segments.nelts - 1;
+    media = mp4->media.elts;
+
+    target = 0;
+
+    for (i = 0; i < n; i++) {
+        duration = segments[i + 1] - segments[i];
+
+        if (target < duration) {
+            target = duration;
+        }
+    }
 
-    /* sync samples starts from 1 */
+    target = (target + mp4->ref->timescale - 1) / mp4->ref->timescale;
+    duration = segments[n] * 1000 / mp4->ref->timescale;
+
+    len = sizeof("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                 "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" "
+                 "profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                 "type=\"static\" "
+                 "mediaPresentationDuration=\"PT.000S\" "
+                 "minBufferTime=\"PTS\">\n"
+                 "<Period start=\"PT0S\">\n"
+                 "</Period>\n"
+                 "</MPD>\n") - 1
+          + 2 * NGX_INT64_LEN;
+
+    for (i = 0; i < mp4->media.nelts; i++) {
+        len += sizeof("<AdaptationSet contentType=\"video\" "
+                      "segmentAlignment=\"true\">\n"
+                      "<Representation id=\"\" mimeType=\"video/mp4\" "
+                      "codecs=\"\" bandwidth=\"\" "
+                      "width=\"\" height=\"\" audioSamplingRate=\"\">\n"
+                      "<SegmentTemplate timescale=\"\" "
+                      "initialization=\"?segment=init&amp;track=\" "
+                      "media=\"?segment=$Number$&amp;track=\" "
+                      "startNumber=\"1\">\n"
+                      "<SegmentTimeline>\n"
+                      "</SegmentTimeline>\n"
+                      "</SegmentTemplate>\n"
+                      "</Representation>\n"
+                      "</AdaptationSet>\n") - 1
+               + sizeof(codecs) + 3 * NGX_INT_T_LEN + 5 * NGX_INT64_LEN
+               + 2 * mp4->name.len
+               + n * (sizeof("<S t=\"\" d=\"\" r=\"\"/>\n") - 1
+                      + 2 * NGX_INT64_LEN + NGX_INT_T_LEN);
+    }
+
+    b = ngx_create_temp_buf(mp4->request->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-    if (start) {
-        start_sample = trak->start_sample + 1;
+    p = ngx_sprintf(b->last,
+                    "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" "
+                    "profiles=\"urn:mpeg:dash:profile:isoff-live:2011\" "
+                    "type=\"static\" "
+                    "mediaPresentationDuration=\"PT%uL.%03uLS\" "
+                    "minBufferTime=\"PT%uLS\">\n"
+                    "<Period start=\"PT0S\">\n",
+                    duration / 1000, duration % 1000, target);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 ctts crop start_sample:%uD", start_sample);
+    for (i = 0; i < mp4->media.nelts; i++) {
+        trak = media[i];
+        video = (trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf != NULL);
 
-    } else if (mp4->length) {
-        start_sample = trak->end_sample - trak->start_sample + 1;
+        if (trak->out[NGX_HTTP_MP4_STSZ_DATA].buf) {
+            bytes = 0;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 ctts crop end_sample:%uD", start_sample);
+            pos = trak->stsz_data_buf.pos;
+            end = trak->stsz_data_buf.last;
 
-    } else {
-        return;
-    }
+            while (pos < end) {
+                bytes += ngx_mp4_get_32value(pos);
+                pos += sizeof(uint32_t);
+            }
 
-    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+        } else {
+            bytes = (uint64_t) ngx_mp4_get_32value(trak->stsz_atom_buf.pos
+                                                   + 12)
+                    * trak->sample_sizes_entries;
+        }
 
-    entries = trak->composition_offset_entries;
-    entry = (ngx_mp4_ctts_entry_t *) data->pos;
-    end = (ngx_mp4_ctts_entry_t *) data->last;
+        bandwidth = bytes * 8 * 1000 / (duration ? duration : 1);
 
-    while (entry < end) {
-        count = ngx_mp4_get_32value(entry->count);
+        p = ngx_sprintf(p, "<AdaptationSet contentType=\"%s\" "
+                           "segmentAlignment=\"true\">\n"
+                           "<Representation id=\"%ui\" mimeType=\"%s\"",
+                        video ? "video" : "audio", i + 1,
+                        video ? "video/mp4" : "audio/mp4");
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "sample:%uD, count:%uD, offset:%uD",
-                       start_sample, count, ngx_mp4_get_32value(entry->offset));
+        last = ngx_http_mp4_codecs(trak, codecs);
 
-        if (start_sample <= count) {
-            rest = start_sample - 1;
-            goto found;
+        if (last != codecs) {
+            p = ngx_sprintf(p, " codecs=\"%*s\"", last - codecs, codecs);
         }
 
-        start_sample -= count;
-        entries--;
-        entry++;
-    }
-
-    if (start) {
-        data->pos = (u_char *) end;
-        trak->composition_offset_entries = 0;
-    }
-
-    return;
-
-found:
+        p = ngx_sprintf(p, " bandwidth=\"%uL\"", bandwidth);
 
-    if (start) {
-        ngx_mp4_set_32value(entry->count, count - rest);
-        data->pos = (u_char *) entry;
-        trak->composition_offset_entries = entries;
+        if (video) {
 
-    } else {
-        ngx_mp4_set_32value(entry->count, rest);
-        data->last = (u_char *) (entry + 1);
-        trak->composition_offset_entries -= entries - 1;
-    }
-}
+            /* dimensions from the first visual sample entry */
 
+            pos = trak->stsd_atom_buf.pos + sizeof(ngx_mp4_stsd_atom_t) - 8;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_stsc_atom_t;
+            if (trak->stsd_atom_buf.last - pos >= 8 + 28
+                && ngx_mp4_get_16value(pos + 32)
+                && ngx_mp4_get_16value(pos + 34))
+            {
+                p = ngx_sprintf(p, " width=\"%ui\" height=\"%ui\"",
+                                (ngx_uint_t) ngx_mp4_get_16value(pos + 32),
+                                (ngx_uint_t) ngx_mp4_get_16value(pos + 34));
+            }
 
+        } else {
+            p = ngx_sprintf(p, " audioSamplingRate=\"%uD\"", trak->timescale);
+        }
 
-static ngx_int_t
-ngx_http_mp4_read_stsc_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stsc_atom_t  *stsc_atom;
-    ngx_http_mp4_trak_t  *trak;
+        p = ngx_sprintf(p, ">\n"
+                           "<SegmentTemplate timescale=\"%uD\" "
+                           "initialization=\"%V?segment=init&amp;track=%ui\" "
+                           "media=\"%V?segment=$Number$&amp;track=%ui\" "
+                           "startNumber=\"1\">\n"
+                           "<SegmentTimeline>\n",
+                        trak->timescale, &mp4->name, i + 1,
+                        &mp4->name, i + 1);
 
-    /* sample-to-chunk atom */
+        /* segment times are those of their first samples */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsc atom");
+        for (k = 0; k < trak->nmarks; k = j) {
+            time = trak->marks[k].dts;
+            next = trak->marks[k + 1].dts;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stsc_atom = (ngx_mp4_stsc_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stsc_atom, 's', 't', 's', 'c');
+            for (j = k + 1; j < trak->nmarks; j++) {
+                if (trak->marks[j + 1].dts - trak->marks[j].dts != next - time)
+                {
+                    break;
+                }
+            }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+            p = ngx_sprintf(p, "<S t=\"%uL\" d=\"%uL\"", time, next - time);
 
-    entries = ngx_mp4_get_32value(stsc_atom->entries);
+            if (j - k > 1) {
+                p = ngx_sprintf(p, " r=\"%ui\"", j - k - 1);
+            }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample-to-chunk entries:%uD", entries);
+            *p++ = '/'; *p++ = '>'; *p++ = '\n';
+        }
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsc_atom_t)
-        + (uint64_t) entries * sizeof(ngx_mp4_stsc_entry_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsc atom too small", mp4->file.name.data);
-        return NGX_ERROR;
+        p = ngx_cpymem(p, "</SegmentTimeline>\n"
+                          "</SegmentTemplate>\n"
+                          "</Representation>\n"
+                          "</AdaptationSet>\n",
+                       sizeof("</SegmentTimeline>\n"
+                              "</SegmentTemplate>\n"
+                              "</Representation>\n"
+                              "</AdaptationSet>\n") - 1);
     }
 
-    atom_table = atom_header + sizeof(ngx_mp4_stsc_atom_t);
-    atom_end = atom_table + entries * sizeof(ngx_mp4_stsc_entry_t);
+    b->last = ngx_cpymem(p, "</Period>\n</MPD>\n",
+                         sizeof("</Period>\n</MPD>\n") - 1);
 
-    trak = ngx_mp4_last_trak(mp4);
+    b->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    b->last_in_chain = 1;
 
-    if (trak->out[NGX_HTTP_MP4_STSC_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stsc atom in \"%s\"", mp4->file.name.data);
+    cl = ngx_alloc_chain_link(mp4->request->pool);
+    if (cl == NULL) {
         return NGX_ERROR;
     }
 
-    trak->sample_to_chunk_entries = entries;
-
-    atom = &trak->stsc_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
-
-    data = &trak->stsc_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    cl->buf = b;
+    cl->next = NULL;
 
-    trak->out[NGX_HTTP_MP4_STSC_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STSC_DATA].buf = data;
+    mp4->out = cl;
+    mp4->content_length = b->last - b->pos;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    ngx_str_set(&mp4->content_type, "application/dash+xml");
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_update_stsc_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+static u_char *
+ngx_http_mp4_codecs(ngx_http_mp4_trak_t *trak, u_char *p)
 {
-    size_t                 atom_size;
-    uint32_t               chunk;
-    ngx_buf_t             *atom, *data;
-    ngx_mp4_stsc_atom_t   *stsc_atom;
-    ngx_mp4_stsc_entry_t  *entry, *end;
-
-    /*
-     * mdia.minf.stbl.stsc updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+    u_char      *entry, *last, *atom, *pos, c;
+    size_t       size;
+    ngx_int_t    len;
+    ngx_uint_t   i, version, flags, oti, aot;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stsc atom update");
+    /* RFC 6381 codecs parameter from the first sample description */
 
-    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+    entry = trak->stsd_atom_buf.pos + sizeof(ngx_mp4_stsd_atom_t) - 8;
+    last = trak->stsd_atom_buf.last;
 
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 stsc atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    if (last - entry < 8) {
+        return p;
     }
 
-    if (trak->sample_to_chunk_entries == 0) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "zero number of entries in stsc atom in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    size = ngx_mp4_get_32value(entry);
 
-    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 1) != NGX_OK) {
-        return NGX_ERROR;
+    if (size < 8 || size > (size_t) (last - entry)) {
+        return p;
     }
 
-    if (ngx_http_mp4_crop_stsc_data(mp4, trak, 0) != NGX_OK) {
-        return NGX_ERROR;
+    last = entry + size;
+
+    for (i = 4; i < 8; i++) {
+        c = (u_char) (entry[i] | 0x20);
+
+        if ((c < 'a' || c > 'z') && (entry[i] < '0' || entry[i] > '9')) {
+            return p;
+        }
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample-to-chunk entries:%uD",
-                   trak->sample_to_chunk_entries);
+    if (ngx_strncmp(entry + 4, "avc1", 4) == 0
+        || ngx_strncmp(entry + 4, "avc3", 4) == 0)
+    {
+        /* visual sample entry fields take 78 bytes */
 
-    entry = (ngx_mp4_stsc_entry_t *) data->pos;
-    end = (ngx_mp4_stsc_entry_t *) data->last;
+        atom = ngx_http_mp4_find_atom(entry + 8 + 78, last, "avcC");
 
-    while (entry < end) {
-        chunk = ngx_mp4_get_32value(entry->chunk);
-        chunk -= trak->start_chunk;
-        ngx_mp4_set_32value(entry->chunk, chunk);
-        entry++;
-    }
+        if (atom && ngx_mp4_get_32value(atom) >= 12) {
+            return ngx_sprintf(p, "%*s.%02xD%02xD%02xD",
+                               (size_t) 4, entry + 4,
+                               (uint32_t) atom[9], (uint32_t) atom[10],
+                               (uint32_t) atom[11]);
+        }
 
-    atom_size = sizeof(ngx_mp4_stsc_atom_t)
-                + trak->sample_to_chunk_entries * sizeof(ngx_mp4_stsc_entry_t);
+    } else if (ngx_strncmp(entry + 4, "mp4a", 4) == 0 && size >= 8 + 28) {
 
-    trak->size += atom_size;
+        /* audio sample entry fields take 28, 44 or 64 bytes */
 
-    atom = trak->out[NGX_HTTP_MP4_STSC_ATOM].buf;
-    stsc_atom = (ngx_mp4_stsc_atom_t *) atom->pos;
+        version = ngx_mp4_get_16value(entry + 16);
+        atom = entry + 8 + 28 + (version == 1 ? 16 : (version == 2 ? 36 : 0));
 
-    ngx_mp4_set_32value(stsc_atom->size, atom_size);
-    ngx_mp4_set_32value(stsc_atom->entries, trak->sample_to_chunk_entries);
+        atom = ngx_http_mp4_find_atom(atom, last, "esds");
 
-    return NGX_OK;
-}
+        if (atom == NULL) {
+            goto done;
+        }
 
+        pos = atom + 12;
+        last = atom + ngx_mp4_get_32value(atom);
 
-static ngx_int_t
-ngx_http_mp4_crop_stsc_data(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, ngx_uint_t start)
-{
-    uint32_t               start_sample, chunk, samples, id, next_chunk, n,
-                           prev_samples;
-    ngx_buf_t             *data, *buf;
-    ngx_uint_t             entries, target_chunk, chunk_samples;
-    ngx_mp4_stsc_entry_t  *entry, *end, *first;
+        /* ES_Descriptor */
+
+        if (ngx_http_mp4_descriptor(&pos, last, 0x03) < 3) {
+            goto done;
+        }
+
+        flags = pos[2];
+        pos += 3;
+
+        if (flags & 0x80) {
+            pos += 2;
+        }
 
-    entries = trak->sample_to_chunk_entries - 1;
+        if ((flags & 0x40) && pos < last) {
+            pos += 1 + *pos;
+        }
 
-    if (start) {
-        start_sample = (uint32_t) trak->start_sample;
+        if (flags & 0x20) {
+            pos += 2;
+        }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stsc crop start_sample:%uD", start_sample);
+        /* DecoderConfigDescriptor */
 
-    } else if (mp4->length) {
-        start_sample = (uint32_t) (trak->end_sample - trak->start_sample);
-        samples = 0;
+        if (ngx_http_mp4_descriptor(&pos, last, 0x04) < 13) {
+            goto done;
+        }
 
-        data = trak->out[NGX_HTTP_MP4_STSC_START].buf;
+        oti = pos[0];
+        pos += 13;
 
-        if (data) {
-            entry = (ngx_mp4_stsc_entry_t *) data->pos;
-            samples = ngx_mp4_get_32value(entry->samples);
-            entries--;
+        /* DecoderSpecificInfo, the AudioSpecificConfig */
 
-            if (samples > start_sample) {
-                samples = start_sample;
-                ngx_mp4_set_32value(entry->samples, samples);
-            }
+        len = ngx_http_mp4_descriptor(&pos, last, 0x05);
 
-            start_sample -= samples;
+        if (len < 1) {
+            return ngx_sprintf(p, "mp4a.%02xD", (uint32_t) oti);
         }
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "mp4 stsc crop end_sample:%uD, ext_samples:%uD",
-                       start_sample, samples);
-
-    } else {
-        return NGX_OK;
-    }
+        aot = pos[0] >> 3;
 
-    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+        if (aot == 31 && len >= 2) {
+            aot = 32 + (((pos[0] & 0x07) << 3) | (pos[1] >> 5));
+        }
 
-    entry = (ngx_mp4_stsc_entry_t *) data->pos;
-    end = (ngx_mp4_stsc_entry_t *) data->last;
+        return ngx_sprintf(p, "mp4a.%02xD.%ui", (uint32_t) oti, aot);
+    }
 
-    chunk = ngx_mp4_get_32value(entry->chunk);
-    samples = ngx_mp4_get_32value(entry->samples);
-    id = ngx_mp4_get_32value(entry->id);
-    prev_samples = 0;
-    entry++;
+done:
 
-    while (entry < end) {
+    return ngx_cpymem(p, entry + 4, 4);
+}
 
-        next_chunk = ngx_mp4_get_32value(entry->chunk);
 
-        ngx_log_debug5(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "sample:%uD, chunk:%uD, chunks:%uD, "
-                       "samples:%uD, id:%uD",
-                       start_sample, chunk, next_chunk - chunk, samples, id);
+static u_char *
+ngx_http_mp4_find_atom(u_char *p, u_char *last, char *name)
+{
+    size_t  size;
 
-        n = (next_chunk - chunk) * samples;
+    while (last - p >= 8) {
+        size = ngx_mp4_get_32value(p);
 
-        if (start_sample < n) {
-            goto found;
+        if (size < 8 || size > (size_t) (last - p)) {
+            return NULL;
         }
 
-        start_sample -= n;
+        if (ngx_strncmp(p + 4, name, 4) == 0) {
+            return p;
+        }
 
-        prev_samples = samples;
-        chunk = next_chunk;
-        samples = ngx_mp4_get_32value(entry->samples);
-        id = ngx_mp4_get_32value(entry->id);
-        entries--;
-        entry++;
+        p += size;
     }
 
-    next_chunk = trak->chunks + 1;
+    return NULL;
+}
 
-    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample:%uD, chunk:%uD, chunks:%uD, samples:%uD",
-                   start_sample, chunk, next_chunk - chunk, samples);
 
-    n = (next_chunk - chunk) * samples;
+static ngx_int_t
+ngx_http_mp4_descriptor(u_char **pos, u_char *last, ngx_uint_t tag)
+{
+    u_char      *p;
+    size_t       len;
+    ngx_uint_t   i;
 
-    if (start_sample > n) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "%s time is out mp4 stsc chunks in \"%s\"",
-                      start ? "start" : "end", mp4->file.name.data);
+    p = *pos;
+
+    if (p >= last || *p++ != tag) {
         return NGX_ERROR;
     }
 
-found:
+    len = 0;
 
-    entries++;
-    entry--;
+    for (i = 0; i < 4; i++) {
+        if (p == last) {
+            return NGX_ERROR;
+        }
 
-    if (samples == 0) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "zero number of samples in \"%s\"",
-                      mp4->file.name.data);
+        len = (len << 7) | (*p & 0x7f);
+
+        if ((*p++ & 0x80) == 0) {
+            break;
+        }
+    }
+
+    if (len > (size_t) (last - p)) {
         return NGX_ERROR;
     }
 
-    target_chunk = chunk - 1;
-    target_chunk += start_sample / samples;
-    chunk_samples = start_sample % samples;
+    *pos = p;
 
-    if (start) {
-        data->pos = (u_char *) entry;
+    return len;
+}
 
-        trak->sample_to_chunk_entries = entries;
-        trak->start_chunk = target_chunk;
-        trak->start_chunk_samples = chunk_samples;
 
-        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 1);
+static u_char  ngx_http_mp4_ftyp[] = {
+    0x00, 0x00, 0x00, 0x1c, 'f',  't',  'y',  'p',
+    'i',  's',  'o',  '6',  0x00, 0x00, 0x00, 0x00,
+    'i',  's',  'o',  '6',  'c',  'm',  'f',  'c',
+    'm',  'p',  '4',  '1'
+};
 
-        samples -= chunk_samples;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "start_chunk:%ui, start_chunk_samples:%ui",
-                       trak->start_chunk, trak->start_chunk_samples);
+static u_char  ngx_http_mp4_dinf[] = {
+    0x00, 0x00, 0x00, 0x24, 'd',  'i',  'n',  'f',
+    0x00, 0x00, 0x00, 0x1c, 'd',  'r',  'e',  'f',
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x0c, 'u',  'r',  'l',  ' ',
+    0x00, 0x00, 0x00, 0x01
+};
 
-    } else {
-        if (start_sample) {
-            data->last = (u_char *) (entry + 1);
-            trak->sample_to_chunk_entries -= entries - 1;
-            trak->end_chunk_samples = samples;
 
-        } else {
-            data->last = (u_char *) entry;
-            trak->sample_to_chunk_entries -= entries;
-            trak->end_chunk_samples = prev_samples;
-        }
+/* empty stts, stsc, stsz, and stco atoms */
 
-        if (chunk_samples) {
-            trak->end_chunk = target_chunk + 1;
-            trak->end_chunk_samples = chunk_samples;
+static u_char  ngx_http_mp4_empty_stbl[] = {
+    0x00, 0x00, 0x00, 0x10, 's',  't',  't',  's',
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x10, 's',  't',  's',  'c',
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x14, 's',  't',  's',  'z',
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x00,
+    0x00, 0x00, 0x00, 0x10, 's',  't',  'c',  'o',
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
 
-        } else {
-            trak->end_chunk = target_chunk;
-        }
 
-        samples = chunk_samples;
-        next_chunk = chunk + 1;
+static ngx_int_t
+ngx_http_mp4_init_segment(ngx_http_mp4_file_t *mp4)
+{
+    u_char                *p, *moov, *atom, *mdia, *minf, *stbl;
+    size_t                 len;
+    ngx_buf_t             *b;
+    ngx_uint_t             i;
+    ngx_chain_t           *cl;
+    ngx_http_mp4_trak_t   *trak, **media;
 
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "end_chunk:%ui, end_chunk_samples:%ui",
-                       trak->end_chunk, trak->end_chunk_samples);
-    }
+    /*
+     * the initialization segment is the moov atom with original
+     * sample descriptions and empty sample tables
+     */
 
-    if (chunk_samples && next_chunk - target_chunk == 2) {
+    media = mp4->media.elts;
 
-        ngx_mp4_set_32value(entry->samples, samples);
+    len = sizeof(ngx_http_mp4_ftyp) + 8
+          + (mp4->mvhd_atom_buf.last - mp4->mvhd_atom_buf.pos) + 8;
 
-    } else if (chunk_samples && start) {
+    for (i = 0; i < mp4->media.nelts; i++) {
 
-        first = &trak->stsc_start_chunk_entry;
-        ngx_mp4_set_32value(first->chunk, 1);
-        ngx_mp4_set_32value(first->samples, samples);
-        ngx_mp4_set_32value(first->id, id);
+        if (mp4->track && mp4->track != i + 1) {
+            continue;
+        }
 
-        buf = &trak->stsc_start_chunk_buf;
-        buf->temporary = 1;
-        buf->pos = (u_char *) first;
-        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
+        trak = media[i];
 
-        trak->out[NGX_HTTP_MP4_STSC_START].buf = buf;
+        len += 8 + trak->tkhd_size
+               + 8 + trak->mdhd_size + trak->hdlr_size
+               + 8 + trak->vmhd_size + trak->smhd_size
+               + (trak->dinf_size ? trak->dinf_size : sizeof(ngx_http_mp4_dinf))
+               + 8 + (trak->stsd_atom_buf.last - trak->stsd_atom_buf.pos)
+               + sizeof(ngx_http_mp4_empty_stbl)
+               + 32;
+    }
 
-        ngx_mp4_set_32value(entry->chunk, trak->start_chunk + 2);
+    b = ngx_create_temp_buf(mp4->request->pool, len);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-        trak->sample_to_chunk_entries++;
+    p = ngx_cpymem(b->last, ngx_http_mp4_ftyp, sizeof(ngx_http_mp4_ftyp));
 
-    } else if (chunk_samples) {
+    moov = p;
+    p += 8;
 
-        first = &trak->stsc_end_chunk_entry;
-        ngx_mp4_set_32value(first->chunk, trak->end_chunk - trak->start_chunk);
-        ngx_mp4_set_32value(first->samples, samples);
-        ngx_mp4_set_32value(first->id, id);
+    p = ngx_mp4_copy_atom(p, &mp4->mvhd_atom_buf);
 
-        buf = &trak->stsc_end_chunk_buf;
-        buf->temporary = 1;
-        buf->pos = (u_char *) first;
-        buf->last = (u_char *) first + sizeof(ngx_mp4_stsc_entry_t);
+    for (i = 0; i < mp4->media.nelts; i++) {
 
-        trak->out[NGX_HTTP_MP4_STSC_END].buf = buf;
+        if (mp4->track && mp4->track != i + 1) {
+            continue;
+        }
 
-        trak->sample_to_chunk_entries++;
-    }
+        trak = media[i];
 
-    return NGX_OK;
-}
+        atom = p;
+        p += 8;
 
+        p = ngx_mp4_copy_atom(p, &trak->tkhd_atom_buf);
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    uniform_size[4];
-    u_char    entries[4];
-} ngx_mp4_stsz_atom_t;
+        mdia = p;
+        p += 8;
 
+        p = ngx_mp4_copy_atom(p, &trak->mdhd_atom_buf);
+        p = ngx_mp4_copy_atom(p, &trak->hdlr_atom_buf);
 
-static ngx_int_t
-ngx_http_mp4_read_stsz_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    size_t                atom_size;
-    uint32_t              entries, size;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stsz_atom_t  *stsz_atom;
-    ngx_http_mp4_trak_t  *trak;
+        minf = p;
+        p += 8;
 
-    /* sample sizes atom */
+        if (trak->out[NGX_HTTP_MP4_VMHD_ATOM].buf) {
+            p = ngx_mp4_copy_atom(p, &trak->vmhd_atom_buf);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stsz atom");
+        } else {
+            p = ngx_mp4_copy_atom(p, &trak->smhd_atom_buf);
+        }
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stsz_atom = (ngx_mp4_stsz_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stsz_atom, 's', 't', 's', 'z');
+        if (trak->out[NGX_HTTP_MP4_DINF_ATOM].buf) {
+            p = ngx_mp4_copy_atom(p, &trak->dinf_atom_buf);
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stsz atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+        } else {
+            p = ngx_cpymem(p, ngx_http_mp4_dinf, sizeof(ngx_http_mp4_dinf));
+        }
 
-    size = ngx_mp4_get_32value(stsz_atom->uniform_size);
-    entries = ngx_mp4_get_32value(stsz_atom->entries);
+        stbl = p;
+        p += 8;
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "sample uniform size:%uD, entries:%uD", size, entries);
+        p = ngx_mp4_copy_atom(p, &trak->stsd_atom_buf);
+        p = ngx_cpymem(p, ngx_http_mp4_empty_stbl,
+                       sizeof(ngx_http_mp4_empty_stbl));
 
-    trak = ngx_mp4_last_trak(mp4);
+        ngx_mp4_set_32value(stbl, p - stbl);
+        ngx_mp4_set_atom_name(stbl, 's', 't', 'b', 'l');
 
-    if (trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stsz atom in \"%s\"", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+        ngx_mp4_set_32value(minf, p - minf);
+        ngx_mp4_set_atom_name(minf, 'm', 'i', 'n', 'f');
 
-    trak->sample_sizes_entries = entries;
+        ngx_mp4_set_32value(mdia, p - mdia);
+        ngx_mp4_set_atom_name(mdia, 'm', 'd', 'i', 'a');
 
-    atom_table = atom_header + sizeof(ngx_mp4_stsz_atom_t);
+        ngx_mp4_set_32value(atom, p - atom);
+        ngx_mp4_set_atom_name(atom, 't', 'r', 'a', 'k');
+    }
 
-    atom = &trak->stsz_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    atom = p;
+    p += 8;
 
-    trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf = atom;
+    for (i = 0; i < mp4->media.nelts; i++) {
 
-    if (size == 0) {
-        if (ngx_mp4_atom_data_size(ngx_mp4_stsz_atom_t)
-            + (uint64_t) entries * sizeof(uint32_t) > atom_data_size)
-        {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "\"%s\" mp4 stsz atom too small",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+        if (mp4->track && mp4->track != i + 1) {
+            continue;
         }
 
-        atom_end = atom_table + entries * sizeof(uint32_t);
+        /* trex: default sample description index 1, other defaults 0 */
 
-        data = &trak->stsz_data_buf;
-        data->temporary = 1;
-        data->pos = atom_table;
-        data->last = atom_end;
+        ngx_memzero(p, 32);
+        ngx_mp4_set_32value(p, 32);
+        ngx_mp4_set_atom_name(p, 't', 'r', 'e', 'x');
+        ngx_mp4_set_32value(p + 12, ngx_http_mp4_track_id(media[i]));
+        ngx_mp4_set_32value(p + 16, 1);
+        p += 32;
+    }
 
-        trak->out[NGX_HTTP_MP4_STSZ_DATA].buf = data;
+    ngx_mp4_set_32value(atom, p - atom);
+    ngx_mp4_set_atom_name(atom, 'm', 'v', 'e', 'x');
 
-    } else {
-        /* if size != 0 then all samples are the same size */
-        /* TODO : chunk samples */
-        atom_size = sizeof(ngx_mp4_atom_header_t) + (size_t) atom_data_size;
-        ngx_mp4_set_32value(atom_header, atom_size);
-        trak->size += atom_size;
+    ngx_mp4_set_32value(moov, p - moov);
+    ngx_mp4_set_atom_name(moov, 'm', 'o', 'o', 'v');
+
+    b->last = p;
+    b->last_buf = (mp4->request == mp4->request->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    cl = ngx_alloc_chain_link(mp4->request->pool);
+    if (cl == NULL) {
+        return NGX_ERROR;
     }
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    cl->buf = b;
+    cl->next = NULL;
+
+    mp4->out = cl;
+    mp4->content_length = b->last - b->pos;
+
+    ngx_str_set(&mp4->content_type, "video/mp4");
 
     return NGX_OK;
 }
 
 
 static ngx_int_t
-ngx_http_mp4_update_stsz_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+ngx_http_mp4_media_segment(ngx_http_mp4_file_t *mp4)
 {
-    size_t                atom_size;
-    uint32_t             *pos, *end, entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stsz_atom_t  *stsz_atom;
+    u_char                 *p;
+    off_t                   size, offset;
+    size_t                  moof_size;
+    uint32_t                flags, samples;
+    ngx_buf_t              *b, *buf;
+    ngx_uint_t              i, j, n, nruns;
+    ngx_chain_t            *out, *cl, **ll;
+    ngx_http_request_t     *r;
+    ngx_http_mp4_run_t     *runs, *run;
+    ngx_http_mp4_mark_t    *mark;
+    ngx_http_mp4_trak_t    *trak, **media;
+    ngx_http_mp4_cursor_t   cursor;
+
+    r = mp4->request;
+
+    n = mp4->segments.nelts - 1;
+
+    if (mp4->segment > n) {
+        return NGX_DECLINED;
+    }
 
-    /*
-     * mdia.minf.stbl.stsz updating requires trak->start_sample
-     * from mdia.minf.stbl.stts which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+    media = mp4->media.elts;
+
+    runs = ngx_palloc(r->pool, mp4->media.nelts * sizeof(ngx_http_mp4_run_t));
+    if (runs == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stsz atom update");
+    /* find samples of each track within the segment time range */
 
-    data = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
+    nruns = 0;
+    size = 0;
+    moof_size = 8 + 16;
 
-    if (data) {
-        entries = trak->sample_sizes_entries;
+    for (i = 0; i < mp4->media.nelts; i++) {
 
-        if (trak->start_sample > entries) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "start time is out mp4 stsz samples in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+        if (mp4->track && mp4->track != i + 1) {
+            continue;
         }
 
-        entries -= trak->start_sample;
-        data->pos += trak->start_sample * sizeof(uint32_t);
-        end = (uint32_t *) data->pos;
+        trak = media[i];
 
-        if (trak->start_chunk_samples > trak->start_sample) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "too many mp4 start chunk samples in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
-        }
+        /* the track ended before the segment */
 
-        for (pos = end - trak->start_chunk_samples; pos < end; pos++) {
-            trak->start_chunk_samples_size += ngx_mp4_get_32value(pos);
+        if (mp4->segment > trak->nmarks) {
+            continue;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                       "chunk samples sizes:%uL",
-                       trak->start_chunk_samples_size);
+        mark = &trak->marks[mp4->segment - 1];
+        samples = mark[1].n - mark[0].n;
 
-        if (trak->start_chunk_samples_size > (uint64_t) mp4->end) {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "too large mp4 start samples size in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+        if (samples == 0) {
+            continue;
         }
 
-        if (mp4->length) {
-            if (trak->end_sample - trak->start_sample > entries) {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "end time is out mp4 stsz samples in \"%s\"",
-                              mp4->file.name.data);
-                return NGX_ERROR;
-            }
+        run = &runs[nruns++];
 
-            entries = trak->end_sample - trak->start_sample;
-            data->last = data->pos + entries * sizeof(uint32_t);
-            end = (uint32_t *) data->last;
+        run->trak = trak;
+        run->time = mark->dts;
+        run->samples = samples;
+        run->size = 0;
 
-            if (trak->end_chunk_samples > entries) {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "too many mp4 end chunk samples in \"%s\"",
-                              mp4->file.name.data);
-                return NGX_ERROR;
-            }
+        ngx_http_mp4_cursor_seek(&cursor, trak, mark);
 
-            for (pos = end - trak->end_chunk_samples; pos < end; pos++) {
-                trak->end_chunk_samples_size += ngx_mp4_get_32value(pos);
-            }
+        run->cursor = cursor;
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "mp4 stsz end_chunk_samples_size:%uL",
-                           trak->end_chunk_samples_size);
+        for (j = 0; j < samples; j++) {
 
-            if (trak->end_chunk_samples_size > (uint64_t) mp4->end) {
+            if (j && ngx_http_mp4_cursor_next(mp4, &cursor) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            if (cursor.offset > mp4->end - cursor.size) {
                 ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "too large mp4 end samples size in \"%s\"",
+                              "\"%s\" mp4 sample is out of file",
                               mp4->file.name.data);
                 return NGX_ERROR;
             }
+
+            run->size += cursor.size;
         }
 
-        atom_size = sizeof(ngx_mp4_stsz_atom_t) + (data->last - data->pos);
-        trak->size += atom_size;
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
+                       "mp4 segment trak:%ui, time:%uL, samples:%uD, size:%O",
+                       i, run->time, run->samples, run->size);
 
-        atom = trak->out[NGX_HTTP_MP4_STSZ_ATOM].buf;
-        stsz_atom = (ngx_mp4_stsz_atom_t *) atom->pos;
+        size += run->size;
+        moof_size += 8 + 16 + 20 + 20 + 16 * (size_t) run->samples;
+    }
 
-        ngx_mp4_set_32value(stsz_atom->size, atom_size);
-        ngx_mp4_set_32value(stsz_atom->entries, entries);
+    if (nruns == 0) {
+        return NGX_DECLINED;
     }
 
-    return NGX_OK;
-}
+    if (size > NGX_MAX_INT32_VALUE) {
+        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                      "\"%s\" mp4 segment is too large", mp4->file.name.data);
+        return NGX_ERROR;
+    }
 
+    b = ngx_create_temp_buf(r->pool, moof_size + 8);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_stco_atom_t;
+    out = ngx_alloc_chain_link(r->pool);
+    if (out == NULL) {
+        return NGX_ERROR;
+    }
 
+    out->buf = b;
+    ll = &out->next;
+    buf = b;
 
-static ngx_int_t
-ngx_http_mp4_read_stco_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
-{
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stco_atom_t  *stco_atom;
-    ngx_http_mp4_trak_t  *trak;
+    p = b->last;
 
-    /* chunk offsets atom */
+    ngx_mp4_set_32value(p, moof_size);
+    ngx_mp4_set_atom_name(p, 'm', 'o', 'o', 'f');
+    p += 8;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 stco atom");
+    ngx_mp4_set_32value(p, 16);
+    ngx_mp4_set_atom_name(p, 'm', 'f', 'h', 'd');
+    ngx_mp4_set_32value(p + 8, 0);
+    ngx_mp4_set_32value(p + 12, mp4->segment);
+    p += 16;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    stco_atom = (ngx_mp4_stco_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(stco_atom, 's', 't', 'c', 'o');
+    /* sample data follow the moof atom and the mdat atom header */
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    offset = moof_size + 8;
 
-    entries = ngx_mp4_get_32value(stco_atom->entries);
+    for (i = 0; i < nruns; i++) {
+        run = &runs[i];
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
+        ngx_mp4_set_32value(p, 8 + 16 + 20 + 20 + 16 * run->samples);
+        ngx_mp4_set_atom_name(p, 't', 'r', 'a', 'f');
+        p += 8;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_stco_atom_t)
-        + (uint64_t) entries * sizeof(uint32_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 stco atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+        /* default-base-is-moof */
 
-    atom_table = atom_header + sizeof(ngx_mp4_stco_atom_t);
-    atom_end = atom_table + entries * sizeof(uint32_t);
+        ngx_mp4_set_32value(p, 16);
+        ngx_mp4_set_atom_name(p, 't', 'f', 'h', 'd');
+        ngx_mp4_set_32value(p + 8, 0x00020000);
+        ngx_mp4_set_32value(p + 12, ngx_http_mp4_track_id(run->trak));
+        p += 16;
 
-    trak = ngx_mp4_last_trak(mp4);
+        ngx_mp4_set_32value(p, 20);
+        ngx_mp4_set_atom_name(p, 't', 'f', 'd', 't');
+        ngx_mp4_set_32value(p + 8, 0x01000000);
+        ngx_mp4_set_64value(p + 12, run->time);
+        p += 20;
+
+        /*
+         * data-offset, sample-duration, sample-size, sample-flags, and
+         * sample-composition-time-offset are present; signed composition
+         * offsets are used if the ctts atom has them
+         */
+
+        flags = 0x00000f01;
+
+        if (run->trak->out[NGX_HTTP_MP4_CTTS_ATOM].buf
+            && run->trak->ctts_atom_buf.pos[8] != 0)
+        {
+            flags |= 0x01000000;
+        }
+
+        ngx_mp4_set_32value(p, 20 + 16 * run->samples);
+        ngx_mp4_set_atom_name(p, 't', 'r', 'u', 'n');
+        ngx_mp4_set_32value(p + 8, flags);
+        ngx_mp4_set_32value(p + 12, run->samples);
+        ngx_mp4_set_32value(p + 16, offset);
+        p += 20;
+
+        offset += run->size;
+
+        cursor = run->cursor;
+
+        for (j = 0; j < run->samples; j++) {
+
+            if (j && ngx_http_mp4_cursor_next(mp4, &cursor) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            /* key frames do not depend on others, other are non-sync */
+
+            flags = cursor.key ? 0x02000000 : 0x01010000;
+
+            ngx_mp4_set_32value(p, cursor.duration);
+            ngx_mp4_set_32value(p + 4, cursor.size);
+            ngx_mp4_set_32value(p + 8, flags);
+            ngx_mp4_set_32value(p + 12, cursor.cto);
+            p += 16;
+
+            if (cursor.size == 0) {
+                continue;
+            }
+
+            /* contiguous samples are sent as a single file range */
+
+            if (buf->in_file && buf->file_last == cursor.offset) {
+                buf->file_last += cursor.size;
+                continue;
+            }
+
+            buf = ngx_calloc_buf(r->pool);
+            if (buf == NULL) {
+                return NGX_ERROR;
+            }
+
+            buf->file = &mp4->file;
+            buf->in_file = 1;
+            buf->file_pos = cursor.offset;
+            buf->file_last = cursor.offset + cursor.size;
+
+            cl = ngx_alloc_chain_link(r->pool);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            cl->buf = buf;
+            *ll = cl;
+            ll = &cl->next;
+        }
 
-    if (trak->out[NGX_HTTP_MP4_STCO_ATOM].buf
-        || trak->out[NGX_HTTP_MP4_CO64_ATOM].buf)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stco/co64 atom in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
     }
 
-    trak->chunks = entries;
+    ngx_mp4_set_32value(p, 8 + size);
+    ngx_mp4_set_atom_name(p, 'm', 'd', 'a', 't');
+    p += 8;
 
-    atom = &trak->stco_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    b->last = p;
 
-    data = &trak->stco_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
+    *ll = NULL;
 
-    trak->out[NGX_HTTP_MP4_STCO_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_STCO_DATA].buf = data;
+    buf->last_buf = (r == r->main) ? 1 : 0;
+    buf->last_in_chain = 1;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    mp4->out = out;
+    mp4->content_length = moof_size + 8 + size;
+
+    ngx_str_set(&mp4->content_type, "video/mp4");
 
     return NGX_OK;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_update_stco_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+static void
+ngx_http_mp4_cursor_init(ngx_http_mp4_cursor_t *cur, ngx_http_mp4_trak_t *trak)
 {
-    size_t                atom_size;
-    uint32_t              entries;
-    uint64_t              chunk_offset, samples_size;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_stco_atom_t  *stco_atom;
+    ngx_buf_t  *data;
 
-    /*
-     * mdia.minf.stbl.stco updating requires trak->start_chunk
-     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+    ngx_memzero(cur, sizeof(ngx_http_mp4_cursor_t));
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stco atom update");
+    cur->trak = trak;
+    cur->samples = trak->sample_sizes_entries;
 
-    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
+    data = trak->out[NGX_HTTP_MP4_STTS_DATA].buf;
+    cur->stts = data->pos;
+    cur->stts_end = data->last;
 
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 stco atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    data = trak->out[NGX_HTTP_MP4_CTTS_DATA].buf;
+    if (data) {
+        cur->ctts = data->pos;
+        cur->ctts_end = data->last;
     }
 
-    if (trak->start_chunk >= trak->chunks) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "start time is out mp4 stco chunks in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    /* all samples are key frames if there is no stss atom */
+
+    data = trak->out[NGX_HTTP_MP4_STSS_DATA].buf;
+    if (data) {
+        cur->stss = data->pos;
+        cur->stss_end = data->last;
     }
 
-    data->pos += trak->start_chunk * sizeof(uint32_t);
+    data = trak->out[NGX_HTTP_MP4_STSC_DATA].buf;
+    cur->stsc = data->pos;
+    cur->stsc_end = data->last;
 
-    chunk_offset = ngx_mp4_get_32value(data->pos);
-    samples_size = trak->start_chunk_samples_size;
+    data = trak->out[NGX_HTTP_MP4_STSZ_DATA].buf;
+    if (data) {
+        cur->stsz = data->pos;
 
-    if (chunk_offset > (uint64_t) mp4->end - samples_size
-        || chunk_offset + samples_size > NGX_MAX_UINT32_VALUE)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "too large chunk offset in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    } else {
+        cur->uniform_size = ngx_mp4_get_32value(trak->stsz_atom_buf.pos + 12);
     }
 
-    trak->start_offset = chunk_offset + samples_size;
-    ngx_mp4_set_32value(data->pos, trak->start_offset);
+    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
+    if (data) {
+        cur->stco = data->pos;
+        cur->co64 = 1;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "start chunk offset:%O", trak->start_offset);
+    } else {
+        cur->stco = trak->out[NGX_HTTP_MP4_STCO_DATA].buf->pos;
+    }
+}
 
-    if (mp4->length) {
 
-        if (trak->end_chunk - trak->start_chunk
-            > trak->chunks - trak->start_chunk)
-        {
-            ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                          "end time is out mp4 stco chunks in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
+static ngx_int_t
+ngx_http_mp4_cursor_next(ngx_http_mp4_file_t *mp4, ngx_http_mp4_cursor_t *cur)
+{
+    u_char    *p;
+    uint32_t   n;
+
+    if (cur->n == cur->samples) {
+        return NGX_DONE;
+    }
+
+    /* 1-based sample number */
+    n = cur->n + 1;
+
+    cur->dts += cur->duration;
+
+    while (cur->stts_left == 0) {
+        if (cur->stts == cur->stts_end) {
+            goto failed;
         }
 
-        entries = trak->end_chunk - trak->start_chunk;
-        data->last = data->pos + entries * sizeof(uint32_t);
+        cur->stts_left = ngx_mp4_get_32value(cur->stts);
+        cur->duration = ngx_mp4_get_32value(cur->stts + 4);
+        cur->stts += 8;
+    }
 
-        if (entries) {
-            chunk_offset = ngx_mp4_get_32value(data->last - sizeof(uint32_t));
-            samples_size = trak->end_chunk_samples_size;
+    cur->stts_left--;
 
-            if (chunk_offset > (uint64_t) mp4->end - samples_size
-                || chunk_offset + samples_size > NGX_MAX_UINT32_VALUE)
-            {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "too large chunk offset in \"%s\"",
-                              mp4->file.name.data);
-                return NGX_ERROR;
-            }
+    while (cur->ctts_left == 0 && cur->ctts < cur->ctts_end) {
+        cur->ctts_left = ngx_mp4_get_32value(cur->ctts);
+        cur->cto = ngx_mp4_get_32value(cur->ctts + 4);
+        cur->ctts += 8;
+    }
 
-            trak->end_offset = chunk_offset + samples_size;
+    if (cur->ctts_left) {
+        cur->ctts_left--;
+
+    } else {
+        cur->cto = 0;
+    }
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "end chunk offset:%O", trak->end_offset);
+    if (cur->stss) {
+        while (cur->stss < cur->stss_end
+               && ngx_mp4_get_32value(cur->stss) < n)
+        {
+            cur->stss += sizeof(uint32_t);
         }
 
+        cur->key = (cur->stss < cur->stss_end
+                    && ngx_mp4_get_32value(cur->stss) == n);
+
     } else {
-        entries = trak->chunks - trak->start_chunk;
-        trak->end_offset = mp4->mdat_data.buf->file_last;
+        cur->key = 1;
     }
 
-    if (entries == 0) {
-        trak->start_offset = mp4->end;
-        trak->end_offset = 0;
-    }
+    if (cur->chunk_left) {
+        cur->offset += cur->size;
 
-    atom_size = sizeof(ngx_mp4_stco_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+    } else {
 
-    atom = trak->out[NGX_HTTP_MP4_STCO_ATOM].buf;
-    stco_atom = (ngx_mp4_stco_atom_t *) atom->pos;
+        do {
+            if (cur->chunk == cur->trak->chunks) {
+                goto failed;
+            }
 
-    ngx_mp4_set_32value(stco_atom->size, atom_size);
-    ngx_mp4_set_32value(stco_atom->entries, entries);
+            cur->chunk++;
 
-    return NGX_OK;
-}
+            while (cur->stsc < cur->stsc_end
+                   && ngx_mp4_get_32value(cur->stsc) <= cur->chunk)
+            {
+                cur->chunk_samples = ngx_mp4_get_32value(cur->stsc + 4);
+                cur->stsc += sizeof(ngx_mp4_stsc_entry_t);
+            }
 
+            cur->chunk_left = cur->chunk_samples;
 
-static void
-ngx_http_mp4_adjust_stco_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, int32_t adjustment)
-{
-    uint32_t    offset, *entry, *end;
-    ngx_buf_t  *data;
+        } while (cur->chunk_left == 0);
 
-    /*
-     * moov.trak.mdia.minf.stbl.stco adjustment requires
-     * minimal start offset of all traks and new moov atom size
-     */
+        if (cur->co64) {
+            p = cur->stco + (cur->chunk - 1) * sizeof(uint64_t);
+            cur->offset = (off_t) ngx_mp4_get_64value(p);
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 stco atom adjustment");
+        } else {
+            p = cur->stco + (cur->chunk - 1) * sizeof(uint32_t);
+            cur->offset = ngx_mp4_get_32value(p);
+        }
+    }
 
-    data = trak->out[NGX_HTTP_MP4_STCO_DATA].buf;
-    entry = (uint32_t *) data->pos;
-    end = (uint32_t *) data->last;
+    cur->chunk_left--;
 
-    while (entry < end) {
-        offset = ngx_mp4_get_32value(entry);
-        offset += adjustment;
-        ngx_mp4_set_32value(entry, offset);
-        entry++;
+    if (cur->stsz) {
+        cur->size = ngx_mp4_get_32value(cur->stsz + cur->n * sizeof(uint32_t));
+
+    } else {
+        cur->size = cur->uniform_size;
     }
-}
 
+    cur->n = n;
 
-typedef struct {
-    u_char    size[4];
-    u_char    name[4];
-    u_char    version[1];
-    u_char    flags[3];
-    u_char    entries[4];
-} ngx_mp4_co64_atom_t;
+    return NGX_OK;
 
+failed:
 
-static ngx_int_t
-ngx_http_mp4_read_co64_atom(ngx_http_mp4_file_t *mp4, uint64_t atom_data_size)
+    ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
+                  "\"%s\" mp4 sample tables are inconsistent",
+                  mp4->file.name.data);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_mp4_cursor_mark(ngx_http_mp4_cursor_t *cur, ngx_http_mp4_mark_t *mark)
 {
-    u_char               *atom_header, *atom_table, *atom_end;
-    uint32_t              entries;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_co64_atom_t  *co64_atom;
     ngx_http_mp4_trak_t  *trak;
 
-    /* chunk offsets atom */
+    /* table positions are saved as offsets to be valid for other copies */
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "mp4 co64 atom");
+    trak = cur->trak;
 
-    atom_header = ngx_mp4_atom_header(mp4);
-    co64_atom = (ngx_mp4_co64_atom_t *) atom_header;
-    ngx_mp4_set_atom_name(co64_atom, 'c', 'o', '6', '4');
+    mark->dts = cur->dts;
+    mark->offset = cur->offset;
+    mark->n = cur->n;
+    mark->duration = cur->duration;
+    mark->size = cur->size;
+    mark->cto = cur->cto;
+    mark->key = cur->key;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t) > atom_data_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    mark->stts = cur->stts - trak->out[NGX_HTTP_MP4_STTS_DATA].buf->pos;
+    mark->stts_left = cur->stts_left;
 
-    entries = ngx_mp4_get_32value(co64_atom->entries);
+    mark->ctts = cur->ctts
+                 ? cur->ctts - trak->out[NGX_HTTP_MP4_CTTS_DATA].buf->pos : 0;
+    mark->ctts_left = cur->ctts_left;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0, "chunks:%uD", entries);
+    mark->stss = cur->stss
+                 ? cur->stss - trak->out[NGX_HTTP_MP4_STSS_DATA].buf->pos : 0;
 
-    if (ngx_mp4_atom_data_size(ngx_mp4_co64_atom_t)
-        + (uint64_t) entries * sizeof(uint64_t) > atom_data_size)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "\"%s\" mp4 co64 atom too small", mp4->file.name.data);
-        return NGX_ERROR;
-    }
+    mark->stsc = cur->stsc - trak->out[NGX_HTTP_MP4_STSC_DATA].buf->pos;
+    mark->chunk = cur->chunk;
+    mark->chunk_samples = cur->chunk_samples;
+    mark->chunk_left = cur->chunk_left;
+}
 
-    atom_table = atom_header + sizeof(ngx_mp4_co64_atom_t);
-    atom_end = atom_table + entries * sizeof(uint64_t);
 
-    trak = ngx_mp4_last_trak(mp4);
+static void
+ngx_http_mp4_cursor_seek(ngx_http_mp4_cursor_t *cur, ngx_http_mp4_trak_t *trak,
+    ngx_http_mp4_mark_t *mark)
+{
+    ngx_http_mp4_cursor_init(cur, trak);
 
-    if (trak->out[NGX_HTTP_MP4_STCO_ATOM].buf
-        || trak->out[NGX_HTTP_MP4_CO64_ATOM].buf)
-    {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "duplicate mp4 stco/co64 atom in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    cur->dts = mark->dts;
+    cur->offset = mark->offset;
+    cur->n = mark->n;
+    cur->duration = mark->duration;
+    cur->size = mark->size;
+    cur->cto = mark->cto;
+    cur->key = mark->key;
+
+    cur->stts += mark->stts;
+    cur->stts_left = mark->stts_left;
+
+    if (cur->ctts) {
+        cur->ctts += mark->ctts;
+        cur->ctts_left = mark->ctts_left;
     }
 
-    trak->chunks = entries;
+    if (cur->stss) {
+        cur->stss += mark->stss;
+    }
 
-    atom = &trak->co64_atom_buf;
-    atom->temporary = 1;
-    atom->pos = atom_header;
-    atom->last = atom_table;
+    cur->stsc += mark->stsc;
+    cur->chunk = mark->chunk;
+    cur->chunk_samples = mark->chunk_samples;
+    cur->chunk_left = mark->chunk_left;
+}
 
-    data = &trak->co64_data_buf;
-    data->temporary = 1;
-    data->pos = atom_table;
-    data->last = atom_end;
 
-    trak->out[NGX_HTTP_MP4_CO64_ATOM].buf = atom;
-    trak->out[NGX_HTTP_MP4_CO64_DATA].buf = data;
+static char *
+ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
 
-    ngx_mp4_atom_next(mp4, atom_data_size);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_mp4_handler;
 
-    return NGX_OK;
+    return NGX_CONF_OK;
 }
 
 
-static ngx_int_t
-ngx_http_mp4_update_co64_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak)
+static char *
+ngx_http_mp4_moov_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    size_t                atom_size;
-    uint64_t              entries, chunk_offset, samples_size;
-    ngx_buf_t            *atom, *data;
-    ngx_mp4_co64_atom_t  *co64_atom;
+    ngx_http_mp4_conf_t *mcf = conf;
 
-    /*
-     * mdia.minf.stbl.co64 updating requires trak->start_chunk
-     * from mdia.minf.stbl.stsc which depends on value from mdia.mdhd
-     * atom which may reside after mdia.minf
-     */
+    size_t       len;
+    ngx_int_t    n;
+    ngx_str_t   *value, name, size;
+    ngx_uint_t   j;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 co64 atom update");
+    if (mcf->moov_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
 
-    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
+    value = cf->args->elts;
 
-    if (data == NULL) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "no mp4 co64 atoms were found in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        mcf->moov_cache = NULL;
+        return NGX_CONF_OK;
     }
 
-    if (trak->start_chunk >= trak->chunks) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "start time is out mp4 co64 chunks in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+    if (value[1].len <= sizeof("shared:") - 1
+        || ngx_strncmp(value[1].data, "shared:", sizeof("shared:") - 1) != 0)
+    {
+        goto invalid;
     }
 
-    data->pos += trak->start_chunk * sizeof(uint64_t);
+    len = 0;
 
-    chunk_offset = ngx_mp4_get_64value(data->pos);
-    samples_size = trak->start_chunk_samples_size;
+    for (j = sizeof("shared:") - 1; j < value[1].len; j++) {
+        if (value[1].data[j] == ':') {
+            break;
+        }
 
-    if (chunk_offset > (uint64_t) mp4->end - samples_size) {
-        ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                      "too large chunk offset in \"%s\"",
-                      mp4->file.name.data);
-        return NGX_ERROR;
+        len++;
     }
 
-    trak->start_offset = chunk_offset + samples_size;
-    ngx_mp4_set_64value(data->pos, trak->start_offset);
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "start chunk offset:%O", trak->start_offset);
-
-    if (mp4->length) {
-
-        if (trak->end_chunk - trak->start_chunk
-            > trak->chunks - trak->start_chunk)
-        {
-            ngx_log_error(NGX_LOG_ALERT, mp4->file.log, 0,
-                          "end time is out mp4 co64 chunks in \"%s\"",
-                          mp4->file.name.data);
-            return NGX_ERROR;
-        }
+    if (len == 0 || j == value[1].len) {
+        goto invalid;
+    }
 
-        entries = trak->end_chunk - trak->start_chunk;
-        data->last = data->pos + entries * sizeof(uint64_t);
+    name.len = len;
+    name.data = value[1].data + sizeof("shared:") - 1;
 
-        if (entries) {
-            chunk_offset = ngx_mp4_get_64value(data->last - sizeof(uint64_t));
-            samples_size = trak->end_chunk_samples_size;
+    size.len = value[1].len - j - 1;
+    size.data = name.data + len + 1;
 
-            if (chunk_offset > (uint64_t) mp4->end - samples_size) {
-                ngx_log_error(NGX_LOG_ERR, mp4->file.log, 0,
-                              "too large chunk offset in \"%s\"",
-                              mp4->file.name.data);
-                return NGX_ERROR;
-            }
+    n = ngx_parse_size(&size);
 
-            trak->end_offset = chunk_offset + samples_size;
+    if (n == NGX_ERROR) {
+        goto invalid;
+    }
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                           "end chunk offset:%O", trak->end_offset);
-        }
+    if (n < (ngx_int_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "mp4 moov cache \"%V\" is too small", &value[1]);
 
-    } else {
-        entries = trak->chunks - trak->start_chunk;
-        trak->end_offset = mp4->mdat_data.buf->file_last;
+        return NGX_CONF_ERROR;
     }
 
-    if (entries == 0) {
-        trak->start_offset = mp4->end;
-        trak->end_offset = 0;
+    mcf->moov_cache = ngx_shared_memory_add(cf, &name, n,
+                                            &ngx_http_mp4_module);
+    if (mcf->moov_cache == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    atom_size = sizeof(ngx_mp4_co64_atom_t) + (data->last - data->pos);
-    trak->size += atom_size;
+    mcf->moov_cache->init = ngx_http_mp4_cache_init;
 
-    atom = trak->out[NGX_HTTP_MP4_CO64_ATOM].buf;
-    co64_atom = (ngx_mp4_co64_atom_t *) atom->pos;
+    return NGX_CONF_OK;
 
-    ngx_mp4_set_32value(co64_atom->size, atom_size);
-    ngx_mp4_set_32value(co64_atom->entries, entries);
+invalid:
 
-    return NGX_OK;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid mp4 moov cache \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
 }
 
 
-static void
-ngx_http_mp4_adjust_co64_atom(ngx_http_mp4_file_t *mp4,
-    ngx_http_mp4_trak_t *trak, off_t adjustment)
+static ngx_int_t
+ngx_http_mp4_cache_init(ngx_shm_zone_t *shm_zone, void *data)
 {
-    uint64_t    offset, *entry, *end;
-    ngx_buf_t  *data;
+    size_t                   len;
+    ngx_slab_pool_t         *shpool;
+    ngx_http_mp4_moov_sh_t  *sh;
 
-    /*
-     * moov.trak.mdia.minf.stbl.co64 adjustment requires
-     * minimal start offset of all traks and new moov atom size
-     */
+    if (data) {
+        shm_zone->data = data;
+        return NGX_OK;
+    }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, mp4->file.log, 0,
-                   "mp4 co64 atom adjustment");
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    data = trak->out[NGX_HTTP_MP4_CO64_DATA].buf;
-    entry = (uint64_t *) data->pos;
-    end = (uint64_t *) data->last;
+    if (shm_zone->shm.exists) {
+        shm_zone->data = shpool->data;
+        return NGX_OK;
+    }
 
-    while (entry < end) {
-        offset = ngx_mp4_get_64value(entry);
-        offset += adjustment;
-        ngx_mp4_set_64value(entry, offset);
-        entry++;
+    sh = ngx_slab_alloc(shpool, sizeof(ngx_http_mp4_moov_sh_t));
+    if (sh == NULL) {
+        return NGX_ERROR;
     }
-}
 
+    shpool->data = sh;
+    shm_zone->data = sh;
 
-static char *
-ngx_http_mp4(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_core_loc_conf_t  *clcf;
+    ngx_rbtree_init(&sh->rbtree, &sh->sentinel, ngx_str_rbtree_insert_value);
 
-    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_mp4_handler;
+    ngx_queue_init(&sh->queue);
 
-    return NGX_CONF_OK;
+    len = sizeof(" in mp4 moov cache \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in mp4 moov cache \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    shpool->log_nomem = 0;
+
+    return NGX_OK;
 }
 
 
@@ -3955,6 +6871,9 @@ ngx_http_mp4_create_conf(ngx_conf_t *cf)
     conf->buffer_size = NGX_CONF_UNSET_SIZE;
     conf->max_buffer_size = NGX_CONF_UNSET_SIZE;
     conf->start_key_frame = NGX_CONF_UNSET;
+    conf->moov_cache = NGX_CONF_UNSET_PTR;
+    conf->segments = NGX_CONF_UNSET;
+    conf->segment_length = NGX_CONF_UNSET_MSEC;
 
     return conf;
 }
@@ -3970,6 +6889,10 @@ ngx_http_mp4_merge_conf(ngx_conf_t *cf, void *parent, void *child)
     ngx_conf_merge_size_value(conf->max_buffer_size, prev->max_buffer_size,
                               10 * 1024 * 1024);
     ngx_conf_merge_value(conf->start_key_frame, prev->start_key_frame, 0);
+    ngx_conf_merge_ptr_value(conf->moov_cache, prev->moov_cache, NULL);
+    ngx_conf_merge_value(conf->segments, prev->segments, 0);
+    ngx_conf_merge_msec_value(conf->segment_length, prev->segment_length,
+                              6000);
 
     return NGX_CONF_OK;
 }
@@ -9,6 +9,13 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+
+#define NGX_HTTP_SUB_PREFILTER  8
+
 
 typedef struct {
     ngx_http_complex_value_t   match;
@@ -23,11 +30,26 @@ typedef struct {
 
 
 typedef struct {
-    ngx_uint_t                 min_match_len;
+    ngx_uint_t                 depth;
+    ngx_uint_t                 match;
+    ngx_uint_t                 output;
+    ngx_uint_t                 leaf;     /* unsigned  leaf:1; */
+} ngx_http_sub_state_t;
+
+
+typedef struct {
     ngx_uint_t                 max_match_len;
+    ngx_uint_t                 nclasses;
+
+    uint32_t                  *next;
+    ngx_http_sub_state_t      *states;
+    u_char                    *same;
+
+    ngx_uint_t                 nbytes;
+    u_char                     bytes[NGX_HTTP_SUB_PREFILTER];
 
-    u_char                     index[257];
-    u_char                     shift[256];
+    u_char                     first[256];
+    u_char                     classes[256];
 } ngx_http_sub_tables_t;
 
 
@@ -69,7 +91,6 @@ typedef struct {
     ngx_str_t                 *sub;
     ngx_uint_t                 applied;
 
-    ngx_int_t                  offset;
     ngx_uint_t                 index;
 
     ngx_http_sub_tables_t     *tables;
@@ -77,24 +98,20 @@ typedef struct {
 } ngx_http_sub_ctx_t;
 
 
-static ngx_uint_t ngx_http_sub_cmp_index;
-
-
 static ngx_int_t ngx_http_sub_output(ngx_http_request_t *r,
     ngx_http_sub_ctx_t *ctx);
 static ngx_int_t ngx_http_sub_parse(ngx_http_request_t *r,
-    ngx_http_sub_ctx_t *ctx, ngx_uint_t flush);
-static ngx_int_t ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_int_t start,
-    ngx_str_t *m);
+    ngx_http_sub_ctx_t *ctx, ngx_uint_t last);
+static ngx_uint_t ngx_http_sub_match(ngx_http_sub_ctx_t *ctx,
+    ngx_uint_t state, ngx_uint_t once, ngx_uint_t *len);
 
 static char * ngx_http_sub_filter(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static void *ngx_http_sub_create_conf(ngx_conf_t *cf);
 static char *ngx_http_sub_merge_conf(ngx_conf_t *cf,
     void *parent, void *child);
-static void ngx_http_sub_init_tables(ngx_http_sub_tables_t *tables,
+static ngx_http_sub_tables_t *ngx_http_sub_init_tables(ngx_pool_t *pool,
     ngx_http_sub_match_t *match, ngx_uint_t n);
-static ngx_int_t ngx_http_sub_cmp_matches(const void *one, const void *two);
 static ngx_int_t ngx_http_sub_filter_init(ngx_conf_t *cf);
 
 
@@ -239,28 +256,25 @@ ngx_http_sub_header_filter(ngx_http_request_t *r)
         ctx->matches->elts = matches;
         ctx->matches->nelts = j;
 
-        ctx->tables = ngx_palloc(r->pool, sizeof(ngx_http_sub_tables_t));
+        ctx->tables = ngx_http_sub_init_tables(r->pool, ctx->matches->elts,
+                                               ctx->matches->nelts);
         if (ctx->tables == NULL) {
             return NGX_ERROR;
         }
-
-        ngx_http_sub_init_tables(ctx->tables, ctx->matches->elts,
-                                 ctx->matches->nelts);
     }
 
-    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len - 1);
+    ctx->saved.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len);
     if (ctx->saved.data == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len - 1);
+    ctx->looked.data = ngx_pnalloc(r->pool, ctx->tables->max_match_len);
     if (ctx->looked.data == NULL) {
         return NGX_ERROR;
     }
 
     ngx_http_set_ctx(r, ctx, ngx_http_sub_filter_module);
 
-    ctx->offset = ctx->tables->min_match_len - 1;
     ctx->last_out = &ctx->out;
 
     r->filter_need_in_memory = 1;
@@ -287,7 +301,7 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_int_t                  rc;
     ngx_buf_t                 *b;
     ngx_str_t                 *sub;
-    ngx_uint_t                 flush, last;
+    ngx_uint_t                 last;
     ngx_chain_t               *cl;
     ngx_http_sub_ctx_t        *ctx;
     ngx_http_sub_match_t      *match;
@@ -329,9 +343,6 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http sub filter \"%V\"", &r->uri);
 
-    flush = 0;
-    last = 0;
-
     while (ctx->in || ctx->buf) {
 
         if (ctx->buf == NULL) {
@@ -340,17 +351,11 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             ctx->pos = ctx->buf->pos;
         }
 
-        if (ctx->buf->flush || ctx->buf->recycled) {
-            flush = 1;
-        }
-
-        if (ctx->in == NULL) {
-            last = flush;
-        }
+        last = ctx->buf->last_buf || ctx->buf->last_in_chain;
 
         b = NULL;
 
-        while (ctx->pos < ctx->buf->last) {
+        while (ctx->pos < ctx->buf->last || (last && ctx->looked.len)) {
 
             rc = ngx_http_sub_parse(r, ctx, last);
 
@@ -474,28 +479,6 @@ ngx_http_sub_body_filter(ngx_http_request_t *r, ngx_chain_t *in)
             continue;
         }
 
-        if (ctx->looked.len
-            && (ctx->buf->last_buf || ctx->buf->last_in_chain))
-        {
-            cl = ngx_chain_get_free_buf(r->pool, &ctx->free);
-            if (cl == NULL) {
-                return NGX_ERROR;
-            }
-
-            b = cl->buf;
-
-            ngx_memzero(b, sizeof(ngx_buf_t));
-
-            b->pos = ctx->looked.data;
-            b->last = b->pos + ctx->looked.len;
-            b->memory = 1;
-
-            *ctx->last_out = cl;
-            ctx->last_out = &cl->next;
-
-            ctx->looked.len = 0;
-        }
-
         if (ctx->buf->last_buf || ctx->buf->flush || ctx->buf->sync
             || ngx_buf_in_memory(ctx->buf))
         {
@@ -603,114 +586,161 @@ ngx_http_sub_output(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx)
 }
 
 
-static ngx_int_t
-ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx,
-    ngx_uint_t flush)
+static ngx_inline u_char *
+ngx_http_sub_skip(ngx_http_sub_tables_t *tables, u_char *p, u_char *last)
 {
-    u_char                   *p, c;
-    ngx_str_t                *m;
-    ngx_int_t                 offset, start, next, end, len, rc;
-    ngx_uint_t                shift, i, j;
-    ngx_http_sub_match_t     *match;
-    ngx_http_sub_tables_t    *tables;
-    ngx_http_sub_loc_conf_t  *slcf;
+#if (NGX_HAVE_SSE2)
+    int         mask;
+    __m128i     x, m, bytes[NGX_HTTP_SUB_PREFILTER];
+    ngx_uint_t  i, n;
 
-    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sub_filter_module);
-    tables = ctx->tables;
-    match = ctx->matches->elts;
+    /* look for the first bytes of the patterns, 16 bytes at a time */
 
-    offset = ctx->offset;
-    end = ctx->buf->last - ctx->pos;
+    n = tables->nbytes;
 
-    if (ctx->once) {
-        /* sets start and next to end */
-        offset = end + (ngx_int_t) tables->min_match_len - 1;
-        goto again;
-    }
+    if (n) {
+        for (i = 0; i < n; i++) {
+            bytes[i] = _mm_set1_epi8((char) tables->bytes[i]);
+        }
 
-    while (offset < end) {
+        while (last - p >= 16) {
+            x = _mm_loadu_si128((__m128i *) p);
 
-        c = offset < 0 ? ctx->looked.data[ctx->looked.len + offset]
-                       : ctx->pos[offset];
+            m = _mm_cmpeq_epi8(x, bytes[0]);
 
-        c = ngx_tolower(c);
+            for (i = 1; i < n; i++) {
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(x, bytes[i]));
+            }
 
-        shift = tables->shift[c];
-        if (shift > 0) {
-            offset += shift;
-            continue;
+            mask = _mm_movemask_epi8(m);
+
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+
+            p += 16;
         }
+    }
+#endif
 
-        /* a potential match */
+    while (p < last && !tables->first[*p]) {
+        p++;
+    }
 
-        start = offset - (ngx_int_t) tables->min_match_len + 1;
+    return p;
+}
 
-        i = ngx_max((ngx_uint_t) tables->index[c], ctx->index);
-        j = tables->index[c + 1];
 
-        while (i != j) {
+/*
+ * The patterns are matched with an Aho-Corasick automaton.  Of the matches
+ * the one which starts first wins, and of the matches starting at the same
+ * position the one which is configured first.  A match is thus reported
+ * only when no partially matched pattern starts at or before it.
+ *
+ * Only the bytes of the partially matched patterns are kept in ctx->looked
+ * between calls, and they are scanned again from the initial state.
+ */
 
-            if (slcf->once && ctx->sub && ctx->sub[i].data) {
-                goto next;
-            }
+static ngx_int_t
+ngx_http_sub_parse(ngx_http_request_t *r, ngx_http_sub_ctx_t *ctx,
+    ngx_uint_t last)
+{
+    u_char                   *p, c;
+    uint32_t                 *move;
+    ngx_int_t                 offset, start, next, end, len, rc;
+    ngx_uint_t                state, i, n, index, found, once, mlen;
+    ngx_http_sub_state_t     *states;
+    ngx_http_sub_tables_t    *tables;
+    ngx_http_sub_loc_conf_t  *slcf;
 
-            m = &match[i].match;
+    end = ctx->buf->last - ctx->pos;
 
-            rc = ngx_http_sub_match(ctx, start, m);
+    if (ctx->once) {
+        start = end;
+        next = end;
+        rc = NGX_AGAIN;
 
-            if (rc == NGX_DECLINED) {
-                goto next;
-            }
+        goto done;
+    }
 
-            ctx->index = i;
+    slcf = ngx_http_get_module_loc_conf(r, ngx_http_sub_filter_module);
+    tables = ctx->tables;
+    states = tables->states;
+    move = tables->next;
 
-            if (rc == NGX_AGAIN) {
-                goto again;
-            }
+    once = slcf->once && ctx->sub;
+
+    state = 0;
+    found = 0;
+    index = 0;
+    mlen = 0;
+    start = 0;
+
+    offset = - (ngx_int_t) ctx->looked.len;
 
-            ctx->offset = offset + (ngx_int_t) m->len;
-            next = start + (ngx_int_t) m->len;
-            end = ngx_max(next, 0);
-            rc = NGX_OK;
+    while (offset < end) {
 
-            goto done;
+        if (state == 0 && offset >= 0) {
+            p = ngx_http_sub_skip(tables, ctx->pos + offset, ctx->buf->last);
 
-        next:
+            offset = p - ctx->pos;
 
-            i++;
+            if (offset == end) {
+                break;
+            }
         }
 
+        c = offset < 0 ? ctx->looked.data[ctx->looked.len + offset]
+                       : ctx->pos[offset];
+
         offset++;
-        ctx->index = 0;
-    }
 
-    if (flush) {
-        for ( ;; ) {
-            start = offset - (ngx_int_t) tables->min_match_len + 1;
+        state = move[state * tables->nclasses + tables->classes[c]];
 
-            if (start >= end) {
-                break;
-            }
+        if (states[state].match || states[state].output) {
+            i = ngx_http_sub_match(ctx, state, once, &n);
 
-            for (i = 0; i < ctx->matches->nelts; i++) {
-                m = &match[i].match;
+            len = offset - (ngx_int_t) n;
 
-                if (ngx_http_sub_match(ctx, start, m) == NGX_AGAIN) {
-                    goto again;
-                }
+            if (i && (!found || len < start || (len == start && i - 1 < index)))
+            {
+                found = 1;
+                index = i - 1;
+                mlen = n;
+                start = len;
             }
+        }
 
-            offset++;
+        if (!found) {
+            continue;
+        }
+
+        /* the earliest partially matched pattern */
+
+        len = offset - (ngx_int_t) states[state].depth;
+
+        if (len > start || (len == start && states[state].leaf)) {
+            goto found;
         }
     }
 
-again:
+    if (found && last) {
+        goto found;
+    }
 
-    ctx->offset = offset;
-    start = offset - (ngx_int_t) tables->min_match_len + 1;
+    start = last ? end : end - (ngx_int_t) states[state].depth;
     next = start;
     rc = NGX_AGAIN;
 
+    goto done;
+
+found:
+
+    ctx->index = index;
+    next = start + (ngx_int_t) mlen;
+    end = ngx_max(next, 0);
+    rc = NGX_OK;
+
 done:
 
     /* send [ - looked.len, start ] to client */
@@ -734,54 +764,42 @@ done:
     /* update position */
 
     ctx->pos += end;
-    ctx->offset -= end;
 
     return rc;
 }
 
 
-static ngx_int_t
-ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_int_t start, ngx_str_t *m)
+static ngx_uint_t
+ngx_http_sub_match(ngx_http_sub_ctx_t *ctx, ngx_uint_t state, ngx_uint_t once,
+    ngx_uint_t *len)
 {
-    u_char  *p, *last, *pat, *pat_end;
+    ngx_uint_t             i;
+    ngx_http_sub_state_t  *states;
 
-    pat = m->data;
-    pat_end = m->data + m->len;
+    states = ctx->tables->states;
 
-    if (start >= 0) {
-        p = ctx->pos + start;
+    if (states[state].match == 0) {
+        state = states[state].output;
+    }
 
-    } else {
-        last = ctx->looked.data + ctx->looked.len;
-        p = last + start;
+    /* the longest pattern ending here starts first */
 
-        while (p < last && pat < pat_end) {
-            if (ngx_tolower(*p) != *pat) {
-                return NGX_DECLINED;
-            }
+    while (state) {
 
-            p++;
-            pat++;
-        }
+        for (i = states[state].match; i; i = ctx->tables->same[i - 1]) {
 
-        p = ctx->pos;
-    }
+            if (once && ctx->sub[i - 1].data) {
+                continue;
+            }
 
-    while (p < ctx->buf->last && pat < pat_end) {
-        if (ngx_tolower(*p) != *pat) {
-            return NGX_DECLINED;
+            *len = states[state].depth;
+            return i;
         }
 
-        p++;
-        pat++;
-    }
-
-    if (pat != pat_end) {
-        /* partial match */
-        return NGX_AGAIN;
+        state = states[state].output;
     }
 
-    return NGX_OK;
+    return 0;
 }
 
 
@@ -931,77 +949,192 @@ ngx_http_sub_merge_conf(ngx_conf_t *cf, void *parent, void *child)
         conf->matches->elts = matches;
         conf->matches->nelts = n;
 
-        conf->tables = ngx_palloc(cf->pool, sizeof(ngx_http_sub_tables_t));
+        conf->tables = ngx_http_sub_init_tables(cf->pool,
+                                                conf->matches->elts,
+                                                conf->matches->nelts);
         if (conf->tables == NULL) {
             return NGX_CONF_ERROR;
         }
-
-        ngx_http_sub_init_tables(conf->tables, conf->matches->elts,
-                                 conf->matches->nelts);
     }
 
     return NGX_CONF_OK;
 }
 
 
-static void
-ngx_http_sub_init_tables(ngx_http_sub_tables_t *tables,
-    ngx_http_sub_match_t *match, ngx_uint_t n)
+static ngx_http_sub_tables_t *
+ngx_http_sub_init_tables(ngx_pool_t *pool, ngx_http_sub_match_t *match,
+    ngx_uint_t n)
 {
-    u_char      c;
-    ngx_uint_t  i, j, min, max, ch;
+    u_char                 *p, *last;
+    uint32_t               *next, t;
+    ngx_uint_t              i, j, k, c, s, f, size, nstates, head, tail;
+    ngx_uint_t             *fail, *queue;
+    ngx_http_sub_state_t   *states;
+    ngx_http_sub_tables_t  *tables;
+
+    tables = ngx_pcalloc(pool, sizeof(ngx_http_sub_tables_t));
+    if (tables == NULL) {
+        return NULL;
+    }
+
+    /*
+     * bytes found in the patterns are mapped to classes starting from 1,
+     * all other bytes to class 0; the patterns are already lowercased,
+     * so there are no more than 231 classes
+     */
+
+    k = 1;
+    size = 1;
+
+    for (i = 0; i < n; i++) {
+        p = match[i].match.data;
+        last = p + match[i].match.len;
+
+        size += match[i].match.len;
+
+        if (tables->max_match_len < match[i].match.len) {
+            tables->max_match_len = match[i].match.len;
+        }
 
-    min = match[0].match.len;
-    max = match[0].match.len;
+        while (p < last) {
+            if (tables->classes[*p] == 0) {
+                tables->classes[*p] = (u_char) k++;
+            }
 
-    for (i = 1; i < n; i++) {
-        min = ngx_min(min, match[i].match.len);
-        max = ngx_max(max, match[i].match.len);
+            p++;
+        }
     }
 
-    tables->min_match_len = min;
-    tables->max_match_len = max;
+    for (c = 'A'; c <= 'Z'; c++) {
+        tables->classes[c] = tables->classes[c | 0x20];
+    }
 
-    ngx_http_sub_cmp_index = tables->min_match_len - 1;
-    ngx_sort(match, n, sizeof(ngx_http_sub_match_t), ngx_http_sub_cmp_matches);
+    tables->nclasses = k;
 
-    min = ngx_min(min, 255);
-    ngx_memset(tables->shift, min, 256);
+    states = ngx_pcalloc(pool, size * sizeof(ngx_http_sub_state_t));
+    if (states == NULL) {
+        return NULL;
+    }
 
-    ch = 0;
+    next = ngx_pcalloc(pool, size * k * sizeof(uint32_t));
+    if (next == NULL) {
+        return NULL;
+    }
+
+    tables->same = ngx_pcalloc(pool, n);
+    if (tables->same == NULL) {
+        return NULL;
+    }
+
+    fail = ngx_palloc(pool, size * sizeof(ngx_uint_t));
+    if (fail == NULL) {
+        return NULL;
+    }
+
+    queue = ngx_palloc(pool, size * sizeof(ngx_uint_t));
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    tables->states = states;
+    tables->next = next;
+
+    /* the trie of the patterns */
+
+    nstates = 1;
 
     for (i = 0; i < n; i++) {
+        p = match[i].match.data;
+        last = p + match[i].match.len;
+
+        s = 0;
+
+        while (p < last) {
+            t = next[s * k + tables->classes[*p++]];
+
+            if (t == 0) {
+                t = nstates++;
+
+                next[s * k + tables->classes[p[-1]]] = t;
+
+                states[t].depth = states[s].depth + 1;
+                states[t].leaf = 1;
+                states[s].leaf = 0;
+            }
+
+            s = t;
+        }
+
+        /* the same patterns are tried in the configuration order */
+
+        if (states[s].match == 0) {
+            states[s].match = i + 1;
+            continue;
+        }
+
+        j = states[s].match;
 
-        for (j = 0; j < min; j++) {
-            c = match[i].match.data[tables->min_match_len - 1 - j];
-            tables->shift[c] = ngx_min(tables->shift[c], (u_char) j);
+        while (tables->same[j - 1]) {
+            j = tables->same[j - 1];
         }
 
-        c = match[i].match.data[tables->min_match_len - 1];
-        while (ch <= (ngx_uint_t) c) {
-            tables->index[ch++] = (u_char) i;
+        tables->same[j - 1] = (u_char) (i + 1);
+    }
+
+    /* failure links and the transitions, in breadth-first order */
+
+    head = 0;
+    tail = 0;
+
+    for (c = 0; c < k; c++) {
+        t = next[c];
+
+        if (t) {
+            fail[t] = 0;
+            queue[tail++] = t;
         }
     }
 
-    while (ch < 257) {
-        tables->index[ch++] = (u_char) n;
+    while (head < tail) {
+        s = queue[head++];
+        f = fail[s];
+
+        states[s].output = states[f].match ? f : states[f].output;
+
+        for (c = 0; c < k; c++) {
+            t = next[s * k + c];
+
+            if (t == 0) {
+                next[s * k + c] = next[f * k + c];
+                continue;
+            }
+
+            fail[t] = next[f * k + c];
+            queue[tail++] = t;
+        }
     }
-}
 
+    /* the bytes which start a match, for the prefilter */
 
-static ngx_int_t
-ngx_http_sub_cmp_matches(const void *one, const void *two)
-{
-    ngx_int_t              c1, c2;
-    ngx_http_sub_match_t  *first, *second;
+    j = 0;
 
-    first = (ngx_http_sub_match_t *) one;
-    second = (ngx_http_sub_match_t *) two;
+    for (c = 0; c < 256; c++) {
+        if (next[tables->classes[c]] == 0) {
+            continue;
+        }
+
+        tables->first[c] = 1;
+
+        if (j < NGX_HTTP_SUB_PREFILTER) {
+            tables->bytes[j] = (u_char) c;
+        }
+
+        j++;
+    }
 
-    c1 = first->match.data[ngx_http_sub_cmp_index];
-    c2 = second->match.data[ngx_http_sub_cmp_index];
+    tables->nbytes = (j <= NGX_HTTP_SUB_PREFILTER) ? j : 0;
 
-    return c1 - c2;
+    return tables;
 }
 
 
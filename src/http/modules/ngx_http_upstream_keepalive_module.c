@@ -10,18 +10,36 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_LIFO  0
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_FIFO  1
+
+
 typedef struct {
     ngx_uint_t                         max_cached;
     ngx_uint_t                         requests;
     ngx_msec_t                         time;
     ngx_msec_t                         timeout;
+    ngx_uint_t                         policy;
+    ngx_uint_t                         min_idle;
 
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
+    ngx_queue_t                        warm;
+
+    ngx_http_upstream_srv_conf_t      *upstream;
+    ngx_http_upstream_conf_t          *upstream_conf;
+    ngx_event_t                        warm_event;
+
+#if (NGX_HTTP_SSL)
+    ngx_str_t                          ssl_name;
+#endif
 
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
+    unsigned                           learned:1;
+    unsigned                           ssl:1;
+
 } ngx_http_upstream_keepalive_srv_conf_t;
 
 
@@ -66,6 +84,26 @@ static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
 
+static void ngx_http_upstream_keepalive_learn(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, ngx_http_upstream_t *u,
+    ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_warm_timer(ngx_event_t *ev);
+static void ngx_http_upstream_keepalive_warm(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf);
+static ngx_uint_t ngx_http_upstream_keepalive_count(ngx_queue_t *queue,
+    ngx_http_upstream_rr_peer_t *peer);
+static ngx_int_t ngx_http_upstream_keepalive_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_keepalive_connect_handler(ngx_event_t *ev);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_upstream_keepalive_ssl_init(ngx_connection_t *c,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_keepalive_ssl_handshake(ngx_connection_t *c);
+#endif
+static void ngx_http_upstream_keepalive_warm_done(ngx_connection_t *c);
+static void ngx_http_upstream_keepalive_warm_failed(ngx_connection_t *c);
+
 #if (NGX_HTTP_SSL)
 static ngx_int_t ngx_http_upstream_keepalive_set_session(
     ngx_peer_connection_t *pc, void *data);
@@ -76,6 +114,14 @@ static void ngx_http_upstream_keepalive_save_session(ngx_peer_connection_t *pc,
 static void *ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static ngx_int_t ngx_http_upstream_keepalive_init_worker(ngx_cycle_t *cycle);
+
+
+static ngx_conf_enum_t  ngx_http_upstream_keepalive_policy[] = {
+    { ngx_string("lifo"), NGX_HTTP_UPSTREAM_KEEPALIVE_LIFO },
+    { ngx_string("fifo"), NGX_HTTP_UPSTREAM_KEEPALIVE_FIFO },
+    { ngx_null_string, 0 }
+};
 
 
 static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
@@ -108,6 +154,20 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
       NULL },
 
+    { ngx_string("keepalive_policy"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, policy),
+      &ngx_http_upstream_keepalive_policy },
+
+    { ngx_string("keepalive_min_idle"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, min_idle),
+      NULL },
+
       ngx_null_command
 };
 
@@ -134,7 +194,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_worker, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -160,6 +220,8 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
     ngx_conf_init_msec_value(kcf->time, 3600000);
     ngx_conf_init_msec_value(kcf->timeout, 60000);
     ngx_conf_init_uint_value(kcf->requests, 1000);
+    ngx_conf_init_uint_value(kcf->policy, NGX_HTTP_UPSTREAM_KEEPALIVE_LIFO);
+    ngx_conf_init_uint_value(kcf->min_idle, 0);
 
     if (kcf->original_init_upstream(cf, us) != NGX_OK) {
         return NGX_ERROR;
@@ -179,6 +241,9 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     ngx_queue_init(&kcf->cache);
     ngx_queue_init(&kcf->free);
+    ngx_queue_init(&kcf->warm);
+
+    kcf->upstream = us;
 
     for (i = 0; i < kcf->max_cached; i++) {
         ngx_queue_insert_head(&kcf->free, &cached[i].queue);
@@ -239,6 +304,7 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
     ngx_http_upstream_keepalive_cache_t      *item;
 
     ngx_int_t          rc;
+    ngx_uint_t         fifo;
     ngx_queue_t       *q, *cache;
     ngx_connection_t  *c;
 
@@ -253,13 +319,18 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         return rc;
     }
 
-    /* search cache for suitable connection */
+    /*
+     * search cache for suitable connection: the most recently used
+     * one with the "lifo" policy, or the least recently used one
+     * with the "fifo" policy
+     */
 
     cache = &kp->conf->cache;
+    fifo = (kp->conf->policy == NGX_HTTP_UPSTREAM_KEEPALIVE_FIFO);
 
-    for (q = ngx_queue_head(cache);
+    for (q = fifo ? ngx_queue_last(cache) : ngx_queue_head(cache);
          q != ngx_queue_sentinel(cache);
-         q = ngx_queue_next(q))
+         q = fifo ? ngx_queue_prev(q) : ngx_queue_next(q))
     {
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
         c = item->connection;
@@ -358,6 +429,10 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
+    if (kp->conf->min_idle && !kp->conf->learned) {
+        ngx_http_upstream_keepalive_learn(kp->conf, u, c);
+    }
+
     if (ngx_queue_empty(&kp->conf->free)) {
 
         q = ngx_queue_last(&kp->conf->cache);
@@ -437,6 +512,30 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
         goto close;
     }
 
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+
+        /*
+         * post-handshake messages, notably TLSv1.3 session tickets
+         * sent after the handshake of a pre-warmed connection, are
+         * processed, anything else means the connection is unusable
+         */
+
+        if (c->recv(c, (u_char *) buf, 1) == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+                goto close;
+            }
+
+            return;
+        }
+
+        goto close;
+    }
+
+#endif
+
     n = recv(c->fd, buf, 1, MSG_PEEK);
 
     if (n == -1 && ngx_socket_errno == NGX_EAGAIN) {
@@ -484,6 +583,461 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+static void
+ngx_http_upstream_keepalive_learn(ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_t *u, ngx_connection_t *c)
+{
+#if (NGX_HTTP_SSL)
+    u_char  *p;
+#endif
+
+    /*
+     * connections are pre-warmed with the parameters of the first
+     * connection cached, as they are defined by the module which
+     * uses the upstream
+     */
+
+    kcf->learned = 1;
+
+    if (c->pool->cleanup) {
+
+        /* protocol state is kept with the connection, as with gRPC */
+
+        return;
+    }
+
+    if (u->conf->local) {
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+
+        if (u->conf->ssl_certificate
+            && u->conf->ssl_certificate->value.len
+            && (u->conf->ssl_certificate->lengths
+                || u->conf->ssl_certificate_key->lengths))
+        {
+            return;
+        }
+
+        p = ngx_alloc(u->ssl_name.len + 1, ngx_cycle->log);
+        if (p == NULL) {
+            return;
+        }
+
+        (void) ngx_cpystrn(p, u->ssl_name.data, u->ssl_name.len + 1);
+
+        kcf->ssl_name.len = u->ssl_name.len;
+        kcf->ssl_name.data = p;
+
+        kcf->ssl = 1;
+    }
+
+#endif
+
+    kcf->upstream_conf = u->conf;
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_timer(ngx_event_t *ev)
+{
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    kcf = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    if (kcf->upstream_conf) {
+        ngx_http_upstream_keepalive_warm(kcf);
+    }
+
+    ngx_add_timer(ev, 1000);
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm(ngx_http_upstream_keepalive_srv_conf_t *kcf)
+{
+    time_t                         now;
+    ngx_uint_t                     n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *peers;
+
+    now = ngx_time();
+
+    peers = kcf->upstream->peer.data;
+
+    ngx_http_upstream_rr_peers_rlock(peers);
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->down || peer->unhealthy) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && now - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        n = ngx_http_upstream_keepalive_count(&kcf->cache, peer)
+            + ngx_http_upstream_keepalive_count(&kcf->warm, peer);
+
+        while (n < kcf->min_idle && !ngx_queue_empty(&kcf->free)) {
+
+            if (ngx_http_upstream_keepalive_connect(kcf, peers, peer)
+                != NGX_OK)
+            {
+                break;
+            }
+
+            n++;
+        }
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_keepalive_count(ngx_queue_t *queue,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_uint_t                            n;
+    ngx_queue_t                          *q;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    n = 0;
+
+    for (q = ngx_queue_head(queue);
+         q != ngx_queue_sentinel(queue);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) peer->sockaddr,
+                         item->socklen, peer->socklen)
+            == 0)
+        {
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t                             rc;
+    ngx_queue_t                          *q;
+    ngx_connection_t                     *c;
+    ngx_peer_connection_t                 pc;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "keepalive warm connection to %V", &peer->name);
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = peer->sockaddr;
+    pc.socklen = peer->socklen;
+    pc.name = &peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_ERR;
+    pc.so_keepalive = kcf->upstream_conf->socket_keepalive;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        return NGX_ERROR;
+    }
+
+    c = pc.connection;
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+    ngx_queue_insert_head(&kcf->warm, q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->connection = c;
+    item->socklen = peer->socklen;
+    ngx_memcpy(&item->sockaddr, peer->sockaddr, peer->socklen);
+
+    /* connections being established are closed on graceful shutdown */
+
+    c->data = item;
+    c->idle = 1;
+
+    c->read->handler = ngx_http_upstream_keepalive_connect_handler;
+    c->write->handler = ngx_http_upstream_keepalive_connect_handler;
+
+#if (NGX_HTTP_SSL)
+
+    /* a saved session, if any, is set while the peer is known to exist */
+
+    if (kcf->ssl && ngx_http_upstream_keepalive_ssl_init(c, peers, peer)
+                    != NGX_OK)
+    {
+        ngx_http_upstream_keepalive_warm_failed(c);
+        return NGX_ERROR;
+    }
+
+#endif
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, kcf->upstream_conf->connect_timeout);
+        return NGX_OK;
+    }
+
+    ngx_http_upstream_keepalive_connect_handler(c->write);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_connect_handler(ngx_event_t *ev)
+{
+    int                                   err;
+    socklen_t                             len;
+    ngx_connection_t                     *c;
+#if (NGX_HTTP_SSL)
+    ngx_http_upstream_keepalive_cache_t  *item;
+#endif
+
+    c = ev->data;
+
+    if (c->close || ev->timedout) {
+        ngx_http_upstream_keepalive_warm_failed(c);
+        return;
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        ngx_http_upstream_keepalive_warm_failed(c);
+        return;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        item = c->data;
+
+        c->read->handler = ngx_http_upstream_keepalive_dummy_handler;
+        c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
+
+        if (ngx_ssl_handshake(c) == NGX_AGAIN) {
+            ngx_add_timer(c->write, item->conf->upstream_conf->connect_timeout);
+            c->ssl->handler = ngx_http_upstream_keepalive_ssl_handshake;
+            return;
+        }
+
+        ngx_http_upstream_keepalive_ssl_handshake(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_upstream_keepalive_warm_done(c);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_upstream_keepalive_ssl_init(ngx_connection_t *c,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_str_t                               *name;
+    ngx_peer_connection_t                    pc;
+    ngx_http_upstream_conf_t                *conf;
+    ngx_http_upstream_rr_peer_data_t         rrp;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+    conf = kcf->upstream_conf;
+
+    if (ngx_ssl_create_connection(conf->ssl, c, NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    name = &kcf->ssl_name;
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+    if (conf->ssl_server_name
+        && name->len
+        && name->data[0] != '['
+        && ngx_inet_addr(name->data, name->len) == INADDR_NONE)
+    {
+        if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) name->data)
+            == 0)
+        {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_tlsext_host_name(\"%s\") failed",
+                          name->data);
+            return NGX_ERROR;
+        }
+    }
+
+#endif
+
+    if (conf->ssl_session_reuse) {
+        ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+        ngx_memzero(&rrp, sizeof(ngx_http_upstream_rr_peer_data_t));
+
+        pc.connection = c;
+        pc.log = c->log;
+
+        rrp.peers = peers;
+        rrp.current = peer;
+
+        if (ngx_http_upstream_set_round_robin_peer_session(&pc, &rrp)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_ssl_handshake(ngx_connection_t *c)
+{
+    long                                     rc;
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+
+    if (!c->ssl->handshaked) {
+        ngx_http_upstream_keepalive_warm_failed(c);
+        return;
+    }
+
+    if (kcf->upstream_conf->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_upstream_keepalive_warm_failed(c);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &kcf->ssl_name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &kcf->ssl_name);
+            ngx_http_upstream_keepalive_warm_failed(c);
+            return;
+        }
+    }
+
+    if (!c->ssl->sendfile) {
+        c->sendfile = 0;
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    ngx_http_upstream_keepalive_warm_done(c);
+}
+
+#endif
+
+
+static void
+ngx_http_upstream_keepalive_warm_done(ngx_connection_t *c)
+{
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive warm connection %p established", c);
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_upstream_keepalive_warm_failed(c);
+        return;
+    }
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&kcf->cache, &item->queue);
+
+    ngx_add_timer(c->read, kcf->timeout);
+
+    c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
+    c->read->handler = ngx_http_upstream_keepalive_close_handler;
+
+    if (c->read->ready) {
+        ngx_http_upstream_keepalive_close_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_upstream_keepalive_warm_failed(ngx_connection_t *c)
+{
+    ngx_http_upstream_keepalive_cache_t     *item;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    item = c->data;
+    kcf = item->conf;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive warm connection %p failed", c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&kcf->free, &item->queue);
+
+    ngx_http_upstream_keepalive_close(c);
+}
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -524,11 +1078,18 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      *     conf->max_cached = 0;
+     *     conf->upstream = NULL;
+     *     conf->upstream_conf = NULL;
+     *     conf->ssl_name = { 0, NULL };
+     *     conf->learned = 0;
+     *     conf->ssl = 0;
      */
 
     conf->time = NGX_CONF_UNSET_MSEC;
     conf->timeout = NGX_CONF_UNSET_MSEC;
     conf->requests = NGX_CONF_UNSET_UINT;
+    conf->policy = NGX_CONF_UNSET_UINT;
+    conf->min_idle = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
@@ -574,3 +1135,51 @@ ngx_http_upstream_keepalive(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     return NGX_CONF_OK;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_http_upstream_srv_conf_t            *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscf,
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->max_cached == 0 || kcf->min_idle == 0) {
+            continue;
+        }
+
+        kcf->warm_event.handler = ngx_http_upstream_keepalive_warm_timer;
+        kcf->warm_event.data = kcf;
+        kcf->warm_event.log = cycle->log;
+        kcf->warm_event.cancelable = 1;
+
+        ngx_add_timer(&kcf->warm_event, 1);
+    }
+
+    return NGX_OK;
+}
@@ -10,6 +10,16 @@
 #include <ngx_http.h>
 
 
+typedef struct {
+    ngx_event_t                     event;
+    ngx_http_upstream_srv_conf_t   *upstream;
+    ngx_http_upstream_server_t     *server;
+    ngx_uint_t                      index;
+} ngx_http_upstream_zone_host_t;
+
+
+static char *ngx_http_upstream_zone_init_main_conf(ngx_conf_t *cf,
+    void *conf);
 static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
@@ -18,6 +28,16 @@ static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
     ngx_slab_pool_t *shpool, ngx_http_upstream_srv_conf_t *uscf);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_copy_peer(
     ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_rr_peer_t *src);
+static ngx_int_t ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle);
+static ngx_int_t ngx_http_upstream_zone_init_resolve(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *event);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static void ngx_http_upstream_zone_update_peers(
+    ngx_http_upstream_zone_host_t *host, ngx_resolver_ctx_t *ctx);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_find_peer(
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t index,
+    struct sockaddr *sockaddr, socklen_t socklen);
 
 
 static ngx_command_t  ngx_http_upstream_zone_commands[] = {
@@ -38,7 +58,7 @@ static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
     NULL,                                  /* postconfiguration */
 
     NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_upstream_zone_init_main_conf, /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -55,7 +75,7 @@ ngx_module_t  ngx_http_upstream_zone_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_zone_init_worker,    /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -64,6 +84,78 @@ ngx_module_t  ngx_http_upstream_zone_module = {
 };
 
 
+static char *
+ngx_http_upstream_zone_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                      i, j;
+    ngx_addr_t                      addr;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->servers == NULL) {
+            continue;
+        }
+
+        server = uscf->servers->elts;
+
+        for (j = 0; j < uscf->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            /* addresses are never re-resolved */
+
+            if (server[j].addrs[0].sockaddr->sa_family == AF_UNIX
+                || ngx_parse_addr_port(cf->pool, &addr, server[j].host.data,
+                                       server[j].host.len)
+                   == NGX_OK)
+            {
+                server[j].resolve = 0;
+                continue;
+            }
+
+            if (uscf->shm_zone == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "resolving names at run time requires "
+                              "upstream \"%V\" in %s:%ui "
+                              "to be in shared memory",
+                              &uscf->host, uscf->file_name, uscf->line);
+                return NGX_CONF_ERROR;
+            }
+
+            if (clcf->resolver == NULL
+                || clcf->resolver->connections.nelts == 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "no resolver defined to resolve %V "
+                              "in upstream \"%V\" in %s:%ui",
+                              &server[j].host, &uscf->host,
+                              uscf->file_name, uscf->line);
+                return NGX_CONF_ERROR;
+            }
+
+            uscf->resolver = clcf->resolver;
+            uscf->resolver_timeout =
+                              clcf->resolver_timeout == NGX_CONF_UNSET_MSEC
+                              ? 30000 : clcf->resolver_timeout;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
 static char *
 ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
@@ -188,9 +280,15 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     ngx_http_upstream_srv_conf_t *uscf)
 {
     ngx_str_t                     *name;
+    ngx_uint_t                    *config;
     ngx_http_upstream_rr_peer_t   *peer, **peerp;
     ngx_http_upstream_rr_peers_t  *peers, *backup;
 
+    config = ngx_slab_calloc(shpool, sizeof(ngx_uint_t));
+    if (config == NULL) {
+        return NULL;
+    }
+
     peers = ngx_slab_alloc(shpool, sizeof(ngx_http_upstream_rr_peers_t));
     if (peers == NULL) {
         return NULL;
@@ -214,6 +312,7 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     peers->name = name;
 
     peers->shpool = shpool;
+    peers->config = config;
 
     for (peerp = &peers->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
@@ -239,6 +338,7 @@ ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
     backup->name = name;
 
     backup->shpool = shpool;
+    backup->config = config;
 
     for (peerp = &backup->peer; *peerp; peerp = &peer->next) {
         /* pool is unlocked */
@@ -323,3 +423,487 @@ failed:
 
     return NULL;
 }
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_int_t                      *weights;
+    ngx_uint_t                      i;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_upstream_rr_peers_t   *peers;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        /*
+         * current weights of the round-robin balancer are kept
+         * separately for each worker process, to avoid exclusive
+         * locking of peers on selection; the first worker process
+         * allocates them for all
+         */
+
+        shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+        ngx_shmtx_lock(&shpool->mutex);
+
+        for (peers = uscf->peer.data; peers; peers = peers->next) {
+
+            if (peers->worker_weights) {
+                continue;
+            }
+
+            weights = ngx_event_peer_alloc_weights(shpool, peers->number);
+            if (weights == NULL) {
+                break;
+            }
+
+            ngx_memory_barrier();
+
+            peers->worker_weights = weights;
+        }
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        /* names are re-resolved by the first worker process */
+
+        if (uscf->resolver && ngx_worker == 0) {
+            if (ngx_http_upstream_zone_init_resolve(cycle, uscf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_resolve(ngx_cycle_t *cycle,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_zone_host_t  *host;
+
+    server = uscf->servers->elts;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+
+        if (!server[i].resolve) {
+            continue;
+        }
+
+        host = ngx_pcalloc(cycle->pool, sizeof(ngx_http_upstream_zone_host_t));
+        if (host == NULL) {
+            return NGX_ERROR;
+        }
+
+        host->upstream = uscf;
+        host->server = &server[i];
+        host->index = i + 1;
+
+        host->event.handler = ngx_http_upstream_zone_resolve_timer;
+        host->event.data = host;
+        host->event.log = cycle->log;
+        host->event.cancelable = 1;
+
+        ngx_add_timer(&host->event, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *event)
+{
+    ngx_resolver_ctx_t             *ctx, temp;
+    ngx_http_upstream_zone_host_t  *host;
+
+    host = event->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    temp.name = host->server->host;
+
+    ctx = ngx_resolve_start(host->upstream->resolver, &temp);
+
+    if (ctx == NULL) {
+        goto retry;
+    }
+
+    if (ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ERR, event->log, 0,
+                      "no resolver defined to resolve %V", &temp.name);
+        return;
+    }
+
+    ctx->name = host->server->host;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = host;
+    ctx->timeout = host->upstream->resolver_timeout;
+    ctx->cancelable = 1;
+
+    if (ngx_resolve_name(ctx) == NGX_OK) {
+        return;
+    }
+
+retry:
+
+    ngx_add_timer(event, 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                          valid;
+    ngx_http_upstream_zone_host_t  *host;
+
+    host = ctx->data;
+
+    if (ctx->state) {
+        ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                      "upstream \"%V\": %V could not be resolved (%i: %s)",
+                      &host->upstream->host, &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+    } else {
+        ngx_http_upstream_zone_update_peers(host, ctx);
+    }
+
+    /* the name is resolved again as soon as the cached answer expires */
+
+    valid = ctx->valid - ngx_time();
+
+    if (valid < 1) {
+        valid = 1;
+    }
+
+    ngx_resolve_name_done(ctx);
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(&host->event, (ngx_msec_t) valid * 1000);
+}
+
+
+static void
+ngx_http_upstream_zone_update_peers(ngx_http_upstream_zone_host_t *host,
+    ngx_resolver_ctx_t *ctx)
+{
+    u_char                          text[NGX_SOCKADDR_STRLEN];
+    ngx_int_t                      *weights;
+    ngx_uint_t                      i, j, n, changed;
+    ngx_sockaddr_t                  sockaddr;
+    ngx_slab_pool_t                *shpool;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_rr_peer_t    *peer, **peerp, *added, tmpl;
+    ngx_http_upstream_rr_peers_t   *peers;
+
+    server = host->server;
+
+    peers = host->upstream->peer.data;
+
+    if (server->backup) {
+        peers = peers->next;
+    }
+
+    shpool = peers->shpool;
+
+    for (i = 0; i < ctx->naddrs; i++) {
+        ngx_inet_set_port(ctx->addrs[i].sockaddr, server->port);
+    }
+
+    ngx_http_upstream_rr_peers_wlock(peers);
+
+    /* count peers which are kept, and see if anything is changed */
+
+    n = 0;
+    changed = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->host != host->index) {
+            n++;
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 ctx->addrs[i].sockaddr,
+                                 ctx->addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i == ctx->naddrs) {
+            changed = 1;
+            continue;
+        }
+
+        n++;
+    }
+
+    /* allocate peers for new addresses */
+
+    added = NULL;
+
+    for (i = 0; i < ctx->naddrs; i++) {
+
+        if (ngx_http_upstream_zone_find_peer(peers, host->index,
+                                             ctx->addrs[i].sockaddr,
+                                             ctx->addrs[i].socklen))
+        {
+            continue;
+        }
+
+        for (j = 0; j < i; j++) {
+            if (ngx_cmp_sockaddr(ctx->addrs[j].sockaddr,
+                                 ctx->addrs[j].socklen,
+                                 ctx->addrs[i].sockaddr,
+                                 ctx->addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (j < i) {
+            continue;
+        }
+
+        ngx_memzero(&tmpl, sizeof(ngx_http_upstream_rr_peer_t));
+
+        ngx_memcpy(&sockaddr, ctx->addrs[i].sockaddr, ctx->addrs[i].socklen);
+
+        tmpl.sockaddr = &sockaddr.sockaddr;
+        tmpl.socklen = ctx->addrs[i].socklen;
+        tmpl.name.data = text;
+        tmpl.name.len = ngx_sock_ntop(tmpl.sockaddr, tmpl.socklen, text,
+                                      NGX_SOCKADDR_STRLEN, 1);
+        tmpl.server = server->name;
+        tmpl.weight = server->weight;
+        tmpl.effective_weight = server->weight;
+        tmpl.max_conns = server->max_conns;
+        tmpl.max_fails = server->max_fails;
+        tmpl.fail_timeout = server->fail_timeout;
+        tmpl.down = server->down;
+        tmpl.host = host->index;
+
+        ngx_shmtx_lock(&shpool->mutex);
+        peer = ngx_http_upstream_zone_copy_peer(peers, &tmpl);
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        if (peer == NULL) {
+            goto failed;
+        }
+
+        peer->next = added;
+        added = peer;
+
+        changed = 1;
+        n++;
+    }
+
+    if (!changed) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        return;
+    }
+
+    /* per-worker current weights are reset, as peers are renumbered */
+
+    weights = NULL;
+
+    if (peers->worker_weights) {
+        ngx_shmtx_lock(&shpool->mutex);
+        weights = ngx_event_peer_alloc_weights(shpool, n);
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        if (weights == NULL) {
+            goto failed;
+        }
+    }
+
+    /* remove peers of the server with addresses no longer present */
+
+    for (peerp = &peers->peer; *peerp; /* void */) {
+        peer = *peerp;
+
+        if (peer->host != host->index) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        for (i = 0; i < ctx->naddrs; i++) {
+            if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                                 ctx->addrs[i].sockaddr,
+                                 ctx->addrs[i].socklen, 1)
+                == NGX_OK)
+            {
+                break;
+            }
+        }
+
+        if (i < ctx->naddrs) {
+            peerp = &peer->next;
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream \"%V\": server %V removed, address %V",
+                      &host->upstream->host, &server->name, &peer->name);
+
+        *peerp = peer->next;
+
+        peers->number--;
+        peers->total_weight -= peer->weight;
+
+        if (!peer->down) {
+            peers->tries--;
+        }
+
+        /* peers still in use are freed when released */
+
+        if (peer->conns) {
+            peer->zombie = 1;
+
+        } else {
+            ngx_http_upstream_zone_free_peer(peers, peer);
+        }
+    }
+
+    /* add new peers to the end of the list */
+
+    while (added) {
+        peer = added;
+        added = peer->next;
+
+        ngx_log_error(NGX_LOG_NOTICE, host->event.log, 0,
+                      "upstream \"%V\": server %V added, address %V",
+                      &host->upstream->host, &server->name, &peer->name);
+
+        peer->next = NULL;
+        *peerp = peer;
+        peerp = &peer->next;
+
+        peers->number++;
+        peers->total_weight += peer->weight;
+
+        if (!peer->down) {
+            peers->tries++;
+        }
+    }
+
+    peers->weighted = (peers->total_weight != peers->number);
+
+    if (peers == host->upstream->peer.data) {
+        peers->single = (peers->number == 1 && peers->next == NULL);
+    }
+
+    if (weights) {
+        ngx_slab_free(shpool, peers->worker_weights);
+        peers->worker_weights = weights;
+    }
+
+    (*peers->config)++;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    return;
+
+failed:
+
+    ngx_log_error(NGX_LOG_ERR, host->event.log, 0,
+                  "upstream \"%V\": could not update server %V%s",
+                  &host->upstream->host, &server->name, shpool->log_ctx);
+
+    while (added) {
+        peer = added;
+        added = peer->next;
+
+        ngx_http_upstream_zone_free_peer(peers, peer);
+    }
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_zone_find_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t index, struct sockaddr *sockaddr, socklen_t socklen)
+{
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+
+        if (peer->host != index) {
+            continue;
+        }
+
+        if (ngx_cmp_sockaddr(peer->sockaddr, peer->socklen,
+                             sockaddr, socklen, 1)
+            == NGX_OK)
+        {
+            return peer;
+        }
+    }
+
+    return NULL;
+}
+
+
+void
+ngx_http_upstream_zone_free_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_slab_pool_t  *pool;
+
+    pool = peers->shpool;
+
+    ngx_shmtx_lock(&pool->mutex);
+
+    if (peer->server.data) {
+        ngx_slab_free_locked(pool, peer->server.data);
+    }
+
+    ngx_slab_free_locked(pool, peer->name.data);
+    ngx_slab_free_locked(pool, peer->sockaddr);
+
+#if (NGX_HTTP_SSL)
+    if (peer->ssl_session) {
+        ngx_slab_free_locked(pool, peer->ssl_session);
+    }
+#endif
+
+    ngx_slab_free_locked(pool, peer);
+
+    ngx_shmtx_unlock(&pool->mutex);
+}
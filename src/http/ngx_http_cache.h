@@ -29,6 +29,16 @@
 
 #define NGX_HTTP_CACHE_VERSION       5
 
+#define NGX_HTTP_CACHE_INDEX_VERSION 1
+#define NGX_HTTP_CACHE_INDEX_BATCH   1000
+
+#define NGX_HTTP_CACHE_RAM_DEPTH     4
+#define NGX_HTTP_CACHE_RAM_MAX_FREQ  15
+#define NGX_HTTP_CACHE_RAM_EVICT     8
+
+#define NGX_HTTP_CACHE_EVICTION_LRU  0
+#define NGX_HTTP_CACHE_EVICTION_SLRU 1
+
 
 typedef struct {
     ngx_uint_t                       status;
@@ -36,6 +46,14 @@ typedef struct {
 } ngx_http_cache_valid_t;
 
 
+typedef struct {
+    ngx_file_uniq_t                  uniq;
+    off_t                            size;
+    size_t                           len;
+    u_char                           name[1];
+} ngx_http_file_cache_fill_t;
+
+
 typedef struct {
     ngx_rbtree_node_t                node;
     ngx_queue_t                      queue;
@@ -51,7 +69,9 @@ typedef struct {
     unsigned                         updating:1;
     unsigned                         deleting:1;
     unsigned                         purged:1;
-                                     /* 10 unused bits */
+    unsigned                         waiting:1;
+    unsigned                         promoted:1;
+    unsigned                         fill_gen:8;
 
     ngx_file_uniq_t                  uniq;
     time_t                           expire;
@@ -59,6 +79,7 @@ typedef struct {
     size_t                           body_start;
     off_t                            fs_size;
     ngx_msec_t                       lock_time;
+    ngx_http_file_cache_fill_t      *fill;
 } ngx_http_file_cache_node_t;
 
 
@@ -95,6 +116,9 @@ struct ngx_http_cache_s {
 
     ngx_http_file_cache_t           *file_cache;
     ngx_http_file_cache_node_t      *node;
+    ngx_http_file_cache_fill_t      *fill;
+    ngx_buf_t                       *fill_buf;
+    ngx_uint_t                       fill_gen;
 
 #if (NGX_THREADS || NGX_COMPAT)
     ngx_thread_task_t               *thread_task;
@@ -106,9 +130,12 @@ struct ngx_http_cache_s {
     ngx_msec_t                       wait_time;
 
     ngx_event_t                      wait_event;
+    ngx_queue_t                      wait_queue;
 
     unsigned                         lock:1;
+    unsigned                         lock_stream:1;
     unsigned                         waiting:1;
+    unsigned                         filling:1;
 
     unsigned                         updated:1;
     unsigned                         updating:1;
@@ -122,6 +149,8 @@ struct ngx_http_cache_s {
 
     unsigned                         stale_updating:1;
     unsigned                         stale_error:1;
+
+    unsigned                         ram:1;
 };
 
 
@@ -144,18 +173,71 @@ typedef struct {
 } ngx_http_file_cache_header_t;
 
 
+typedef struct {
+    ngx_uint_t                       version;
+    time_t                           time;
+    size_t                           bsize;
+    ngx_uint_t                       count;
+    u_char                           level[NGX_MAX_PATH_LEVEL];
+} ngx_http_file_cache_index_header_t;
+
+
+typedef struct {
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
+    ngx_file_uniq_t                  uniq;
+    time_t                           expire;
+    off_t                            fs_size;
+    uint32_t                         body_start;
+    u_short                          uses;
+} ngx_http_file_cache_index_entry_t;
+
+
 typedef struct {
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_queue_t                      queue;
+    ngx_queue_t                      promoted;
     ngx_atomic_t                     cold;
     ngx_atomic_t                     loading;
     off_t                            size;
+    off_t                            promoted_size;
     ngx_uint_t                       count;
     ngx_uint_t                       watermark;
+    time_t                           index_time;
+
+    ngx_atomic_t                     hits;
+    ngx_atomic_t                     misses;
+    ngx_atomic_t                     evictions;
 } ngx_http_file_cache_sh_t;
 
 
+typedef struct {
+    ngx_rbtree_node_t                node;
+    ngx_queue_t                      queue;
+
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN
+                                         - sizeof(ngx_rbtree_key_t)];
+
+    ngx_file_uniq_t                  uniq;
+    size_t                           len;
+    u_char                           data[1];
+} ngx_http_file_cache_ram_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                     rbtree;
+    ngx_rbtree_node_t                sentinel;
+    ngx_queue_t                      queue;
+    size_t                           size;
+    ngx_uint_t                       count;
+
+    /* count-min sketch of access frequencies */
+    ngx_uint_t                       width;
+    ngx_uint_t                       samples;
+    u_char                          *sketch;
+} ngx_http_file_cache_ram_sh_t;
+
+
 struct ngx_http_file_cache_s {
     ngx_http_file_cache_sh_t        *sh;
     ngx_slab_pool_t                 *shpool;
@@ -184,6 +266,17 @@ struct ngx_http_file_cache_s {
 
     ngx_uint_t                       use_temp_path;
                                      /* unsigned use_temp_path:1 */
+
+    ngx_uint_t                       index;
+                                     /* unsigned index:1 */
+    ngx_uint_t                       eviction;
+    time_t                           index_interval;
+    time_t                           index_time;
+
+    ngx_http_file_cache_ram_sh_t    *ram;
+    ngx_slab_pool_t                 *ram_shpool;
+    ngx_shm_zone_t                  *ram_zone;
+    size_t                           ram_max_size;
 };
 
 
@@ -193,6 +286,7 @@ void ngx_http_file_cache_create_key(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_open(ngx_http_request_t *r);
 ngx_int_t ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf);
 void ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf);
+void ngx_http_file_cache_progress(ngx_http_request_t *r, ngx_temp_file_t *tf);
 void ngx_http_file_cache_update_header(ngx_http_request_t *r);
 ngx_int_t ngx_http_cache_send(ngx_http_request_t *);
 void ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf);
@@ -180,6 +180,26 @@ static ngx_str_t  ngx_http_gzip_private = ngx_string("private");
 #endif
 
 
+/*
+ * Values of these response headers are expected to change from response
+ * to response, so adding them to an HPACK or QPACK dynamic table only
+ * pushes out entries that could be reused.
+ */
+
+static ngx_str_t  ngx_http_core_volatile_headers[] = {
+    ngx_string("date"),
+    ngx_string("content-length"),
+    ngx_string("content-range"),
+    ngx_string("last-modified"),
+    ngx_string("etag"),
+    ngx_string("expires"),
+    ngx_string("age"),
+    ngx_string("location"),
+    ngx_string("set-cookie"),
+    ngx_null_string
+};
+
+
 static ngx_command_t  ngx_http_core_commands[] = {
 
     { ngx_string("variables_hash_max_size"),
@@ -2918,6 +2938,23 @@ ngx_http_link_multi_headers(ngx_http_request_t *r)
 }
 
 
+ngx_uint_t
+ngx_http_volatile_header(ngx_str_t *name)
+{
+    ngx_str_t  *h;
+
+    for (h = ngx_http_core_volatile_headers; h->len; h++) {
+        if (h->len == name->len
+            && ngx_strncasecmp(h->data, name->data, name->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
 static char *
 ngx_http_core_server(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
 {
@@ -4082,6 +4119,22 @@ ngx_http_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         }
 #endif
 
+        if (ngx_strncmp(value[n].data, "batch=", 6) == 0) {
+            lsopt.batch = ngx_atoi(value[n].data + 6, value[n].len - 6);
+            lsopt.set = 1;
+            lsopt.bind = 1;
+
+            if (lsopt.batch == NGX_ERROR || lsopt.batch == 0
+                || lsopt.batch > NGX_UDP_MAX_BATCH)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid batch \"%V\"", &value[n]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[n].data, "backlog=", 8) == 0) {
             lsopt.backlog = ngx_atoi(value[n].data + 8, value[n].len - 8);
             lsopt.set = 1;
@@ -4403,6 +4456,9 @@ ngx_http_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         if (lsopt.proxy_protocol) {
             return "\"proxy_protocol\" parameter is incompatible with \"quic\"";
         }
+
+    } else if (lsopt.batch) {
+        return "\"batch\" parameter requires \"quic\"";
     }
 
     for (n = 0; n < u.naddrs; n++) {
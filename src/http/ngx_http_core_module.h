@@ -88,6 +88,7 @@ typedef struct {
     int                        backlog;
     int                        rcvbuf;
     int                        sndbuf;
+    int                        batch;
     int                        type;
 #if (NGX_HAVE_SETFIB)
     int                        setfib;
@@ -546,6 +547,7 @@ ngx_int_t ngx_http_get_forwarded_addr(ngx_http_request_t *r, ngx_addr_t *addr,
     int recursive);
 
 ngx_int_t ngx_http_link_multi_headers(ngx_http_request_t *r);
+ngx_uint_t ngx_http_volatile_header(ngx_str_t *name);
 
 
 extern ngx_module_t  ngx_http_core_module;
@@ -16,6 +16,20 @@ static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_lock_wait(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_fill_open(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ngx_str_t *name, ngx_file_uniq_t uniq);
+static void ngx_http_file_cache_fill_send(ngx_http_request_t *r);
+static ngx_int_t ngx_http_file_cache_fill_reopen(ngx_http_request_t *r,
+    ngx_http_cache_t *c, ngx_file_uniq_t uniq);
+static void ngx_http_file_cache_fill_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_fill_write_handler(ngx_http_request_t *r);
+static void ngx_http_file_cache_fill_free(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_uint_t done);
+static void ngx_http_file_cache_wakeup(ngx_http_file_cache_node_t *fcn,
+    ngx_uint_t waiting, ngx_log_t *log);
+#if !(NGX_WIN32)
+static void ngx_http_file_cache_wakeup_handler(ngx_event_t *ev);
+#endif
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
@@ -45,10 +59,20 @@ static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
 static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_cleanup(void *data);
+static void ngx_http_file_cache_queue_insert(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t promote);
+static void ngx_http_file_cache_queue_remove(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn);
+static ngx_queue_t *ngx_http_file_cache_queue_last(
+    ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache);
 static time_t ngx_http_file_cache_expire(ngx_http_file_cache_t *cache);
 static void ngx_http_file_cache_delete(ngx_http_file_cache_t *cache,
     ngx_queue_t *q, u_char *name);
+static void ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache);
+static time_t ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache);
+static int ngx_libc_cdecl ngx_http_file_cache_index_cmp(const void *one,
+    const void *two);
 static void ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache);
 static ngx_int_t ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
@@ -64,6 +88,29 @@ static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
 static void ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache);
 
+static ngx_int_t ngx_http_file_cache_ram_init(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_int_t ngx_http_file_cache_ram_get(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_add(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c);
+static void ngx_http_file_cache_ram_delete(ngx_http_file_cache_t *cache,
+    u_char *key);
+static void ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_node_t *rn);
+static ngx_http_file_cache_ram_node_t *ngx_http_file_cache_ram_lookup(
+    ngx_http_file_cache_t *cache, u_char *key);
+static void ngx_http_file_cache_ram_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_uint_t ngx_http_file_cache_ram_frequency(
+    ngx_http_file_cache_ram_sh_t *ram, u_char *key, ngx_uint_t increment);
+
+
+/* requests waiting for cache locks in this process */
+
+static ngx_queue_t  ngx_http_file_cache_waiting;
+
 
 ngx_str_t  ngx_http_cache_status[] = {
     ngx_string("MISS"),
@@ -145,12 +192,19 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
                     ngx_http_file_cache_rbtree_insert_value);
 
     ngx_queue_init(&cache->sh->queue);
+    ngx_queue_init(&cache->sh->promoted);
 
     cache->sh->cold = 1;
     cache->sh->loading = 0;
     cache->sh->size = 0;
     cache->sh->count = 0;
+    cache->sh->promoted_size = 0;
     cache->sh->watermark = (ngx_uint_t) -1;
+    cache->sh->index_time = 0;
+
+    cache->sh->hits = 0;
+    cache->sh->misses = 0;
+    cache->sh->evictions = 0;
 
     cache->bsize = ngx_fs_bsize(cache->path->name.data);
 
@@ -345,6 +399,18 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         goto done;
     }
 
+    if (cache->ram && c->exists) {
+        rc = ngx_http_file_cache_ram_get(r, c);
+
+        if (rc == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        if (rc == NGX_ERROR) {
+            return rc;
+        }
+    }
+
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
     ngx_memzero(&of, sizeof(ngx_open_file_info_t));
@@ -406,6 +472,16 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         c->buf->end = c->buf->start + c->body_start;
         c->buf->temporary = 1;
 
+    } else if (cache->ram && c->length <= (off_t) cache->ram_max_size) {
+
+        /* small files are read as a whole to be kept in memory */
+
+        c->buf = ngx_create_temp_buf(r->pool,
+                                     ngx_max((size_t) c->length, c->body_start));
+        if (c->buf == NULL) {
+            return NGX_ERROR;
+        }
+
     } else {
         c->buf = ngx_create_temp_buf(r->pool, c->body_start);
         if (c->buf == NULL) {
@@ -428,17 +504,31 @@ done:
 static ngx_int_t
 ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_msec_t                 now, timer;
-    ngx_http_file_cache_t     *cache;
+    ngx_str_t                    name;
+    ngx_msec_t                   now, timer;
+    ngx_file_uniq_t              uniq;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_fill_t  *fill;
 
     if (!c->lock) {
         return NGX_DECLINED;
     }
 
+    if (ngx_http_file_cache_waiting.next == NULL) {
+        ngx_queue_init(&ngx_http_file_cache_waiting);
+
+#if !(NGX_WIN32)
+        ngx_wakeup_event.handler = ngx_http_file_cache_wakeup_handler;
+#endif
+    }
+
     now = ngx_current_msec;
 
     cache = c->file_cache;
 
+    name.len = 0;
+    uniq = 0;
+
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     timer = c->node->lock_time - now;
@@ -448,18 +538,51 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->node->lock_time = now + c->lock_age;
         c->updating = 1;
         c->lock_time = c->node->lock_time;
+
+    } else if (c->lock_stream && c->node->fill) {
+        fill = c->node->fill;
+
+        name.data = ngx_pnalloc(r->pool, fill->len + 1);
+
+        if (name.data) {
+            name.len = fill->len;
+            ngx_memcpy(name.data, fill->name, fill->len + 1);
+            uniq = fill->uniq;
+            c->fill_gen = c->node->fill_gen;
+        }
+
+        if (c->lock_timeout) {
+            c->node->waiting = 1;
+        }
+
+    } else if (c->lock_timeout) {
+        c->node->waiting = 1;
     }
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache lock u:%d wt:%M",
-                   c->updating, c->wait_time);
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache lock u:%d f:%d wt:%M",
+                   c->updating, name.len ? 1 : 0, c->wait_time);
 
     if (c->updating) {
         return NGX_DECLINED;
     }
 
+    if (name.len) {
+
+        /*
+         * the cache element is being filled, followers
+         * read the temp file while it is being written
+         */
+
+        if (ngx_http_file_cache_fill_open(r, c, &name, uniq) == NGX_OK) {
+            return ngx_http_file_cache_read(r, c);
+        }
+
+        /* the temp file is already gone, wait for the lock as usual */
+    }
+
     if (c->lock_timeout == 0) {
         return NGX_HTTP_CACHE_SCARCE;
     }
@@ -474,6 +597,13 @@ ngx_http_file_cache_lock(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->wait_event.log = r->connection->log;
     }
 
+    /*
+     * the waiting request is woken up as soon as the lock is released,
+     * periodic checks are only needed to handle expired locks
+     */
+
+    ngx_queue_insert_tail(&ngx_http_file_cache_waiting, &c->wait_queue);
+
     timer = c->wait_time - now;
 
     ngx_add_timer(&c->wait_event, (timer > 500) ? 500 : timer);
@@ -499,12 +629,18 @@ ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev)
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http file cache wait: \"%V?%V\"", &r->uri, &r->args);
 
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
     rc = ngx_http_file_cache_lock_wait(r, r->cache);
 
     if (rc == NGX_AGAIN) {
         return;
     }
 
+    ngx_queue_remove(&r->cache->wait_queue);
+
     r->cache->waiting = 0;
     r->main->blocked--;
 
@@ -548,7 +684,10 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     timer = c->node->lock_time - now;
 
-    if (c->node->updating && (ngx_msec_int_t) timer > 0) {
+    if (c->node->updating && (ngx_msec_int_t) timer > 0
+        && !(c->lock_stream && c->node->fill))
+    {
+        c->node->waiting = 1;
         wait = 1;
     }
 
@@ -563,6 +702,142 @@ ngx_http_file_cache_lock_wait(ngx_http_request_t *r, ngx_http_cache_t *c)
 }
 
 
+static ngx_int_t
+ngx_http_file_cache_fill_open(ngx_http_request_t *r, ngx_http_cache_t *c,
+    ngx_str_t *name, ngx_file_uniq_t uniq)
+{
+    ngx_fd_t                  fd;
+    ngx_err_t                 err;
+    ngx_file_info_t           fi;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", name->data);
+        }
+
+        return NGX_DECLINED;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name->data);
+        goto failed;
+    }
+
+    /* the temp file might have been replaced by another one */
+
+    if (ngx_file_uniq(&fi) != uniq) {
+        goto failed;
+    }
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = name->data;
+    clnf->log = r->pool->log;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill: \"%s\" %O",
+                   name->data, ngx_file_size(&fi));
+
+    c->buf = ngx_create_temp_buf(r->pool, c->body_start);
+    if (c->buf == NULL) {
+        return NGX_ERROR;
+    }
+
+    c->file.fd = fd;
+    c->file.name = *name;
+    c->file.log = r->connection->log;
+    c->uniq = uniq;
+    c->length = ngx_file_size(&fi);
+    c->filling = 1;
+
+    return NGX_OK;
+
+failed:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name->data);
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_file_cache_wakeup(ngx_http_file_cache_node_t *fcn,
+    ngx_uint_t waiting, ngx_log_t *log)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
+
+    if (!waiting) {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http file cache wakeup: %p", fcn);
+
+    if (ngx_http_file_cache_waiting.next) {
+
+        for (q = ngx_queue_head(&ngx_http_file_cache_waiting);
+             q != ngx_queue_sentinel(&ngx_http_file_cache_waiting);
+             q = ngx_queue_next(q))
+        {
+            c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
+
+            if (c->node == fcn) {
+                ngx_post_event(&c->wait_event, &ngx_posted_events);
+            }
+        }
+    }
+
+#if !(NGX_WIN32)
+    ngx_wakeup_worker_processes(log);
+#endif
+}
+
+
+#if !(NGX_WIN32)
+
+static void
+ngx_http_file_cache_wakeup_handler(ngx_event_t *ev)
+{
+    ngx_queue_t       *q;
+    ngx_http_cache_t  *c;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache wakeup handler");
+
+    /* the node is not known, all waiting requests check their locks */
+
+    for (q = ngx_queue_head(&ngx_http_file_cache_waiting);
+         q != ngx_queue_sentinel(&ngx_http_file_cache_waiting);
+         q = ngx_queue_next(q))
+    {
+        c = ngx_queue_data(q, ngx_http_cache_t, wait_queue);
+
+        ngx_post_event(&c->wait_event, &ngx_posted_events);
+    }
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
@@ -575,10 +850,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_http_file_cache_t         *cache;
     ngx_http_file_cache_header_t  *h;
 
-    n = ngx_http_file_cache_aio_read(r, c);
+    if (c->ram) {
+        n = (ssize_t) c->length;
 
-    if (n < 0) {
-        return n;
+    } else {
+        n = ngx_http_file_cache_aio_read(r, c);
+
+        if (n < 0) {
+            return n;
+        }
     }
 
     if ((size_t) n < c->header_start) {
@@ -656,7 +936,15 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     cache = c->file_cache;
 
-    if (cache->sh->cold) {
+    if (cache->ram && !c->ram && !c->filling
+        && (off_t) n == c->length
+        && c->length <= (off_t) cache->ram_max_size)
+    {
+        ngx_http_file_cache_ram_add(cache, c);
+        c->ram = 1;
+    }
+
+    if (cache->sh->cold && !c->filling) {
 
         ngx_shmtx_lock(&cache->shpool->mutex);
 
@@ -707,6 +995,7 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 static ssize_t
 ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
+    size_t                     size;
 #if (NGX_HAVE_FILE_AIO || NGX_THREADS)
     ssize_t                    n;
     ngx_http_core_loc_conf_t  *clcf;
@@ -714,10 +1003,12 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 #endif
 
+    size = c->buf->end - c->buf->pos;
+
 #if (NGX_HAVE_FILE_AIO)
 
     if (clcf->aio == NGX_HTTP_AIO_ON && ngx_file_aio) {
-        n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_file_aio_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         if (n != NGX_AGAIN) {
             c->reading = 0;
@@ -746,7 +1037,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         c->file.thread_handler = ngx_http_cache_thread_handler;
         c->file.thread_ctx = r;
 
-        n = ngx_thread_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
+        n = ngx_thread_read(&c->file, c->buf->pos, size, 0, r->pool);
 
         c->thread_task = c->file.thread_task;
         c->reading = (n == NGX_AGAIN);
@@ -756,7 +1047,7 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
 #endif
 
-    return ngx_read_file(&c->file, c->buf->pos, c->body_start, 0);
+    return ngx_read_file(&c->file, c->buf->pos, size, 0);
 }
 
 
@@ -901,10 +1192,87 @@ ngx_http_cache_thread_event_handler(ngx_event_t *ev)
 #endif
 
 
+static void
+ngx_http_file_cache_queue_insert(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn, ngx_uint_t promote)
+{
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *demoted;
+
+    if (!promote || cache->eviction != NGX_HTTP_CACHE_EVICTION_SLRU) {
+        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        return;
+    }
+
+    /*
+     * segmented LRU: entries hit again are moved from the probationary
+     * segment to the protected one, which is limited to 80% of max_size;
+     * the least recently used protected entries are moved back
+     */
+
+    fcn->promoted = 1;
+    cache->sh->promoted_size += fcn->fs_size;
+
+    ngx_queue_insert_head(&cache->sh->promoted, &fcn->queue);
+
+    while (cache->sh->promoted_size > cache->max_size - cache->max_size / 5
+           && ngx_queue_last(&cache->sh->promoted) != &fcn->queue)
+    {
+        q = ngx_queue_last(&cache->sh->promoted);
+        demoted = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_http_file_cache_queue_remove(cache, demoted);
+        ngx_queue_insert_head(&cache->sh->queue, &demoted->queue);
+    }
+}
+
+
+static void
+ngx_http_file_cache_queue_remove(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_node_t *fcn)
+{
+    ngx_queue_remove(&fcn->queue);
+
+    if (fcn->promoted) {
+        fcn->promoted = 0;
+        cache->sh->promoted_size -= fcn->fs_size;
+    }
+}
+
+
+static ngx_queue_t *
+ngx_http_file_cache_queue_last(ngx_http_file_cache_t *cache)
+{
+    ngx_queue_t                 *q, *p;
+    ngx_http_file_cache_node_t  *fcn, *pfcn;
+
+    /* the least recently used entry of both segments */
+
+    q = ngx_queue_empty(&cache->sh->queue)
+        ? NULL : ngx_queue_last(&cache->sh->queue);
+
+    if (ngx_queue_empty(&cache->sh->promoted)) {
+        return q;
+    }
+
+    p = ngx_queue_last(&cache->sh->promoted);
+
+    if (q == NULL) {
+        return p;
+    }
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    pfcn = ngx_queue_data(p, ngx_http_file_cache_node_t, queue);
+
+    return (pfcn->expire < fcn->expire) ? p : q;
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
     ngx_int_t                    rc;
+    ngx_uint_t                   promote;
     ngx_http_file_cache_node_t  *fcn;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
@@ -916,7 +1284,9 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
     }
 
     if (fcn) {
-        ngx_queue_remove(&fcn->queue);
+        promote = fcn->promoted || (c->node == NULL && fcn->exists);
+
+        ngx_http_file_cache_queue_remove(cache, fcn);
 
         if (c->node == NULL) {
             fcn->uses++;
@@ -987,6 +1357,7 @@ ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 renew:
 
     rc = NGX_DECLINED;
+    promote = 0;
 
     fcn->valid_msec = 0;
     fcn->error = 0;
@@ -1000,7 +1371,7 @@ done:
 
     fcn->expire = ngx_time() + cache->inactive;
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+    ngx_http_file_cache_queue_insert(cache, fcn, promote);
 
     c->uniq = fcn->uniq;
     c->error = fcn->error;
@@ -1314,6 +1685,7 @@ ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
     c->secondary = 1;
+    c->ram = 0;
     c->file.name.len = 0;
     c->body_start = c->buffer_size;
 
@@ -1391,7 +1763,9 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 static ngx_int_t
 ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache;
+    ngx_uint_t                   waiting;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
 
     if (!c->secondary) {
         return NGX_OK;
@@ -1415,12 +1789,20 @@ ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
-    c->node->count--;
-    c->node->updating = 0;
+    fcn = c->node;
+
+    fcn->count--;
+    fcn->updating = 0;
+
+    waiting = fcn->waiting;
+    fcn->waiting = 0;
+
     c->node = NULL;
 
     ngx_shmtx_unlock(&cache->shpool->mutex);
 
+    ngx_http_file_cache_wakeup(fcn, waiting, r->connection->log);
+
     c->file.name.len = 0;
     c->update_variant = 1;
 
@@ -1443,6 +1825,7 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
     off_t                   fs_size;
     ngx_int_t               rc;
+    ngx_uint_t              waiting;
     ngx_file_uniq_t         uniq;
     ngx_file_info_t         fi;
     ngx_http_cache_t        *c;
@@ -1481,9 +1864,11 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
 
     if (rc == NGX_OK) {
 
-        if (ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        /* the temp file is copied if it is on another file system */
+
+        if (ngx_file_info(c->file.name.data, &fi) == NGX_FILE_ERROR) {
             ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                          ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+                          ngx_file_info_n " \"%s\" failed", c->file.name.data);
 
             rc = NGX_ERROR;
 
@@ -1493,6 +1878,10 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
         }
     }
 
+    if (cache->ram) {
+        ngx_http_file_cache_ram_delete(cache, c->key);
+    }
+
     ngx_shmtx_lock(&cache->shpool->mutex);
 
     c->node->count--;
@@ -1501,70 +1890,189 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     c->node->body_start = c->body_start;
 
     cache->sh->size += fs_size - c->node->fs_size;
+
+    if (c->node->promoted) {
+        cache->sh->promoted_size += fs_size - c->node->fs_size;
+    }
+
     c->node->fs_size = fs_size;
 
     if (rc == NGX_OK) {
         c->node->exists = 1;
     }
 
+    ngx_http_file_cache_fill_free(cache, c, rc == NGX_OK);
+
     c->node->updating = 0;
 
+    waiting = c->node->waiting;
+    c->node->waiting = 0;
+
     ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wakeup(c->node, waiting, r->connection->log);
 }
 
 
 void
-ngx_http_file_cache_update_header(ngx_http_request_t *r)
+ngx_http_file_cache_progress(ngx_http_request_t *r, ngx_temp_file_t *tf)
 {
-    ssize_t                        n;
-    ngx_err_t                      err;
-    ngx_file_t                     file;
-    ngx_file_info_t                fi;
-    ngx_http_cache_t              *c;
-    ngx_http_file_cache_header_t   h;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http file cache update header");
+    ngx_uint_t                   waiting;
+    ngx_file_info_t              fi;
+    ngx_http_cache_t            *c;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+    ngx_http_file_cache_fill_t  *fill;
 
     c = r->cache;
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
+    if (!c->lock_stream || !c->updating || c->updated
+        || tf->file.fd == NGX_INVALID_FILE
+        || tf->offset < (off_t) c->body_start)
+    {
+        return;
+    }
 
-    file.name = c->file.name;
-    file.log = r->connection->log;
-    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+    if (c->fill && c->fill->size == tf->offset) {
+        return;
+    }
 
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache progress: %O", tf->offset);
 
-        /* cache file may have been deleted */
+    if (c->fill == NULL && ngx_fd_info(tf->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", tf->file.name.data);
+        return;
+    }
 
-        if (err == NGX_ENOENT) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "http file cache \"%s\" not found",
-                           file.name.data);
-            return;
+    cache = c->file_cache;
+    fcn = c->node;
+    waiting = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    if (c->fill == NULL) {
+
+        if (!fcn->updating || fcn->lock_time != c->lock_time) {
+            goto done;
         }
 
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", file.name.data);
-        return;
+        fill = ngx_slab_alloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_fill_t)
+                                     + tf->file.name.len);
+        if (fill == NULL) {
+            goto done;
+        }
+
+        fill->uniq = ngx_file_uniq(&fi);
+        fill->len = tf->file.name.len;
+        ngx_memcpy(fill->name, tf->file.name.data, tf->file.name.len + 1);
+
+        c->fill = fill;
+        fcn->fill = fill;
+        fcn->fill_gen++;
     }
 
-    /*
-     * make sure cache file wasn't replaced;
-     * if it was, do nothing
-     */
+    c->fill->size = tf->offset;
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+    if (fcn->fill != c->fill) {
         goto done;
     }
 
-    if (c->uniq != ngx_file_uniq(&fi)
-        || c->length != ngx_file_size(&fi))
-    {
+    /* the lock is kept as long as the temp file grows */
+
+    if (fcn->updating && fcn->lock_time == c->lock_time) {
+        fcn->lock_time = ngx_current_msec + c->lock_age;
+        c->lock_time = fcn->lock_time;
+    }
+
+    waiting = fcn->waiting;
+    fcn->waiting = 0;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wakeup(fcn, waiting, r->connection->log);
+}
+
+
+static void
+ngx_http_file_cache_fill_free(ngx_http_file_cache_t *cache,
+    ngx_http_cache_t *c, ngx_uint_t done)
+{
+    if (c->fill == NULL) {
+        return;
+    }
+
+    if (c->node->fill == c->fill) {
+        c->node->fill = NULL;
+
+        /* followers of an incomplete file see another generation */
+
+        if (!done) {
+            c->node->fill_gen++;
+        }
+    }
+
+    ngx_slab_free_locked(cache->shpool, c->fill);
+    c->fill = NULL;
+}
+
+
+void
+ngx_http_file_cache_update_header(ngx_http_request_t *r)
+{
+    ssize_t                        n;
+    ngx_err_t                      err;
+    ngx_file_t                     file;
+    ngx_file_info_t                fi;
+    ngx_http_cache_t              *c;
+    ngx_http_file_cache_header_t   h;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache update header");
+
+    c = r->cache;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name = c->file.name;
+    file.log = r->connection->log;
+    file.fd = ngx_open_file(file.name.data, NGX_FILE_RDWR, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        /* cache file may have been deleted */
+
+        if (err == NGX_ENOENT) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache \"%s\" not found",
+                           file.name.data);
+            return;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                      ngx_open_file_n " \"%s\" failed", file.name.data);
+        return;
+    }
+
+    /*
+     * make sure cache file wasn't replaced;
+     * if it was, do nothing
+     */
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", file.name.data);
+        goto done;
+    }
+
+    if (c->uniq != ngx_file_uniq(&fi)
+        || c->length != ngx_file_size(&fi))
+    {
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http file cache \"%s\" changed",
                        file.name.data);
@@ -1636,6 +2144,10 @@ ngx_http_file_cache_update_header(ngx_http_request_t *r)
     (void) ngx_write_file(&file, (u_char *) &h,
                           sizeof(ngx_http_file_cache_header_t), 0);
 
+    if (c->file_cache->ram) {
+        ngx_http_file_cache_ram_delete(c->file_cache, c->key);
+    }
+
 done:
 
     if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
@@ -1665,9 +2177,16 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
-    if (b->file == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!c->ram) {
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+    if (c->filling) {
+        /* multipart ranges need the whole response in a single buffer */
+        r->single_range = 1;
     }
 
     rc = ngx_http_send_header(r);
@@ -1676,6 +2195,45 @@ ngx_http_cache_send(ngx_http_request_t *r)
         return rc;
     }
 
+    if (c->filling) {
+        b->file_pos = c->body_start;
+        b->file_last = c->body_start;
+
+        b->file->fd = c->file.fd;
+        b->file->name = c->file.name;
+        b->file->log = r->connection->log;
+
+        c->fill_buf = b;
+
+        c->wait_event.handler = ngx_http_file_cache_fill_handler;
+        c->wait_event.data = r;
+        c->wait_event.log = r->connection->log;
+
+        r->write_event_handler = ngx_http_file_cache_fill_write_handler;
+
+        ngx_http_file_cache_fill_send(r);
+
+        return NGX_DONE;
+    }
+
+    if (c->ram) {
+
+        /* the whole response is in memory */
+
+        b->pos = c->buf->pos + c->body_start;
+        b->last = c->buf->pos + c->length;
+
+        b->memory = (c->length - c->body_start) ? 1 : 0;
+        b->last_buf = (r == r->main) ? 1 : 0;
+        b->last_in_chain = 1;
+        b->sync = (b->last_buf || b->memory) ? 0 : 1;
+
+        out.buf = b;
+        out.next = NULL;
+
+        return ngx_http_output_filter(r, &out);
+    }
+
     b->file_pos = c->body_start;
     b->file_last = c->length;
 
@@ -1696,205 +2254,445 @@ ngx_http_cache_send(ngx_http_request_t *r)
 }
 
 
-void
-ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+static void
+ngx_http_file_cache_fill_send(ngx_http_request_t *r)
 {
+    off_t                        size, sent;
+    ngx_int_t                    rc;
+    ngx_buf_t                   *b;
+    ngx_uint_t                   done, wait;
+    ngx_event_t                 *wev;
+    ngx_chain_t                  out;
+    ngx_file_info_t              fi;
+    ngx_file_uniq_t              uniq;
+    ngx_http_cache_t            *c;
     ngx_http_file_cache_t       *cache;
     ngx_http_file_cache_node_t  *fcn;
+    ngx_http_core_loc_conf_t    *clcf;
 
-    if (c->updated || c->node == NULL) {
+    if (r->aio) {
         return;
     }
 
+    c = r->cache;
+    b = c->fill_buf;
     cache = c->file_cache;
-
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache free, fd: %d", c->file.fd);
-
-    ngx_shmtx_lock(&cache->shpool->mutex);
-
     fcn = c->node;
-    fcn->count--;
+    wev = r->connection->write;
 
-    if (c->updating && fcn->lock_time == c->lock_time) {
-        fcn->updating = 0;
-    }
-
-    if (c->error) {
-        fcn->error = c->error;
+    clcf = ngx_http_get_module_loc_conf(r->main, ngx_http_core_module);
 
-        if (c->valid_sec) {
-            fcn->valid_sec = c->valid_sec;
-            fcn->valid_msec = c->valid_msec;
-        }
+    for ( ;; ) {
 
-    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
-        ngx_queue_remove(&fcn->queue);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
-        c->node = NULL;
-    }
+        sent = r->connection->sent;
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (b->file_pos != b->file_last
+            || r->buffered || r->postponed
+            || (r == r->main && r->connection->buffered))
+        {
+            rc = ngx_http_output_filter(r, NULL);
 
-    c->updated = 1;
-    c->updating = 0;
+            if (rc == NGX_ERROR) {
+                ngx_http_finalize_request(r, rc);
+                return;
+            }
 
-    if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                           "http file cache incomplete: \"%s\"",
-                           tf->file.name.data);
+            /* the buffer is reused once the previous part is sent */
 
-            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
-                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
-                              ngx_delete_file_n " \"%s\" failed",
-                              tf->file.name.data);
+            if (b->file_pos != b->file_last) {
+                goto blocked;
             }
         }
-    }
 
-    if (c->wait_event.timer_set) {
-        ngx_del_timer(&c->wait_event);
-    }
-}
+        size = 0;
+        done = 0;
+        wait = 0;
+        uniq = 0;
 
+        ngx_shmtx_lock(&cache->shpool->mutex);
 
-static void
-ngx_http_file_cache_cleanup(void *data)
-{
-    ngx_http_cache_t  *c = data;
+        /*
+         * completion is tracked by the generation of the file rather
+         * than by its uniq, as the file might have been copied
+         */
 
-    if (c->updated) {
-        return;
-    }
+        if (fcn->fill && fcn->fill_gen == c->fill_gen) {
+            size = fcn->fill->size;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
-                   "http file cache cleanup");
+            if (size <= b->file_last) {
+                fcn->waiting = 1;
+                wait = 1;
+            }
 
-    if (c->updating && !c->background) {
-        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
-                      "stalled cache updating, error:%ui", c->error);
-    }
+        } else if (fcn->exists && fcn->fill_gen == c->fill_gen) {
+            done = 1;
+            uniq = fcn->uniq;
 
-    ngx_http_file_cache_free(c, NULL);
-}
+        } else {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
 
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "cache file \"%s\" was not completed",
+                          c->file.name.data);
 
-static time_t
-ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
-{
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       wait;
-    ngx_uint_t                   tries;
-    ngx_path_t                  *path;
-    ngx_queue_t                 *q, *sentinel;
-    ngx_http_file_cache_node_t  *fcn;
-    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache forced expire");
+        ngx_shmtx_unlock(&cache->shpool->mutex);
 
-    path = cache->path;
-    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        if (wait) {
+            break;
+        }
 
-    name = ngx_alloc(len + 1, ngx_cycle->log);
-    if (name == NULL) {
-        return 10;
-    }
+        if (done) {
+            if (uniq != c->uniq
+                && ngx_http_file_cache_fill_reopen(r, c, uniq) != NGX_OK)
+            {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
 
-    ngx_memcpy(name, path->name.data, path->name.len);
+            if (ngx_fd_info(c->file.fd, &fi) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                              ngx_fd_info_n " \"%s\" failed",
+                              c->file.name.data);
 
-    wait = 10;
-    tries = 20;
-    sentinel = NULL;
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+            size = ngx_file_size(&fi);
 
-    for ( ;; ) {
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            break;
-        }
+            if (c->waiting) {
+                c->waiting = 0;
+                ngx_queue_remove(&c->wait_queue);
+            }
 
-        q = ngx_queue_last(&cache->sh->queue);
+            if (c->wait_event.timer_set) {
+                ngx_del_timer(&c->wait_event);
+            }
 
-        if (q == sentinel) {
-            break;
+            if (c->wait_event.posted) {
+                ngx_delete_posted_event(&c->wait_event);
+            }
         }
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http file cache fill send: %O-%O d:%ui",
+                       b->file_last, size, done);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
-                  fcn->count, fcn->exists,
-                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        b->file_pos = b->file_last;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            wait = 0;
-            break;
+        if (size > b->file_last) {
+            b->file_last = size;
         }
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+        b->in_file = (b->file_last - b->file_pos) ? 1 : 0;
+        b->flush = done ? 0 : 1;
+        b->last_buf = (done && r == r->main) ? 1 : 0;
+        b->last_in_chain = done;
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        out.buf = b;
+        out.next = NULL;
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+        rc = ngx_http_output_filter(r, &out);
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        if (rc == NGX_ERROR || done) {
+            ngx_http_finalize_request(r, rc);
+            return;
+        }
+    }
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    /* wait for the temp file to grow */
 
-        if (sentinel == NULL) {
-            sentinel = q;
-        }
+    if (!c->waiting) {
+        c->waiting = 1;
+        ngx_queue_insert_tail(&ngx_http_file_cache_waiting, &c->wait_queue);
+    }
 
-        if (--tries) {
-            continue;
+    /* periodic checks are only needed if a wakeup was lost */
+
+    ngx_add_timer(&c->wait_event, 500);
+
+    if (!r->buffered && !r->postponed
+        && !(r == r->main && r->connection->buffered))
+    {
+        if (wev->timer_set && !wev->delayed) {
+            ngx_del_timer(wev);
         }
 
-        wait = 1;
-        break;
+        return;
     }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+blocked:
 
-    ngx_free(name);
+    if (!wev->delayed) {
+        ngx_http_send_timeout(r, r->connection->sent - sent);
+    }
 
-    return wait;
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+    }
 }
 
 
-static time_t
-ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+static ngx_int_t
+ngx_http_file_cache_fill_reopen(ngx_http_request_t *r, ngx_http_cache_t *c,
+    ngx_file_uniq_t uniq)
 {
-    u_char                      *name, *p;
-    size_t                       len;
-    time_t                       now, wait;
+    ngx_fd_t                  fd;
+    ngx_err_t                 err;
+    ngx_file_info_t           fi;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    /*
+     * the temp file was copied to the cache file, the latter is used
+     * instead so that the space taken by the temp file is freed
+     */
+
+    c->file.name.len = 0;
+
+    if (ngx_http_file_cache_name(r, c->file_cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    fd = ngx_open_file(c->file.name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
+                          ngx_open_file_n " \"%s\" failed", c->file.name.data);
+        }
+
+        return NGX_OK;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", c->file.name.data);
+        goto failed;
+    }
+
+    /* the cache file might have been replaced already */
+
+    if (ngx_file_uniq(&fi) != uniq) {
+        goto failed;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache fill reopen: \"%s\"", c->file.name.data);
+
+    ngx_pool_run_cleanup_file(r->pool, c->file.fd);
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = c->file.name.data;
+    clnf->log = r->pool->log;
+
+    c->file.fd = fd;
+    c->uniq = uniq;
+
+    c->fill_buf->file->fd = fd;
+    c->fill_buf->file->name = c->file.name;
+
+    return NGX_OK;
+
+failed:
+
+    /* the temp file is still complete and is sent as is */
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", c->file.name.data);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_fill_handler(ngx_event_t *ev)
+{
+    ngx_connection_t    *c;
+    ngx_http_request_t  *r;
+
+    r = ev->data;
+    c = r->connection;
+
+    ngx_http_set_log_request(c->log, r);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache fill wait: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    ngx_http_file_cache_fill_send(r);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_file_cache_fill_write_handler(ngx_http_request_t *r)
+{
+    ngx_event_t  *wev;
+
+    wev = r->connection->write;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, wev->log, 0,
+                   "http file cache fill writer: \"%V?%V\"",
+                   &r->uri, &r->args);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        r->connection->timedout = 1;
+
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed || r->aio) {
+        return;
+    }
+
+    ngx_http_file_cache_fill_send(r);
+}
+
+
+void
+ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
+{
+    ngx_uint_t                   waiting;
+    ngx_http_file_cache_t       *cache;
+    ngx_http_file_cache_node_t  *fcn;
+
+    if (c->updated || c->node == NULL) {
+        return;
+    }
+
+    cache = c->file_cache;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache free, fd: %d", c->file.fd);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = c->node;
+    fcn->count--;
+
+    waiting = 0;
+
+    ngx_http_file_cache_fill_free(cache, c, 0);
+
+    if (c->updating && fcn->lock_time == c->lock_time) {
+        fcn->updating = 0;
+
+        waiting = fcn->waiting;
+        fcn->waiting = 0;
+    }
+
+    if (c->error) {
+        fcn->error = c->error;
+
+        if (c->valid_sec) {
+            fcn->valid_sec = c->valid_sec;
+            fcn->valid_msec = c->valid_msec;
+        }
+
+    } else if (!fcn->exists && fcn->count == 0 && c->min_uses == 1) {
+        ngx_http_file_cache_queue_remove(cache, fcn);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+        c->node = NULL;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_http_file_cache_wakeup(fcn, waiting, c->file.log);
+
+    c->updated = 1;
+    c->updating = 0;
+
+    if (c->temp_file) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                           "http file cache incomplete: \"%s\"",
+                           tf->file.name.data);
+
+            if (ngx_delete_file(tf->file.name.data) == NGX_FILE_ERROR) {
+                ngx_log_error(NGX_LOG_CRIT, c->file.log, ngx_errno,
+                              ngx_delete_file_n " \"%s\" failed",
+                              tf->file.name.data);
+            }
+        }
+    }
+
+    if (c->wait_event.timer_set) {
+        ngx_del_timer(&c->wait_event);
+    }
+
+    if (c->waiting) {
+        c->waiting = 0;
+
+        ngx_queue_remove(&c->wait_queue);
+
+        if (c->wait_event.posted) {
+            ngx_delete_posted_event(&c->wait_event);
+        }
+    }
+}
+
+
+static void
+ngx_http_file_cache_cleanup(void *data)
+{
+    ngx_http_cache_t  *c = data;
+
+    if (c->updated) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
+                   "http file cache cleanup");
+
+    if (c->updating && !c->background) {
+        ngx_log_error(NGX_LOG_ALERT, c->file.log, 0,
+                      "stalled cache updating, error:%ui", c->error);
+    }
+
+    ngx_http_file_cache_free(c, NULL);
+}
+
+
+static time_t
+ngx_http_file_cache_forced_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       wait;
+    ngx_uint_t                   tries;
     ngx_path_t                  *path;
-    ngx_msec_t                   elapsed;
-    ngx_queue_t                 *q;
+    ngx_queue_t                 *q, *prev, *queue;
     ngx_http_file_cache_node_t  *fcn;
     u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache expire");
+                   "http file cache forced expire");
 
     path = cache->path;
     len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
@@ -1906,471 +2704,1456 @@ ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
 
     ngx_memcpy(name, path->name.data, path->name.len);
 
-    now = ngx_time();
+    wait = 10;
+    tries = 20;
 
     ngx_shmtx_lock(&cache->shpool->mutex);
 
+    /* entries not promoted by the eviction policy go first */
+
+    queue = &cache->sh->queue;
+    q = ngx_queue_last(queue);
+
     for ( ;; ) {
 
-        if (ngx_quit || ngx_terminate) {
-            wait = 1;
+        if (q == ngx_queue_sentinel(queue)) {
+
+            if (queue == &cache->sh->promoted) {
+                break;
+            }
+
+            /* nothing to evict in the probationary segment */
+
+            queue = &cache->sh->promoted;
+            q = ngx_queue_last(queue);
+            tries = 20;
+
+            continue;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                  "http file cache forced expire: #%d %d %02xd%02xd%02xd%02xd",
+                  fcn->count, fcn->exists,
+                  fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            if (fcn->exists) {
+                (void) ngx_atomic_fetch_add(&cache->sh->evictions, 1);
+            }
+
+            ngx_http_file_cache_delete(cache, q, name);
+            wait = 0;
             break;
         }
 
-        if (ngx_queue_empty(&cache->sh->queue)) {
-            wait = 10;
+        if (fcn->deleting) {
+            wait = 1;
             break;
         }
 
-        q = ngx_queue_last(&cache->sh->queue);
+        wait = 1;
 
-        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+        if (--tries == 0) {
+            q = ngx_queue_sentinel(queue);
+            continue;
+        }
 
-        wait = fcn->expire - now;
+        prev = ngx_queue_prev(q);
 
-        if (wait > 0) {
-            wait = wait > 10 ? 10 : wait;
-            break;
+        if (fcn->expire > ngx_time()) {
+
+            /* the entry is in use, e.g. it is being filled */
+
+            q = prev;
+            continue;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_http_file_cache_queue_remove(cache, fcn);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_queue_insert(cache, fcn, 0);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+        q = prev;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static time_t
+ngx_http_file_cache_expire(ngx_http_file_cache_t *cache)
+{
+    u_char                      *name, *p;
+    size_t                       len;
+    time_t                       now, wait;
+    ngx_path_t                  *path;
+    ngx_msec_t                   elapsed;
+    ngx_queue_t                 *q;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache expire");
+
+    path = cache->path;
+    len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+
+    name = ngx_alloc(len + 1, ngx_cycle->log);
+    if (name == NULL) {
+        return 10;
+    }
+
+    ngx_memcpy(name, path->name.data, path->name.len);
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for ( ;; ) {
+
+        if (ngx_quit || ngx_terminate) {
+            wait = 1;
+            break;
+        }
+
+        q = ngx_http_file_cache_queue_last(cache);
+
+        if (q == NULL) {
+            wait = 10;
+            break;
+        }
+
+        fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+        wait = fcn->expire - now;
+
+        if (wait > 0) {
+            wait = wait > 10 ? 10 : wait;
+            break;
+        }
+
+        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
+                       fcn->count, fcn->exists,
+                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+
+        if (fcn->count == 0) {
+            ngx_http_file_cache_delete(cache, q, name);
+            goto next;
+        }
+
+        if (fcn->deleting) {
+            wait = 1;
+            break;
+        }
+
+        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        (void) ngx_hex_dump(p, fcn->key, len);
+
+        /*
+         * abnormally exited workers may leave locked cache entries,
+         * and although it may be safe to remove them completely,
+         * we prefer to just move them to the top of the inactive queue
+         */
+
+        ngx_http_file_cache_queue_remove(cache, fcn);
+        fcn->expire = ngx_time() + cache->inactive;
+        ngx_http_file_cache_queue_insert(cache, fcn, 0);
+
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                      "ignore long locked inactive cache entry %*s, count:%d",
+                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+
+next:
+
+        if (++cache->files >= cache->manager_files) {
+            wait = 0;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            wait = 0;
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_free(name);
+
+    return wait;
+}
+
+
+static void
+ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
+    u_char *name)
+{
+    u_char                      *p;
+    size_t                       len;
+    ngx_path_t                  *path;
+    ngx_http_file_cache_node_t  *fcn;
+    u_char                       key[NGX_HTTP_CACHE_KEY_LEN];
+
+    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+
+    if (fcn->exists) {
+        cache->sh->size -= fcn->fs_size;
+
+        ngx_memcpy(key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        path = cache->path;
+        p = name + path->name.len + 1 + path->len;
+        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
+                         sizeof(ngx_rbtree_key_t));
+        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
+        p = ngx_hex_dump(p, fcn->key, len);
+        *p = '\0';
+
+        fcn->count++;
+        fcn->deleting = 1;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
+        ngx_create_hashed_filename(path, name, len);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache expire: \"%s\"", name);
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+
+        if (cache->ram) {
+            ngx_http_file_cache_ram_delete(cache, key);
+        }
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        fcn->count--;
+        fcn->deleting = 0;
+    }
+
+    if (fcn->count == 0) {
+        ngx_http_file_cache_queue_remove(cache, fcn);
+        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
+        ngx_slab_free_locked(cache->shpool, fcn);
+        cache->sh->count--;
+    }
+}
+
+
+static ngx_msec_t
+ngx_http_file_cache_manager(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    off_t       size, free;
+    time_t      wait;
+    ngx_msec_t  elapsed, next;
+    ngx_uint_t  count, watermark;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+
+    if (next == 0) {
+        next = cache->manager_sleep;
+        goto done;
+    }
+
+    for ( ;; ) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        size = cache->sh->size;
+        count = cache->sh->count;
+        watermark = cache->sh->watermark;
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache size: %O c:%ui w:%i",
+                       size, count, (ngx_int_t) watermark);
+
+        if (size < cache->max_size && count < watermark) {
+
+            if (!cache->min_free) {
+                break;
+            }
+
+            free = ngx_fs_available(cache->path->name.data);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache free: %O", free);
+
+            if (free > cache->min_free) {
+                break;
+            }
+        }
+
+        wait = ngx_http_file_cache_forced_expire(cache);
+
+        if (wait > 0) {
+            next = (ngx_msec_t) wait * 1000;
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            break;
+        }
+
+        if (++cache->files >= cache->manager_files) {
+            next = cache->manager_sleep;
+            break;
+        }
+
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        if (elapsed >= cache->manager_threshold) {
+            next = cache->manager_sleep;
+            break;
+        }
+    }
+
+done:
+
+    if (cache->index && !cache->sh->cold
+        && ngx_time() >= cache->sh->index_time + cache->index_interval)
+    {
+        ngx_http_file_cache_index_save(cache);
+    }
+
+    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache manager: %ui e:%M n:%M",
+                   cache->files, elapsed, next);
+
+    return next;
+}
+
+
+static void
+ngx_http_file_cache_index_save(ngx_http_file_cache_t *cache)
+{
+    u_char                              *name, *temp;
+    size_t                               len;
+    off_t                                offset;
+    time_t                               now;
+    ngx_uint_t                           i, n, count;
+    ngx_file_t                           file;
+    ngx_rbtree_t                        *tree;
+    ngx_rbtree_node_t                   *node;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_entry_t   *entries, *e;
+    ngx_http_file_cache_index_header_t   h;
+
+    now = ngx_time();
+
+    /* the next attempt is scheduled even if this one fails */
+
+    cache->sh->index_time = now;
+
+    len = cache->path->name.len + sizeof("/index.tmp");
+
+    name = ngx_alloc(2 * len + NGX_HTTP_CACHE_INDEX_BATCH
+                             * sizeof(ngx_http_file_cache_index_entry_t),
+                     ngx_cycle->log);
+    if (name == NULL) {
+        return;
+    }
+
+    temp = name + len;
+    entries = (ngx_http_file_cache_index_entry_t *) (temp + len);
+
+    ngx_sprintf(name, "%V/index%Z", &cache->path->name);
+    ngx_sprintf(temp, "%V/index.tmp%Z", &cache->path->name);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.len = len - 1;
+    file.name.data = temp;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                            NGX_FILE_OWNER_ACCESS);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        ngx_free(name);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index save: \"%s\"", name);
+
+    tree = &cache->sh->rbtree;
+
+    offset = sizeof(ngx_http_file_cache_index_header_t);
+    count = 0;
+    node = NULL;
+
+    /*
+     * the tree is saved in batches; the node to continue with
+     * is referenced between batches so it cannot be deleted
+     */
+
+    for ( ;; ) {
+
+        ngx_shmtx_lock(&cache->shpool->mutex);
+
+        if (node) {
+            ((ngx_http_file_cache_node_t *) node)->count--;
+
+        } else if (tree->root != tree->sentinel) {
+            node = ngx_rbtree_min(tree->root, tree->sentinel);
+        }
+
+        n = 0;
+
+        for (i = 0; node && i < NGX_HTTP_CACHE_INDEX_BATCH; i++) {
+            fcn = (ngx_http_file_cache_node_t *) node;
+
+            if (fcn->exists && !fcn->deleting) {
+                e = &entries[n++];
+
+                ngx_memcpy(e->key, &fcn->node.key, sizeof(ngx_rbtree_key_t));
+                ngx_memcpy(&e->key[sizeof(ngx_rbtree_key_t)], fcn->key,
+                           NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+                e->uniq = fcn->uniq;
+                e->expire = fcn->expire - now;
+                e->fs_size = fcn->fs_size;
+                e->body_start = (uint32_t) fcn->body_start;
+                e->uses = (u_short) fcn->uses;
+            }
+
+            node = ngx_rbtree_next(tree, node);
+        }
+
+        if (node) {
+            ((ngx_http_file_cache_node_t *) node)->count++;
+        }
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+
+        if (n) {
+            len = n * sizeof(ngx_http_file_cache_index_entry_t);
+
+            if (ngx_write_file(&file, (u_char *) entries, len, offset)
+                == NGX_ERROR)
+            {
+                goto failed;
+            }
+
+            offset += len;
+            count += n;
+        }
+
+        if (node == NULL) {
+            break;
+        }
+
+        if (ngx_quit || ngx_terminate) {
+            goto failed;
+        }
+    }
+
+    ngx_memzero(&h, sizeof(ngx_http_file_cache_index_header_t));
+
+    h.version = NGX_HTTP_CACHE_INDEX_VERSION;
+    h.time = now;
+    h.bsize = cache->bsize;
+    h.count = count;
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        h.level[i] = (u_char) cache->path->level[i];
+    }
+
+    if (ngx_write_file(&file, (u_char *) &h,
+                       sizeof(ngx_http_file_cache_index_header_t), 0)
+        == NGX_ERROR)
+    {
+        goto failed;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    if (ngx_rename_file(temp, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      temp, name);
+        goto delete;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache index saved: %ui entries, %O bytes",
+                   count, offset);
+
+    ngx_free(name);
+
+    return;
+
+failed:
+
+    if (node) {
+        ngx_shmtx_lock(&cache->shpool->mutex);
+        ((ngx_http_file_cache_node_t *) node)->count--;
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+delete:
+
+    if (ngx_delete_file(temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp);
+    }
+
+    ngx_free(name);
+}
+
+
+static time_t
+ngx_http_file_cache_index_load(ngx_http_file_cache_t *cache)
+{
+    u_char                              *name;
+    size_t                               len, batch;
+    off_t                                size, offset;
+    time_t                               now;
+    ssize_t                              n;
+    ngx_err_t                            err;
+    ngx_uint_t                           i, loaded;
+    ngx_file_t                           file;
+    ngx_file_info_t                      fi;
+    ngx_http_file_cache_node_t          *fcn;
+    ngx_http_file_cache_index_entry_t   *entries, *e;
+    ngx_http_file_cache_index_header_t   h;
+
+    len = cache->path->name.len + sizeof("/index");
+
+    name = ngx_alloc(len, ngx_cycle->log);
+    if (name == NULL) {
+        return 0;
+    }
+
+    ngx_sprintf(name, "%V/index%Z", &cache->path->name);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.name.len = len - 1;
+    file.name.data = name;
+    file.log = ngx_cycle->log;
+
+    entries = NULL;
+    h.time = 0;
+
+    file.fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+
+    if (file.fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err != NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_open_file_n " \"%s\" failed", name);
+        }
+
+        ngx_free(name);
+        return 0;
+    }
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name);
+        goto failed;
+    }
+
+    n = ngx_read_file(&file, (u_char *) &h,
+                      sizeof(ngx_http_file_cache_index_header_t), 0);
+
+    if (n == NGX_ERROR) {
+        goto failed;
+    }
+
+    size = ngx_file_size(&fi) - sizeof(ngx_http_file_cache_index_header_t);
+
+    if ((size_t) n != sizeof(ngx_http_file_cache_index_header_t)
+        || h.version != NGX_HTTP_CACHE_INDEX_VERSION
+        || h.bsize != cache->bsize
+        || size != (off_t) (h.count
+                            * sizeof(ngx_http_file_cache_index_entry_t)))
+    {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "cache index \"%s\" is invalid, ignored", name);
+        goto failed;
+    }
+
+    for (i = 0; i < NGX_MAX_PATH_LEVEL; i++) {
+        if (h.level[i] != cache->path->level[i]) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "cache index \"%s\" had different levels, ignored",
+                          name);
+            goto failed;
+        }
+    }
+
+    /* the index is read in batches, as it was saved */
+
+    if (h.count) {
+        entries = ngx_alloc(NGX_HTTP_CACHE_INDEX_BATCH
+                            * sizeof(ngx_http_file_cache_index_entry_t),
+                            ngx_cycle->log);
+        if (entries == NULL) {
+            goto failed;
+        }
+    }
+
+    offset = sizeof(ngx_http_file_cache_index_header_t);
+    now = ngx_time();
+    loaded = 0;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    for (i = 0; i < h.count; i++) {
+
+        if (i % NGX_HTTP_CACHE_INDEX_BATCH == 0) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            batch = ngx_min(h.count - i, NGX_HTTP_CACHE_INDEX_BATCH);
+            len = batch * sizeof(ngx_http_file_cache_index_entry_t);
+
+            n = ngx_read_file(&file, (u_char *) entries, len, offset);
+
+            if (n == NGX_ERROR) {
+                goto failed;
+            }
+
+            if ((size_t) n != len) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, 0,
+                              ngx_read_file_n " read only %z of %uz "
+                              "from \"%s\"", n, len, name);
+                goto failed;
+            }
+
+            offset += len;
+
+            /*
+             * the most recently used entries of a batch go first,
+             * batches are in the order they were saved in
+             */
+
+            ngx_qsort(entries, batch,
+                      sizeof(ngx_http_file_cache_index_entry_t),
+                      ngx_http_file_cache_index_cmp);
+
+            ngx_shmtx_lock(&cache->shpool->mutex);
+        }
+
+        if (i % cache->loader_files == 0) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            if (ngx_quit || ngx_terminate) {
+                goto failed;
+            }
+
+            ngx_shmtx_lock(&cache->shpool->mutex);
+        }
+
+        e = &entries[i % NGX_HTTP_CACHE_INDEX_BATCH];
+
+        if (ngx_http_file_cache_lookup(cache, e->key)) {
+            continue;
+        }
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                          "could not allocate node%s", cache->shpool->log_ctx);
+            break;
+        }
+
+        cache->sh->count++;
+
+        ngx_memcpy((u_char *) &fcn->node.key, e->key,
+                   sizeof(ngx_rbtree_key_t));
+
+        ngx_memcpy(fcn->key, &e->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
+
+        fcn->uses = e->uses;
+        fcn->exists = 1;
+        fcn->uniq = e->uniq;
+        fcn->body_start = e->body_start;
+        fcn->fs_size = e->fs_size;
+        fcn->expire = now + e->expire;
+
+        cache->sh->size += e->fs_size;
+
+        /* entries are older than ones added while the cache is cold */
+
+        ngx_queue_insert_tail(&cache->sh->queue, &fcn->queue);
+
+        loaded++;
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V index loaded, %ui of %ui entries",
+                  &cache->path->name, loaded, h.count);
+
+    ngx_free(entries);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    ngx_free(name);
+
+    return h.time;
+
+failed:
+
+    if (entries) {
+        ngx_free(entries);
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    ngx_free(name);
+
+    return 0;
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_file_cache_index_cmp(const void *one, const void *two)
+{
+    ngx_http_file_cache_index_entry_t  *first, *second;
+
+    first = (ngx_http_file_cache_index_entry_t *) one;
+    second = (ngx_http_file_cache_index_entry_t *) two;
+
+    if (first->expire == second->expire) {
+        return 0;
+    }
+
+    return (first->expire > second->expire) ? -1 : 1;
+}
+
+
+static void
+ngx_http_file_cache_loader(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_tree_ctx_t  tree;
+
+    if (!cache->sh->cold || cache->sh->loading) {
+        return;
+    }
+
+    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
+        return;
+    }
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache loader");
+
+    if (cache->index) {
+        cache->index_time = ngx_http_file_cache_index_load(cache);
+    }
+
+    tree.init_handler = NULL;
+    tree.file_handler = ngx_http_file_cache_manage_file;
+    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
+    tree.post_tree_handler = ngx_http_file_cache_noop;
+    tree.spec_handler = ngx_http_file_cache_delete_file;
+    tree.data = cache;
+    tree.alloc = 0;
+    tree.log = ngx_cycle->log;
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+
+    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
+        cache->sh->loading = 0;
+        return;
+    }
+
+    cache->sh->cold = 0;
+    cache->sh->loading = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                  "http file cache: %V %.3fM, bsize: %uz",
+                  &cache->path->name,
+                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
+                  cache->bsize);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_msec_t              elapsed;
+    ngx_http_file_cache_t  *cache;
+
+    cache = ctx->data;
+
+    if (cache->index
+        && path->len == cache->path->name.len + sizeof("/index") - 1
+        && ngx_strcmp(path->data + cache->path->name.len, "/index") == 0)
+    {
+        return NGX_OK;
+    }
+
+    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
+        (void) ngx_http_file_cache_delete_file(ctx, path);
+    }
+
+    if (++cache->files >= cache->loader_files) {
+        ngx_http_file_cache_loader_sleep(cache);
+
+    } else {
+        ngx_time_update();
+
+        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http file cache loader time elapsed: %M", elapsed);
+
+        if (elapsed >= cache->loader_threshold) {
+            ngx_http_file_cache_loader_sleep(cache);
+        }
+    }
+
+    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_http_file_cache_t  *cache;
+
+    if (path->len >= 5
+        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
+    {
+        return NGX_DECLINED;
+    }
+
+    cache = ctx->data;
+
+    /*
+     * files are added to or removed from the last level directories only,
+     * and these directories are not changed since the index was saved
+     * if their modification time is older than the index
+     */
+
+    if (cache->index_time
+        && path->len == cache->path->name.len + cache->path->len
+        && ctx->mtime < cache->index_time)
+    {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+{
+    ngx_msleep(cache->loader_sleep);
+
+    ngx_time_update();
+
+    cache->last = ngx_current_msec;
+    cache->files = 0;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+{
+    u_char                 *p;
+    ngx_int_t               n;
+    ngx_uint_t              i;
+    ngx_http_cache_t        c;
+    ngx_http_file_cache_t  *cache;
+
+    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * Temporary files in cache have a suffix consisting of a dot
+     * followed by 10 digits.
+     */
+
+    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
+        && name->data[name->len - 10 - 1] == '.')
+    {
+        return NGX_OK;
+    }
+
+    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
+                      "cache file \"%s\" is too small", name->data);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(&c, sizeof(ngx_http_cache_t));
+    cache = ctx->data;
+
+    c.length = ctx->size;
+    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+
+    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+
+    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
+        n = ngx_hextoi(p, 2);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        p += 2;
+
+        c.key[i] = (u_char) n;
+    }
+
+    return ngx_http_file_cache_add(cache, &c);
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_node_t  *fcn;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    fcn = ngx_http_file_cache_lookup(cache, c->key);
+
+    if (fcn == NULL) {
+
+        fcn = ngx_slab_calloc_locked(cache->shpool,
+                                     sizeof(ngx_http_file_cache_node_t));
+        if (fcn == NULL) {
+            ngx_http_file_cache_set_watermark(cache);
+
+            if (cache->fail_time != ngx_time()) {
+                cache->fail_time = ngx_time();
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
+                           "could not allocate node%s", cache->shpool->log_ctx);
+            }
+
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
         }
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: #%d %d %02xd%02xd%02xd%02xd",
-                       fcn->count, fcn->exists,
-                       fcn->key[0], fcn->key[1], fcn->key[2], fcn->key[3]);
+        cache->sh->count++;
 
-        if (fcn->count == 0) {
-            ngx_http_file_cache_delete(cache, q, name);
-            goto next;
-        }
+        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
 
-        if (fcn->deleting) {
-            wait = 1;
-            break;
-        }
+        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        p = ngx_hex_dump(key, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        (void) ngx_hex_dump(p, fcn->key, len);
+        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-        /*
-         * abnormally exited workers may leave locked cache entries,
-         * and although it may be safe to remove them completely,
-         * we prefer to just move them to the top of the inactive queue
-         */
+        fcn->uses = 1;
+        fcn->exists = 1;
+        fcn->fs_size = c->fs_size;
 
-        ngx_queue_remove(q);
-        fcn->expire = ngx_time() + cache->inactive;
-        ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        cache->sh->size += c->fs_size;
 
-        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                      "ignore long locked inactive cache entry %*s, count:%d",
-                      (size_t) 2 * NGX_HTTP_CACHE_KEY_LEN, key, fcn->count);
+    } else {
+        ngx_http_file_cache_queue_remove(cache, fcn);
+    }
 
-next:
+    fcn->expire = ngx_time() + cache->inactive;
 
-        if (++cache->files >= cache->manager_files) {
-            wait = 0;
-            break;
-        }
+    ngx_http_file_cache_queue_insert(cache, fcn, 0);
 
-        ngx_time_update();
+    ngx_shmtx_unlock(&cache->shpool->mutex);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    return NGX_OK;
+}
 
-        if (elapsed >= cache->manager_threshold) {
-            wait = 0;
-            break;
-        }
-    }
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+static ngx_int_t
+ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+{
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
+                   "http file cache delete: \"%s\"", path->data);
 
-    ngx_free(name);
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
 
-    return wait;
+    return NGX_OK;
 }
 
 
 static void
-ngx_http_file_cache_delete(ngx_http_file_cache_t *cache, ngx_queue_t *q,
-    u_char *name)
+ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
 {
-    u_char                      *p;
-    size_t                       len;
-    ngx_path_t                  *path;
-    ngx_http_file_cache_node_t  *fcn;
+    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
 
-    fcn = ngx_queue_data(q, ngx_http_file_cache_node_t, queue);
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache watermark: %ui", cache->sh->watermark);
+}
 
-    if (fcn->exists) {
-        cache->sh->size -= fcn->fs_size;
 
-        path = cache->path;
-        p = name + path->name.len + 1 + path->len;
-        p = ngx_hex_dump(p, (u_char *) &fcn->node.key,
-                         sizeof(ngx_rbtree_key_t));
-        len = NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t);
-        p = ngx_hex_dump(p, fcn->key, len);
-        *p = '\0';
+static ngx_int_t
+ngx_http_file_cache_ram_init(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_file_cache_t  *ocache = data;
 
-        fcn->count++;
-        fcn->deleting = 1;
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    size_t                         len;
+    ngx_uint_t                     width;
+    ngx_http_file_cache_t         *cache;
+    ngx_http_file_cache_ram_sh_t  *ram;
 
-        len = path->name.len + 1 + path->len + 2 * NGX_HTTP_CACHE_KEY_LEN;
-        ngx_create_hashed_filename(path, name, len);
+    cache = shm_zone->data;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache expire: \"%s\"", name);
+    if (ocache) {
+        cache->ram = ocache->ram;
+        cache->ram_shpool = ocache->ram_shpool;
 
-        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
-                          ngx_delete_file_n " \"%s\" failed", name);
-        }
+        return NGX_OK;
+    }
 
-        ngx_shmtx_lock(&cache->shpool->mutex);
-        fcn->count--;
-        fcn->deleting = 0;
+    cache->ram_shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->ram = cache->ram_shpool->data;
+
+        return NGX_OK;
     }
 
-    if (fcn->count == 0) {
-        ngx_queue_remove(q);
-        ngx_rbtree_delete(&cache->sh->rbtree, &fcn->node);
-        ngx_slab_free_locked(cache->shpool, fcn);
-        cache->sh->count--;
+    ram = ngx_slab_alloc(cache->ram_shpool,
+                         sizeof(ngx_http_file_cache_ram_sh_t));
+    if (ram == NULL) {
+        return NGX_ERROR;
     }
-}
 
+    cache->ram = ram;
+    cache->ram_shpool->data = ram;
 
-static ngx_msec_t
-ngx_http_file_cache_manager(void *data)
-{
-    ngx_http_file_cache_t  *cache = data;
+    ngx_rbtree_init(&ram->rbtree, &ram->sentinel,
+                    ngx_http_file_cache_ram_rbtree_insert_value);
 
-    off_t       size, free;
-    time_t      wait;
-    ngx_msec_t  elapsed, next;
-    ngx_uint_t  count, watermark;
+    ngx_queue_init(&ram->queue);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ram->size = 0;
+    ram->count = 0;
 
-    next = (ngx_msec_t) ngx_http_file_cache_expire(cache) * 1000;
+    /* a counter per kilobyte of memory, the width is a power of 2 */
 
-    if (next == 0) {
-        next = cache->manager_sleep;
-        goto done;
+    for (width = 256; width < shm_zone->shm.size / 1024; width <<= 1) {
+        /* void */
     }
 
-    for ( ;; ) {
-        ngx_shmtx_lock(&cache->shpool->mutex);
+    ram->sketch = ngx_slab_calloc(cache->ram_shpool,
+                                  NGX_HTTP_CACHE_RAM_DEPTH * width);
+    if (ram->sketch == NULL) {
+        return NGX_ERROR;
+    }
 
-        size = cache->sh->size;
-        count = cache->sh->count;
-        watermark = cache->sh->watermark;
+    ram->width = width;
+    ram->samples = 0;
 
-        ngx_shmtx_unlock(&cache->shpool->mutex);
+    len = sizeof(" in cache ram zone \"\"") + shm_zone->shm.name.len;
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache size: %O c:%ui w:%i",
-                       size, count, (ngx_int_t) watermark);
+    cache->ram_shpool->log_ctx = ngx_slab_alloc(cache->ram_shpool, len);
+    if (cache->ram_shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
 
-        if (size < cache->max_size && count < watermark) {
+    ngx_sprintf(cache->ram_shpool->log_ctx, " in cache ram zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
-            if (!cache->min_free) {
-                break;
-            }
+    cache->ram_shpool->log_nomem = 0;
 
-            free = ngx_fs_available(cache->path->name.data);
+    return NGX_OK;
+}
 
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                           "http file cache free: %O", free);
 
-            if (free > cache->min_free) {
-                break;
-            }
-        }
+static ngx_int_t
+ngx_http_file_cache_ram_get(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_buf_t                       *b;
+    ngx_int_t                        rc;
+    ngx_http_file_cache_t           *cache;
+    ngx_http_file_cache_ram_node_t  *rn;
 
-        wait = ngx_http_file_cache_forced_expire(cache);
+    cache = c->file_cache;
 
-        if (wait > 0) {
-            next = (ngx_msec_t) wait * 1000;
-            break;
-        }
+    rc = NGX_DECLINED;
 
-        if (ngx_quit || ngx_terminate) {
-            break;
-        }
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
 
-        if (++cache->files >= cache->manager_files) {
-            next = cache->manager_sleep;
-            break;
-        }
+    (void) ngx_http_file_cache_ram_frequency(cache->ram, c->key, 1);
 
-        ngx_time_update();
+    rn = ngx_http_file_cache_ram_lookup(cache, c->key);
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    if (rn == NULL) {
+        goto done;
+    }
 
-        if (elapsed >= cache->manager_threshold) {
-            next = cache->manager_sleep;
-            break;
-        }
+    if (rn->uniq != c->uniq) {
+
+        /* the cache file was replaced */
+
+        ngx_http_file_cache_ram_free(cache, rn);
+        goto done;
+    }
+
+    b = ngx_create_temp_buf(r->pool, ngx_max(rn->len, c->body_start));
+    if (b == NULL) {
+        rc = NGX_ERROR;
+        goto done;
     }
 
+    ngx_memcpy(b->pos, rn->data, rn->len);
+
+    c->buf = b;
+    c->length = rn->len;
+    c->ram = 1;
+
+    ngx_queue_remove(&rn->queue);
+    ngx_queue_insert_head(&cache->ram->queue, &rn->queue);
+
+    rc = NGX_OK;
+
 done:
 
-    elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache manager: %ui e:%M n:%M",
-                   cache->files, elapsed, next);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache ram: %i \"%s\"", rc, c->file.name.data);
 
-    return next;
+    return rc;
 }
 
 
 static void
-ngx_http_file_cache_loader(void *data)
+ngx_http_file_cache_ram_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
-    ngx_http_file_cache_t  *cache = data;
-
-    ngx_tree_ctx_t  tree;
-
-    if (!cache->sh->cold || cache->sh->loading) {
-        return;
-    }
+    size_t                           len;
+    ngx_uint_t                       n, frequency;
+    ngx_queue_t                     *q;
+    ngx_http_file_cache_ram_sh_t    *ram;
+    ngx_http_file_cache_ram_node_t  *rn;
+    u_char                           key[NGX_HTTP_CACHE_KEY_LEN];
 
-    if (!ngx_atomic_cmp_set(&cache->sh->loading, 0, ngx_pid)) {
-        return;
-    }
+    ram = cache->ram;
+    len = (size_t) c->length;
 
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache loader");
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
 
-    tree.init_handler = NULL;
-    tree.file_handler = ngx_http_file_cache_manage_file;
-    tree.pre_tree_handler = ngx_http_file_cache_manage_directory;
-    tree.post_tree_handler = ngx_http_file_cache_noop;
-    tree.spec_handler = ngx_http_file_cache_delete_file;
-    tree.data = cache;
-    tree.alloc = 0;
-    tree.log = ngx_cycle->log;
+    rn = ngx_http_file_cache_ram_lookup(cache, c->key);
 
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    if (rn) {
+        if (rn->uniq == c->uniq) {
+            goto done;
+        }
 
-    if (ngx_walk_tree(&tree, &cache->path->name) == NGX_ABORT) {
-        cache->sh->loading = 0;
-        return;
+        ngx_http_file_cache_ram_free(cache, rn);
     }
 
-    cache->sh->cold = 0;
-    cache->sh->loading = 0;
+    frequency = ngx_http_file_cache_ram_frequency(ram, c->key, 0);
 
-    ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
-                  "http file cache: %V %.3fM, bsize: %uz",
-                  &cache->path->name,
-                  ((double) cache->sh->size * cache->bsize) / (1024 * 1024),
-                  cache->bsize);
-}
+    for (n = 0; /* void */ ; n++) {
+
+        rn = ngx_slab_alloc_locked(cache->ram_shpool,
+                                   offsetof(ngx_http_file_cache_ram_node_t,
+                                            data)
+                                   + len);
+        if (rn) {
+            break;
+        }
 
+        /*
+         * an object is only admitted if it is used more often
+         * than each of the least recently used objects it replaces
+         */
 
-static ngx_int_t
-ngx_http_file_cache_noop(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    return NGX_OK;
-}
+        if (n == NGX_HTTP_CACHE_RAM_EVICT || ngx_queue_empty(&ram->queue)) {
+            goto done;
+        }
 
+        q = ngx_queue_last(&ram->queue);
+        rn = ngx_queue_data(q, ngx_http_file_cache_ram_node_t, queue);
 
-static ngx_int_t
-ngx_http_file_cache_manage_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_msec_t              elapsed;
-    ngx_http_file_cache_t  *cache;
+        ngx_memcpy(key, &rn->node.key, sizeof(ngx_rbtree_key_t));
+        ngx_memcpy(&key[sizeof(ngx_rbtree_key_t)], rn->key,
+                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    cache = ctx->data;
+        if (ngx_http_file_cache_ram_frequency(ram, key, 0) >= frequency) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                           "http file cache ram rejected: %ui", frequency);
+            goto done;
+        }
 
-    if (ngx_http_file_cache_add_file(ctx, path) != NGX_OK) {
-        (void) ngx_http_file_cache_delete_file(ctx, path);
+        ngx_http_file_cache_ram_free(cache, rn);
     }
 
-    if (++cache->files >= cache->loader_files) {
-        ngx_http_file_cache_loader_sleep(cache);
+    ngx_memcpy((u_char *) &rn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+    ngx_memcpy(rn->key, &c->key[sizeof(ngx_rbtree_key_t)],
+               NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-    } else {
-        ngx_time_update();
+    rn->uniq = c->uniq;
+    rn->len = len;
 
-        elapsed = ngx_abs((ngx_msec_int_t) (ngx_current_msec - cache->last));
+    ngx_memcpy(rn->data, c->buf->pos, len);
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                       "http file cache loader time elapsed: %M", elapsed);
+    ngx_rbtree_insert(&ram->rbtree, &rn->node);
+    ngx_queue_insert_head(&ram->queue, &rn->queue);
 
-        if (elapsed >= cache->loader_threshold) {
-            ngx_http_file_cache_loader_sleep(cache);
-        }
-    }
+    ram->size += len;
+    ram->count++;
 
-    return (ngx_quit || ngx_terminate) ? NGX_ABORT : NGX_OK;
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache ram add: %uz, %uz in %ui",
+                   len, ram->size, ram->count);
+
+done:
+
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_manage_directory(ngx_tree_ctx_t *ctx, ngx_str_t *path)
+static void
+ngx_http_file_cache_ram_delete(ngx_http_file_cache_t *cache, u_char *key)
 {
-    if (path->len >= 5
-        && ngx_strncmp(path->data + path->len - 5, "/temp", 5) == 0)
-    {
-        return NGX_DECLINED;
+    ngx_http_file_cache_ram_node_t  *rn;
+
+    ngx_shmtx_lock(&cache->ram_shpool->mutex);
+
+    rn = ngx_http_file_cache_ram_lookup(cache, key);
+
+    if (rn) {
+        ngx_http_file_cache_ram_free(cache, rn);
     }
 
-    return NGX_OK;
+    ngx_shmtx_unlock(&cache->ram_shpool->mutex);
 }
 
 
 static void
-ngx_http_file_cache_loader_sleep(ngx_http_file_cache_t *cache)
+ngx_http_file_cache_ram_free(ngx_http_file_cache_t *cache,
+    ngx_http_file_cache_ram_node_t *rn)
 {
-    ngx_msleep(cache->loader_sleep);
+    cache->ram->size -= rn->len;
+    cache->ram->count--;
 
-    ngx_time_update();
-
-    cache->last = ngx_current_msec;
-    cache->files = 0;
+    ngx_queue_remove(&rn->queue);
+    ngx_rbtree_delete(&cache->ram->rbtree, &rn->node);
+    ngx_slab_free_locked(cache->ram_shpool, rn);
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
+static ngx_http_file_cache_ram_node_t *
+ngx_http_file_cache_ram_lookup(ngx_http_file_cache_t *cache, u_char *key)
 {
-    u_char                 *p;
-    ngx_int_t               n;
-    ngx_uint_t              i;
-    ngx_http_cache_t        c;
-    ngx_http_file_cache_t  *cache;
+    ngx_int_t                        rc;
+    ngx_rbtree_key_t                 node_key;
+    ngx_rbtree_node_t               *node, *sentinel;
+    ngx_http_file_cache_ram_node_t  *rn;
 
-    if (name->len < 2 * NGX_HTTP_CACHE_KEY_LEN) {
-        return NGX_ERROR;
-    }
+    ngx_memcpy((u_char *) &node_key, key, sizeof(ngx_rbtree_key_t));
 
-    /*
-     * Temporary files in cache have a suffix consisting of a dot
-     * followed by 10 digits.
-     */
+    node = cache->ram->rbtree.root;
+    sentinel = cache->ram->rbtree.sentinel;
 
-    if (name->len >= 2 * NGX_HTTP_CACHE_KEY_LEN + 1 + 10
-        && name->data[name->len - 10 - 1] == '.')
-    {
-        return NGX_OK;
-    }
+    while (node != sentinel) {
 
-    if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
-                      "cache file \"%s\" is too small", name->data);
-        return NGX_ERROR;
-    }
+        if (node_key < node->key) {
+            node = node->left;
+            continue;
+        }
 
-    ngx_memzero(&c, sizeof(ngx_http_cache_t));
-    cache = ctx->data;
+        if (node_key > node->key) {
+            node = node->right;
+            continue;
+        }
 
-    c.length = ctx->size;
-    c.fs_size = (ctx->fs_size + cache->bsize - 1) / cache->bsize;
+        /* node_key == node->key */
 
-    p = &name->data[name->len - 2 * NGX_HTTP_CACHE_KEY_LEN];
+        rn = (ngx_http_file_cache_ram_node_t *) node;
 
-    for (i = 0; i < NGX_HTTP_CACHE_KEY_LEN; i++) {
-        n = ngx_hextoi(p, 2);
+        rc = ngx_memcmp(&key[sizeof(ngx_rbtree_key_t)], rn->key,
+                        NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
 
-        if (n == NGX_ERROR) {
-            return NGX_ERROR;
+        if (rc == 0) {
+            return rn;
         }
 
-        p += 2;
-
-        c.key[i] = (u_char) n;
+        node = (rc < 0) ? node->left : node->right;
     }
 
-    return ngx_http_file_cache_add(cache, &c);
+    /* not found */
+
+    return NULL;
 }
 
 
-static ngx_int_t
-ngx_http_file_cache_add(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
+static void
+ngx_http_file_cache_ram_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
 {
-    ngx_http_file_cache_node_t  *fcn;
+    ngx_rbtree_node_t               **p;
+    ngx_http_file_cache_ram_node_t   *rn, *rnt;
 
-    ngx_shmtx_lock(&cache->shpool->mutex);
+    for ( ;; ) {
 
-    fcn = ngx_http_file_cache_lookup(cache, c->key);
+        if (node->key < temp->key) {
 
-    if (fcn == NULL) {
+            p = &temp->left;
 
-        fcn = ngx_slab_calloc_locked(cache->shpool,
-                                     sizeof(ngx_http_file_cache_node_t));
-        if (fcn == NULL) {
-            ngx_http_file_cache_set_watermark(cache);
+        } else if (node->key > temp->key) {
 
-            if (cache->fail_time != ngx_time()) {
-                cache->fail_time = ngx_time();
-                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0,
-                           "could not allocate node%s", cache->shpool->log_ctx);
-            }
+            p = &temp->right;
 
-            ngx_shmtx_unlock(&cache->shpool->mutex);
-            return NGX_ERROR;
+        } else { /* node->key == temp->key */
+
+            rn = (ngx_http_file_cache_ram_node_t *) node;
+            rnt = (ngx_http_file_cache_ram_node_t *) temp;
+
+            p = (ngx_memcmp(rn->key, rnt->key,
+                            NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t))
+                 < 0)
+                    ? &temp->left : &temp->right;
         }
 
-        cache->sh->count++;
+        if (*p == sentinel) {
+            break;
+        }
 
-        ngx_memcpy((u_char *) &fcn->node.key, c->key, sizeof(ngx_rbtree_key_t));
+        temp = *p;
+    }
 
-        ngx_memcpy(fcn->key, &c->key[sizeof(ngx_rbtree_key_t)],
-                   NGX_HTTP_CACHE_KEY_LEN - sizeof(ngx_rbtree_key_t));
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
 
-        ngx_rbtree_insert(&cache->sh->rbtree, &fcn->node);
 
-        fcn->uses = 1;
-        fcn->exists = 1;
-        fcn->fs_size = c->fs_size;
+static ngx_uint_t
+ngx_http_file_cache_ram_frequency(ngx_http_file_cache_ram_sh_t *ram,
+    u_char *key, ngx_uint_t increment)
+{
+    u_char      *counter[NGX_HTTP_CACHE_RAM_DEPTH];
+    uint32_t     hash;
+    ngx_uint_t   i, min;
 
-        cache->sh->size += c->fs_size;
+    /*
+     * the frequency is estimated with a count-min sketch, each row
+     * is indexed with its own part of the md5 key
+     */
 
-    } else {
-        ngx_queue_remove(&fcn->queue);
-    }
+    min = NGX_HTTP_CACHE_RAM_MAX_FREQ;
 
-    fcn->expire = ngx_time() + cache->inactive;
+    for (i = 0; i < NGX_HTTP_CACHE_RAM_DEPTH; i++) {
+        ngx_memcpy(&hash, &key[i * sizeof(uint32_t)], sizeof(uint32_t));
 
-    ngx_queue_insert_head(&cache->sh->queue, &fcn->queue);
+        counter[i] = ram->sketch + i * ram->width + (hash & (ram->width - 1));
 
-    ngx_shmtx_unlock(&cache->shpool->mutex);
+        if (*counter[i] < min) {
+            min = *counter[i];
+        }
+    }
 
-    return NGX_OK;
-}
+    if (!increment) {
+        return min;
+    }
 
+    if (min < NGX_HTTP_CACHE_RAM_MAX_FREQ) {
 
-static ngx_int_t
-ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
-{
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ctx->log, 0,
-                   "http file cache delete: \"%s\"", path->data);
+        /* conservative update */
 
-    if (ngx_delete_file(path->data) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_CRIT, ctx->log, ngx_errno,
-                      ngx_delete_file_n " \"%s\" failed", path->data);
+        for (i = 0; i < NGX_HTTP_CACHE_RAM_DEPTH; i++) {
+            if (*counter[i] == min) {
+                (*counter[i])++;
+            }
+        }
+
+        min++;
     }
 
-    return NGX_OK;
-}
+    /* aging: all counters are halved periodically */
 
+    if (++ram->samples >= ram->width * NGX_HTTP_CACHE_RAM_DEPTH * 2) {
 
-static void
-ngx_http_file_cache_set_watermark(ngx_http_file_cache_t *cache)
-{
-    cache->sh->watermark = cache->sh->count - cache->sh->count / 8;
+        for (i = 0; i < NGX_HTTP_CACHE_RAM_DEPTH * ram->width; i++) {
+            ram->sketch[i] >>= 1;
+        }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
-                   "http file cache watermark: %ui", cache->sh->watermark);
+        ram->samples = 0;
+    }
+
+    return min;
 }
 
 
@@ -2407,13 +4190,13 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     off_t                   max_size, min_free;
     u_char                 *last, *p;
-    time_t                  inactive;
-    ssize_t                 size;
-    ngx_str_t               s, name, *value;
+    time_t                  inactive, index_interval;
+    ssize_t                 size, ram_size, ram_max_size;
+    ngx_str_t               s, name, ram_name, *value;
     ngx_int_t               loader_files, manager_files;
     ngx_msec_t              loader_sleep, manager_sleep, loader_threshold,
                             manager_threshold;
-    ngx_uint_t              i, n, use_temp_path;
+    ngx_uint_t              i, n, use_temp_path, index, eviction;
     ngx_array_t            *caches;
     ngx_http_file_cache_t  *cache, **ce;
 
@@ -2431,6 +4214,14 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     inactive = 600;
 
+    index = 0;
+    index_interval = 300;
+
+    eviction = NGX_HTTP_CACHE_EVICTION_LRU;
+
+    ram_size = 0;
+    ram_max_size = 16384;
+
     loader_files = 100;
     loader_sleep = 50;
     loader_threshold = 200;
@@ -2514,6 +4305,98 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "index=", 6) == 0) {
+
+            if (ngx_strcmp(&value[i].data[6], "on") == 0) {
+                index = 1;
+
+            } else if (ngx_strcmp(&value[i].data[6], "off") == 0) {
+                index = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid index value \"%V\", "
+                                   "it must be \"on\" or \"off\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_interval=", 15) == 0) {
+
+            s.len = value[i].len - 15;
+            s.data = value[i].data + 15;
+
+            index_interval = ngx_parse_time(&s, 1);
+            if (index_interval == (time_t) NGX_ERROR || index_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                              "invalid index_interval value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "eviction=", 9) == 0) {
+
+            if (ngx_strcmp(&value[i].data[9], "lru") == 0) {
+                eviction = NGX_HTTP_CACHE_EVICTION_LRU;
+
+            } else if (ngx_strcmp(&value[i].data[9], "slru") == 0) {
+                eviction = NGX_HTTP_CACHE_EVICTION_SLRU;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid eviction value \"%V\", "
+                                   "it must be \"lru\" or \"slru\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_cache=", 10) == 0) {
+
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            ram_size = ngx_parse_size(&s);
+
+            if (ram_size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_cache value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (ram_size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "ram cache \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ram_max_size=", 13) == 0) {
+
+            s.len = value[i].len - 13;
+            s.data = value[i].data + 13;
+
+            ram_max_size = ngx_parse_size(&s);
+
+            if (ram_max_size == NGX_ERROR || ram_max_size == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid ram_max_size value \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
 
             name.data = value[i].data + 10;
@@ -2708,6 +4591,9 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->manager_files = manager_files;
     cache->manager_sleep = manager_sleep;
     cache->manager_threshold = manager_threshold;
+    cache->index = index;
+    cache->index_interval = index_interval;
+    cache->eviction = eviction;
 
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
@@ -2728,6 +4614,33 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->shm_zone->init = ngx_http_file_cache_init;
     cache->shm_zone->data = cache;
 
+    if (ram_size) {
+        ram_name.len = name.len + sizeof(":ram") - 1;
+        ram_name.data = ngx_pnalloc(cf->pool, ram_name.len);
+        if (ram_name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_sprintf(ram_name.data, "%V:ram", &name);
+
+        cache->ram_zone = ngx_shared_memory_add(cf, &ram_name, ram_size,
+                                                cmd->post);
+        if (cache->ram_zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        if (cache->ram_zone->data) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate zone \"%V\"", &ram_name);
+            return NGX_CONF_ERROR;
+        }
+
+        cache->ram_zone->init = ngx_http_file_cache_ram_init;
+        cache->ram_zone->data = cache;
+
+        cache->ram_max_size = ram_max_size;
+    }
+
     cache->use_temp_path = use_temp_path;
 
     cache->inactive = inactive;
@@ -17,6 +17,30 @@ typedef struct {
 } ngx_http_huff_encode_code_t;
 
 
+#define NGX_HTTP_HUFF_CACHE_SIZE  256
+#define NGX_HTTP_HUFF_CACHE_LEN   64
+
+typedef struct {
+    uint32_t  hash;
+    u_char    len;
+    u_char    hlen;
+    u_char    src[NGX_HTTP_HUFF_CACHE_LEN];
+    u_char    dst[NGX_HTTP_HUFF_CACHE_LEN];
+} ngx_http_huff_cache_t;
+
+
+static size_t ngx_http_huff_encode_string(u_char *src, size_t len,
+    u_char *dst, ngx_uint_t lower);
+
+
+/*
+ * the same short strings, such as header names and common values,
+ * are encoded over and over again, so the results are cached
+ */
+
+static ngx_http_huff_cache_t  ngx_http_huff_cache[NGX_HTTP_HUFF_CACHE_SIZE];
+
+
 static ngx_http_huff_encode_code_t  ngx_http_huff_encode_table[256] =
 {
     {0x00001ff8, 13}, {0x007fffd8, 23}, {0x0fffffe2, 28}, {0x0fffffe3, 28},
@@ -190,6 +214,42 @@ static ngx_http_huff_encode_code_t  ngx_http_huff_encode_table_lc[256] =
 
 size_t
 ngx_http_huff_encode(u_char *src, size_t len, u_char *dst, ngx_uint_t lower)
+{
+    size_t                  hlen;
+    uint32_t                hash;
+    ngx_http_huff_cache_t  *hc;
+
+    if (len == 0 || len > NGX_HTTP_HUFF_CACHE_LEN) {
+        return ngx_http_huff_encode_string(src, len, dst, lower);
+    }
+
+    hash = ngx_murmur_hash2(src, len) ^ (uint32_t) lower;
+
+    hc = &ngx_http_huff_cache[hash % NGX_HTTP_HUFF_CACHE_SIZE];
+
+    if (hc->hash == hash && hc->len == len
+        && ngx_memcmp(hc->src, src, len) == 0)
+    {
+        ngx_memcpy(dst, hc->dst, hc->hlen);
+        return hc->hlen;
+    }
+
+    hlen = ngx_http_huff_encode_string(src, len, dst, lower);
+
+    hc->hash = hash;
+    hc->len = (u_char) len;
+    hc->hlen = (u_char) hlen;
+
+    ngx_memcpy(hc->src, src, len);
+    ngx_memcpy(hc->dst, dst, hlen);
+
+    return hlen;
+}
+
+
+static size_t
+ngx_http_huff_encode_string(u_char *src, size_t len, u_char *dst,
+    ngx_uint_t lower)
 {
     u_char                       *end;
     size_t                        hlen;
@@ -210,6 +270,19 @@ ngx_http_huff_encode(u_char *src, size_t len, u_char *dst, ngx_uint_t lower)
         code = next->code;
         pending += next->len;
 
+#if (NGX_PTR_SIZE == 8)
+
+        /* codes are at most 30 bits long, so two of them fit in a word */
+
+        if (src != end) {
+            next = &table[*src++];
+
+            code = (code << next->len) | next->code;
+            pending += next->len;
+        }
+
+#endif
+
         /* accumulate bits */
         if (pending < sizeof(buf) * 8) {
             buf |= code << (sizeof(buf) * 8 - pending);
@@ -9,6 +9,14 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 
+#if (NGX_HAVE_SSE2)
+#include <emmintrin.h>
+#endif
+
+
+static ngx_inline u_char *ngx_http_parse_skip_uri(u_char *p, u_char *last);
+static ngx_inline u_char *ngx_http_parse_skip_value(u_char *p, u_char *last);
+
 
 static uint32_t  usual[] = {
     0x00000000, /* 0000 0000 0000 0000  0000 0000 0000 0000 */
@@ -98,6 +106,126 @@ static uint32_t  usual[] = {
 #endif
 
 
+/*
+ * the fast paths below skip runs of bytes which do not change the state
+ * of the parsers, 16 bytes at a time with SSE2, or 8 bytes at a time
+ */
+
+#define ngx_http_parse_bytes(c)  ((uint64_t) (c) * 0x0101010101010101ULL)
+
+#define ngx_http_parse_has_less(v, c)                                         \
+    (((v) - ngx_http_parse_bytes(c)) & ~(v) & ngx_http_parse_bytes(0x80))
+
+#define ngx_http_parse_has_zero(v)  ngx_http_parse_has_less(v, 1)
+
+
+static ngx_inline u_char *
+ngx_http_parse_skip_uri(u_char *p, u_char *last)
+{
+    uint64_t  v;
+#if (NGX_HAVE_SSE2)
+    int       mask;
+    __m128i   x, space, hash, del;
+
+    /* control characters, space, '#', and DEL */
+
+    space = _mm_set1_epi8(' ');
+    hash = _mm_set1_epi8('#');
+    del = _mm_set1_epi8(0x7f);
+
+    while (last - p >= 16) {
+        x = _mm_loadu_si128((__m128i *) p);
+
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(
+                       _mm_cmpeq_epi8(_mm_min_epu8(x, space), x),
+                       _mm_or_si128(_mm_cmpeq_epi8(x, hash),
+                                    _mm_cmpeq_epi8(x, del))));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while (last - p >= 8) {
+        ngx_memcpy(&v, p, 8);
+
+        if (ngx_http_parse_has_less(v, ' ' + 1)
+            || ngx_http_parse_has_zero(v ^ ngx_http_parse_bytes('#'))
+            || ngx_http_parse_has_zero(v ^ ngx_http_parse_bytes(0x7f)))
+        {
+            break;
+        }
+
+        p += 8;
+    }
+
+    for ( /* void */ ; p < last; p++) {
+        if (*p <= ' ' || *p == '#' || *p == 0x7f) {
+            break;
+        }
+    }
+
+    return p;
+}
+
+
+static ngx_inline u_char *
+ngx_http_parse_skip_value(u_char *p, u_char *last)
+{
+    uint64_t  v;
+#if (NGX_HAVE_SSE2)
+    int       mask;
+    __m128i   x, cr, lf, zero;
+
+    /* CR, LF, and NUL */
+
+    cr = _mm_set1_epi8(CR);
+    lf = _mm_set1_epi8(LF);
+    zero = _mm_setzero_si128();
+
+    while (last - p >= 16) {
+        x = _mm_loadu_si128((__m128i *) p);
+
+        mask = _mm_movemask_epi8(
+                   _mm_or_si128(_mm_cmpeq_epi8(x, zero),
+                                _mm_or_si128(_mm_cmpeq_epi8(x, cr),
+                                             _mm_cmpeq_epi8(x, lf))));
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 16;
+    }
+#endif
+
+    while (last - p >= 8) {
+        ngx_memcpy(&v, p, 8);
+
+        if (ngx_http_parse_has_zero(v)
+            || ngx_http_parse_has_zero(v ^ ngx_http_parse_bytes(CR))
+            || ngx_http_parse_has_zero(v ^ ngx_http_parse_bytes(LF)))
+        {
+            break;
+        }
+
+        p += 8;
+    }
+
+    for ( /* void */ ; p < last; p++) {
+        if (*p == CR || *p == LF || *p == '\0') {
+            break;
+        }
+    }
+
+    return p;
+}
+
+
 /* gcc, icc, msvc and others compile these switches as an jump table */
 
 ngx_int_t
@@ -630,6 +758,7 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1U << (ch & 0x1f))) {
+                p = ngx_http_parse_skip_uri(p + 1, b->last) - 1;
                 break;
             }
 
@@ -844,7 +973,7 @@ ngx_int_t
 ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
     ngx_uint_t allow_underscores)
 {
-    u_char      c, ch, *p;
+    u_char      c, ch, *p, *m;
     ngx_uint_t  hash, i;
     enum {
         sw_start = 0,
@@ -1022,6 +1151,24 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
             case '\0':
                 r->header_end = p;
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+            default:
+                m = ngx_http_parse_skip_value(p + 1, b->last);
+
+                /* trailing spaces are not included in the value */
+
+                if (m[-1] == ' ') {
+                    for (r->header_end = m - 1;
+                         r->header_end[-1] == ' ';
+                         r->header_end--)
+                    {
+                        /* void */
+                    }
+
+                    state = sw_space_after_value;
+                }
+
+                p = m - 1;
+                break;
             }
             break;
 
@@ -33,6 +33,8 @@ static ngx_int_t ngx_http_upstream_cache_etag(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 static ngx_int_t ngx_http_upstream_cache_age(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
+static ngx_int_t ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
@@ -445,6 +447,21 @@ static ngx_http_variable_t  ngx_http_upstream_vars[] = {
       ngx_http_upstream_cache_age, 0,
       NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
 
+    { ngx_string("upstream_cache_hits"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, hits),
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
+    { ngx_string("upstream_cache_misses"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, misses),
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
+    { ngx_string("upstream_cache_evictions"), NULL,
+      ngx_http_upstream_cache_counter,
+      offsetof(ngx_http_file_cache_sh_t, evictions),
+      NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_NOHASH, 0 },
+
 #endif
 
     { ngx_string("upstream_http_"), NULL, ngx_http_upstream_header_variable,
@@ -760,6 +777,12 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
                 return;
             }
 
+            if (u->init_peer && u->init_peer(r) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
             ngx_http_upstream_connect(r, u);
 
             return;
@@ -829,6 +852,12 @@ found:
         return;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
     u->peer.start_time = ngx_current_msec;
 
     if (u->conf->next_upstream_tries
@@ -915,6 +944,7 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
         c->lock = u->conf->cache_lock;
         c->lock_timeout = u->conf->cache_lock_timeout;
         c->lock_age = u->conf->cache_lock_age;
+        c->lock_stream = u->conf->cache_lock_stream;
 
         u->cache_status = NGX_HTTP_CACHE_MISS;
     }
@@ -966,6 +996,8 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     case NGX_OK:
 
+        (void) ngx_atomic_fetch_add(&c->file_cache->sh->hits, 1);
+
         return NGX_OK;
 
     case NGX_HTTP_CACHE_STALE:
@@ -1011,9 +1043,13 @@ ngx_http_upstream_cache(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->cache_status = NGX_HTTP_CACHE_HIT;
 
+        (void) ngx_atomic_fetch_add(&c->file_cache->sh->hits, 1);
+
         return rc;
     }
 
+    (void) ngx_atomic_fetch_add(&c->file_cache->sh->misses, 1);
+
     if (ngx_http_upstream_cache_check_range(r, u) == NGX_DECLINED) {
         u->cacheable = 0;
     }
@@ -1257,6 +1293,12 @@ ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx)
         goto failed;
     }
 
+    if (u->init_peer && u->init_peer(r) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        goto failed;
+    }
+
     ngx_resolve_name_done(ctx);
     ur->ctx = NULL;
 
@@ -4329,6 +4371,9 @@ ngx_http_upstream_process_request(ngx_http_request_t *r,
 
             } else if (p->upstream_error) {
                 ngx_http_file_cache_free(r->cache, p->temp_file);
+
+            } else {
+                ngx_http_file_cache_progress(r, p->temp_file);
             }
         }
 
@@ -6329,6 +6374,35 @@ ngx_http_upstream_cache_age(ngx_http_request_t *r,
     return NGX_OK;
 }
 
+
+static ngx_int_t
+ngx_http_upstream_cache_counter(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    u_char        *p;
+    ngx_atomic_t  *counter;
+
+    if (r->upstream == NULL || r->cache == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_ATOMIC_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    counter = (ngx_atomic_t *) ((char *) r->cache->file_cache->sh + data);
+
+    v->len = ngx_sprintf(p, "%uA", *counter) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
 #endif
 
 
@@ -6561,6 +6635,11 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+
         goto invalid;
     }
 
@@ -6581,6 +6660,8 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
+    us->host = u.host;
+    us->port = u.port;
     us->weight = weight;
     us->max_conns = max_conns;
     us->max_fails = max_fails;
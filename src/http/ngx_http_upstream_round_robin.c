@@ -15,7 +15,7 @@
 
 
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
-    ngx_http_upstream_rr_peer_data_t *rrp);
+    ngx_http_upstream_rr_peer_data_t *rrp, ngx_int_t *weights);
 
 #if (NGX_HTTP_SSL)
 
@@ -103,6 +103,9 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+                peer[n].host = server[i].resolve ? i + 1 : 0;
+#endif
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
@@ -173,6 +176,9 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+                peer[n].host = server[i].resolve ? i + 1 : 0;
+#endif
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
@@ -275,12 +281,22 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
     rrp->current = NULL;
     rrp->config = 0;
 
+    ngx_http_upstream_rr_peers_rlock(rrp->peers);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    if (rrp->peers->config) {
+        rrp->config = *rrp->peers->config;
+    }
+#endif
+
     n = rrp->peers->number;
 
     if (rrp->peers->next && rrp->peers->next->number > n) {
         n = rrp->peers->next->number;
     }
 
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
     if (n <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
         rrp->data = 0;
@@ -432,7 +448,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 {
     ngx_http_upstream_rr_peer_data_t  *rrp = data;
 
-    ngx_int_t                      rc;
+    ngx_int_t                      rc, *weights;
     ngx_uint_t                     i, n;
     ngx_http_upstream_rr_peer_t   *peer;
     ngx_http_upstream_rr_peers_t  *peers;
@@ -444,16 +460,49 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->connection = NULL;
 
     peers = rrp->peers;
-    ngx_http_upstream_rr_peers_wlock(peers);
+    weights = NULL;
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /*
+     * with current weights kept per worker process, peers are only
+     * modified under their own locks, and a shared lock is enough;
+     * the weights are replaced along with the list of peers, so they
+     * are only looked at under the lock
+     */
+
+    if (peers->worker_weights) {
+        ngx_http_upstream_rr_peers_rlock(peers);
+
+        weights = ngx_event_peer_worker_weights(peers->worker_weights,
+                                                peers->number);
+
+    } else
+#endif
+    {
+        ngx_http_upstream_rr_peers_wlock(peers);
+    }
+
+    if (ngx_http_upstream_rr_peers_changed(peers, rrp)) {
+
+        /* peers were changed after the request was started */
+
+        ngx_http_upstream_rr_peers_unlock(peers);
+        goto busy;
+    }
 
     if (peers->single) {
         peer = peers->peer;
 
-        if (peer->down) {
+        ngx_http_upstream_rr_peer_lock(peers, peer);
+
+        if (peer->down || peer->unhealthy) {
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
             goto failed;
         }
 
         if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
             goto failed;
         }
 
@@ -463,7 +512,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
         /* there are several peers */
 
-        peer = ngx_http_upstream_get_peer(rrp);
+        peer = ngx_http_upstream_get_peer(rrp, weights);
 
         if (peer == NULL) {
             goto failed;
@@ -480,6 +529,7 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
     peer->conns++;
 
+    ngx_http_upstream_rr_peer_unlock(peers, peer);
     ngx_http_upstream_rr_peers_unlock(peers);
 
     return NGX_OK;
@@ -507,11 +557,13 @@ failed:
             return rc;
         }
 
-        ngx_http_upstream_rr_peers_wlock(peers);
+        ngx_http_upstream_rr_peers_rlock(peers);
     }
 
     ngx_http_upstream_rr_peers_unlock(peers);
 
+busy:
+
     pc->name = peers->name;
 
     return NGX_BUSY;
@@ -519,24 +571,31 @@ failed:
 
 
 static ngx_http_upstream_rr_peer_t *
-ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
+ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_int_t *weights)
 {
-    time_t                        now;
-    uintptr_t                     m;
-    ngx_int_t                     total;
-    ngx_uint_t                    i, n, p;
-    ngx_http_upstream_rr_peer_t  *peer, *best;
+    time_t                         now;
+    uintptr_t                      m;
+    ngx_int_t                      total, *current, *best_current;
+    ngx_uint_t                     i, n, p;
+    ngx_http_upstream_rr_peer_t   *peer, *best;
+    ngx_http_upstream_rr_peers_t  *peers;
 
     now = ngx_time();
 
+    peers = rrp->peers;
+
+again:
+
     best = NULL;
     total = 0;
 
 #if (NGX_SUPPRESS_WARN)
     p = 0;
+    best_current = NULL;
 #endif
 
-    for (peer = rrp->peers->peer, i = 0;
+    for (peer = peers->peer, i = 0;
          peer;
          peer = peer->next, i++)
     {
@@ -547,7 +606,7 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -562,15 +621,24 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        peer->current_weight += peer->effective_weight;
+        current = weights ? &weights[i] : &peer->current_weight;
+
+        *current += peer->effective_weight;
         total += peer->effective_weight;
 
         if (peer->effective_weight < peer->weight) {
-            peer->effective_weight++;
+            ngx_http_upstream_rr_peer_lock(peers, peer);
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            ngx_http_upstream_rr_peer_unlock(peers, peer);
         }
 
-        if (best == NULL || peer->current_weight > best->current_weight) {
+        if (best == NULL || *current > *best_current) {
             best = peer;
+            best_current = current;
             p = i;
         }
     }
@@ -579,14 +647,24 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
         return NULL;
     }
 
-    rrp->current = best;
-
     n = p / (8 * sizeof(uintptr_t));
     m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
 
     rrp->tried[n] |= m;
 
-    best->current_weight -= total;
+    *best_current -= total;
+
+    ngx_http_upstream_rr_peer_lock(peers, best);
+
+    if (best->max_conns && best->conns >= best->max_conns) {
+
+        /* the limit was reached by another worker process */
+
+        ngx_http_upstream_rr_peer_unlock(peers, best);
+        goto again;
+    }
+
+    rrp->current = best;
 
     if (now - best->checked > best->fail_timeout) {
         best->checked = now;
@@ -604,6 +682,9 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     time_t                       now;
     ngx_http_upstream_rr_peer_t  *peer;
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    ngx_uint_t                   zombie;
+#endif
 
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
@@ -619,7 +700,18 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
         peer->conns--;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        zombie = (peer->zombie && peer->conns == 0);
+#endif
+
         ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+        if (zombie) {
+            ngx_http_upstream_zone_free_peer(rrp->peers, peer);
+        }
+#endif
+
         ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
         pc->tries = 0;
@@ -661,7 +753,22 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     peer->conns--;
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+    zombie = (peer->zombie && peer->conns == 0);
+#endif
+
     ngx_http_upstream_rr_peer_unlock(rrp->peers, peer);
+
+#if (NGX_HTTP_UPSTREAM_ZONE)
+
+    /* the peer was removed from the list while in use */
+
+    if (zombie) {
+        ngx_http_upstream_zone_free_peer(rrp->peers, peer);
+    }
+
+#endif
+
     ngx_http_upstream_rr_peers_unlock(rrp->peers);
 
     if (pc->tries) {
@@ -38,7 +38,14 @@ struct ngx_http_upstream_rr_peer_s {
     ngx_msec_t                      slow_start;
     ngx_msec_t                      start_time;
 
+    ngx_msec_t                      ewma;
+    ngx_msec_t                      ewma_time;
+
     ngx_uint_t                      down;
+    ngx_uint_t                      unhealthy;
+
+    ngx_uint_t                      check_fails;
+    ngx_uint_t                      check_passes;
 
 #if (NGX_HTTP_SSL || NGX_COMPAT)
     void                           *ssl_session;
@@ -47,6 +54,8 @@ struct ngx_http_upstream_rr_peer_s {
 
 #if (NGX_HTTP_UPSTREAM_ZONE)
     ngx_atomic_t                    lock;
+    ngx_uint_t                      host;
+    ngx_uint_t                      zombie;
 #endif
 
     ngx_http_upstream_rr_peer_t    *next;
@@ -62,6 +71,9 @@ struct ngx_http_upstream_rr_peers_s {
     ngx_slab_pool_t                *shpool;
     ngx_atomic_t                    rwlock;
     ngx_http_upstream_rr_peers_t   *zone_next;
+    ngx_int_t                      *worker_weights;
+    ngx_msec_t                      check_time;
+    ngx_uint_t                     *config;
 #endif
 
     ngx_uint_t                      total_weight;
@@ -111,6 +123,9 @@ struct ngx_http_upstream_rr_peers_s {
         ngx_rwlock_unlock(&peer->lock);                                       \
     }
 
+#define ngx_http_upstream_rr_peers_changed(peers, rrp)                        \
+    ((peers)->config && *(peers)->config != (rrp)->config)
+
 #else
 
 #define ngx_http_upstream_rr_peers_rlock(peers)
@@ -118,6 +133,7 @@ struct ngx_http_upstream_rr_peers_s {
 #define ngx_http_upstream_rr_peers_unlock(peers)
 #define ngx_http_upstream_rr_peer_lock(peers, peer)
 #define ngx_http_upstream_rr_peer_unlock(peers, peer)
+#define ngx_http_upstream_rr_peers_changed(peers, rrp)  0
 
 #endif
 
@@ -142,6 +158,11 @@ ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
 void ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+#if (NGX_HTTP_UPSTREAM_ZONE)
+void ngx_http_upstream_zone_free_peer(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer);
+#endif
+
 #if (NGX_HTTP_SSL)
 ngx_int_t
     ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
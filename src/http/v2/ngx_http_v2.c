@@ -273,6 +273,14 @@ ngx_http_v2_init(ngx_event_t *rev)
         return;
     }
 
+    if (h2scf->dynamic_table_size
+        && ngx_http_v2_init_encoder(h2c, h2scf->dynamic_table_size)
+           != NGX_OK)
+    {
+        ngx_http_close_connection(c);
+        return;
+    }
+
     if (ngx_http_v2_send_settings(h2c) == NGX_ERROR) {
         ngx_http_close_connection(c);
         return;
@@ -2304,6 +2312,10 @@ ngx_http_v2_state_settings_params(ngx_http_v2_connection_t *h2c, u_char *pos,
 
         case NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING:
 
+            if (h2c->encoder.max) {
+                ngx_http_v2_encoder_table_size(h2c, value);
+            }
+
             h2c->table_update = 1;
             break;
 
@@ -51,6 +51,9 @@
 
 #define NGX_HTTP_V2_DEFAULT_WEIGHT       16
 
+#define NGX_HTTP_V2_TABLE_SIZE           4096
+#define NGX_HTTP_V2_MAX_TABLE_SIZE       65536
+
 
 typedef struct ngx_http_v2_connection_s   ngx_http_v2_connection_t;
 typedef struct ngx_http_v2_node_s         ngx_http_v2_node_t;
@@ -67,6 +70,7 @@ typedef struct {
     ngx_uint_t                       concurrent_streams;
     size_t                           preread_size;
     ngx_uint_t                       streams_index_mask;
+    size_t                           dynamic_table_size;
 } ngx_http_v2_srv_conf_t;
 
 
@@ -121,6 +125,35 @@ typedef struct {
 } ngx_http_v2_hpack_t;
 
 
+typedef struct {
+    ngx_uint_t                       name_hash;
+    ngx_uint_t                       value_hash;
+    ngx_str_t                        name;
+    ngx_str_t                        value;
+} ngx_http_v2_hpack_entry_t;
+
+
+typedef struct {
+    ngx_http_v2_hpack_entry_t       *entries;
+
+    ngx_uint_t                       added;
+    ngx_uint_t                       deleted;
+    ngx_uint_t                       allocated;
+
+    size_t                           max;
+    size_t                           size;
+    size_t                           min;
+    size_t                           used;
+
+    u_char                          *storage;
+    u_char                          *end;
+    u_char                          *pos;
+
+    off_t                            raw_bytes;
+    off_t                            encoded_bytes;
+} ngx_http_v2_hpack_encoder_t;
+
+
 struct ngx_http_v2_connection_s {
     ngx_connection_t                *connection;
     ngx_http_connection_t           *http_connection;
@@ -146,6 +179,7 @@ struct ngx_http_v2_connection_s {
     ngx_http_v2_state_t              state;
 
     ngx_http_v2_hpack_t              hpack;
+    ngx_http_v2_hpack_encoder_t      encoder;
 
     ngx_pool_t                      *pool;
 
@@ -304,6 +338,8 @@ void ngx_http_v2_close_stream(ngx_http_v2_stream_t *stream, ngx_int_t rc);
 
 ngx_int_t ngx_http_v2_send_output_queue(ngx_http_v2_connection_t *h2c);
 
+ngx_int_t ngx_http_v2_upstream_init_peer(ngx_http_request_t *r);
+
 
 ngx_str_t *ngx_http_v2_get_static_name(ngx_uint_t index);
 ngx_str_t *ngx_http_v2_get_static_value(ngx_uint_t index);
@@ -314,6 +350,16 @@ ngx_int_t ngx_http_v2_add_header(ngx_http_v2_connection_t *h2c,
     ngx_http_v2_header_t *header);
 ngx_int_t ngx_http_v2_table_size(ngx_http_v2_connection_t *h2c, size_t size);
 
+ngx_int_t ngx_http_v2_init_encoder(ngx_http_v2_connection_t *h2c,
+    size_t size);
+void ngx_http_v2_encoder_table_size(ngx_http_v2_connection_t *h2c,
+    size_t size);
+void ngx_http_v2_reset_encoder(ngx_http_v2_connection_t *h2c);
+u_char *ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c,
+    u_char *pos);
+u_char *ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp);
+
 
 #define ngx_http_v2_prefix(bits)  ((1 << (bits)) - 1)
 
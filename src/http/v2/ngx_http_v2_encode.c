@@ -12,6 +12,13 @@
 
 static u_char *ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix,
     ngx_uint_t value);
+static ngx_uint_t ngx_http_v2_encoder_indexable(
+    ngx_http_v2_hpack_encoder_t *enc, ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_v2_encoder_add(ngx_http_v2_hpack_encoder_t *enc,
+    ngx_str_t *name, ngx_str_t *value, ngx_uint_t name_hash,
+    ngx_uint_t value_hash);
+static void ngx_http_v2_encoder_evict(ngx_http_v2_hpack_encoder_t *enc,
+    size_t size);
 
 
 u_char *
@@ -60,3 +67,301 @@ ngx_http_v2_write_int(u_char *pos, ngx_uint_t prefix, ngx_uint_t value)
 
     return pos;
 }
+
+
+ngx_int_t
+ngx_http_v2_init_encoder(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_encoder_t  *enc;
+
+    enc = &h2c->encoder;
+
+    /*
+     * An entry takes at least 33 octets, and the insertion policy
+     * limits data of an entry to a quarter of the table, hence the
+     * storage twice as large as the table always has room for
+     * a new entry after the older ones are evicted.
+     */
+
+    enc->allocated = size / 33 + 1;
+
+    enc->entries = ngx_palloc(h2c->connection->pool,
+                              sizeof(ngx_http_v2_hpack_entry_t)
+                              * enc->allocated);
+    if (enc->entries == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->storage = ngx_pnalloc(h2c->connection->pool, 2 * size);
+    if (enc->storage == NULL) {
+        return NGX_ERROR;
+    }
+
+    enc->end = enc->storage + 2 * size;
+    enc->pos = enc->storage;
+
+    enc->max = size;
+    enc->size = ngx_min(size, NGX_HTTP_V2_TABLE_SIZE);
+    enc->min = enc->size;
+
+    h2c->table_update = 1;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_v2_encoder_table_size(ngx_http_v2_connection_t *h2c, size_t size)
+{
+    ngx_http_v2_hpack_encoder_t  *enc;
+
+    enc = &h2c->encoder;
+
+    size = ngx_min(size, enc->max);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 encoder table size: %uz was:%uz", size, enc->size);
+
+    ngx_http_v2_encoder_evict(enc, size);
+
+    if (size < enc->min) {
+        enc->min = size;
+    }
+
+    enc->size = size;
+}
+
+
+void
+ngx_http_v2_reset_encoder(ngx_http_v2_connection_t *h2c)
+{
+    ngx_http_v2_hpack_encoder_t  *enc;
+
+    /*
+     * A header block was encoded but is not going to be sent,
+     * so the peer table is resynchronized by shrinking it to zero
+     * at the start of the next block.
+     */
+
+    enc = &h2c->encoder;
+
+    if (enc->max == 0) {
+        return;
+    }
+
+    ngx_http_v2_encoder_evict(enc, 0);
+
+    enc->min = 0;
+
+    h2c->table_update = 1;
+}
+
+
+u_char *
+ngx_http_v2_write_table_update(ngx_http_v2_connection_t *h2c, u_char *pos)
+{
+    ngx_http_v2_hpack_encoder_t  *enc;
+
+    enc = &h2c->encoder;
+
+    if (enc->max == 0) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: 0");
+        *pos++ = (1 << 5) | 0;
+        return pos;
+    }
+
+    if (enc->min < enc->size) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 table size update: %uz", enc->min);
+
+        *pos = 1 << 5;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->min);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 table size update: %uz", enc->size);
+
+    *pos = 1 << 5;
+    pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(5), enc->size);
+
+    enc->min = enc->size;
+
+    return pos;
+}
+
+
+u_char *
+ngx_http_v2_write_header(ngx_http_v2_connection_t *h2c, u_char *pos,
+    ngx_uint_t index, ngx_str_t *name, ngx_str_t *value, u_char *tmp)
+{
+    ngx_uint_t                    i, n, name_index, name_hash, value_hash;
+    ngx_http_v2_hpack_entry_t    *entry;
+    ngx_http_v2_hpack_encoder_t  *enc;
+
+    enc = &h2c->encoder;
+
+    if (name == NULL) {
+        name = ngx_http_v2_get_static_name(index);
+    }
+
+    enc->raw_bytes += name->len + sizeof(": ") - 1
+                      + value->len + sizeof(CRLF) - 1;
+
+    if (enc->max == 0) {
+
+        if (index) {
+            *pos++ = ngx_http_v2_inc_indexed(index);
+
+        } else {
+            *pos++ = 0;
+            pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+        }
+
+        return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+    }
+
+    name_hash = 0;
+
+    for (i = 0; i < name->len; i++) {
+        name_hash = ngx_hash(name_hash, ngx_tolower(name->data[i]));
+    }
+
+    value_hash = ngx_hash_key(value->data, value->len);
+
+    name_index = index;
+
+    for (n = enc->added; n != enc->deleted; n--) {
+        entry = &enc->entries[(n - 1) % enc->allocated];
+
+        if (entry->name_hash != name_hash
+            || entry->name.len != name->len
+            || ngx_strncasecmp(entry->name.data, name->data, name->len) != 0)
+        {
+            continue;
+        }
+
+        if (entry->value_hash == value_hash
+            && entry->value.len == value->len
+            && ngx_memcmp(entry->value.data, value->data, value->len) == 0)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                           "http2 encoder table hit: %ui",
+                           62 + enc->added - n);
+
+            *pos = 0x80;
+            return ngx_http_v2_write_int(pos, ngx_http_v2_prefix(7),
+                                         62 + enc->added - n);
+        }
+
+        if (name_index == 0) {
+            name_index = 62 + enc->added - n;
+        }
+    }
+
+    if (ngx_http_v2_encoder_indexable(enc, name, value)
+        && ngx_http_v2_encoder_add(enc, name, value, name_hash, value_hash)
+           == NGX_OK)
+    {
+        *pos = 0x40;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(6), name_index);
+
+    } else {
+        *pos = 0;
+        pos = ngx_http_v2_write_int(pos, ngx_http_v2_prefix(4), name_index);
+    }
+
+    if (name_index == 0) {
+        pos = ngx_http_v2_write_name(pos, name->data, name->len, tmp);
+    }
+
+    return ngx_http_v2_write_value(pos, value->data, value->len, tmp);
+}
+
+
+static ngx_uint_t
+ngx_http_v2_encoder_indexable(ngx_http_v2_hpack_encoder_t *enc,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    if (name->len + value->len + 32 > enc->size / 4) {
+        return 0;
+    }
+
+    return !ngx_http_volatile_header(name);
+}
+
+
+static ngx_int_t
+ngx_http_v2_encoder_add(ngx_http_v2_hpack_encoder_t *enc, ngx_str_t *name,
+    ngx_str_t *value, ngx_uint_t name_hash, ngx_uint_t value_hash)
+{
+    u_char                     *p, *oldest;
+    size_t                      len;
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    ngx_http_v2_encoder_evict(enc, enc->size - (name->len + value->len + 32));
+
+    len = name->len + value->len;
+    p = enc->pos;
+
+    /*
+     * If the entry is declined, it is not added to the peer table either,
+     * and the peer keeps the entries evicted above; these are never
+     * referenced again and go first once the peer evicts anything.
+     */
+
+    if (enc->added != enc->deleted) {
+        oldest = enc->entries[enc->deleted % enc->allocated].name.data;
+
+        if (oldest < p) {
+            if (p + len > enc->end) {
+                p = enc->storage;
+
+                if (p + len > oldest) {
+                    return NGX_DECLINED;
+                }
+            }
+
+        } else if (p + len > oldest) {
+            return NGX_DECLINED;
+        }
+
+        if (enc->added - enc->deleted == enc->allocated) {
+            return NGX_DECLINED;
+        }
+
+    } else {
+        p = enc->storage;
+    }
+
+    entry = &enc->entries[enc->added++ % enc->allocated];
+
+    entry->name_hash = name_hash;
+    entry->value_hash = value_hash;
+
+    entry->name.len = name->len;
+    entry->name.data = p;
+    ngx_strlow(p, name->data, name->len);
+    p += name->len;
+
+    entry->value.len = value->len;
+    entry->value.data = p;
+    p = ngx_cpymem(p, value->data, value->len);
+
+    enc->pos = p;
+    enc->used += len + 32;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_encoder_evict(ngx_http_v2_hpack_encoder_t *enc, size_t size)
+{
+    ngx_http_v2_hpack_entry_t  *entry;
+
+    while (enc->used > size) {
+        entry = &enc->entries[enc->deleted++ % enc->allocated];
+        enc->used -= 32 + entry->name.len + entry->value.len;
+    }
+}
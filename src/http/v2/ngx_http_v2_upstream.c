@@ -0,0 +1,3499 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/* errors */
+#define NGX_HTTP_V2_NO_ERROR                     0x0
+#define NGX_HTTP_V2_PROTOCOL_ERROR               0x1
+#define NGX_HTTP_V2_INTERNAL_ERROR               0x2
+#define NGX_HTTP_V2_FLOW_CTRL_ERROR              0x3
+#define NGX_HTTP_V2_STREAM_CLOSED                0x5
+#define NGX_HTTP_V2_SIZE_ERROR                   0x6
+#define NGX_HTTP_V2_CANCEL                       0x8
+#define NGX_HTTP_V2_COMP_ERROR                   0x9
+
+/* frame sizes */
+#define NGX_HTTP_V2_RST_STREAM_SIZE              4
+#define NGX_HTTP_V2_PRIORITY_SIZE                5
+#define NGX_HTTP_V2_PING_SIZE                    8
+#define NGX_HTTP_V2_GOAWAY_SIZE                  8
+#define NGX_HTTP_V2_WINDOW_UPDATE_SIZE           4
+
+#define NGX_HTTP_V2_SETTINGS_PARAM_SIZE          6
+
+/* settings fields */
+#define NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING    0x1
+#define NGX_HTTP_V2_ENABLE_PUSH_SETTING          0x2
+#define NGX_HTTP_V2_MAX_STREAMS_SETTING          0x3
+#define NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING     0x4
+#define NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING       0x5
+
+/* static table indices */
+#define NGX_HTTP_V2_AUTHORITY_INDEX              1
+#define NGX_HTTP_V2_METHOD_INDEX                 2
+#define NGX_HTTP_V2_METHOD_GET_INDEX             2
+#define NGX_HTTP_V2_METHOD_POST_INDEX            3
+#define NGX_HTTP_V2_PATH_INDEX                   4
+#define NGX_HTTP_V2_PATH_ROOT_INDEX              4
+#define NGX_HTTP_V2_SCHEME_HTTP_INDEX            6
+#define NGX_HTTP_V2_SCHEME_HTTPS_INDEX           7
+
+
+#define NGX_HTTP_V2_UPSTREAM_WINDOW              (256 * 1024)
+#define NGX_HTTP_V2_UPSTREAM_STREAMS             100
+#define NGX_HTTP_V2_UPSTREAM_OUTPUT              (64 * 1024)
+#define NGX_HTTP_V2_UPSTREAM_IDLE_TIMEOUT        60000
+#define NGX_HTTP_V2_UPSTREAM_MAX_SID             0x7fff0000
+
+#define NGX_HTTP_V2_UPSTREAM_BUFFER_SIZE                                      \
+    (NGX_HTTP_V2_FRAME_HEADER_SIZE + NGX_HTTP_V2_DEFAULT_FRAME_SIZE)
+
+
+typedef struct ngx_http_v2_upstream_conn_s    ngx_http_v2_upstream_conn_t;
+typedef struct ngx_http_v2_upstream_stream_s  ngx_http_v2_upstream_stream_t;
+
+
+struct ngx_http_v2_upstream_conn_s {
+    ngx_queue_t                        queue;
+
+    ngx_connection_t                  *connection;
+    ngx_http_upstream_conf_t          *conf;
+
+    struct sockaddr                   *sockaddr;
+    socklen_t                          socklen;
+    ngx_str_t                          ssl_name;
+
+    ngx_queue_t                        streams;
+    ngx_uint_t                         processing;
+    ngx_uint_t                         concurrent_streams;
+    ngx_uint_t                         next_sid;
+
+    size_t                             init_window;
+    ssize_t                            send_window;
+    size_t                             recv_window;
+
+    ngx_buf_t                         *buffer;
+
+    u_char                            *header_block;
+    size_t                             header_len;
+    size_t                             header_size;
+    ngx_uint_t                         header_sid;
+    ngx_uint_t                         header_flags;
+
+    ngx_chain_t                       *out;
+    ngx_chain_t                      **last_out;
+    ngx_chain_t                       *free;
+    size_t                             queued;
+
+    ngx_http_v2_upstream_stream_t     *creator;
+
+    unsigned                           connected:1;
+    unsigned                           goaway:1;
+};
+
+
+typedef enum {
+    ngx_http_v2_upstream_st_head = 0,
+    ngx_http_v2_upstream_st_body,
+    ngx_http_v2_upstream_st_chunked,
+    ngx_http_v2_upstream_st_done
+} ngx_http_v2_upstream_state_e;
+
+
+struct ngx_http_v2_upstream_stream_s {
+    /* the fake connection must be the first member */
+    ngx_connection_t                   connection;
+    ngx_event_t                        read;
+    ngx_event_t                        write;
+
+    ngx_queue_t                        queue;
+
+    ngx_http_v2_upstream_conn_t       *h2c;
+    ngx_peer_connection_t             *peer;
+    ngx_uint_t                         id;
+
+    ssize_t                            send_window;
+    size_t                             recv_window;
+
+    ngx_chain_t                       *in;
+    ngx_chain_t                       *last_in;
+    ngx_chain_t                       *free;
+    size_t                             size;
+
+    ngx_buf_t                         *request;
+    ngx_http_v2_upstream_state_e       state;
+    off_t                              rest;
+    ngx_http_chunked_t                 chunked;
+
+    unsigned                           empty_line:1;
+    unsigned                           head:1;
+    unsigned                           response:1;
+    unsigned                           chunked_response:1;
+    unsigned                           out_closed:1;
+    unsigned                           in_closed:1;
+    unsigned                           blocked:1;
+    unsigned                           reset:1;
+    unsigned                           error:1;
+};
+
+
+typedef struct {
+    ngx_http_upstream_conf_t          *conf;
+    ngx_http_v2_upstream_stream_t     *stream;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+
+#if (NGX_HTTP_SSL)
+    ngx_event_set_peer_session_pt      original_set_session;
+    ngx_event_save_peer_session_pt     original_save_session;
+
+    ngx_str_t                          ssl_name;
+    ngx_uint_t                         ssl;
+#endif
+} ngx_http_v2_upstream_peer_data_t;
+
+
+static ngx_int_t ngx_http_v2_upstream_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_v2_upstream_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_v2_upstream_ssl_name(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_http_v2_upstream_peer_data_t *p);
+static ngx_int_t ngx_http_v2_upstream_set_session(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_v2_upstream_save_session(ngx_peer_connection_t *pc,
+    void *data);
+#endif
+
+static ngx_http_v2_upstream_conn_t *ngx_http_v2_upstream_find(
+    ngx_peer_connection_t *pc, ngx_http_v2_upstream_peer_data_t *p);
+static ngx_http_v2_upstream_conn_t *ngx_http_v2_upstream_connect(
+    ngx_peer_connection_t *pc, ngx_http_v2_upstream_peer_data_t *p);
+static void ngx_http_v2_upstream_connect_handler(ngx_event_t *ev);
+#if (NGX_HTTP_SSL)
+static ngx_int_t ngx_http_v2_upstream_ssl_init(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_peer_connection_t *pc, ngx_http_v2_upstream_peer_data_t *p);
+static void ngx_http_v2_upstream_ssl_handshake(ngx_connection_t *c);
+#endif
+static void ngx_http_v2_upstream_connected(ngx_http_v2_upstream_conn_t *h2c);
+static void ngx_http_v2_upstream_idle(ngx_http_v2_upstream_conn_t *h2c);
+static void ngx_http_v2_upstream_close(ngx_http_v2_upstream_conn_t *h2c);
+
+static void ngx_http_v2_upstream_read_handler(ngx_event_t *rev);
+static void ngx_http_v2_upstream_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_v2_upstream_send_output(
+    ngx_http_v2_upstream_conn_t *h2c);
+static void ngx_http_v2_upstream_unblock(ngx_http_v2_upstream_conn_t *h2c);
+
+static ngx_int_t ngx_http_v2_upstream_process(
+    ngx_http_v2_upstream_conn_t *h2c);
+static ngx_int_t ngx_http_v2_upstream_state_data(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *pos, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_headers(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t type, ngx_uint_t sid,
+    ngx_uint_t flags, u_char *pos, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_header_block(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *pos, u_char *end);
+static ngx_int_t ngx_http_v2_upstream_state_rst_stream(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_settings(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *pos, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_ping(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, ngx_uint_t flags,
+    u_char *pos, size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_goaway(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_v2_upstream_state_window_update(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, u_char *pos,
+    size_t len);
+static ngx_int_t ngx_http_v2_upstream_connection_error(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t status);
+
+static ngx_int_t ngx_http_v2_upstream_parse_headers(
+    ngx_http_v2_upstream_stream_t *s, ngx_uint_t flags, u_char *pos,
+    u_char *end);
+static ngx_int_t ngx_http_v2_upstream_parse_int(u_char **pos, u_char *end,
+    ngx_uint_t prefix, ngx_uint_t *value);
+static ngx_int_t ngx_http_v2_upstream_parse_string(
+    ngx_http_v2_upstream_stream_t *s, u_char **pos, u_char *end,
+    u_char **tmp, ngx_str_t *str);
+static ngx_int_t ngx_http_v2_upstream_hop_header(ngx_str_t *name);
+
+static ngx_int_t ngx_http_v2_upstream_queue_frame(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t type, ngx_uint_t flags,
+    ngx_uint_t sid, u_char *data, size_t len);
+static ngx_int_t ngx_http_v2_upstream_send_preface(
+    ngx_http_v2_upstream_conn_t *h2c);
+static ngx_int_t ngx_http_v2_upstream_send_window_update(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, size_t window);
+static ngx_int_t ngx_http_v2_upstream_send_rst_stream(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid, ngx_uint_t status);
+static ngx_int_t ngx_http_v2_upstream_send_goaway(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t status);
+
+static ngx_http_v2_upstream_stream_t *ngx_http_v2_upstream_create_stream(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_peer_connection_t *pc);
+static ngx_http_v2_upstream_stream_t *ngx_http_v2_upstream_find_stream(
+    ngx_http_v2_upstream_conn_t *h2c, ngx_uint_t sid);
+static void ngx_http_v2_upstream_close_stream(
+    ngx_http_v2_upstream_stream_t *s);
+static void ngx_http_v2_upstream_stream_error(
+    ngx_http_v2_upstream_stream_t *s, ngx_uint_t status);
+static void ngx_http_v2_upstream_post(ngx_event_t *ev);
+static ngx_int_t ngx_http_v2_upstream_append(ngx_http_v2_upstream_stream_t *s,
+    u_char *data, size_t len);
+static void ngx_http_v2_upstream_update_window(
+    ngx_http_v2_upstream_stream_t *s);
+
+static ssize_t ngx_http_v2_upstream_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_v2_upstream_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ssize_t ngx_http_v2_upstream_send(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_http_v2_upstream_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static ngx_int_t ngx_http_v2_upstream_process_request(
+    ngx_http_v2_upstream_stream_t *s, ngx_buf_t *b);
+static ngx_int_t ngx_http_v2_upstream_read_head(
+    ngx_http_v2_upstream_stream_t *s, ngx_buf_t *b);
+static ngx_int_t ngx_http_v2_upstream_send_headers(
+    ngx_http_v2_upstream_stream_t *s, u_char *start, u_char *end);
+static ngx_int_t ngx_http_v2_upstream_parse_line(u_char **pos, u_char *end,
+    ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_v2_upstream_send_data(
+    ngx_http_v2_upstream_stream_t *s, ngx_buf_t *b, size_t size,
+    ngx_uint_t last);
+
+
+static ngx_queue_t  ngx_http_v2_upstream_connections;
+
+
+static ngx_str_t  ngx_http_v2_upstream_hop_headers[] = {
+    ngx_string("connection"),
+    ngx_string("keep-alive"),
+    ngx_string("proxy-connection"),
+    ngx_string("transfer-encoding"),
+    ngx_string("upgrade"),
+    ngx_string("http2-settings"),
+    ngx_null_string
+};
+
+
+ngx_int_t
+ngx_http_v2_upstream_init_peer(ngx_http_request_t *r)
+{
+    ngx_http_upstream_t               *u;
+    ngx_http_v2_upstream_peer_data_t  *p;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http2 upstream init peer");
+
+    u = r->upstream;
+
+    p = ngx_palloc(r->pool, sizeof(ngx_http_v2_upstream_peer_data_t));
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    p->conf = u->conf;
+    p->stream = NULL;
+
+    p->data = u->peer.data;
+    p->original_get_peer = u->peer.get;
+    p->original_free_peer = u->peer.free;
+
+    u->peer.data = p;
+    u->peer.get = ngx_http_v2_upstream_get_peer;
+    u->peer.free = ngx_http_v2_upstream_free_peer;
+
+#if (NGX_HTTP_SSL)
+    p->original_set_session = u->peer.set_session;
+    p->original_save_session = u->peer.save_session;
+
+    u->peer.set_session = ngx_http_v2_upstream_set_session;
+    u->peer.save_session = ngx_http_v2_upstream_save_session;
+
+    p->ssl = u->ssl;
+    ngx_str_null(&p->ssl_name);
+
+    if (u->ssl && ngx_http_v2_upstream_ssl_name(r, u, p) != NGX_OK) {
+        return NGX_ERROR;
+    }
+#endif
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_v2_upstream_peer_data_t  *p = data;
+
+    ngx_int_t                       rc;
+    ngx_connection_t               *c;
+    ngx_http_v2_upstream_conn_t    *h2c;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream get peer");
+
+    p->stream = NULL;
+
+    rc = p->original_get_peer(pc, p->data);
+
+    if (rc != NGX_OK && rc != NGX_DONE) {
+        return rc;
+    }
+
+    if (rc == NGX_DONE) {
+
+        /* an HTTP/1.x connection cached by the keepalive module */
+
+        c = pc->connection;
+        pc->connection = NULL;
+
+#if (NGX_HTTP_SSL)
+        if (c->ssl) {
+            c->ssl->no_wait_shutdown = 1;
+            c->ssl->no_send_shutdown = 1;
+
+            (void) ngx_ssl_shutdown(c);
+        }
+#endif
+
+        if (c->pool) {
+            ngx_destroy_pool(c->pool);
+        }
+
+        ngx_close_connection(c);
+    }
+
+    h2c = ngx_http_v2_upstream_find(pc, p);
+
+    if (h2c) {
+        pc->cached = 1;
+
+    } else {
+        pc->cached = 0;
+
+        h2c = ngx_http_v2_upstream_connect(pc, p);
+        if (h2c == NULL) {
+            return NGX_DECLINED;
+        }
+    }
+
+    s = ngx_http_v2_upstream_create_stream(h2c, pc);
+    if (s == NULL) {
+        if (h2c->processing == 0) {
+            ngx_http_v2_upstream_close(h2c);
+        }
+
+        return NGX_ERROR;
+    }
+
+    if (!pc->cached) {
+        h2c->creator = s;
+    }
+
+    p->stream = s;
+    pc->connection = &s->connection;
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_v2_upstream_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_v2_upstream_peer_data_t  *p = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream free peer");
+
+    if (p->stream) {
+        ngx_http_v2_upstream_close_stream(p->stream);
+
+        p->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    p->original_free_peer(pc, p->data, state);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_v2_upstream_ssl_name(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_http_v2_upstream_peer_data_t *p)
+{
+    u_char     *s, *last;
+    ngx_str_t   name;
+
+    if (u->conf->ssl_name) {
+        if (ngx_http_complex_value(r, u->conf->ssl_name, &name) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        name = u->ssl_name;
+    }
+
+    if (name.len == 0) {
+        return NGX_OK;
+    }
+
+    /* strip port, if any */
+
+    s = name.data;
+    last = name.data + name.len;
+
+    if (*s == '[') {
+        s = ngx_strlchr(s, last, ']');
+
+        if (s == NULL) {
+            s = name.data;
+        }
+    }
+
+    s = ngx_strlchr(s, last, ':');
+
+    if (s != NULL) {
+        name.len = s - name.data;
+    }
+
+    p->ssl_name.data = ngx_pnalloc(r->pool, name.len + 1);
+    if (p->ssl_name.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    (void) ngx_cpystrn(p->ssl_name.data, name.data, name.len + 1);
+    p->ssl_name.len = name.len;
+
+    u->ssl_name = p->ssl_name;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_set_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_v2_upstream_peer_data_t  *p = data;
+
+    return p->original_set_session(pc, p->data);
+}
+
+
+static void
+ngx_http_v2_upstream_save_session(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_v2_upstream_peer_data_t  *p = data;
+
+    p->original_save_session(pc, p->data);
+}
+
+#endif
+
+
+static ngx_http_v2_upstream_conn_t *
+ngx_http_v2_upstream_find(ngx_peer_connection_t *pc,
+    ngx_http_v2_upstream_peer_data_t *p)
+{
+    ngx_queue_t                  *q;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    if (ngx_http_v2_upstream_connections.next == NULL) {
+        ngx_queue_init(&ngx_http_v2_upstream_connections);
+        return NULL;
+    }
+
+    for (q = ngx_queue_head(&ngx_http_v2_upstream_connections);
+         q != ngx_queue_sentinel(&ngx_http_v2_upstream_connections);
+         q = ngx_queue_next(q))
+    {
+        h2c = ngx_queue_data(q, ngx_http_v2_upstream_conn_t, queue);
+
+        if (h2c->conf != p->conf
+            || h2c->goaway
+            || h2c->processing >= h2c->concurrent_streams
+            || h2c->next_sid >= NGX_HTTP_V2_UPSTREAM_MAX_SID)
+        {
+            continue;
+        }
+
+        if (ngx_cmp_sockaddr(h2c->sockaddr, h2c->socklen,
+                             pc->sockaddr, pc->socklen, 1)
+            != NGX_OK)
+        {
+            continue;
+        }
+
+#if (NGX_HTTP_SSL)
+        if (h2c->ssl_name.len != p->ssl_name.len
+            || ngx_strncmp(h2c->ssl_name.data, p->ssl_name.data,
+                           p->ssl_name.len)
+               != 0)
+        {
+            continue;
+        }
+#endif
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                       "http2 upstream connection %p, streams: %ui",
+                       h2c->connection, h2c->processing);
+
+        return h2c;
+    }
+
+    return NULL;
+}
+
+
+static ngx_http_v2_upstream_conn_t *
+ngx_http_v2_upstream_connect(ngx_peer_connection_t *pc,
+    ngx_http_v2_upstream_peer_data_t *p)
+{
+    ngx_int_t                     rc;
+    ngx_pool_t                   *pool;
+    ngx_connection_t             *c;
+    ngx_peer_connection_t         peer;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream connect to %V", pc->name);
+
+    ngx_memzero(&peer, sizeof(ngx_peer_connection_t));
+
+    peer.sockaddr = pc->sockaddr;
+    peer.socklen = pc->socklen;
+    peer.name = pc->name;
+    peer.get = ngx_event_get_peer;
+    peer.local = pc->local;
+    peer.type = pc->type;
+    peer.rcvbuf = pc->rcvbuf;
+    peer.log = ngx_cycle->log;
+    peer.log_error = pc->log_error;
+    peer.transparent = pc->transparent;
+    peer.so_keepalive = pc->so_keepalive;
+
+    rc = ngx_event_connect_peer(&peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        return NULL;
+    }
+
+    c = peer.connection;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        ngx_close_connection(c);
+        return NULL;
+    }
+
+    c->pool = pool;
+
+    h2c = ngx_pcalloc(pool, sizeof(ngx_http_v2_upstream_conn_t));
+    if (h2c == NULL) {
+        goto failed;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     h2c->processing = 0;
+     *     h2c->header_block = NULL;
+     *     h2c->header_sid = 0;
+     *     h2c->out = NULL;
+     *     h2c->free = NULL;
+     *     h2c->queued = 0;
+     *     h2c->creator = NULL;
+     *     h2c->connected = 0;
+     *     h2c->goaway = 0;
+     */
+
+    h2c->connection = c;
+    h2c->conf = p->conf;
+
+    h2c->sockaddr = ngx_palloc(pool, pc->socklen);
+    if (h2c->sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(h2c->sockaddr, pc->sockaddr, pc->socklen);
+    h2c->socklen = pc->socklen;
+
+#if (NGX_HTTP_SSL)
+    if (p->ssl_name.len) {
+        h2c->ssl_name.data = ngx_pnalloc(pool, p->ssl_name.len + 1);
+        if (h2c->ssl_name.data == NULL) {
+            goto failed;
+        }
+
+        (void) ngx_cpystrn(h2c->ssl_name.data, p->ssl_name.data,
+                           p->ssl_name.len + 1);
+        h2c->ssl_name.len = p->ssl_name.len;
+    }
+#endif
+
+    ngx_queue_init(&h2c->streams);
+
+    h2c->concurrent_streams = NGX_HTTP_V2_UPSTREAM_STREAMS;
+    h2c->next_sid = 1;
+
+    h2c->init_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->send_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+    h2c->recv_window = NGX_HTTP_V2_DEFAULT_WINDOW;
+
+    h2c->last_out = &h2c->out;
+
+    h2c->buffer = ngx_create_temp_buf(pool, NGX_HTTP_V2_UPSTREAM_BUFFER_SIZE);
+    if (h2c->buffer == NULL) {
+        goto failed;
+    }
+
+    if (ngx_http_v2_upstream_send_preface(h2c) != NGX_OK) {
+        goto failed;
+    }
+
+    c->data = h2c;
+
+    c->read->handler = ngx_http_v2_upstream_connect_handler;
+    c->write->handler = ngx_http_v2_upstream_connect_handler;
+
+#if (NGX_HTTP_SSL)
+
+    if (p->ssl && ngx_http_v2_upstream_ssl_init(h2c, pc, p) != NGX_OK) {
+        goto failed;
+    }
+
+#endif
+
+    ngx_queue_insert_tail(&ngx_http_v2_upstream_connections, &h2c->queue);
+
+    ngx_add_timer(c->write, p->conf->connect_timeout);
+
+    if (rc == NGX_OK) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return h2c;
+
+failed:
+
+    ngx_close_connection(c);
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_v2_upstream_connect_handler(ngx_event_t *ev)
+{
+    int                           err;
+    socklen_t                     len;
+    ngx_connection_t             *c;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    c = ev->data;
+    h2c = c->data;
+
+    if (c->close || ev->timedout) {
+        if (ev->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out");
+        }
+
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        if (ngx_ssl_handshake(c) == NGX_AGAIN) {
+            c->ssl->handler = ngx_http_v2_upstream_ssl_handshake;
+            return;
+        }
+
+        ngx_http_v2_upstream_ssl_handshake(c);
+        return;
+    }
+
+#endif
+
+    ngx_http_v2_upstream_connected(h2c);
+}
+
+
+#if (NGX_HTTP_SSL)
+
+static ngx_int_t
+ngx_http_v2_upstream_ssl_init(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_peer_connection_t *pc, ngx_http_v2_upstream_peer_data_t *p)
+{
+    ngx_int_t                  rc;
+    ngx_str_t                 *name;
+    ngx_connection_t          *c;
+    ngx_http_upstream_conf_t  *conf;
+
+    c = h2c->connection;
+    conf = h2c->conf;
+
+    if (ngx_ssl_create_connection(conf->ssl, c, NGX_SSL_BUFFER|NGX_SSL_CLIENT)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    name = &h2c->ssl_name;
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+
+    /* as per RFC 6066, literal IPv4 and IPv6 addresses are not permitted */
+
+    if (conf->ssl_server_name
+        && name->len
+        && name->data[0] != '['
+        && ngx_inet_addr(name->data, name->len) == INADDR_NONE)
+    {
+        if (SSL_set_tlsext_host_name(c->ssl->connection, (char *) name->data)
+            == 0)
+        {
+            ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                          "SSL_set_tlsext_host_name(\"%s\") failed",
+                          name->data);
+            return NGX_ERROR;
+        }
+    }
+
+#endif
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    if (SSL_set_alpn_protos(c->ssl->connection,
+                            (u_char *) NGX_HTTP_V2_ALPN_PROTO,
+                            sizeof(NGX_HTTP_V2_ALPN_PROTO) - 1)
+        != 0)
+    {
+        ngx_ssl_error(NGX_LOG_ERR, c->log, 0,
+                      "SSL_set_alpn_protos() failed");
+        return NGX_ERROR;
+    }
+
+#endif
+
+    if (conf->ssl_session_reuse && p->original_set_session) {
+        pc->connection = c;
+        rc = p->original_set_session(pc, p->data);
+        pc->connection = NULL;
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_ssl_handshake(ngx_connection_t *c)
+{
+    long                               rc;
+    ngx_connection_t                  *saved;
+    ngx_peer_connection_t             *pc;
+    ngx_http_v2_upstream_conn_t       *h2c;
+    ngx_http_v2_upstream_peer_data_t  *p;
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    unsigned int                       len;
+    const unsigned char               *data;
+#endif
+
+    h2c = c->data;
+
+    if (!c->ssl->handshaked) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+
+    SSL_get0_alpn_selected(c->ssl->connection, &data, &len);
+
+    if (len != 2 || data[0] != 'h' || data[1] != '2') {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "upstream SSL server did not select \"h2\" by ALPN");
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+#endif
+
+    if (h2c->conf->ssl_verify) {
+        rc = SSL_get_verify_result(c->ssl->connection);
+
+        if (rc != X509_V_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate verify error: (%l:%s)",
+                          rc, X509_verify_cert_error_string(rc));
+            ngx_http_v2_upstream_close(h2c);
+            return;
+        }
+
+        if (ngx_ssl_check_host(c, &h2c->ssl_name) != NGX_OK) {
+            ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                          "upstream SSL certificate does not match \"%V\"",
+                          &h2c->ssl_name);
+            ngx_http_v2_upstream_close(h2c);
+            return;
+        }
+    }
+
+    if (h2c->conf->ssl_session_reuse && h2c->creator) {
+
+        /* the stream still uses the peer the connection was made to */
+
+        pc = h2c->creator->peer;
+        p = pc->data;
+
+        saved = pc->connection;
+        pc->connection = c;
+
+        p->original_save_session(pc, p->data);
+
+        pc->connection = saved;
+    }
+
+    ngx_http_v2_upstream_connected(h2c);
+}
+
+#endif
+
+
+static void
+ngx_http_v2_upstream_connected(ngx_http_v2_upstream_conn_t *h2c)
+{
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream connection %p established", c);
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    h2c->connected = 1;
+
+    c->read->handler = ngx_http_v2_upstream_read_handler;
+    c->write->handler = ngx_http_v2_upstream_write_handler;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+    if (ngx_http_v2_upstream_send_output(h2c) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+    if (c->read->ready) {
+        ngx_http_v2_upstream_read_handler(c->read);
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_idle(ngx_http_v2_upstream_conn_t *h2c)
+{
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    if (h2c->goaway || ngx_terminate || ngx_exiting) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream connection %p idle", c);
+
+    c->idle = 1;
+
+    ngx_add_timer(c->read, NGX_HTTP_V2_UPSTREAM_IDLE_TIMEOUT);
+}
+
+
+static void
+ngx_http_v2_upstream_close(ngx_http_v2_upstream_conn_t *h2c)
+{
+    ngx_pool_t                     *pool;
+    ngx_queue_t                    *q;
+    ngx_connection_t               *c;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    c = h2c->connection;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream close connection %p", c);
+
+    while (!ngx_queue_empty(&h2c->streams)) {
+        q = ngx_queue_head(&h2c->streams);
+        ngx_queue_remove(q);
+
+        s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        s->h2c = NULL;
+
+        if (!s->in_closed) {
+            s->error = 1;
+        }
+
+        ngx_http_v2_upstream_post(&s->read);
+        ngx_http_v2_upstream_post(&s->write);
+    }
+
+    ngx_queue_remove(&h2c->queue);
+
+    if (h2c->header_block) {
+        ngx_free(h2c->header_block);
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        (void) ngx_ssl_shutdown(c);
+    }
+
+#endif
+
+    pool = c->pool;
+
+    ngx_close_connection(c);
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_http_v2_upstream_read_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_buf_t                    *b;
+    ngx_connection_t             *c;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    c = rev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream read handler");
+
+    if (rev->timedout || c->close) {
+        rev->timedout = 0;
+
+        if (h2c->processing == 0) {
+            ngx_http_v2_upstream_close(h2c);
+            return;
+        }
+    }
+
+    b = h2c->buffer;
+
+    while (rev->ready) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_http_v2_upstream_close(h2c);
+            return;
+        }
+
+        b->last += n;
+
+        if (ngx_http_v2_upstream_process(h2c) != NGX_OK) {
+            (void) ngx_http_v2_upstream_send_output(h2c);
+            ngx_http_v2_upstream_close(h2c);
+            return;
+        }
+    }
+
+    if (h2c->goaway && h2c->processing == 0) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+}
+
+
+static void
+ngx_http_v2_upstream_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t             *c;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    c = wev->data;
+    h2c = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream write handler");
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out");
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+
+    if (ngx_http_v2_upstream_send_output(h2c) != NGX_OK) {
+        ngx_http_v2_upstream_close(h2c);
+        return;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_output(ngx_http_v2_upstream_conn_t *h2c)
+{
+    ngx_buf_t         *b;
+    ngx_chain_t       *cl, *ln;
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    if (!h2c->connected || h2c->out == NULL) {
+        return NGX_OK;
+    }
+
+    cl = c->send_chain(c, h2c->out, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        c->error = 1;
+        return NGX_ERROR;
+    }
+
+    while (h2c->out != cl) {
+        ln = h2c->out;
+        h2c->out = ln->next;
+
+        b = ln->buf;
+
+        h2c->queued -= b->last - b->start;
+
+        b->pos = b->start;
+        b->last = b->start;
+
+        ln->next = h2c->free;
+        h2c->free = ln;
+    }
+
+    if (cl) {
+        if (!c->write->timer_set) {
+            ngx_add_timer(c->write, h2c->conf->send_timeout);
+        }
+
+        if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+    } else {
+        h2c->last_out = &h2c->out;
+
+        if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+    }
+
+    ngx_http_v2_upstream_unblock(h2c);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_unblock(ngx_http_v2_upstream_conn_t *h2c)
+{
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    if (h2c->send_window <= 0 || h2c->queued >= NGX_HTTP_V2_UPSTREAM_OUTPUT) {
+        return;
+    }
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (s->blocked && s->send_window > 0) {
+            s->blocked = 0;
+            ngx_http_v2_upstream_post(&s->write);
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_process(ngx_http_v2_upstream_conn_t *h2c)
+{
+    u_char      *p;
+    size_t       size, len;
+    ngx_int_t    rc;
+    ngx_buf_t   *b;
+    ngx_uint_t   type, flags, sid;
+
+    b = h2c->buffer;
+
+    for ( ;; ) {
+
+        size = b->last - b->pos;
+
+        if (size < NGX_HTTP_V2_FRAME_HEADER_SIZE) {
+            break;
+        }
+
+        p = b->pos;
+
+        len = ((size_t) p[0] << 16) | (p[1] << 8) | p[2];
+        type = p[3];
+        flags = p[4];
+        sid = ngx_http_v2_parse_sid(&p[5]);
+
+        if (len > NGX_HTTP_V2_DEFAULT_FRAME_SIZE) {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent too large http2 frame: %uz", len);
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                     NGX_HTTP_V2_SIZE_ERROR);
+        }
+
+        if (size < NGX_HTTP_V2_FRAME_HEADER_SIZE + len) {
+            break;
+        }
+
+        ngx_log_debug4(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 upstream frame type:%ui f:%Xi l:%uz sid:%ui",
+                       type, flags, len, sid);
+
+        p += NGX_HTTP_V2_FRAME_HEADER_SIZE;
+
+        if (h2c->header_sid && type != NGX_HTTP_V2_CONTINUATION_FRAME) {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent unexpected http2 frame: %ui", type);
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        switch (type) {
+
+        case NGX_HTTP_V2_DATA_FRAME:
+            rc = ngx_http_v2_upstream_state_data(h2c, sid, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_HEADERS_FRAME:
+        case NGX_HTTP_V2_CONTINUATION_FRAME:
+            rc = ngx_http_v2_upstream_state_headers(h2c, type, sid, flags,
+                                                    p, len);
+            break;
+
+        case NGX_HTTP_V2_RST_STREAM_FRAME:
+            rc = ngx_http_v2_upstream_state_rst_stream(h2c, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_SETTINGS_FRAME:
+            rc = ngx_http_v2_upstream_state_settings(h2c, sid, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_PING_FRAME:
+            rc = ngx_http_v2_upstream_state_ping(h2c, sid, flags, p, len);
+            break;
+
+        case NGX_HTTP_V2_GOAWAY_FRAME:
+            rc = ngx_http_v2_upstream_state_goaway(h2c, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_WINDOW_UPDATE_FRAME:
+            rc = ngx_http_v2_upstream_state_window_update(h2c, sid, p, len);
+            break;
+
+        case NGX_HTTP_V2_PUSH_PROMISE_FRAME:
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent unexpected push promise");
+            rc = ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+            break;
+
+        default:
+
+            /* priority and unknown frames are ignored */
+
+            rc = NGX_OK;
+        }
+
+        if (rc != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        b->pos += NGX_HTTP_V2_FRAME_HEADER_SIZE + len;
+    }
+
+    if (b->pos != b->start) {
+        size = b->last - b->pos;
+
+        ngx_memmove(b->start, b->pos, size);
+
+        b->pos = b->start;
+        b->last = b->start + size;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_data(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *pos, size_t len)
+{
+    u_char                          buf[NGX_SIZE_T_LEN + 2];
+    size_t                          size, padding;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent http2 data frame for stream 0");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (len > h2c->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream violated http2 connection flow control");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_FLOW_CTRL_ERROR);
+    }
+
+    h2c->recv_window -= len;
+
+    if (h2c->recv_window < NGX_HTTP_V2_MAX_WINDOW / 2) {
+        if (ngx_http_v2_upstream_send_window_update(h2c, 0,
+                                   NGX_HTTP_V2_MAX_WINDOW - h2c->recv_window)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+    }
+
+    size = len;
+
+    if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+        padding = len ? *pos : 0;
+
+        if (len == 0 || padding >= len) {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent http2 frame with invalid padding");
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        pos++;
+        size -= 1 + padding;
+    }
+
+    s = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (s == NULL) {
+        if (sid >= h2c->next_sid || (sid % 2) == 0) {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent http2 frame for unknown stream %ui",
+                          sid);
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        return NGX_OK;
+    }
+
+    if (s->reset) {
+        return NGX_OK;
+    }
+
+    if (s->in_closed) {
+        ngx_http_v2_upstream_stream_error(s, NGX_HTTP_V2_STREAM_CLOSED);
+        return NGX_OK;
+    }
+
+    if (len > s->recv_window) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream violated http2 stream flow control");
+        ngx_http_v2_upstream_stream_error(s, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    s->recv_window -= len;
+
+    if (!s->response) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream sent http2 data frame before headers");
+        ngx_http_v2_upstream_stream_error(s, NGX_HTTP_V2_PROTOCOL_ERROR);
+        return NGX_OK;
+    }
+
+    if (size) {
+        if (s->chunked_response) {
+            if (ngx_http_v2_upstream_append(s, buf,
+                                            ngx_sprintf(buf, "%xz" CRLF, size)
+                                            - buf)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        if (ngx_http_v2_upstream_append(s, pos, size) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        if (s->chunked_response) {
+            if (ngx_http_v2_upstream_append(s, (u_char *) CRLF, 2) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        if (s->chunked_response) {
+            if (ngx_http_v2_upstream_append(s, (u_char *) "0" CRLF CRLF, 5)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
+
+        s->in_closed = 1;
+    }
+
+    ngx_http_v2_upstream_post(&s->read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_headers(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t type, ngx_uint_t sid, ngx_uint_t flags, u_char *pos, size_t len)
+{
+    u_char     *p;
+    size_t      size, padding;
+    ngx_int_t   rc;
+
+    if (sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent http2 headers frame for stream 0");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (type == NGX_HTTP_V2_HEADERS_FRAME) {
+
+        padding = 0;
+
+        if (flags & NGX_HTTP_V2_PADDED_FLAG) {
+            padding = len ? *pos : 0;
+
+            if (len == 0 || padding >= len) {
+                ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                              "upstream sent http2 frame "
+                              "with invalid padding");
+                return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            pos++;
+            len -= 1 + padding;
+        }
+
+        if (flags & NGX_HTTP_V2_PRIORITY_FLAG) {
+            if (len < NGX_HTTP_V2_PRIORITY_SIZE) {
+                ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                              "upstream sent too short http2 headers frame");
+                return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_SIZE_ERROR);
+            }
+
+            pos += NGX_HTTP_V2_PRIORITY_SIZE;
+            len -= NGX_HTTP_V2_PRIORITY_SIZE;
+        }
+
+        if (flags & NGX_HTTP_V2_END_HEADERS_FLAG) {
+            return ngx_http_v2_upstream_state_header_block(h2c, sid, flags,
+                                                           pos, pos + len);
+        }
+
+        h2c->header_sid = sid;
+        h2c->header_flags = flags;
+        h2c->header_len = 0;
+
+    } else if (h2c->header_sid != sid) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent unexpected http2 continuation frame");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    /* collect fragments of a header block split into several frames */
+
+    if (h2c->header_len + len > h2c->header_size) {
+
+        size = h2c->header_len + len;
+
+        if (size > ngx_max(h2c->conf->buffer_size,
+                           NGX_HTTP_V2_DEFAULT_FRAME_SIZE))
+        {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent too large http2 header block");
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        p = ngx_alloc(size, h2c->connection->log);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (h2c->header_block) {
+            ngx_memcpy(p, h2c->header_block, h2c->header_len);
+            ngx_free(h2c->header_block);
+        }
+
+        h2c->header_block = p;
+        h2c->header_size = size;
+    }
+
+    ngx_memcpy(h2c->header_block + h2c->header_len, pos, len);
+    h2c->header_len += len;
+
+    if (!(flags & NGX_HTTP_V2_END_HEADERS_FLAG)) {
+        return NGX_OK;
+    }
+
+    h2c->header_sid = 0;
+
+    rc = ngx_http_v2_upstream_state_header_block(h2c, sid, h2c->header_flags,
+                                                 h2c->header_block,
+                                                 h2c->header_block
+                                                 + h2c->header_len);
+
+    ngx_free(h2c->header_block);
+
+    h2c->header_block = NULL;
+    h2c->header_size = 0;
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_header_block(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *pos, u_char *end)
+{
+    ngx_int_t                       rc;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    s = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (s == NULL) {
+        if (sid >= h2c->next_sid || (sid % 2) == 0) {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent http2 frame for unknown stream %ui",
+                          sid);
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+        }
+
+        /* no dynamic table is used, so the block can be skipped */
+
+        return NGX_OK;
+    }
+
+    if (s->reset) {
+        return NGX_OK;
+    }
+
+    if (s->in_closed) {
+        ngx_http_v2_upstream_stream_error(s, NGX_HTTP_V2_STREAM_CLOSED);
+        return NGX_OK;
+    }
+
+    rc = ngx_http_v2_upstream_parse_headers(s, flags, pos, end);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_http_v2_upstream_stream_error(s, NGX_HTTP_V2_PROTOCOL_ERROR);
+        return NGX_OK;
+    }
+
+    ngx_http_v2_upstream_post(&s->read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_rst_stream(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, u_char *pos, size_t len)
+{
+    ngx_uint_t                      status;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    if (len != NGX_HTTP_V2_RST_STREAM_SIZE || sid == 0) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent invalid http2 rst stream frame");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    status = ngx_http_v2_parse_uint32(pos);
+
+    s = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (s == NULL) {
+        return NGX_OK;
+    }
+
+    if (status != NGX_HTTP_V2_NO_ERROR || !s->in_closed) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream reset http2 stream with code %ui", status);
+    }
+
+    s->reset = 1;
+    s->out_closed = 1;
+
+    if (!s->in_closed) {
+        s->error = 1;
+    }
+
+    ngx_http_v2_upstream_post(&s->read);
+    ngx_http_v2_upstream_post(&s->write);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_settings(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *pos, size_t len)
+{
+    ssize_t                         delta;
+    ngx_uint_t                      id, value;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    if (sid != 0 || len % NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent invalid http2 settings frame");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        if (len != 0) {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent invalid http2 settings ack");
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_SIZE_ERROR);
+        }
+
+        return NGX_OK;
+    }
+
+    for ( /* void */ ; len; len -= NGX_HTTP_V2_SETTINGS_PARAM_SIZE) {
+
+        id = ngx_http_v2_parse_uint16(pos);
+        value = ngx_http_v2_parse_uint32(&pos[2]);
+
+        pos += NGX_HTTP_V2_SETTINGS_PARAM_SIZE;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                       "http2 upstream setting %ui:%ui", id, value);
+
+        switch (id) {
+
+        case NGX_HTTP_V2_MAX_STREAMS_SETTING:
+            h2c->concurrent_streams = value;
+            break;
+
+        case NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING:
+
+            if (value > NGX_HTTP_V2_MAX_WINDOW) {
+                ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                              "upstream sent invalid http2 "
+                              "initial window size: %ui", value);
+                return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_FLOW_CTRL_ERROR);
+            }
+
+            delta = (ssize_t) value - (ssize_t) h2c->init_window;
+            h2c->init_window = value;
+
+            for (q = ngx_queue_head(&h2c->streams);
+                 q != ngx_queue_sentinel(&h2c->streams);
+                 q = ngx_queue_next(q))
+            {
+                s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+                s->send_window += delta;
+            }
+
+            break;
+
+        case NGX_HTTP_V2_MAX_FRAME_SIZE_SETTING:
+
+            if (value < NGX_HTTP_V2_DEFAULT_FRAME_SIZE
+                || value > NGX_HTTP_V2_MAX_FRAME_SIZE)
+            {
+                ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                              "upstream sent invalid http2 "
+                              "max frame size: %ui", value);
+                return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+            }
+
+            /* frames larger than the default are never sent */
+
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    if (ngx_http_v2_upstream_queue_frame(h2c, NGX_HTTP_V2_SETTINGS_FRAME,
+                                         NGX_HTTP_V2_ACK_FLAG, 0, NULL, 0)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    ngx_http_v2_upstream_unblock(h2c);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_ping(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, ngx_uint_t flags, u_char *pos, size_t len)
+{
+    if (sid != 0 || len != NGX_HTTP_V2_PING_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent invalid http2 ping frame");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    if (flags & NGX_HTTP_V2_ACK_FLAG) {
+        return NGX_OK;
+    }
+
+    return ngx_http_v2_upstream_queue_frame(h2c, NGX_HTTP_V2_PING_FRAME,
+                                            NGX_HTTP_V2_ACK_FLAG, 0,
+                                            pos, NGX_HTTP_V2_PING_SIZE);
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_goaway(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, u_char *pos, size_t len)
+{
+    ngx_uint_t                      last_sid, status;
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    if (sid != 0 || len < NGX_HTTP_V2_GOAWAY_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent invalid http2 goaway frame");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_PROTOCOL_ERROR);
+    }
+
+    last_sid = ngx_http_v2_parse_sid(pos);
+    status = ngx_http_v2_parse_uint32(&pos[4]);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 upstream goaway sid:%ui code:%ui",
+                   last_sid, status);
+
+    if (status != NGX_HTTP_V2_NO_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent http2 goaway with code %ui", status);
+    }
+
+    h2c->goaway = 1;
+
+    /* streams not processed by the upstream are safe to retry */
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (s->id == 0 || s->id > last_sid) {
+            s->reset = 1;
+            s->out_closed = 1;
+            s->error = 1;
+
+            ngx_http_v2_upstream_post(&s->read);
+            ngx_http_v2_upstream_post(&s->write);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_state_window_update(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, u_char *pos, size_t len)
+{
+    size_t                          window;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    if (len != NGX_HTTP_V2_WINDOW_UPDATE_SIZE) {
+        ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                      "upstream sent invalid http2 window update frame");
+        return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_SIZE_ERROR);
+    }
+
+    window = ngx_http_v2_parse_window(pos);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 upstream window update sid:%ui window:%uz",
+                   sid, window);
+
+    if (sid == 0) {
+        if (window == 0
+            || window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - h2c->send_window))
+        {
+            ngx_log_error(NGX_LOG_ERR, h2c->connection->log, 0,
+                          "upstream sent invalid http2 window update");
+            return ngx_http_v2_upstream_connection_error(h2c,
+                                                 NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        }
+
+        h2c->send_window += window;
+
+        ngx_http_v2_upstream_unblock(h2c);
+
+        return NGX_OK;
+    }
+
+    s = ngx_http_v2_upstream_find_stream(h2c, sid);
+
+    if (s == NULL || s->reset) {
+        return NGX_OK;
+    }
+
+    if (window == 0
+        || window > (size_t) (NGX_HTTP_V2_MAX_WINDOW - s->send_window))
+    {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream sent invalid http2 window update");
+        ngx_http_v2_upstream_stream_error(s, NGX_HTTP_V2_FLOW_CTRL_ERROR);
+        return NGX_OK;
+    }
+
+    s->send_window += window;
+
+    if (s->blocked && s->send_window > 0 && h2c->send_window > 0
+        && h2c->queued < NGX_HTTP_V2_UPSTREAM_OUTPUT)
+    {
+        s->blocked = 0;
+        ngx_http_v2_upstream_post(&s->write);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_connection_error(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t status)
+{
+    (void) ngx_http_v2_upstream_send_goaway(h2c, status);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_headers(ngx_http_v2_upstream_stream_t *s,
+    ngx_uint_t flags, u_char *pos, u_char *end)
+{
+    u_char      ch, *p, *tmp, buf[sizeof("HTTP/1.1 000" CRLF) - 1];
+    ngx_str_t   name, value;
+    ngx_uint_t  i, index, status, trailers, interim, emitted, length;
+
+    trailers = s->response;
+
+    if (trailers && !(flags & NGX_HTTP_V2_END_STREAM_FLAG)) {
+        ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                      "upstream sent http2 trailers without end stream");
+        return NGX_DECLINED;
+    }
+
+    tmp = ngx_pnalloc(s->connection.pool, (end - pos) * 8 / 5 + 1);
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    status = 0;
+    interim = 0;
+    emitted = 0;
+    length = 0;
+
+    while (pos < end) {
+
+        ch = *pos;
+
+        if (ch & 0x80) {
+
+            /* indexed header field */
+
+            if (ngx_http_v2_upstream_parse_int(&pos, end, 7, &index)
+                != NGX_OK)
+            {
+                goto invalid;
+            }
+
+            if (index == 0 || index > 61) {
+                goto invalid;
+            }
+
+            name = *ngx_http_v2_get_static_name(index);
+            value = *ngx_http_v2_get_static_value(index);
+
+        } else if ((ch & 0xe0) == 0x20) {
+
+            /* dynamic table size update */
+
+            if (ngx_http_v2_upstream_parse_int(&pos, end, 5, &index)
+                != NGX_OK
+                || index != 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+
+        } else {
+
+            /* literal header field */
+
+            if (ngx_http_v2_upstream_parse_int(&pos, end,
+                                               (ch & 0xc0) == 0x40 ? 6 : 4,
+                                               &index)
+                != NGX_OK
+                || index > 61)
+            {
+                goto invalid;
+            }
+
+            if (index) {
+                name = *ngx_http_v2_get_static_name(index);
+
+            } else if (ngx_http_v2_upstream_parse_string(s, &pos, end, &tmp,
+                                                         &name)
+                       != NGX_OK)
+            {
+                goto invalid;
+            }
+
+            if (ngx_http_v2_upstream_parse_string(s, &pos, end, &tmp, &value)
+                != NGX_OK)
+            {
+                goto invalid;
+            }
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                       "http2 upstream header: \"%V: %V\"", &name, &value);
+
+        for (i = 0; i < value.len; i++) {
+            ch = value.data[i];
+
+            if (ch == '\0' || ch == CR || ch == LF) {
+                goto invalid;
+            }
+        }
+
+        if (name.len && name.data[0] == ':') {
+
+            if (trailers || emitted
+                || name.len != sizeof(":status") - 1
+                || ngx_strncmp(name.data, ":status", sizeof(":status") - 1)
+                   != 0
+                || status != 0)
+            {
+                goto invalid;
+            }
+
+            if (value.len != 3) {
+                goto invalid;
+            }
+
+            status = ngx_atoi(value.data, 3);
+
+            if (status == (ngx_uint_t) NGX_ERROR || status < 100) {
+                goto invalid;
+            }
+
+            if (status < 200) {
+                interim = 1;
+            }
+
+            continue;
+        }
+
+        for (i = 0; i < name.len; i++) {
+            ch = name.data[i];
+
+            if (ch <= 0x20 || ch == 0x7f || ch == ':'
+                || (ch >= 'A' && ch <= 'Z'))
+            {
+                goto invalid;
+            }
+        }
+
+        if (name.len == 0) {
+            goto invalid;
+        }
+
+        if (interim || ngx_http_v2_upstream_hop_header(&name)) {
+            continue;
+        }
+
+        if (trailers) {
+            if (!s->chunked_response) {
+                continue;
+            }
+
+            if (!emitted) {
+                emitted = 1;
+
+                if (ngx_http_v2_upstream_append(s, (u_char *) "0" CRLF, 3)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+            }
+
+        } else if (!emitted) {
+            if (status == 0) {
+                goto invalid;
+            }
+
+            emitted = 1;
+
+            p = ngx_sprintf(buf, "HTTP/1.1 %03ui" CRLF, status);
+
+            if (ngx_http_v2_upstream_append(s, buf, p - buf) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        if (name.len == sizeof("content-length") - 1
+            && ngx_strncmp(name.data, "content-length",
+                           sizeof("content-length") - 1)
+               == 0)
+        {
+            length = 1;
+        }
+
+        if (ngx_http_v2_upstream_append(s, name.data, name.len) != NGX_OK
+            || ngx_http_v2_upstream_append(s, (u_char *) ": ", 2) != NGX_OK
+            || ngx_http_v2_upstream_append(s, value.data, value.len)
+               != NGX_OK
+            || ngx_http_v2_upstream_append(s, (u_char *) CRLF, 2) != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+    }
+
+    if (trailers) {
+        if (s->chunked_response) {
+            if (!emitted
+                && ngx_http_v2_upstream_append(s, (u_char *) "0" CRLF, 3)
+                   != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            if (ngx_http_v2_upstream_append(s, (u_char *) CRLF, 2) != NGX_OK) {
+                return NGX_ERROR;
+            }
+        }
+
+        s->in_closed = 1;
+
+        return NGX_OK;
+    }
+
+    if (status == 0) {
+        goto invalid;
+    }
+
+    if (interim) {
+        if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+            goto invalid;
+        }
+
+        return NGX_OK;
+    }
+
+    if (!emitted) {
+        p = ngx_sprintf(buf, "HTTP/1.1 %03ui" CRLF, status);
+
+        if (ngx_http_v2_upstream_append(s, buf, p - buf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    /*
+     * the response body is delimited with chunked transfer encoding
+     * unless its length is known
+     */
+
+    if (!length && !s->head
+        && status != NGX_HTTP_NO_CONTENT && status != NGX_HTTP_NOT_MODIFIED)
+    {
+        if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+            if (ngx_http_v2_upstream_append(s,
+                                  (u_char *) "content-length: 0" CRLF,
+                                  sizeof("content-length: 0" CRLF) - 1)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+        } else {
+            if (ngx_http_v2_upstream_append(s,
+                                  (u_char *) "transfer-encoding: chunked" CRLF,
+                                  sizeof("transfer-encoding: chunked" CRLF) - 1)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            s->chunked_response = 1;
+        }
+    }
+
+    if (ngx_http_v2_upstream_append(s, (u_char *) CRLF, 2) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    s->response = 1;
+
+    if (flags & NGX_HTTP_V2_END_STREAM_FLAG) {
+        s->in_closed = 1;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, s->connection.log, 0,
+                  "upstream sent invalid http2 header block");
+
+    return NGX_DECLINED;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_int(u_char **pos, u_char *end, ngx_uint_t prefix,
+    ngx_uint_t *value)
+{
+    u_char      *p, ch;
+    ngx_uint_t   n, shift;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    prefix = ngx_http_v2_prefix(prefix);
+
+    n = *p++ & prefix;
+
+    if (n == prefix) {
+
+        for (shift = 0; shift < 7 * NGX_HTTP_V2_INT_OCTETS; shift += 7) {
+
+            if (p == end) {
+                return NGX_ERROR;
+            }
+
+            ch = *p++;
+
+            n += (ngx_uint_t) (ch & 0x7f) << shift;
+
+            if ((ch & 0x80) == 0) {
+                goto done;
+            }
+        }
+
+        return NGX_ERROR;
+    }
+
+done:
+
+    *pos = p;
+    *value = n;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_string(ngx_http_v2_upstream_stream_t *s,
+    u_char **pos, u_char *end, u_char **tmp, ngx_str_t *str)
+{
+    u_char      *p, state, *dst;
+    ngx_uint_t   huff, len;
+
+    p = *pos;
+
+    if (p == end) {
+        return NGX_ERROR;
+    }
+
+    huff = *p & 0x80;
+
+    if (ngx_http_v2_upstream_parse_int(&p, end, 7, &len) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (len > (size_t) (end - p)) {
+        return NGX_ERROR;
+    }
+
+    if (huff) {
+        state = 0;
+        dst = *tmp;
+
+        if (ngx_http_huff_decode(&state, p, len, &dst, 1, s->connection.log)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        str->data = *tmp;
+        str->len = dst - *tmp;
+
+        *tmp = dst;
+
+    } else {
+        str->data = p;
+        str->len = len;
+    }
+
+    *pos = p + len;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_hop_header(ngx_str_t *name)
+{
+    ngx_str_t  *h;
+
+    for (h = ngx_http_v2_upstream_hop_headers; h->len; h++) {
+        if (name->len == h->len
+            && ngx_strncasecmp(name->data, h->data, h->len) == 0)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_queue_frame(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t type, ngx_uint_t flags, ngx_uint_t sid, u_char *data,
+    size_t len)
+{
+    u_char            *p;
+    ngx_buf_t         *b;
+    ngx_chain_t       *cl;
+    ngx_connection_t  *c;
+
+    c = h2c->connection;
+
+    cl = h2c->free;
+
+    if (cl) {
+        h2c->free = cl->next;
+        b = cl->buf;
+
+    } else {
+        cl = ngx_alloc_chain_link(c->pool);
+        if (cl == NULL) {
+            return NGX_ERROR;
+        }
+
+        b = ngx_create_temp_buf(c->pool, NGX_HTTP_V2_UPSTREAM_BUFFER_SIZE);
+        if (b == NULL) {
+            return NGX_ERROR;
+        }
+
+        /* frames are not held in the SSL buffer */
+
+        b->flush = 1;
+
+        cl->buf = b;
+    }
+
+    cl->next = NULL;
+
+    p = b->last;
+
+    *p++ = (u_char) (len >> 16);
+    *p++ = (u_char) (len >> 8);
+    *p++ = (u_char) len;
+    *p++ = (u_char) type;
+    *p++ = (u_char) flags;
+
+    p = ngx_http_v2_write_sid(p, sid);
+
+    if (len) {
+        p = ngx_cpymem(p, data, len);
+    }
+
+    b->last = p;
+
+    *h2c->last_out = cl;
+    h2c->last_out = &cl->next;
+
+    h2c->queued += b->last - b->start;
+
+    if (h2c->connected) {
+        ngx_post_event(c->write, &ngx_posted_events);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_preface(ngx_http_v2_upstream_conn_t *h2c)
+{
+    u_char      *p, settings[3 * NGX_HTTP_V2_SETTINGS_PARAM_SIZE];
+    ngx_buf_t   *b;
+    ngx_chain_t *cl;
+
+    if (ngx_http_v2_upstream_queue_frame(h2c, NGX_HTTP_V2_SETTINGS_FRAME,
+                                         NGX_HTTP_V2_NO_FLAG, 0, NULL, 0)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    /* the preface goes before the first frame */
+
+    cl = h2c->out;
+    b = cl->buf;
+
+    ngx_memmove(b->start + sizeof(NGX_HTTP_V2_PREFACE) - 1, b->start,
+                NGX_HTTP_V2_FRAME_HEADER_SIZE);
+    ngx_memcpy(b->start, NGX_HTTP_V2_PREFACE, sizeof(NGX_HTTP_V2_PREFACE) - 1);
+
+    b->last += sizeof(NGX_HTTP_V2_PREFACE) - 1;
+    h2c->queued += sizeof(NGX_HTTP_V2_PREFACE) - 1;
+
+    /* settings, the frame is completed in place */
+
+    p = settings;
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_HEADER_TABLE_SIZE_SETTING);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_ENABLE_PUSH_SETTING);
+    p = ngx_http_v2_write_uint32(p, 0);
+
+    p = ngx_http_v2_write_uint16(p, NGX_HTTP_V2_INIT_WINDOW_SIZE_SETTING);
+    p = ngx_http_v2_write_uint32(p, NGX_HTTP_V2_UPSTREAM_WINDOW);
+
+    b->start[sizeof(NGX_HTTP_V2_PREFACE) - 1 + 2] = (u_char) sizeof(settings);
+    b->last = ngx_cpymem(b->last, settings, sizeof(settings));
+    h2c->queued += sizeof(settings);
+
+    if (ngx_http_v2_upstream_send_window_update(h2c, 0,
+                                   NGX_HTTP_V2_MAX_WINDOW
+                                   - NGX_HTTP_V2_DEFAULT_WINDOW)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+    h2c->recv_window = NGX_HTTP_V2_MAX_WINDOW;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_window_update(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, size_t window)
+{
+    u_char  buf[NGX_HTTP_V2_WINDOW_UPDATE_SIZE];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 upstream send window update sid:%ui window:%uz",
+                   sid, window);
+
+    (void) ngx_http_v2_write_uint32(buf, window);
+
+    return ngx_http_v2_upstream_queue_frame(h2c,
+                                            NGX_HTTP_V2_WINDOW_UPDATE_FRAME,
+                                            NGX_HTTP_V2_NO_FLAG, sid,
+                                            buf, sizeof(buf));
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_rst_stream(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid, ngx_uint_t status)
+{
+    u_char  buf[NGX_HTTP_V2_RST_STREAM_SIZE];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 upstream send rst stream sid:%ui code:%ui",
+                   sid, status);
+
+    (void) ngx_http_v2_write_uint32(buf, status);
+
+    return ngx_http_v2_upstream_queue_frame(h2c, NGX_HTTP_V2_RST_STREAM_FRAME,
+                                            NGX_HTTP_V2_NO_FLAG, sid,
+                                            buf, sizeof(buf));
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_goaway(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t status)
+{
+    u_char  *p, buf[NGX_HTTP_V2_GOAWAY_SIZE];
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, h2c->connection->log, 0,
+                   "http2 upstream send goaway code:%ui", status);
+
+    p = ngx_http_v2_write_uint32(buf, 0);
+    (void) ngx_http_v2_write_uint32(p, status);
+
+    h2c->goaway = 1;
+
+    return ngx_http_v2_upstream_queue_frame(h2c, NGX_HTTP_V2_GOAWAY_FRAME,
+                                            NGX_HTTP_V2_NO_FLAG, 0,
+                                            buf, sizeof(buf));
+}
+
+
+static ngx_http_v2_upstream_stream_t *
+ngx_http_v2_upstream_create_stream(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_peer_connection_t *pc)
+{
+    ngx_pool_t                     *pool;
+    ngx_event_t                    *rev, *wev;
+    ngx_connection_t               *fc;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    pool = ngx_create_pool(1024, pc->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    s = ngx_pcalloc(pool, sizeof(ngx_http_v2_upstream_stream_t));
+    if (s == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     s->id = 0;
+     *     s->in = NULL;
+     *     s->last_in = NULL;
+     *     s->free = NULL;
+     *     s->size = 0;
+     *     s->request = NULL;
+     *     s->state = ngx_http_v2_upstream_st_head;
+     *     s->empty_line = 0;
+     *     s->head = 0;
+     *     s->response = 0;
+     *     s->chunked_response = 0;
+     *     s->out_closed = 0;
+     *     s->in_closed = 0;
+     *     s->blocked = 0;
+     *     s->reset = 0;
+     *     s->error = 0;
+     */
+
+    s->h2c = h2c;
+    s->peer = pc;
+
+    s->send_window = h2c->init_window;
+    s->recv_window = NGX_HTTP_V2_UPSTREAM_WINDOW;
+
+    /* the fake connection shares the socket with the real one */
+
+    fc = &s->connection;
+    rev = &s->read;
+    wev = &s->write;
+
+    *fc = *h2c->connection;
+
+    fc->data = NULL;
+    fc->read = rev;
+    fc->write = wev;
+    fc->pool = pool;
+    fc->log = pc->log;
+
+    fc->recv = ngx_http_v2_upstream_recv;
+    fc->send = ngx_http_v2_upstream_send;
+    fc->recv_chain = ngx_http_v2_upstream_recv_chain;
+    fc->send_chain = ngx_http_v2_upstream_send_chain;
+
+    fc->sent = 0;
+    fc->requests = 0;
+    fc->buffer = NULL;
+    fc->buffered = 0;
+    fc->sendfile = 0;
+    fc->sndlowat = 1;
+    fc->tcp_nodelay = NGX_TCP_NODELAY_DISABLED;
+    fc->tcp_nopush = NGX_TCP_NOPUSH_DISABLED;
+    fc->idle = 0;
+    fc->close = 0;
+    fc->reusable = 0;
+    fc->error = 0;
+
+    /* events of shared connections are not passed to the event module */
+
+    fc->shared = 1;
+
+    rev->data = fc;
+    rev->index = NGX_INVALID_INDEX;
+    rev->log = pc->log;
+
+    *wev = *rev;
+
+    wev->write = 1;
+    wev->ready = 1;
+
+    ngx_queue_insert_tail(&h2c->streams, &s->queue);
+    h2c->processing++;
+
+    if (h2c->connection->idle) {
+        h2c->connection->idle = 0;
+
+        if (h2c->connection->read->timer_set) {
+            ngx_del_timer(h2c->connection->read);
+        }
+    }
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "http2 upstream create stream %p on %p, streams: %ui",
+                   s, h2c->connection, h2c->processing);
+
+    return s;
+}
+
+
+static ngx_http_v2_upstream_stream_t *
+ngx_http_v2_upstream_find_stream(ngx_http_v2_upstream_conn_t *h2c,
+    ngx_uint_t sid)
+{
+    ngx_queue_t                    *q;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    for (q = ngx_queue_head(&h2c->streams);
+         q != ngx_queue_sentinel(&h2c->streams);
+         q = ngx_queue_next(q))
+    {
+        s = ngx_queue_data(q, ngx_http_v2_upstream_stream_t, queue);
+
+        if (s->id == sid) {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_v2_upstream_close_stream(ngx_http_v2_upstream_stream_t *s)
+{
+    ngx_connection_t             *fc;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    fc = &s->connection;
+    h2c = s->h2c;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, fc->log, 0,
+                   "http2 upstream close stream %p, sid:%ui", s, s->id);
+
+    if (h2c) {
+        if (s->id && !s->reset && !(s->in_closed && s->out_closed)) {
+            (void) ngx_http_v2_upstream_send_rst_stream(h2c, s->id,
+                                                        NGX_HTTP_V2_CANCEL);
+        }
+
+        if (h2c->creator == s) {
+            h2c->creator = NULL;
+        }
+
+        ngx_queue_remove(&s->queue);
+        h2c->processing--;
+
+        if (h2c->processing == 0) {
+            ngx_http_v2_upstream_idle(h2c);
+        }
+    }
+
+    if (s->read.timer_set) {
+        ngx_del_timer(&s->read);
+    }
+
+    if (s->write.timer_set) {
+        ngx_del_timer(&s->write);
+    }
+
+    if (s->read.posted) {
+        ngx_delete_posted_event(&s->read);
+    }
+
+    if (s->write.posted) {
+        ngx_delete_posted_event(&s->write);
+    }
+
+    ngx_destroy_pool(fc->pool);
+}
+
+
+static void
+ngx_http_v2_upstream_stream_error(ngx_http_v2_upstream_stream_t *s,
+    ngx_uint_t status)
+{
+    if (!s->reset) {
+        s->reset = 1;
+        (void) ngx_http_v2_upstream_send_rst_stream(s->h2c, s->id, status);
+    }
+
+    s->out_closed = 1;
+    s->error = 1;
+
+    /* the response is not usable */
+
+    s->in = NULL;
+    s->last_in = NULL;
+    s->size = 0;
+
+    ngx_http_v2_upstream_post(&s->read);
+    ngx_http_v2_upstream_post(&s->write);
+}
+
+
+static void
+ngx_http_v2_upstream_post(ngx_event_t *ev)
+{
+    ev->ready = 1;
+
+    if (ev->handler) {
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_append(ngx_http_v2_upstream_stream_t *s, u_char *data,
+    size_t len)
+{
+    size_t        n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    s->size += len;
+
+    while (len) {
+
+        cl = s->last_in;
+
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+
+            cl = s->free;
+
+            if (cl) {
+                s->free = cl->next;
+
+            } else {
+                cl = ngx_alloc_chain_link(s->connection.pool);
+                if (cl == NULL) {
+                    return NGX_ERROR;
+                }
+
+                cl->buf = ngx_create_temp_buf(s->connection.pool,
+                                              NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+                if (cl->buf == NULL) {
+                    return NGX_ERROR;
+                }
+            }
+
+            cl->next = NULL;
+
+            if (s->last_in) {
+                s->last_in->next = cl;
+
+            } else {
+                s->in = cl;
+            }
+
+            s->last_in = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min(len, (size_t) (b->end - b->last));
+
+        b->last = ngx_cpymem(b->last, data, n);
+
+        data += n;
+        len -= n;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v2_upstream_update_window(ngx_http_v2_upstream_stream_t *s)
+{
+    size_t  window;
+
+    if (s->h2c == NULL || s->in_closed || s->reset) {
+        return;
+    }
+
+    /* the window is reopened as the queued response is consumed */
+
+    if (s->size >= NGX_HTTP_V2_UPSTREAM_WINDOW) {
+        return;
+    }
+
+    window = NGX_HTTP_V2_UPSTREAM_WINDOW - s->size;
+
+    if (window <= s->recv_window
+        || window - s->recv_window < NGX_HTTP_V2_UPSTREAM_WINDOW / 4)
+    {
+        return;
+    }
+
+    if (ngx_http_v2_upstream_send_window_update(s->h2c, s->id,
+                                                window - s->recv_window)
+        != NGX_OK)
+    {
+        return;
+    }
+
+    s->recv_window = window;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    size_t                          n, total;
+    ngx_buf_t                      *b;
+    ngx_chain_t                    *cl;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    s = (ngx_http_v2_upstream_stream_t *) c;
+
+    if (s->size == 0) {
+
+        if (s->error) {
+            c->read->ready = 0;
+            c->read->error = 1;
+            return NGX_ERROR;
+        }
+
+        if (s->in_closed) {
+            c->read->ready = 0;
+            c->read->eof = 1;
+            return 0;
+        }
+
+        c->read->ready = 0;
+        return NGX_AGAIN;
+    }
+
+    total = 0;
+
+    while (s->in && total < size) {
+        cl = s->in;
+        b = cl->buf;
+
+        n = ngx_min(size - total, (size_t) (b->last - b->pos));
+
+        buf = ngx_cpymem(buf, b->pos, n);
+
+        b->pos += n;
+        total += n;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+
+            s->in = cl->next;
+
+            if (s->in == NULL) {
+                s->last_in = NULL;
+            }
+
+            cl->next = s->free;
+            s->free = cl;
+        }
+    }
+
+    s->size -= total;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http2 upstream recv: %uz of %uz", total, size);
+
+    ngx_http_v2_upstream_update_window(s);
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_recv_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    size_t      size;
+    ssize_t     n, total;
+    ngx_buf_t  *b;
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+
+        b = in->buf;
+
+        size = b->end - b->last;
+
+        if (limit) {
+            if (total >= limit) {
+                break;
+            }
+
+            if ((off_t) size > limit - total) {
+                size = (size_t) (limit - total);
+            }
+        }
+
+        n = ngx_http_v2_upstream_recv(c, b->last, size);
+
+        if (n == NGX_AGAIN || n == NGX_ERROR || n == 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if ((size_t) n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_v2_upstream_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   cl, *rc;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.temporary = 1;
+
+    cl.buf = &b;
+    cl.next = NULL;
+
+    rc = ngx_http_v2_upstream_send_chain(c, &cl, 0);
+
+    if (rc == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (b.pos == buf) {
+        return NGX_AGAIN;
+    }
+
+    return b.pos - buf;
+}
+
+
+static ngx_chain_t *
+ngx_http_v2_upstream_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    u_char                         *pos;
+    ngx_int_t                       rc;
+    ngx_buf_t                      *b;
+    ngx_http_v2_upstream_stream_t  *s;
+
+    s = (ngx_http_v2_upstream_stream_t *) c;
+
+    if (s->h2c == NULL || s->out_closed) {
+
+        if (s->in_closed && !s->error) {
+
+            /* the response is complete, the rest of request is not needed */
+
+            for ( /* void */ ; in; in = in->next) {
+                if (!ngx_buf_special(in->buf)) {
+                    in->buf->pos = in->buf->last;
+                }
+            }
+
+            return NULL;
+        }
+
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    for ( /* void */ ; in; in = in->next) {
+
+        b = in->buf;
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "file buf in http2 upstream send chain");
+            return NGX_CHAIN_ERROR;
+        }
+
+        pos = b->pos;
+
+        rc = ngx_http_v2_upstream_process_request(s, b);
+
+        c->sent += b->pos - pos;
+
+        if (rc == NGX_ERROR) {
+            c->write->error = 1;
+            return NGX_CHAIN_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http2 upstream stream blocked");
+
+            s->blocked = 1;
+            c->write->ready = 0;
+
+            return in;
+        }
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_process_request(ngx_http_v2_upstream_stream_t *s,
+    ngx_buf_t *b)
+{
+    size_t     size;
+    ngx_int_t  rc, n;
+
+    while (b->pos < b->last) {
+
+        switch (s->state) {
+
+        case ngx_http_v2_upstream_st_head:
+
+            if (ngx_http_v2_upstream_read_head(s, b) != NGX_OK) {
+                return NGX_ERROR;
+            }
+
+            break;
+
+        case ngx_http_v2_upstream_st_body:
+
+            size = (size_t) ngx_min((off_t) (b->last - b->pos), s->rest);
+
+            n = ngx_http_v2_upstream_send_data(s, b, size,
+                                               (off_t) size == s->rest);
+
+            if (n == NGX_AGAIN || n == NGX_ERROR) {
+                return n;
+            }
+
+            s->rest -= n;
+
+            if (s->rest == 0) {
+                s->state = ngx_http_v2_upstream_st_done;
+            }
+
+            break;
+
+        case ngx_http_v2_upstream_st_chunked:
+
+            rc = ngx_http_parse_chunked(s->connection.data, b, &s->chunked);
+
+            if (rc == NGX_OK) {
+
+                /* a chunk has been parsed successfully */
+
+                size = (size_t) ngx_min((off_t) (b->last - b->pos),
+                                        s->chunked.size);
+
+                n = ngx_http_v2_upstream_send_data(s, b, size, 0);
+
+                if (n == NGX_AGAIN || n == NGX_ERROR) {
+                    return n;
+                }
+
+                s->chunked.size -= n;
+
+                break;
+            }
+
+            if (rc == NGX_DONE) {
+
+                /* a whole request body has been parsed successfully */
+
+                if (ngx_http_v2_upstream_queue_frame(s->h2c,
+                                                  NGX_HTTP_V2_DATA_FRAME,
+                                                  NGX_HTTP_V2_END_STREAM_FLAG,
+                                                  s->id, NULL, 0)
+                    != NGX_OK)
+                {
+                    return NGX_ERROR;
+                }
+
+                s->out_closed = 1;
+                s->state = ngx_http_v2_upstream_st_done;
+
+                break;
+            }
+
+            if (rc == NGX_AGAIN) {
+                break;
+            }
+
+            ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                          "invalid chunked request body for http2 upstream");
+
+            return NGX_ERROR;
+
+        default: /* ngx_http_v2_upstream_st_done */
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                           "http2 upstream extra request data: %z",
+                           b->last - b->pos);
+
+            b->pos = b->last;
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_read_head(ngx_http_v2_upstream_stream_t *s,
+    ngx_buf_t *b)
+{
+    u_char      *p, ch;
+    size_t       size, len;
+    ngx_int_t    rc;
+    ngx_buf_t   *r;
+    ngx_uint_t   done;
+
+    done = 0;
+
+    for (p = b->pos; p < b->last; p++) {
+        ch = *p;
+
+        if (ch == LF) {
+            if (s->empty_line) {
+                done = 1;
+                p++;
+                break;
+            }
+
+            s->empty_line = 1;
+
+        } else if (ch != CR) {
+            s->empty_line = 0;
+        }
+    }
+
+    r = s->request;
+
+    if (done && r == NULL) {
+
+        /* the whole request head is in the buffer */
+
+        rc = ngx_http_v2_upstream_send_headers(s, b->pos, p);
+
+        b->pos = p;
+
+        return rc;
+    }
+
+    size = p - b->pos;
+
+    if (r == NULL || (size_t) (r->end - r->last) < size) {
+
+        len = r ? (size_t) (r->last - r->pos) : 0;
+
+        r = ngx_create_temp_buf(s->connection.pool,
+                                ngx_max(2 * len + size, 1024));
+        if (r == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (s->request) {
+            r->last = ngx_cpymem(r->last, s->request->pos, len);
+        }
+
+        s->request = r;
+    }
+
+    r->last = ngx_cpymem(r->last, b->pos, size);
+
+    b->pos = p;
+
+    if (done) {
+        return ngx_http_v2_upstream_send_headers(s, r->pos, r->last);
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_headers(ngx_http_v2_upstream_stream_t *s,
+    u_char *start, u_char *end)
+{
+    u_char                       *p, *pos, *last, *block, *tmp;
+    size_t                        len;
+    ngx_int_t                     rc;
+    ngx_str_t                     method, uri, name, value, host;
+    ngx_uint_t                    flags, type, body, chunked;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    h2c = s->h2c;
+
+    /* request line */
+
+    pos = start;
+
+    p = ngx_strlchr(pos, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    method.data = pos;
+    method.len = p - pos;
+
+    pos = p + 1;
+
+    p = ngx_strlchr(pos, end, ' ');
+    if (p == NULL) {
+        goto invalid;
+    }
+
+    uri.data = pos;
+    uri.len = p - pos;
+
+    p = ngx_strlchr(p, end, LF);
+    if (p == NULL || method.len == 0 || uri.len == 0) {
+        goto invalid;
+    }
+
+    start = p + 1;
+
+    /* the host header, and how the request body is delimited */
+
+    ngx_str_null(&host);
+
+    body = 0;
+    chunked = 0;
+
+    pos = start;
+
+    while ((rc = ngx_http_v2_upstream_parse_line(&pos, end, &name, &value))
+           == NGX_OK)
+    {
+        if (name.len == sizeof("host") - 1
+            && ngx_strncasecmp(name.data, (u_char *) "host", name.len) == 0)
+        {
+            host = value;
+
+        } else if (name.len == sizeof("content-length") - 1
+                   && ngx_strncasecmp(name.data, (u_char *) "content-length",
+                                      name.len)
+                      == 0)
+        {
+            s->rest = ngx_atoof(value.data, value.len);
+
+            if (s->rest == NGX_ERROR) {
+                goto invalid;
+            }
+
+            body = (s->rest > 0);
+
+        } else if (name.len == sizeof("transfer-encoding") - 1
+                   && ngx_strncasecmp(name.data,
+                                      (u_char *) "transfer-encoding",
+                                      name.len)
+                      == 0)
+        {
+            if (value.len != sizeof("chunked") - 1
+                || ngx_strncasecmp(value.data, (u_char *) "chunked",
+                                   value.len)
+                   != 0)
+            {
+                goto invalid;
+            }
+
+            chunked = 1;
+        }
+    }
+
+    if (rc == NGX_ERROR) {
+        goto invalid;
+    }
+
+    /*
+     * the header block: an indexed or literal representation without
+     * indexing per header, so as not to use the dynamic table
+     */
+
+    len = 3 * (end - start) + method.len + uri.len + host.len
+          + 8 * NGX_HTTP_V2_INT_OCTETS;
+
+    block = ngx_pnalloc(s->connection.pool, len);
+    if (block == NULL) {
+        return NGX_ERROR;
+    }
+
+    tmp = ngx_pnalloc(s->connection.pool, ngx_max(end - start,
+                                                  (ssize_t) uri.len));
+    if (tmp == NULL) {
+        return NGX_ERROR;
+    }
+
+    last = block;
+
+    if (method.len == 3 && ngx_strncmp(method.data, "GET", 3) == 0) {
+        *last++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_GET_INDEX);
+
+    } else if (method.len == 4 && ngx_strncmp(method.data, "POST", 4) == 0) {
+        *last++ = ngx_http_v2_indexed(NGX_HTTP_V2_METHOD_POST_INDEX);
+
+    } else {
+        if (method.len == 4 && ngx_strncmp(method.data, "HEAD", 4) == 0) {
+            s->head = 1;
+        }
+
+        *last++ = NGX_HTTP_V2_METHOD_INDEX;
+        last = ngx_http_v2_write_value(last, method.data, method.len, tmp);
+    }
+
+#if (NGX_HTTP_SSL)
+    if (h2c->connection->ssl) {
+        *last++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTPS_INDEX);
+
+    } else
+#endif
+    {
+        *last++ = ngx_http_v2_indexed(NGX_HTTP_V2_SCHEME_HTTP_INDEX);
+    }
+
+    if (host.len) {
+        *last++ = NGX_HTTP_V2_AUTHORITY_INDEX;
+        last = ngx_http_v2_write_value(last, host.data, host.len, tmp);
+    }
+
+    if (uri.len == 1 && uri.data[0] == '/') {
+        *last++ = ngx_http_v2_indexed(NGX_HTTP_V2_PATH_ROOT_INDEX);
+
+    } else {
+        *last++ = NGX_HTTP_V2_PATH_INDEX;
+        last = ngx_http_v2_write_value(last, uri.data, uri.len, tmp);
+    }
+
+    pos = start;
+
+    while (ngx_http_v2_upstream_parse_line(&pos, end, &name, &value)
+           == NGX_OK)
+    {
+        if (ngx_http_v2_upstream_hop_header(&name)) {
+            continue;
+        }
+
+        if (name.len == sizeof("host") - 1
+            && ngx_strncasecmp(name.data, (u_char *) "host", name.len) == 0)
+        {
+            continue;
+        }
+
+        if (name.len == sizeof("te") - 1
+            && ngx_strncasecmp(name.data, (u_char *) "te", name.len) == 0
+            && (value.len != sizeof("trailers") - 1
+                || ngx_strncasecmp(value.data, (u_char *) "trailers",
+                                   value.len)
+                   != 0))
+        {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                       "http2 upstream output header: \"%V: %V\"",
+                       &name, &value);
+
+        *last++ = 0;
+
+        last = ngx_http_v2_write_name(last, name.data, name.len, tmp);
+        last = ngx_http_v2_write_value(last, value.data, value.len, tmp);
+    }
+
+    /* the stream id is assigned as the stream is opened */
+
+    s->id = h2c->next_sid;
+    h2c->next_sid += 2;
+
+    flags = NGX_HTTP_V2_NO_FLAG;
+
+    if (chunked) {
+        s->state = ngx_http_v2_upstream_st_chunked;
+
+    } else if (body) {
+        s->state = ngx_http_v2_upstream_st_body;
+
+    } else {
+        s->state = ngx_http_v2_upstream_st_done;
+        s->out_closed = 1;
+        flags = NGX_HTTP_V2_END_STREAM_FLAG;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "http2 upstream open stream sid:%ui header block:%uz",
+                   s->id, (size_t) (last - block));
+
+    type = NGX_HTTP_V2_HEADERS_FRAME;
+    pos = block;
+
+    do {
+        len = ngx_min((size_t) (last - pos), NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+        if (pos + len == last) {
+            flags |= NGX_HTTP_V2_END_HEADERS_FLAG;
+        }
+
+        if (ngx_http_v2_upstream_queue_frame(h2c, type, flags, s->id,
+                                             pos, len)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        pos += len;
+
+        type = NGX_HTTP_V2_CONTINUATION_FRAME;
+        flags = NGX_HTTP_V2_NO_FLAG;
+
+    } while (pos < last);
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ALERT, s->connection.log, 0,
+                  "invalid request head for http2 upstream");
+
+    return NGX_ERROR;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_parse_line(u_char **pos, u_char *end, ngx_str_t *name,
+    ngx_str_t *value)
+{
+    u_char  *p, *lf, *colon, *last;
+
+    p = *pos;
+
+    if (p < end && *p == CR) {
+        p++;
+    }
+
+    if (p < end && *p == LF) {
+        *pos = p + 1;
+        return NGX_DONE;
+    }
+
+    p = *pos;
+
+    lf = ngx_strlchr(p, end, LF);
+    if (lf == NULL) {
+        return NGX_ERROR;
+    }
+
+    colon = ngx_strlchr(p, lf, ':');
+    if (colon == NULL || colon == p) {
+        return NGX_ERROR;
+    }
+
+    name->data = p;
+    name->len = colon - p;
+
+    for (p = colon + 1; p < lf && (*p == ' ' || *p == '\t'); p++) {
+        /* void */
+    }
+
+    for (last = lf; last > p; last--) {
+        if (last[-1] != CR && last[-1] != ' ' && last[-1] != '\t') {
+            break;
+        }
+    }
+
+    value->data = p;
+    value->len = last - p;
+
+    *pos = lf + 1;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v2_upstream_send_data(ngx_http_v2_upstream_stream_t *s,
+    ngx_buf_t *b, size_t size, ngx_uint_t last)
+{
+    size_t                        n, total;
+    ngx_uint_t                    flags;
+    ngx_http_v2_upstream_conn_t  *h2c;
+
+    h2c = s->h2c;
+    total = 0;
+
+    while (total < size) {
+
+        if (s->send_window <= 0
+            || h2c->send_window <= 0
+            || h2c->queued >= NGX_HTTP_V2_UPSTREAM_OUTPUT)
+        {
+            break;
+        }
+
+        n = ngx_min(size - total, (size_t) s->send_window);
+        n = ngx_min(n, (size_t) h2c->send_window);
+        n = ngx_min(n, NGX_HTTP_V2_DEFAULT_FRAME_SIZE);
+
+        flags = (last && total + n == size) ? NGX_HTTP_V2_END_STREAM_FLAG
+                                            : NGX_HTTP_V2_NO_FLAG;
+
+        if (ngx_http_v2_upstream_queue_frame(h2c, NGX_HTTP_V2_DATA_FRAME,
+                                             flags, s->id, b->pos, n)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        b->pos += n;
+        total += n;
+
+        s->send_window -= n;
+        h2c->send_window -= n;
+
+        if (flags) {
+            s->out_closed = 1;
+        }
+    }
+
+    if (total == 0 && size) {
+        return NGX_AGAIN;
+    }
+
+    return total;
+}
@@ -30,5 +30,11 @@ uintptr_t ngx_http_v3_encode_field_pbi(u_char *p, ngx_uint_t index);
 uintptr_t ngx_http_v3_encode_field_lpbi(u_char *p, ngx_uint_t index,
     u_char *data, size_t len);
 
+uintptr_t ngx_http_v3_encode_set_capacity(u_char *p, ngx_uint_t capacity);
+uintptr_t ngx_http_v3_encode_insert_ref(u_char *p, ngx_uint_t index,
+    ngx_str_t *value);
+uintptr_t ngx_http_v3_encode_insert(u_char *p, ngx_str_t *name,
+    ngx_str_t *value);
+
 
 #endif /* _NGX_HTTP_V3_ENCODE_H_INCLUDED_ */
@@ -83,18 +83,22 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 {
     u_char                    *p;
     size_t                     len, n;
+    ngx_int_t                  rc;
     ngx_buf_t                 *b;
-    ngx_str_t                  host, location;
+    ngx_str_t                  host, location, value;
     ngx_uint_t                 i, port;
     ngx_chain_t               *out, *hl, *cl, **ll;
     ngx_list_part_t           *part;
     ngx_table_elt_t           *header;
     ngx_connection_t          *c;
+    ngx_http_v3_section_t     *s, section;
     ngx_http_v3_session_t     *h3c;
     ngx_http_v3_filter_ctx_t  *ctx;
     ngx_http_core_loc_conf_t  *clcf;
     ngx_http_core_srv_conf_t  *cscf;
     u_char                     addr[NGX_SOCKADDR_STRLEN];
+    u_char                     status[sizeof("418") - 1];
+    u_char                     prefix[2 * NGX_HTTP_V3_PREFIX_INT_LEN];
 
     if (r->http_version != NGX_HTTP_VERSION_30) {
         return ngx_http_next_header_filter(r);
@@ -144,6 +148,14 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
     out = NULL;
     ll = &out;
 
+    rc = ngx_http_v3_start_section(c, &section);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    s = (rc == NGX_OK) ? &section : NULL;
+
     len = ngx_http_v3_encode_field_section_prefix(NULL, 0, 0, 0);
 
     if (r->headers_out.status == NGX_HTTP_OK) {
@@ -312,6 +324,15 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
 
         len += ngx_http_v3_encode_field_l(NULL, &header[i].key,
                                           &header[i].value);
+
+        if (s) {
+            /* a dynamic table index may take up to two more octets */
+            len += 2;
+        }
+    }
+
+    if (s) {
+        len += 2 * NGX_HTTP_V3_PREFIX_INT_LEN + 3 * 2;
     }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0, "http3 header len:%uz", len);
@@ -321,8 +342,16 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    b->last = (u_char *) ngx_http_v3_encode_field_section_prefix(b->last,
-                                                                 0, 0, 0);
+    if (s) {
+        /* the prefix is written once the field lines are encoded */
+
+        b->pos += 2 * NGX_HTTP_V3_PREFIX_INT_LEN;
+        b->last = b->pos;
+
+    } else {
+        b->last = (u_char *) ngx_http_v3_encode_field_section_prefix(b->last,
+                                                                     0, 0, 0);
+    }
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http3 output header: \":status: %03ui\"",
@@ -333,10 +362,13 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
                                                 NGX_HTTP_V3_HEADER_STATUS_200);
 
     } else {
-        b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
-                                                 NGX_HTTP_V3_HEADER_STATUS_200,
-                                                 NULL, 3);
-        b->last = ngx_sprintf(b->last, "%03ui", r->headers_out.status);
+        value.len = ngx_sprintf(status, "%03ui", r->headers_out.status)
+                    - status;
+        value.data = status;
+
+        b->last = ngx_http_v3_write_field(c, s, b->last,
+                                          NGX_HTTP_V3_HEADER_STATUS_200,
+                                          NULL, &value);
     }
 
     if (r->headers_out.server == NULL) {
@@ -356,9 +388,12 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
         ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "http3 output header: \"server: %*s\"", n, p);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
-                                                     NGX_HTTP_V3_HEADER_SERVER,
-                                                     p, n);
+        value.len = n;
+        value.data = p;
+
+        b->last = ngx_http_v3_write_field(c, s, b->last,
+                                          NGX_HTTP_V3_HEADER_SERVER,
+                                          NULL, &value);
     }
 
     if (r->headers_out.date == NULL) {
@@ -402,10 +437,9 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
                        "http3 output header: \"content-type: %V\"",
                        &r->headers_out.content_type);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_lri(b->last, 0,
+        b->last = ngx_http_v3_write_field(c, s, b->last,
                                     NGX_HTTP_V3_HEADER_CONTENT_TYPE_TEXT_PLAIN,
-                                    r->headers_out.content_type.data,
-                                    r->headers_out.content_type.len);
+                                    NULL, &r->headers_out.content_type);
     }
 
     if (r->headers_out.content_length == NULL
@@ -496,9 +530,18 @@ ngx_http_v3_header_filter(ngx_http_request_t *r)
                        "http3 output header: \"%V: %V\"",
                        &header[i].key, &header[i].value);
 
-        b->last = (u_char *) ngx_http_v3_encode_field_l(b->last,
-                                                        &header[i].key,
-                                                        &header[i].value);
+        b->last = ngx_http_v3_write_field(c, s, b->last, -1, &header[i].key,
+                                          &header[i].value);
+    }
+
+    if (s) {
+        p = ngx_http_v3_finish_section(c, s, prefix);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        b->pos -= p - prefix;
+        ngx_memcpy(b->pos, prefix, p - prefix);
     }
 
     if (r->header_only) {
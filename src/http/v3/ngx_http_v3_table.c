@@ -16,6 +16,16 @@
 static ngx_int_t ngx_http_v3_evict(ngx_connection_t *c, size_t target);
 static void ngx_http_v3_unblock(void *data);
 static ngx_int_t ngx_http_v3_new_entry(ngx_connection_t *c);
+static ngx_uint_t ngx_http_v3_encoder_indexable(
+    ngx_http_v3_encoder_table_t *et, ngx_str_t *name, ngx_str_t *value);
+static ngx_int_t ngx_http_v3_encoder_ref(ngx_http_v3_encoder_table_t *et,
+    ngx_http_v3_section_t *s, uint64_t index);
+static ngx_int_t ngx_http_v3_encoder_insert(ngx_connection_t *c,
+    ngx_http_v3_section_t *s, ngx_int_t index, ngx_str_t *name,
+    ngx_str_t *value);
+static void ngx_http_v3_free_section(ngx_http_v3_encoder_table_t *et,
+    ngx_http_v3_section_t *section);
+static void ngx_http_v3_encoder_unblock(ngx_http_v3_encoder_table_t *et);
 
 
 typedef struct {
@@ -331,8 +341,19 @@ void
 ngx_http_v3_cleanup_table(ngx_http_v3_session_t *h3c)
 {
     ngx_uint_t                    n;
+    ngx_http_v3_encoder_table_t  *et;
     ngx_http_v3_dynamic_table_t  *dt;
 
+    et = &h3c->encoder;
+
+    if (et->elts) {
+        for (n = 0; n < et->nelts; n++) {
+            ngx_free(et->elts[n]);
+        }
+
+        ngx_free(et->elts);
+    }
+
     dt = &h3c->table;
 
     if (dt->elts == NULL) {
@@ -411,10 +432,36 @@ ngx_http_v3_duplicate(ngx_connection_t *c, ngx_uint_t index)
 ngx_int_t
 ngx_http_v3_ack_section(ngx_connection_t *c, ngx_uint_t stream_id)
 {
+    ngx_queue_t                  *q;
+    ngx_http_v3_section_t        *section;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http3 ack section %ui", stream_id);
 
-    /* we do not use dynamic tables */
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = ngx_queue_next(q))
+    {
+        section = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (section->stream_id != stream_id) {
+            continue;
+        }
+
+        if (section->insert_count > et->known_insert_count) {
+            et->known_insert_count = section->insert_count;
+        }
+
+        ngx_http_v3_free_section(et, section);
+        ngx_http_v3_encoder_unblock(et);
+
+        return NGX_OK;
+    }
 
     return NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR;
 }
@@ -423,12 +470,24 @@ ngx_http_v3_ack_section(ngx_connection_t *c, ngx_uint_t stream_id)
 ngx_int_t
 ngx_http_v3_inc_insert_count(ngx_connection_t *c, ngx_uint_t inc)
 {
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http3 increment insert count %ui", inc);
 
-    /* we do not use dynamic tables */
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
 
-    return NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR;
+    if (inc == 0 || et->known_insert_count + inc > et->base + et->nelts) {
+        return NGX_HTTP_V3_ERR_DECODER_STREAM_ERROR;
+    }
+
+    et->known_insert_count += inc;
+
+    ngx_http_v3_encoder_unblock(et);
+
+    return NGX_OK;
 }
 
 
@@ -687,11 +746,17 @@ ngx_http_v3_new_entry(ngx_connection_t *c)
 ngx_int_t
 ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id, uint64_t value)
 {
+    ngx_http_v3_session_t  *h3c;
+
+    h3c = ngx_http_v3_get_session(c);
+
     switch (id) {
 
     case NGX_HTTP_V3_PARAM_MAX_TABLE_CAPACITY:
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "http3 param QPACK_MAX_TABLE_CAPACITY:%uL", value);
+
+        h3c->encoder.max_capacity = value;
         break;
 
     case NGX_HTTP_V3_PARAM_MAX_FIELD_SECTION_SIZE:
@@ -703,6 +768,8 @@ ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id, uint64_t value)
     case NGX_HTTP_V3_PARAM_BLOCKED_STREAMS:
         ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                        "http3 param QPACK_BLOCKED_STREAMS:%uL", value);
+
+        h3c->encoder.max_blocked = value;
         break;
 
     default:
@@ -713,3 +780,403 @@ ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id, uint64_t value)
 
     return NGX_OK;
 }
+
+
+ngx_int_t
+ngx_http_v3_start_section(ngx_connection_t *c, ngx_http_v3_section_t *s)
+{
+    size_t                        capacity;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_srv_conf_t       *h3scf;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    h3scf = ngx_http_v3_get_module_srv_conf(c, ngx_http_v3_module);
+
+    et = &h3c->encoder;
+
+    capacity = ngx_min(h3scf->dynamic_table_capacity, et->max_capacity);
+
+    if (capacity == 0) {
+        return NGX_DECLINED;
+    }
+
+    if (et->nsections >= h3scf->max_concurrent_streams) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 too many unacknowledged sections: %ui",
+                       et->nsections);
+        return NGX_DECLINED;
+    }
+
+    if (et->elts == NULL) {
+        et->elts = ngx_alloc((capacity / 32 + 1) * sizeof(void *), c->log);
+        if (et->elts == NULL) {
+            return NGX_ERROR;
+        }
+
+        if (ngx_http_v3_send_set_capacity(c, capacity) != NGX_OK) {
+            return NGX_ERROR;
+        }
+
+        et->capacity = capacity;
+    }
+
+    s->stream_id = c->quic->id;
+    s->base = et->base + et->nelts;
+    s->insert_count = 0;
+    s->min_index = (uint64_t) -1;
+    s->blocked = 0;
+
+    return NGX_OK;
+}
+
+
+u_char *
+ngx_http_v3_write_field(ngx_connection_t *c, ngx_http_v3_section_t *s,
+    u_char *p, ngx_int_t index, ngx_str_t *name, ngx_str_t *value)
+{
+    uint64_t                      n;
+    ngx_str_t                     static_name;
+    ngx_http_v3_field_t          *field;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    if (s == NULL) {
+        goto literal;
+    }
+
+    if (name == NULL) {
+        if (ngx_http_v3_lookup_static(c, index, &static_name, NULL)
+            != NGX_OK)
+        {
+            goto literal;
+        }
+
+        name = &static_name;
+    }
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    for (n = et->nelts; n; n--) {
+        field = et->elts[n - 1];
+
+        if (field->name.len == name->len
+            && field->value.len == value->len
+            && ngx_strncasecmp(field->name.data, name->data, name->len) == 0
+            && ngx_memcmp(field->value.data, value->data, value->len) == 0)
+        {
+            n = et->base + n - 1;
+
+            if (ngx_http_v3_encoder_ref(et, s, n) == NGX_OK) {
+                goto indexed;
+            }
+
+            goto literal;
+        }
+    }
+
+    if (ngx_http_v3_encoder_indexable(et, name, value)
+        && ngx_http_v3_encoder_insert(c, s, index, name, value) == NGX_OK)
+    {
+        n = et->base + et->nelts - 1;
+
+        if (ngx_http_v3_encoder_ref(et, s, n) == NGX_OK) {
+            goto indexed;
+        }
+    }
+
+literal:
+
+    if (index >= 0) {
+        return (u_char *) ngx_http_v3_encode_field_lri(p, 0, index,
+                                                       value->data,
+                                                       value->len);
+    }
+
+    return (u_char *) ngx_http_v3_encode_field_l(p, name, value);
+
+indexed:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 encoder ref [%uL] base:%uL", n, s->base);
+
+    if (n < s->base) {
+        return (u_char *) ngx_http_v3_encode_field_ri(p, 1, s->base - 1 - n);
+    }
+
+    return (u_char *) ngx_http_v3_encode_field_pbi(p, n - s->base);
+}
+
+
+u_char *
+ngx_http_v3_finish_section(ngx_connection_t *c, ngx_http_v3_section_t *s,
+    u_char *p)
+{
+    ngx_uint_t                    insert_count, max_entries;
+    ngx_queue_t                  *q;
+    ngx_connection_t             *pc;
+    ngx_http_v3_section_t        *section;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    if (s->insert_count == 0) {
+        return (u_char *) ngx_http_v3_encode_field_section_prefix(p, 0, 0, 0);
+    }
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    if (!ngx_queue_empty(&et->free)) {
+        q = ngx_queue_head(&et->free);
+        ngx_queue_remove(q);
+
+        section = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+    } else {
+        pc = c->quic ? c->quic->parent : c;
+
+        section = ngx_palloc(pc->pool, sizeof(ngx_http_v3_section_t));
+        if (section == NULL) {
+            return NULL;
+        }
+    }
+
+    *section = *s;
+
+    /*
+     * a section referencing entries not yet acknowledged by the decoder
+     * may block the stream until the encoder stream data arrives
+     */
+
+    if (s->insert_count > et->known_insert_count) {
+        section->blocked = 1;
+        et->nblocked++;
+    }
+
+    ngx_queue_insert_tail(&et->sections, &section->queue);
+    et->nsections++;
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 section insert_count:%uL base:%uL blocked:%ui/%ui",
+                   s->insert_count, s->base, et->nblocked, et->max_blocked);
+
+    max_entries = et->max_capacity / 32;
+    insert_count = s->insert_count % (2 * max_entries) + 1;
+
+    if (s->base >= s->insert_count) {
+        return (u_char *) ngx_http_v3_encode_field_section_prefix(p,
+                                       insert_count, 0,
+                                       s->base - s->insert_count);
+    }
+
+    return (u_char *) ngx_http_v3_encode_field_section_prefix(p,
+                                       insert_count, 1,
+                                       s->insert_count - s->base - 1);
+}
+
+
+void
+ngx_http_v3_cancel_sections(ngx_connection_t *c, uint64_t stream_id)
+{
+    ngx_queue_t                  *q, *next;
+    ngx_http_v3_section_t        *section;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        section = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (section->stream_id == stream_id) {
+            ngx_http_v3_free_section(et, section);
+        }
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_v3_encoder_indexable(ngx_http_v3_encoder_table_t *et,
+    ngx_str_t *name, ngx_str_t *value)
+{
+    if (ngx_http_v3_table_entry_size(name, value) > et->capacity / 4) {
+        return 0;
+    }
+
+    return !ngx_http_volatile_header(name);
+}
+
+
+static ngx_int_t
+ngx_http_v3_encoder_ref(ngx_http_v3_encoder_table_t *et,
+    ngx_http_v3_section_t *s, uint64_t index)
+{
+    if (index >= et->known_insert_count
+        && s->insert_count <= et->known_insert_count
+        && et->nblocked >= et->max_blocked)
+    {
+        /* referencing the entry would block one more stream */
+        return NGX_DECLINED;
+    }
+
+    if (index + 1 > s->insert_count) {
+        s->insert_count = index + 1;
+    }
+
+    if (index < s->min_index) {
+        s->min_index = index;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_v3_encoder_insert(ngx_connection_t *c, ngx_http_v3_section_t *s,
+    ngx_int_t index, ngx_str_t *name, ngx_str_t *value)
+{
+    u_char                       *p;
+    size_t                        size, used;
+    uint64_t                      limit;
+    ngx_int_t                     rc;
+    ngx_uint_t                    n, k;
+    ngx_queue_t                  *q;
+    ngx_http_v3_field_t          *field;
+    ngx_http_v3_section_t        *section;
+    ngx_http_v3_session_t        *h3c;
+    ngx_http_v3_encoder_table_t  *et;
+
+    h3c = ngx_http_v3_get_session(c);
+    et = &h3c->encoder;
+
+    size = ngx_http_v3_table_entry_size(name, value);
+
+    /*
+     * entries can only be evicted once acknowledged by the decoder and
+     * no longer referenced by unacknowledged field sections
+     */
+
+    limit = ngx_min(et->known_insert_count, s->min_index);
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = ngx_queue_next(q))
+    {
+        section = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (section->min_index < limit) {
+            limit = section->min_index;
+        }
+    }
+
+    used = et->size;
+
+    for (n = 0; used + size > et->capacity; n++) {
+
+        if (n == et->nelts || et->base + n >= limit) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "http3 encoder table is full");
+            return NGX_DECLINED;
+        }
+
+        field = et->elts[n];
+        used -= ngx_http_v3_table_entry_size(&field->name, &field->value);
+    }
+
+    p = ngx_alloc(sizeof(ngx_http_v3_field_t) + name->len + value->len,
+                  c->log);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_v3_send_insert(c, index, name, value);
+
+    if (rc != NGX_OK) {
+        ngx_free(p);
+        return rc;
+    }
+
+    for (k = 0; k < n; k++) {
+        field = et->elts[k];
+
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http3 encoder evict [%ui] \"%V\":\"%V\"",
+                       et->base + k, &field->name, &field->value);
+
+        ngx_free(field);
+    }
+
+    if (n) {
+        et->nelts -= n;
+        et->base += n;
+        ngx_memmove(et->elts, &et->elts[n], et->nelts * sizeof(void *));
+    }
+
+    field = (ngx_http_v3_field_t *) p;
+
+    field->name.data = p + sizeof(ngx_http_v3_field_t);
+    field->name.len = name->len;
+    ngx_strlow(field->name.data, name->data, name->len);
+
+    field->value.data = field->name.data + name->len;
+    field->value.len = value->len;
+    ngx_memcpy(field->value.data, value->data, value->len);
+
+    ngx_log_debug4(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http3 encoder insert [%ui] \"%V\":\"%V\", size:%uz",
+                   et->base + et->nelts, &field->name, &field->value, size);
+
+    et->elts[et->nelts++] = field;
+    et->size = used + size;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_v3_free_section(ngx_http_v3_encoder_table_t *et,
+    ngx_http_v3_section_t *section)
+{
+    ngx_queue_remove(&section->queue);
+
+    if (section->blocked) {
+        et->nblocked--;
+    }
+
+    et->nsections--;
+
+    ngx_queue_insert_tail(&et->free, &section->queue);
+}
+
+
+static void
+ngx_http_v3_encoder_unblock(ngx_http_v3_encoder_table_t *et)
+{
+    ngx_queue_t            *q;
+    ngx_http_v3_section_t  *section;
+
+    if (et->nblocked == 0) {
+        return;
+    }
+
+    for (q = ngx_queue_head(&et->sections);
+         q != ngx_queue_sentinel(&et->sections);
+         q = ngx_queue_next(q))
+    {
+        section = ngx_queue_data(q, ngx_http_v3_section_t, queue);
+
+        if (section->blocked
+            && section->insert_count <= et->known_insert_count)
+        {
+            section->blocked = 0;
+            et->nblocked--;
+        }
+    }
+}
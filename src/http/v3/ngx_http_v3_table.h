@@ -32,6 +32,32 @@ typedef struct {
 } ngx_http_v3_dynamic_table_t;
 
 
+typedef struct {
+    ngx_queue_t                   queue;
+    uint64_t                      stream_id;
+    uint64_t                      base;
+    uint64_t                      insert_count;
+    uint64_t                      min_index;
+    unsigned                      blocked:1;
+} ngx_http_v3_section_t;
+
+
+typedef struct {
+    ngx_http_v3_field_t         **elts;
+    ngx_uint_t                    nelts;
+    ngx_uint_t                    base;
+    size_t                        size;
+    size_t                        capacity;
+    size_t                        max_capacity;
+    uint64_t                      known_insert_count;
+    ngx_uint_t                    max_blocked;
+    ngx_uint_t                    nblocked;
+    ngx_uint_t                    nsections;
+    ngx_queue_t                   sections;
+    ngx_queue_t                   free;
+} ngx_http_v3_encoder_table_t;
+
+
 void ngx_http_v3_inc_insert_count_handler(ngx_event_t *ev);
 void ngx_http_v3_cleanup_table(ngx_http_v3_session_t *h3c);
 ngx_int_t ngx_http_v3_ref_insert(ngx_connection_t *c, ngx_uint_t dynamic,
@@ -54,5 +80,13 @@ void ngx_http_v3_ack_insert_count(ngx_connection_t *c, uint64_t insert_count);
 ngx_int_t ngx_http_v3_set_param(ngx_connection_t *c, uint64_t id,
     uint64_t value);
 
+ngx_int_t ngx_http_v3_start_section(ngx_connection_t *c,
+    ngx_http_v3_section_t *s);
+u_char *ngx_http_v3_write_field(ngx_connection_t *c, ngx_http_v3_section_t *s,
+    u_char *p, ngx_int_t index, ngx_str_t *name, ngx_str_t *value);
+u_char *ngx_http_v3_finish_section(ngx_connection_t *c,
+    ngx_http_v3_section_t *s, u_char *p);
+void ngx_http_v3_cancel_sections(ngx_connection_t *c, uint64_t stream_id);
+
 
 #endif /* _NGX_HTTP_V3_TABLE_H_INCLUDED_ */
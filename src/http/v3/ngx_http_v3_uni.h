@@ -27,6 +27,10 @@ ngx_int_t ngx_http_v3_send_cancel_stream(ngx_connection_t *c,
     ngx_uint_t stream_id);
 ngx_int_t ngx_http_v3_send_inc_insert_count(ngx_connection_t *c,
     ngx_uint_t inc);
+ngx_int_t ngx_http_v3_send_set_capacity(ngx_connection_t *c,
+    ngx_uint_t capacity);
+ngx_int_t ngx_http_v3_send_insert(ngx_connection_t *c, ngx_int_t index,
+    ngx_str_t *name, ngx_str_t *value);
 
 
 #endif /* _NGX_HTTP_V3_UNI_H_INCLUDED_ */
@@ -52,6 +52,8 @@ sig_atomic_t  ngx_noaccept;
 ngx_uint_t    ngx_noaccepting;
 ngx_uint_t    ngx_restart;
 
+ngx_event_t   ngx_wakeup_event;
+
 
 static u_char  master_process[] = "master process";
 
@@ -1000,6 +1002,39 @@ ngx_worker_process_exit(ngx_cycle_t *cycle)
 }
 
 
+void
+ngx_wakeup_worker_processes(ngx_log_t *log)
+{
+    ngx_int_t      i;
+    ngx_channel_t  ch;
+
+    ngx_memzero(&ch, sizeof(ngx_channel_t));
+
+    ch.command = NGX_CMD_WAKEUP;
+    ch.pid = ngx_pid;
+    ch.slot = ngx_process_slot;
+    ch.fd = -1;
+
+    for (i = 0; i < ngx_last_process; i++) {
+
+        if (i == ngx_process_slot
+            || ngx_processes[i].pid <= 0
+            || ngx_processes[i].channel[0] == -1)
+        {
+            continue;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_CORE, log, 0,
+                       "wakeup channel s:%i pid:%P", i, ngx_processes[i].pid);
+
+        /* a lost wakeup is not fatal, the waiters check the state anyway */
+
+        (void) ngx_write_channel(ngx_processes[i].channel[0],
+                                 &ch, sizeof(ngx_channel_t), log);
+    }
+}
+
+
 static void
 ngx_channel_handler(ngx_event_t *ev)
 {
@@ -1067,6 +1102,11 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].pid = ch.pid;
             ngx_processes[ch.slot].channel[0] = ch.fd;
+
+            if (ch.slot >= ngx_last_process) {
+                ngx_last_process = ch.slot + 1;
+            }
+
             break;
 
         case NGX_CMD_CLOSE_CHANNEL:
@@ -1083,6 +1123,18 @@ ngx_channel_handler(ngx_event_t *ev)
 
             ngx_processes[ch.slot].channel[0] = -1;
             break;
+
+        case NGX_CMD_WAKEUP:
+
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, ev->log, 0,
+                           "wakeup s:%i pid:%P", ch.slot, ch.pid);
+
+            if (ngx_wakeup_event.handler) {
+                ngx_wakeup_event.log = ev->log;
+                ngx_post_event(&ngx_wakeup_event, &ngx_posted_events);
+            }
+
+            break;
         }
     }
 }
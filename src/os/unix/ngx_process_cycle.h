@@ -18,6 +18,7 @@
 #define NGX_CMD_QUIT           3
 #define NGX_CMD_TERMINATE      4
 #define NGX_CMD_REOPEN         5
+#define NGX_CMD_WAKEUP         6
 
 
 #define NGX_PROCESS_SINGLE     0
@@ -36,6 +37,7 @@ typedef struct {
 
 void ngx_master_process_cycle(ngx_cycle_t *cycle);
 void ngx_single_process_cycle(ngx_cycle_t *cycle);
+void ngx_wakeup_worker_processes(ngx_log_t *log);
 
 
 extern ngx_uint_t      ngx_process;
@@ -45,6 +47,7 @@ extern ngx_pid_t       ngx_new_binary;
 extern ngx_uint_t      ngx_inherited;
 extern ngx_uint_t      ngx_daemonized;
 extern ngx_uint_t      ngx_exiting;
+extern ngx_event_t     ngx_wakeup_event;
 
 extern sig_atomic_t    ngx_reap;
 extern sig_atomic_t    ngx_sigio;
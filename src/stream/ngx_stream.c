@@ -496,6 +496,7 @@ ngx_stream_optimize_servers(ngx_conf_t *cf, ngx_array_t *ports)
             ls->backlog = addr[i].opt.backlog;
             ls->rcvbuf = addr[i].opt.rcvbuf;
             ls->sndbuf = addr[i].opt.sndbuf;
+            ls->batch = addr[i].opt.batch;
 
             ls->wildcard = addr[i].opt.wildcard;
 
@@ -66,6 +66,7 @@ typedef struct {
     int                            backlog;
     int                            rcvbuf;
     int                            sndbuf;
+    int                            batch;
 #if (NGX_HAVE_TCP_FASTOPEN)
     int                            fastopen;
 #endif
@@ -669,6 +669,21 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+            ls->batch = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            ls->bind = 1;
+
+            if (ls->batch == NGX_ERROR || ls->batch == 0
+                || ls->batch > NGX_UDP_MAX_BATCH)
+            {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid batch \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "rcvbuf=", 7) == 0) {
             size.len = value[i].len - 7;
             size.data = value[i].data + 7;
@@ -902,6 +917,9 @@ ngx_stream_core_listen(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             return "\"multipath\" parameter is incompatible with \"udp\"";
         }
 #endif
+
+    } else if (ls->batch) {
+        return "\"batch\" parameter requires \"udp\"";
     }
 
     for (n = 0; n < u.naddrs; n++) {
@@ -38,6 +38,12 @@ typedef struct {
 typedef struct {
     ngx_stream_limit_conn_shctx_t  *sh;
     ngx_slab_pool_t                *shpool;
+} ngx_stream_limit_conn_shard_t;
+
+
+typedef struct {
+    ngx_stream_limit_conn_shard_t  *shards;
+    ngx_uint_t                      nshards;
     ngx_stream_complex_value_t      key;
 } ngx_stream_limit_conn_ctx_t;
 
@@ -61,6 +67,8 @@ static void ngx_stream_limit_conn_cleanup(void *data);
 static ngx_inline void ngx_stream_limit_conn_cleanup_all(ngx_pool_t *pool);
 static void ngx_stream_limit_conn_cleanup_node(ngx_shm_zone_t *shm_zone,
     ngx_rbtree_node_t *node);
+static void ngx_stream_limit_conn_init_shards(ngx_stream_limit_conn_ctx_t *ctx,
+    ngx_slab_pool_t *shpool);
 
 static ngx_int_t ngx_stream_limit_conn_status_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data);
@@ -87,7 +95,7 @@ static ngx_conf_enum_t  ngx_stream_limit_conn_log_levels[] = {
 static ngx_command_t  ngx_stream_limit_conn_commands[] = {
 
     { ngx_string("limit_conn_zone"),
-      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE2,
+      NGX_STREAM_MAIN_CONF|NGX_CONF_TAKE23,
       ngx_stream_limit_conn_zone,
       0,
       0,
@@ -172,6 +180,7 @@ ngx_stream_limit_conn_handler(ngx_stream_session_t *s)
     ngx_rbtree_node_t                *node;
     ngx_pool_cleanup_t               *cln;
     ngx_stream_limit_conn_ctx_t      *ctx;
+    ngx_stream_limit_conn_shard_t    *shard;
     ngx_stream_limit_conn_node_t     *lc;
     ngx_stream_limit_conn_conf_t     *lccf;
     ngx_stream_limit_conn_limit_t    *limits;
@@ -203,9 +212,11 @@ ngx_stream_limit_conn_handler(ngx_stream_session_t *s)
 
         hash = ngx_crc32_short(key.data, key.len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        shard = &ctx->shards[hash % ctx->nshards];
+
+        ngx_shmtx_lock(&shard->shpool->mutex);
 
-        node = ngx_stream_limit_conn_lookup(&ctx->sh->rbtree, &key, hash);
+        node = ngx_stream_limit_conn_lookup(&shard->sh->rbtree, &key, hash);
 
         if (node == NULL) {
 
@@ -213,10 +224,10 @@ ngx_stream_limit_conn_handler(ngx_stream_session_t *s)
                 + offsetof(ngx_stream_limit_conn_node_t, data)
                 + key.len;
 
-            node = ngx_slab_alloc_locked(ctx->shpool, n);
+            node = ngx_slab_alloc_locked(shard->shpool, n);
 
             if (node == NULL) {
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                ngx_shmtx_unlock(&shard->shpool->mutex);
                 ngx_stream_limit_conn_cleanup_all(s->connection->pool);
 
                 if (lccf->dry_run) {
@@ -237,7 +248,7 @@ ngx_stream_limit_conn_handler(ngx_stream_session_t *s)
             lc->conn = 1;
             ngx_memcpy(lc->data, key.data, key.len);
 
-            ngx_rbtree_insert(&ctx->sh->rbtree, node);
+            ngx_rbtree_insert(&shard->sh->rbtree, node);
 
         } else {
 
@@ -245,7 +256,7 @@ ngx_stream_limit_conn_handler(ngx_stream_session_t *s)
 
             if ((ngx_uint_t) lc->conn >= limits[i].conn) {
 
-                ngx_shmtx_unlock(&ctx->shpool->mutex);
+                ngx_shmtx_unlock(&shard->shpool->mutex);
 
                 ngx_log_error(lccf->log_level, s->connection->log, 0,
                               "limiting connections%s by zone \"%V\"",
@@ -271,7 +282,7 @@ ngx_stream_limit_conn_handler(ngx_stream_session_t *s)
         ngx_log_debug2(NGX_LOG_DEBUG_STREAM, s->connection->log, 0,
                        "limit conn: %08Xi %d", node->key, lc->conn);
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(&shard->shpool->mutex);
 
         cln = ngx_pool_cleanup_add(s->connection->pool,
                                    sizeof(ngx_stream_limit_conn_cleanup_t));
@@ -377,15 +388,18 @@ ngx_stream_limit_conn_cleanup(void *data)
 {
     ngx_stream_limit_conn_cleanup_t  *lccln = data;
 
-    ngx_rbtree_node_t             *node;
-    ngx_stream_limit_conn_ctx_t   *ctx;
-    ngx_stream_limit_conn_node_t  *lc;
+    ngx_rbtree_node_t              *node;
+    ngx_stream_limit_conn_ctx_t    *ctx;
+    ngx_stream_limit_conn_node_t   *lc;
+    ngx_stream_limit_conn_shard_t  *shard;
 
     ctx = lccln->shm_zone->data;
     node = lccln->node;
     lc = (ngx_stream_limit_conn_node_t *) &node->color;
 
-    ngx_shmtx_lock(&ctx->shpool->mutex);
+    shard = &ctx->shards[node->key % ctx->nshards];
+
+    ngx_shmtx_lock(&shard->shpool->mutex);
 
     ngx_log_debug2(NGX_LOG_DEBUG_STREAM, lccln->shm_zone->shm.log, 0,
                    "limit conn cleanup: %08Xi %d", node->key, lc->conn);
@@ -393,11 +407,11 @@ ngx_stream_limit_conn_cleanup(void *data)
     lc->conn--;
 
     if (lc->conn == 0) {
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_rbtree_delete(&shard->sh->rbtree, node);
+        ngx_slab_free_locked(shard->shpool, node);
     }
 
-    ngx_shmtx_unlock(&ctx->shpool->mutex);
+    ngx_shmtx_unlock(&shard->shpool->mutex);
 }
 
 
@@ -435,8 +449,11 @@ ngx_stream_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
 {
     ngx_stream_limit_conn_ctx_t  *octx = data;
 
-    size_t                        len;
-    ngx_stream_limit_conn_ctx_t  *ctx;
+    size_t                          len, size;
+    ngx_uint_t                      i;
+    ngx_slab_pool_t                *shpool, *sp;
+    ngx_stream_limit_conn_ctx_t    *ctx;
+    ngx_stream_limit_conn_shctx_t  *sh;
 
     ctx = shm_zone->data;
 
@@ -454,45 +471,90 @@ ngx_stream_limit_conn_init_zone(ngx_shm_zone_t *shm_zone, void *data)
             return NGX_ERROR;
         }
 
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_conn_zone \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards,
+                          octx->nshards);
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(ctx->shards, octx->shards,
+                   ctx->nshards * sizeof(ngx_stream_limit_conn_shard_t));
 
         return NGX_OK;
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
     if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+        ngx_stream_limit_conn_init_shards(ctx, shpool);
 
         return NGX_OK;
     }
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool,
-                             sizeof(ngx_stream_limit_conn_shctx_t));
-    if (ctx->sh == NULL) {
+    len = sizeof(" in limit_conn_zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
         return NGX_ERROR;
     }
 
-    ctx->shpool->data = ctx->sh;
+    ngx_sprintf(shpool->log_ctx, " in limit_conn_zone \"%V\"%Z",
+                &shm_zone->shm.name);
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_stream_limit_conn_rbtree_insert_value);
+    size = shpool->pfree / ctx->nshards * ngx_pagesize;
 
-    len = sizeof(" in limit_conn_zone \"\"") + shm_zone->shm.name.len;
+    for (i = 0; i < ctx->nshards; i++) {
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+        if (ctx->nshards == 1) {
+            sp = shpool;
+
+        } else {
+            sp = ngx_slab_add_pool(shpool, size);
+            if (sp == NULL) {
+                return NGX_ERROR;
+            }
+
+            sp->log_ctx = shpool->log_ctx;
+        }
+
+        sh = ngx_slab_alloc(sp, sizeof(ngx_stream_limit_conn_shctx_t));
+        if (sh == NULL) {
+            return NGX_ERROR;
+        }
+
+        sp->data = sh;
+
+        ngx_rbtree_init(&sh->rbtree, &sh->sentinel,
+                        ngx_stream_limit_conn_rbtree_insert_value);
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in limit_conn_zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    ngx_stream_limit_conn_init_shards(ctx, shpool);
 
     return NGX_OK;
 }
 
 
+static void
+ngx_stream_limit_conn_init_shards(ngx_stream_limit_conn_ctx_t *ctx,
+    ngx_slab_pool_t *shpool)
+{
+    ngx_uint_t        i;
+    ngx_slab_pool_t  *sp;
+
+    sp = (ctx->nshards == 1) ? shpool : shpool->next;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        ctx->shards[i].sh = sp->data;
+        ctx->shards[i].shpool = sp;
+
+        sp = sp->next;
+    }
+}
+
+
 static ngx_int_t
 ngx_stream_limit_conn_status_variable(ngx_stream_session_t *s,
     ngx_stream_variable_value_t *v, uintptr_t data)
@@ -559,6 +621,7 @@ ngx_stream_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     u_char                              *p;
     ssize_t                              size;
     ngx_str_t                           *value, name, s;
+    ngx_int_t                            shards;
     ngx_uint_t                           i;
     ngx_shm_zone_t                      *shm_zone;
     ngx_stream_limit_conn_ctx_t         *ctx;
@@ -582,6 +645,7 @@ ngx_stream_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     size = 0;
+    shards = 1;
     name.len = 0;
 
     for (i = 2; i < cf->args->nelts; i++) {
@@ -620,6 +684,19 @@ ngx_stream_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 256) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid number of shards \"%V\"",
+                                   &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -632,6 +709,20 @@ ngx_stream_limit_conn_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    if (size / shards < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small for %i shards",
+                           &name, shards);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->nshards = shards;
+    ctx->shards = ngx_pcalloc(cf->pool,
+                              shards * sizeof(ngx_stream_limit_conn_shard_t));
+    if (ctx->shards == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_stream_limit_conn_module);
     if (shm_zone == NULL) {
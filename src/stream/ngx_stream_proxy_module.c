@@ -35,6 +35,10 @@ typedef struct {
     ngx_stream_upstream_local_t     *local;
     ngx_flag_t                       socket_keepalive;
 
+#if (NGX_HAVE_SPLICE)
+    ngx_flag_t                       splice;
+#endif
+
 #if (NGX_STREAM_SSL)
     ngx_flag_t                       ssl_enable;
     ngx_flag_t                       ssl_session_reuse;
@@ -60,6 +64,24 @@ typedef struct {
 } ngx_stream_proxy_srv_conf_t;
 
 
+#if (NGX_HAVE_SPLICE)
+
+typedef struct {
+    ngx_fd_t                         fd[2];
+    size_t                           size;
+    size_t                           capacity;
+    unsigned                         active:1;
+} ngx_stream_proxy_pipe_t;
+
+
+typedef struct {
+    ngx_stream_proxy_pipe_t          upstream;
+    ngx_stream_proxy_pipe_t          downstream;
+} ngx_stream_proxy_splice_t;
+
+#endif
+
+
 static void ngx_stream_proxy_handler(ngx_stream_session_t *s);
 static ngx_int_t ngx_stream_proxy_eval(ngx_stream_session_t *s,
     ngx_stream_proxy_srv_conf_t *pscf);
@@ -78,6 +100,13 @@ static void ngx_stream_proxy_process(ngx_stream_session_t *s,
     ngx_uint_t from_upstream, ngx_uint_t do_write);
 static ngx_int_t ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
     ngx_uint_t from_upstream);
+#if (NGX_HAVE_SPLICE)
+static ngx_int_t ngx_stream_proxy_init_splice(ngx_stream_session_t *s);
+static ssize_t ngx_stream_proxy_splice(ngx_stream_session_t *s,
+    ngx_stream_proxy_pipe_t *p, ngx_connection_t *src, ngx_connection_t *dst,
+    char *recv_action, char *send_action);
+static void ngx_stream_proxy_splice_cleanup(void *data);
+#endif
 static void ngx_stream_proxy_next_upstream(ngx_stream_session_t *s);
 static void ngx_stream_proxy_finalize(ngx_stream_session_t *s, ngx_uint_t rc);
 static u_char *ngx_stream_proxy_log_error(ngx_log_t *log, u_char *buf,
@@ -255,6 +284,17 @@ static ngx_command_t  ngx_stream_proxy_commands[] = {
       offsetof(ngx_stream_proxy_srv_conf_t, half_close),
       NULL },
 
+#if (NGX_HAVE_SPLICE)
+
+    { ngx_string("proxy_splice"),
+      NGX_STREAM_MAIN_CONF|NGX_STREAM_SRV_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_stream_proxy_srv_conf_t, splice),
+      NULL },
+
+#endif
+
 #if (NGX_STREAM_SSL)
 
     { ngx_string("proxy_ssl"),
@@ -926,6 +966,15 @@ ngx_stream_proxy_init_upstream(ngx_stream_session_t *s)
     u->upload_last = ngx_current_msec;
     u->upload_excess = s->received;
 
+#if (NGX_HAVE_SPLICE)
+
+    if (pscf->splice && ngx_stream_proxy_init_splice(s) != NGX_OK) {
+        ngx_stream_proxy_finalize(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+#endif
+
     u->connected = 1;
 
     pc->read->handler = ngx_stream_proxy_upstream_handler;
@@ -1570,6 +1619,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
     ngx_log_handler_pt            handler;
     ngx_stream_upstream_t        *u;
     ngx_stream_proxy_srv_conf_t  *pscf;
+#if (NGX_HAVE_SPLICE)
+    ngx_stream_proxy_pipe_t      *p;
+    ngx_stream_proxy_splice_t    *sp;
+#endif
 
     u = s->upstream;
 
@@ -1631,6 +1684,43 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         sent = dst->sent;
     }
 
+#if (NGX_HAVE_SPLICE)
+
+    sp = ngx_stream_get_module_ctx(s, ngx_stream_proxy_module);
+
+    if (sp && dst) {
+        p = from_upstream ? &sp->upstream : &sp->downstream;
+
+        /* data already buffered are sent with the write filter first */
+
+        if (p->active || (*out == NULL && *busy == NULL && !dst->buffered)) {
+
+            n = ngx_stream_proxy_splice(s, p, src, dst, recv_action,
+                                        send_action);
+
+            if (n == NGX_ERROR) {
+                ngx_stream_proxy_finalize(s, NGX_STREAM_OK);
+                return;
+            }
+
+            if (n) {
+                if (from_upstream
+                    && u->state->first_byte_time == (ngx_msec_t) -1)
+                {
+                    u->state->first_byte_time = ngx_current_msec
+                                                - u->start_time;
+                }
+
+                (*packets)++;
+                *received += n;
+            }
+
+            goto done;
+        }
+    }
+
+#endif
+
     for ( ;; ) {
 
         if (do_write && dst) {
@@ -1751,6 +1841,10 @@ ngx_stream_proxy_process(ngx_stream_session_t *s, ngx_uint_t from_upstream,
         break;
     }
 
+#if (NGX_HAVE_SPLICE)
+done:
+#endif
+
     c->log->action = "proxying connection";
 
     if (ngx_stream_proxy_test_finalize(s, from_upstream) == NGX_OK) {
@@ -1888,6 +1982,232 @@ ngx_stream_proxy_test_finalize(ngx_stream_session_t *s,
 }
 
 
+#if (NGX_HAVE_SPLICE)
+
+static ngx_int_t
+ngx_stream_proxy_init_splice(ngx_stream_session_t *s)
+{
+    ngx_connection_t           *c, *pc;
+    ngx_pool_cleanup_t         *cln;
+    ngx_stream_upstream_t      *u;
+    ngx_stream_proxy_splice_t  *sp;
+
+    c = s->connection;
+    u = s->upstream;
+    pc = u->peer.connection;
+
+    /*
+     * the data can be moved between sockets in the kernel only
+     * when they are passed through as is
+     */
+
+    if (c->type != SOCK_STREAM
+        || u->upload_rate
+        || u->download_rate
+#if (NGX_STREAM_SSL)
+        || c->ssl
+        || pc->ssl
+#endif
+        || ngx_stream_get_module_ctx(s, ngx_stream_proxy_module))
+    {
+        return NGX_OK;
+    }
+
+    sp = ngx_pcalloc(c->pool, sizeof(ngx_stream_proxy_splice_t));
+    if (sp == NULL) {
+        return NGX_ERROR;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     sp->upstream.size = 0;
+     *     sp->upstream.active = 0;
+     *     sp->downstream.size = 0;
+     *     sp->downstream.active = 0;
+     */
+
+    sp->upstream.fd[0] = NGX_INVALID_FILE;
+    sp->upstream.fd[1] = NGX_INVALID_FILE;
+    sp->downstream.fd[0] = NGX_INVALID_FILE;
+    sp->downstream.fd[1] = NGX_INVALID_FILE;
+
+    cln = ngx_pool_cleanup_add(c->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_stream_proxy_splice_cleanup;
+    cln->data = sp;
+
+    ngx_stream_set_ctx(s, sp, ngx_stream_proxy_module);
+
+    ngx_log_debug0(NGX_LOG_DEBUG_STREAM, c->log, 0, "stream proxy splice");
+
+    return NGX_OK;
+}
+
+
+static ssize_t
+ngx_stream_proxy_splice(ngx_stream_session_t *s, ngx_stream_proxy_pipe_t *p,
+    ngx_connection_t *src, ngx_connection_t *dst, char *recv_action,
+    char *send_action)
+{
+    int                           n;
+    ssize_t                       size, received;
+    ngx_err_t                     err;
+    ngx_uint_t                    progress;
+    ngx_connection_t             *c;
+    ngx_stream_proxy_srv_conf_t  *pscf;
+
+    c = s->connection;
+
+    if (!p->active) {
+        if (pipe2(p->fd, O_NONBLOCK|O_CLOEXEC) == -1) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno, "pipe2() failed");
+            return NGX_ERROR;
+        }
+
+        p->active = 1;
+        p->capacity = 65536;
+
+#if (defined F_GETPIPE_SZ && defined F_SETPIPE_SZ)
+
+        n = fcntl(p->fd[1], F_GETPIPE_SZ);
+
+        if (n > 0) {
+            p->capacity = n;
+        }
+
+        pscf = ngx_stream_get_module_srv_conf(s, ngx_stream_proxy_module);
+
+        if (pscf->buffer_size > p->capacity) {
+            n = fcntl(p->fd[1], F_SETPIPE_SZ, (int) pscf->buffer_size);
+
+            if (n > 0) {
+                p->capacity = n;
+            }
+        }
+
+#endif
+
+        ngx_log_debug3(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                       "stream proxy pipe %d:%d, size:%uz",
+                       p->fd[0], p->fd[1], p->capacity);
+    }
+
+    received = 0;
+
+    do {
+        progress = 0;
+
+        if (p->size && dst->write->ready) {
+            c->log->action = send_action;
+
+            size = splice(p->fd[0], NULL, dst->fd, NULL, p->size,
+                          SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice to %d: %z", dst->fd, size);
+
+            if (size == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+                    dst->write->ready = 0;
+
+                } else if (err != NGX_EINTR) {
+                    dst->write->error = 1;
+                    ngx_connection_error(dst, err, "splice() failed");
+                    return NGX_ERROR;
+                }
+
+            } else {
+                p->size -= size;
+                dst->sent += size;
+                progress = 1;
+            }
+        }
+
+        if (p->size < p->capacity && src->read->ready && !src->read->eof) {
+            c->log->action = recv_action;
+
+            size = splice(src->fd, NULL, p->fd[1], NULL,
+                          p->capacity - p->size,
+                          SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_STREAM, c->log, 0,
+                           "splice from %d: %z", src->fd, size);
+
+            if (size == -1) {
+                err = ngx_errno;
+
+                if (err == NGX_EAGAIN) {
+
+                    /* a non-empty pipe may have no room for more pages */
+
+                    if (p->size == 0) {
+                        src->read->ready = 0;
+                    }
+
+                } else if (err != NGX_EINTR) {
+                    src->read->ready = 0;
+                    src->read->eof = 1;
+                    src->read->error = 1;
+                    ngx_connection_error(src, err, "splice() failed");
+                }
+
+            } else if (size == 0) {
+                src->read->ready = 0;
+                src->read->eof = 1;
+
+            } else {
+                p->size += size;
+                received += size;
+                progress = 1;
+            }
+        }
+
+    } while (progress);
+
+    if (p->size) {
+        dst->buffered |= NGX_LOWLEVEL_BUFFERED;
+
+    } else {
+        dst->buffered &= ~NGX_LOWLEVEL_BUFFERED;
+    }
+
+    return received;
+}
+
+
+static void
+ngx_stream_proxy_splice_cleanup(void *data)
+{
+    ngx_stream_proxy_splice_t  *sp = data;
+
+    ngx_uint_t                i, k;
+    ngx_stream_proxy_pipe_t  *p;
+
+    for (i = 0; i < 2; i++) {
+        p = i ? &sp->downstream : &sp->upstream;
+
+        if (!p->active) {
+            continue;
+        }
+
+        for (k = 0; k < 2; k++) {
+            if (close(p->fd[k]) == -1) {
+                ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                              "close() pipe failed");
+            }
+        }
+    }
+}
+
+#endif
+
+
 static void
 ngx_stream_proxy_next_upstream(ngx_stream_session_t *s)
 {
@@ -2090,6 +2410,9 @@ ngx_stream_proxy_create_srv_conf(ngx_conf_t *cf)
     conf->local = NGX_CONF_UNSET_PTR;
     conf->socket_keepalive = NGX_CONF_UNSET;
     conf->half_close = NGX_CONF_UNSET;
+#if (NGX_HAVE_SPLICE)
+    conf->splice = NGX_CONF_UNSET;
+#endif
 
 #if (NGX_STREAM_SSL)
     conf->ssl_enable = NGX_CONF_UNSET;
@@ -2150,6 +2473,10 @@ ngx_stream_proxy_merge_srv_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_value(conf->half_close, prev->half_close, 0);
 
+#if (NGX_HAVE_SPLICE)
+    ngx_conf_merge_value(conf->splice, prev->splice, 0);
+#endif
+
 #if (NGX_STREAM_SSL)
 
     if (ngx_stream_proxy_merge_ssl(cf, conf, prev) != NGX_OK) {
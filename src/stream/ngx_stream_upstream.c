@@ -511,6 +511,11 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+            us->resolve = 1;
+            continue;
+        }
+
         goto invalid;
     }
 
@@ -536,6 +541,8 @@ ngx_stream_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     us->name = u.url;
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
+    us->host = u.host;
+    us->port = u.port;
     us->weight = weight;
     us->max_conns = max_conns;
     us->max_fails = max_fails;
@@ -0,0 +1,792 @@
+
+/*
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_stream.h>
+
+
+typedef struct {
+    ngx_msec_t                             interval;
+    ngx_msec_t                             timeout;
+    ngx_uint_t                             fails;
+    ngx_uint_t                             passes;
+
+    ngx_str_t                              send;
+    ngx_str_t                              expect;
+} ngx_stream_upstream_check_srv_conf_t;
+
+
+typedef struct {
+    ngx_stream_upstream_check_srv_conf_t  *conf;
+    ngx_stream_upstream_srv_conf_t        *upstream;
+
+    ngx_stream_upstream_rr_peers_t        *peers;
+    ngx_stream_upstream_rr_peer_t         *peer;
+    ngx_uint_t                             config;
+
+    ngx_peer_connection_t                  pc;
+    ngx_str_t                              name;
+
+    ngx_buf_t                             *request;
+    ngx_buf_t                             *response;
+
+    ngx_pool_t                            *pool;
+    ngx_log_t                              log;
+
+    unsigned                               connected:1;
+} ngx_stream_upstream_check_ctx_t;
+
+
+static ngx_int_t ngx_stream_upstream_check_init_worker(ngx_cycle_t *cycle);
+static void ngx_stream_upstream_check_handler(ngx_event_t *ev);
+static void ngx_stream_upstream_check_peer(
+    ngx_stream_upstream_srv_conf_t *uscf, ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_t *peer, ngx_log_t *log);
+static void ngx_stream_upstream_check_send_handler(ngx_event_t *wev);
+static void ngx_stream_upstream_check_recv_handler(ngx_event_t *rev);
+static ngx_int_t ngx_stream_upstream_check_test_connect(ngx_connection_t *c);
+static ngx_int_t ngx_stream_upstream_check_process(
+    ngx_stream_upstream_check_ctx_t *ctx, ngx_uint_t last);
+static void ngx_stream_upstream_check_done(
+    ngx_stream_upstream_check_ctx_t *ctx, ngx_int_t rc);
+static u_char *ngx_stream_upstream_check_log_error(ngx_log_t *log,
+    u_char *buf, size_t len);
+
+static void *ngx_stream_upstream_check_create_conf(ngx_conf_t *cf);
+static char *ngx_stream_upstream_check_init_main_conf(ngx_conf_t *cf,
+    void *conf);
+static char *ngx_stream_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_stream_upstream_check_commands[] = {
+
+    { ngx_string("health_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_stream_upstream_check,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_stream_module_t  ngx_stream_upstream_check_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    ngx_stream_upstream_check_init_main_conf, /* init main configuration */
+
+    ngx_stream_upstream_check_create_conf, /* create server configuration */
+    NULL                                   /* merge server configuration */
+};
+
+
+ngx_module_t  ngx_stream_upstream_check_module = {
+    NGX_MODULE_V1,
+    &ngx_stream_upstream_check_module_ctx, /* module context */
+    ngx_stream_upstream_check_commands,    /* module directives */
+    NGX_STREAM_MODULE,                     /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_stream_upstream_check_init_worker, /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_stream_upstream_check_init_worker(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                             i;
+    ngx_event_t                           *ev;
+    ngx_stream_upstream_srv_conf_t        *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t       *umcf;
+    ngx_stream_upstream_check_srv_conf_t  *ucf;
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_stream_cycle_get_module_main_conf(cycle,
+                                                 ngx_stream_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL || uscf->shm_zone == NULL) {
+            continue;
+        }
+
+        ucf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                              ngx_stream_upstream_check_module);
+
+        if (ucf->interval == 0) {
+            continue;
+        }
+
+        ev = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
+        if (ev == NULL) {
+            return NGX_ERROR;
+        }
+
+        ev->handler = ngx_stream_upstream_check_handler;
+        ev->data = uscf;
+        ev->log = cycle->log;
+        ev->cancelable = 1;
+
+        ngx_add_timer(ev, ngx_random() % ucf->interval + 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_stream_upstream_check_handler(ngx_event_t *ev)
+{
+    ngx_stream_upstream_rr_peer_t         *peer;
+    ngx_stream_upstream_rr_peers_t        *peers, *primary;
+    ngx_stream_upstream_srv_conf_t        *uscf;
+    ngx_stream_upstream_check_srv_conf_t  *ucf;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    uscf = ev->data;
+    ucf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                            ngx_stream_upstream_check_module);
+
+    ngx_add_timer(ev, ucf->interval);
+
+    primary = uscf->peer.data;
+
+    /*
+     * each round of checks is run by a single worker process,
+     * the one whose timer fires first after the interval
+     */
+
+    ngx_stream_upstream_rr_peers_wlock(primary);
+
+    if (primary->check_time
+        && (ngx_msec_int_t) (ngx_current_msec - primary->check_time)
+           < (ngx_msec_int_t) ucf->interval)
+    {
+        ngx_stream_upstream_rr_peers_unlock(primary);
+        return;
+    }
+
+    primary->check_time = ngx_current_msec;
+
+    ngx_stream_upstream_rr_peers_unlock(primary);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, ev->log, 0,
+                   "health check upstream \"%V\"", &uscf->host);
+
+    for (peers = primary; peers; peers = peers->next) {
+
+        ngx_stream_upstream_rr_peers_rlock(peers);
+
+        for (peer = peers->peer; peer; peer = peer->next) {
+
+            if (peer->down) {
+                continue;
+            }
+
+            ngx_stream_upstream_check_peer(uscf, peers, peer, ev->log);
+        }
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+    }
+}
+
+
+static void
+ngx_stream_upstream_check_peer(ngx_stream_upstream_srv_conf_t *uscf,
+    ngx_stream_upstream_rr_peers_t *peers, ngx_stream_upstream_rr_peer_t *peer,
+    ngx_log_t *log)
+{
+    ngx_int_t                              rc;
+    ngx_pool_t                            *pool;
+    ngx_connection_t                      *c;
+    ngx_stream_upstream_check_ctx_t       *ctx;
+    ngx_stream_upstream_check_srv_conf_t  *ucf;
+
+    ucf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                            ngx_stream_upstream_check_module);
+
+    pool = ngx_create_pool(1024, log);
+    if (pool == NULL) {
+        return;
+    }
+
+    ctx = ngx_pcalloc(pool, sizeof(ngx_stream_upstream_check_ctx_t));
+    if (ctx == NULL) {
+        ngx_destroy_pool(pool);
+        return;
+    }
+
+    ctx->conf = ucf;
+    ctx->upstream = uscf;
+    ctx->peers = peers;
+    ctx->peer = peer;
+    ctx->pool = pool;
+
+    if (peers->config) {
+        ctx->config = *peers->config;
+    }
+
+    ctx->log = *log;
+    ctx->log.handler = ngx_stream_upstream_check_log_error;
+    ctx->log.data = ctx;
+    ctx->log.action = "checking upstream server";
+
+    pool->log = &ctx->log;
+
+    ctx->pc.sockaddr = ngx_pcalloc(pool, peer->socklen);
+    if (ctx->pc.sockaddr == NULL) {
+        goto failed;
+    }
+
+    ngx_memcpy(ctx->pc.sockaddr, peer->sockaddr, peer->socklen);
+    ctx->pc.socklen = peer->socklen;
+
+    ctx->name.data = ngx_pstrdup(pool, &peer->name);
+    if (ctx->name.data == NULL) {
+        goto failed;
+    }
+
+    ctx->name.len = peer->name.len;
+
+    ctx->request = ngx_create_temp_buf(pool, ucf->send.len);
+    if (ctx->request == NULL) {
+        goto failed;
+    }
+
+    ctx->request->last = ngx_cpymem(ctx->request->pos, ucf->send.data,
+                                    ucf->send.len);
+
+    /* the response is matched as it is received, see below */
+
+    ctx->response = ngx_create_temp_buf(pool,
+                                        ngx_max(ngx_pagesize, ucf->expect.len));
+    if (ctx->response == NULL) {
+        goto failed;
+    }
+
+    ctx->pc.name = &ctx->name;
+    ctx->pc.get = ngx_event_get_peer;
+    ctx->pc.log = &ctx->log;
+    ctx->pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&ctx->pc);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+        return;
+    }
+
+    /* rc == NGX_OK || rc == NGX_AGAIN || rc == NGX_DONE */
+
+    c = ctx->pc.connection;
+
+    c->data = ctx;
+    c->pool = pool;
+
+    c->write->handler = ngx_stream_upstream_check_send_handler;
+    c->read->handler = ngx_stream_upstream_check_recv_handler;
+
+    ngx_add_timer(c->read, ucf->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_stream_upstream_check_send_handler(c->write);
+    }
+
+    return;
+
+failed:
+
+    ngx_destroy_pool(pool);
+}
+
+
+static void
+ngx_stream_upstream_check_send_handler(ngx_event_t *wev)
+{
+    ssize_t                           n;
+    ngx_buf_t                        *b;
+    ngx_connection_t                 *c;
+    ngx_stream_upstream_check_ctx_t  *ctx;
+
+    c = wev->data;
+    ctx = c->data;
+    b = ctx->request;
+
+    if (!ctx->connected) {
+        if (ngx_stream_upstream_check_test_connect(c) != NGX_OK) {
+            ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+            return;
+        }
+
+        ctx->connected = 1;
+    }
+
+    while (b->pos < b->last) {
+
+        n = c->send(c, b->pos, b->last - b->pos);
+
+        if (n == NGX_ERROR) {
+            ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+            return;
+        }
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+            }
+
+            return;
+        }
+
+        b->pos += n;
+    }
+
+    ngx_stream_upstream_check_recv_handler(c->read);
+}
+
+
+static void
+ngx_stream_upstream_check_recv_handler(ngx_event_t *rev)
+{
+    ssize_t                           n;
+    ngx_int_t                         rc;
+    ngx_buf_t                        *b;
+    ngx_connection_t                 *c;
+    ngx_stream_upstream_check_ctx_t  *ctx;
+
+    c = rev->data;
+    ctx = c->data;
+    b = ctx->response;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "health check timed out");
+        ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+        return;
+    }
+
+    if (ctx->request->pos < ctx->request->last) {
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            rc = ngx_stream_upstream_check_process(ctx, 0);
+
+            if (rc != NGX_AGAIN) {
+                ngx_stream_upstream_check_done(ctx, rc);
+                return;
+            }
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+            return;
+        }
+
+        if (n == 0) {
+            rc = ngx_stream_upstream_check_process(ctx, 1);
+            ngx_stream_upstream_check_done(ctx, rc);
+            return;
+        }
+
+        b->last += n;
+    }
+
+    rc = ngx_stream_upstream_check_process(ctx, 0);
+
+    if (rc != NGX_AGAIN) {
+        ngx_stream_upstream_check_done(ctx, rc);
+        return;
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_stream_upstream_check_done(ctx, NGX_ERROR);
+    }
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_check_test_connect(ngx_connection_t *c)
+{
+    int        err;
+    socklen_t  len;
+
+#if (NGX_HAVE_KQUEUE)
+
+    if (ngx_event_flags & NGX_USE_KQUEUE_EVENT)  {
+        if (c->write->pending_eof || c->read->pending_eof) {
+            if (c->write->pending_eof) {
+                err = c->write->kq_errno;
+
+            } else {
+                err = c->read->kq_errno;
+            }
+
+            (void) ngx_connection_error(c, err,
+                                    "kevent() reported that connect() failed");
+            return NGX_ERROR;
+        }
+
+    } else
+#endif
+    {
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_stream_upstream_check_process(ngx_stream_upstream_check_ctx_t *ctx,
+    ngx_uint_t last)
+{
+    size_t                                 size;
+    ngx_buf_t                             *b;
+    ngx_stream_upstream_check_srv_conf_t  *ucf;
+
+    ucf = ctx->conf;
+    b = ctx->response;
+
+    if (ucf->expect.len == 0) {
+        return NGX_OK;
+    }
+
+    if (ngx_strnstr(b->pos, (char *) ucf->expect.data, b->last - b->pos)) {
+        return NGX_OK;
+    }
+
+    if (!last) {
+
+        /*
+         * only the end of the response received so far, which is shorter
+         * than the string, is kept, as it can be the start of a match
+         */
+
+        size = ngx_min((size_t) (b->last - b->pos), ucf->expect.len - 1);
+
+        b->last = ngx_movemem(b->start, b->last - size, size);
+        b->pos = b->start;
+
+        return NGX_AGAIN;
+    }
+
+    ngx_log_error(NGX_LOG_INFO, ctx->pc.connection->log, 0,
+                  "health check failed, response does not match");
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_stream_upstream_check_done(ngx_stream_upstream_check_ctx_t *ctx,
+    ngx_int_t rc)
+{
+    ngx_stream_upstream_rr_peer_t         *peer;
+    ngx_stream_upstream_rr_peers_t        *peers;
+    ngx_stream_upstream_check_srv_conf_t  *ucf;
+
+    ucf = ctx->conf;
+    peers = ctx->peers;
+    peer = ctx->peer;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_STREAM, &ctx->log, 0,
+                   "health check done: %i", rc);
+
+    if (ctx->pc.connection) {
+        ngx_close_connection(ctx->pc.connection);
+        ctx->pc.connection = NULL;
+    }
+
+    ctx->log.action = NULL;
+
+    ngx_stream_upstream_rr_peers_rlock(peers);
+
+    if (peers->config && *peers->config != ctx->config) {
+
+        /* the peer might have been removed after re-resolving */
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+        ngx_destroy_pool(ctx->pool);
+        return;
+    }
+
+    ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+    if (rc == NGX_OK) {
+        peer->check_fails = 0;
+
+        if (peer->unhealthy && ++peer->check_passes >= ucf->passes) {
+            peer->unhealthy = 0;
+            peer->check_passes = 0;
+
+            ngx_log_error(NGX_LOG_NOTICE, &ctx->log, 0,
+                          "upstream server passed health checks");
+        }
+
+    } else {
+        peer->check_passes = 0;
+
+        if (!peer->unhealthy && ++peer->check_fails >= ucf->fails) {
+            peer->unhealthy = 1;
+            peer->check_fails = 0;
+
+            ngx_log_error(NGX_LOG_WARN, &ctx->log, 0,
+                          "upstream server failed health checks");
+        }
+    }
+
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(peers);
+
+    ngx_destroy_pool(ctx->pool);
+}
+
+
+static u_char *
+ngx_stream_upstream_check_log_error(ngx_log_t *log, u_char *buf, size_t len)
+{
+    u_char                           *p;
+    ngx_stream_upstream_check_ctx_t  *ctx;
+
+    p = buf;
+
+    if (log->action) {
+        p = ngx_snprintf(buf, len, " while %s", log->action);
+        len -= p - buf;
+        buf = p;
+    }
+
+    ctx = log->data;
+
+    p = ngx_snprintf(buf, len, ", upstream: \"%V\", server: %V",
+                     &ctx->upstream->host, &ctx->name);
+
+    return p;
+}
+
+
+static void *
+ngx_stream_upstream_check_create_conf(ngx_conf_t *cf)
+{
+    ngx_stream_upstream_check_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_stream_upstream_check_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->interval = 0;
+     *     conf->send = { 0, NULL };
+     *     conf->expect = { 0, NULL };
+     */
+
+    return conf;
+}
+
+
+static char *
+ngx_stream_upstream_check_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_uint_t                             i;
+    ngx_stream_upstream_srv_conf_t        *uscf, **uscfp;
+    ngx_stream_upstream_main_conf_t       *umcf;
+    ngx_stream_upstream_check_srv_conf_t  *ucf;
+
+    umcf = ngx_stream_conf_get_module_main_conf(cf, ngx_stream_upstream_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->srv_conf == NULL) {
+            continue;
+        }
+
+        ucf = ngx_stream_conf_upstream_srv_conf(uscf,
+                                              ngx_stream_upstream_check_module);
+
+        if (ucf->interval && uscf->shm_zone == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                          "health check requires \"zone\" in upstream \"%V\" "
+                          "in %s:%ui",
+                          &uscf->host, uscf->file_name, uscf->line);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_stream_upstream_check(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_stream_upstream_check_srv_conf_t  *ucf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    if (ucf->interval) {
+        return "is duplicate";
+    }
+
+    ucf->interval = 5000;
+    ucf->fails = 1;
+    ucf->passes = 1;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            ucf->interval = ngx_parse_time(&s, 0);
+
+            if (ucf->interval == (ngx_msec_t) NGX_ERROR
+                || ucf->interval == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = &value[i].data[8];
+
+            ucf->timeout = ngx_parse_time(&s, 0);
+
+            if (ucf->timeout == (ngx_msec_t) NGX_ERROR
+                || ucf->timeout == 0)
+            {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ucf->fails = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "passes=", 7) == 0) {
+
+            n = ngx_atoi(&value[i].data[7], value[i].len - 7);
+
+            if (n == NGX_ERROR || n == 0) {
+                goto invalid;
+            }
+
+            ucf->passes = n;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "send=", 5) == 0) {
+
+            ucf->send.len = value[i].len - 5;
+            ucf->send.data = &value[i].data[5];
+
+            if (ucf->send.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "expect=", 7) == 0) {
+
+            ucf->expect.len = value[i].len - 7;
+            ucf->expect.data = &value[i].data[7];
+
+            if (ucf->expect.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (ucf->timeout == 0) {
+        ucf->timeout = ucf->interval;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -22,9 +22,17 @@ typedef struct {
 } ngx_stream_upstream_chash_points_t;
 
 
+typedef struct {
+    ngx_uint_t                            number;
+    ngx_str_t                           **server;
+    uint32_t                             *entry;
+} ngx_stream_upstream_maglev_t;
+
+
 typedef struct {
     ngx_stream_complex_value_t            key;
     ngx_stream_upstream_chash_points_t   *points;
+    ngx_stream_upstream_maglev_t         *maglev;
 } ngx_stream_upstream_hash_srv_conf_t;
 
 
@@ -49,6 +57,9 @@ static ngx_int_t ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc,
 
 static ngx_int_t ngx_stream_upstream_init_chash(ngx_conf_t *cf,
     ngx_stream_upstream_srv_conf_t *us);
+static ngx_int_t ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us);
+static ngx_uint_t ngx_stream_upstream_maglev_size(ngx_uint_t n);
 static int ngx_libc_cdecl
     ngx_stream_upstream_chash_cmp_points(const void *one, const void *two);
 static ngx_uint_t ngx_stream_upstream_find_chash_point(
@@ -178,7 +189,9 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || ngx_stream_upstream_rr_peers_changed(hp->rrp.peers, &hp->rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -232,7 +245,7 @@ ngx_stream_upstream_get_hash_peer(ngx_peer_connection_t *pc, void *data)
         ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                        "get hash peer, value:%uD, peer:%ui", hp->hash, p);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_stream_upstream_rr_peer_unlock(hp->rrp.peers, peer);
             goto next;
         }
@@ -409,6 +422,153 @@ ngx_stream_upstream_init_chash(ngx_conf_t *cf,
 }
 
 
+static ngx_int_t
+ngx_stream_upstream_init_maglev(ngx_conf_t *cf,
+    ngx_stream_upstream_srv_conf_t *us)
+{
+    u_char                               *key, *p;
+    uint32_t                             *pos, *skip, c;
+    ngx_str_t                            *server;
+    ngx_uint_t                            i, j, n, filled;
+    ngx_stream_upstream_rr_peer_t        *peer;
+    ngx_stream_upstream_rr_peers_t       *peers;
+    ngx_stream_upstream_maglev_t         *maglev;
+    ngx_stream_upstream_hash_srv_conf_t  *hcf;
+
+    if (ngx_stream_upstream_init_round_robin(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    us->peer.init = ngx_stream_upstream_init_chash_peer;
+
+    peers = us->peer.data;
+    n = peers->total_weight;
+
+    /*
+     * Maglev hashing: each weight unit of a server walks its own
+     * permutation of the lookup table, and the permutations take turns
+     * in claiming free entries until the table is full.  The table size
+     * is a prime much larger than the number of weight units, so servers
+     * get nearly equal shares, and only a few entries move when the list
+     * of servers changes.
+     */
+
+    maglev = ngx_palloc(cf->pool, sizeof(ngx_stream_upstream_maglev_t));
+    if (maglev == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->number = ngx_stream_upstream_maglev_size(n);
+
+    maglev->entry = ngx_palloc(cf->pool, maglev->number * sizeof(uint32_t));
+    if (maglev->entry == NULL) {
+        return NGX_ERROR;
+    }
+
+    maglev->server = ngx_palloc(cf->pool, n * sizeof(ngx_str_t *));
+    if (maglev->server == NULL) {
+        return NGX_ERROR;
+    }
+
+    pos = ngx_palloc(cf->temp_pool, 2 * n * sizeof(uint32_t));
+    if (pos == NULL) {
+        return NGX_ERROR;
+    }
+
+    skip = pos + n;
+    i = 0;
+
+    for (peer = peers->peer; peer; peer = peer->next) {
+        server = &peer->server;
+
+        key = ngx_pnalloc(cf->temp_pool, server->len + 1 + NGX_INT_T_LEN);
+        if (key == NULL) {
+            return NGX_ERROR;
+        }
+
+        for (j = 0; j < (ngx_uint_t) peer->weight; j++) {
+
+            /* SERVER \0 WEIGHT_UNIT */
+
+            p = ngx_cpymem(key, server->data, server->len);
+            *p++ = '\0';
+            p = ngx_sprintf(p, "%ui", j);
+
+            pos[i] = ngx_crc32_long(key, p - key) % maglev->number;
+            skip[i] = ngx_murmur_hash2(key, p - key)
+                      % (maglev->number - 1) + 1;
+
+            maglev->server[i++] = server;
+        }
+    }
+
+    ngx_memset(maglev->entry, 0xff, maglev->number * sizeof(uint32_t));
+
+    filled = 0;
+
+    for ( ;; ) {
+        for (i = 0; i < n; i++) {
+
+            do {
+                c = pos[i];
+                pos[i] = (c + skip[i]) % maglev->number;
+
+            } while (maglev->entry[c] != (uint32_t) -1);
+
+            maglev->entry[c] = i;
+
+            if (++filled == maglev->number) {
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, cf->log, 0,
+                   "maglev table size:%ui, servers:%ui", maglev->number, n);
+
+    hcf = ngx_stream_conf_upstream_srv_conf(us,
+                                            ngx_stream_upstream_hash_module);
+    hcf->maglev = maglev;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t
+ngx_stream_upstream_maglev_size(ngx_uint_t n)
+{
+    ngx_uint_t  size, i;
+
+    /*
+     * the table size must not follow the number of servers exactly,
+     * or almost all keys would be remapped on any change: it is 65537
+     * unless there are more than 655 weight units, otherwise the smallest
+     * prime at least 4 times larger, and so on
+     */
+
+    size = 65537;
+
+    while (size < n * 100) {
+
+        for (size *= 4; /* void */ ; size++) {
+            for (i = 2; i * i <= size; i++) {
+                if (size % i == 0) {
+                    break;
+                }
+            }
+
+            if (i * i > size) {
+                break;
+            }
+        }
+    }
+
+    return size;
+}
+
+
 static int ngx_libc_cdecl
 ngx_stream_upstream_chash_cmp_points(const void *one, const void *two)
 {
@@ -481,6 +641,11 @@ ngx_stream_upstream_init_chash_peer(ngx_stream_session_t *s,
 
     hash = ngx_crc32_long(hp->key.data, hp->key.len);
 
+    if (hcf->maglev) {
+        hp->hash = hash % hcf->maglev->number;
+        return NGX_OK;
+    }
+
     ngx_stream_upstream_rr_peers_rlock(hp->rrp.peers);
 
     hp->hash = ngx_stream_upstream_find_chash_point(hcf->points, hash);
@@ -502,7 +667,7 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     ngx_int_t                             total;
     ngx_uint_t                            i, n, best_i;
     ngx_stream_upstream_rr_peer_t        *peer, *best;
-    ngx_stream_upstream_chash_point_t    *point;
+    ngx_stream_upstream_maglev_t         *maglev;
     ngx_stream_upstream_chash_points_t   *points;
     ngx_stream_upstream_hash_srv_conf_t  *hcf;
 
@@ -511,7 +676,9 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_wlock(hp->rrp.peers);
 
-    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0) {
+    if (hp->tries > 20 || hp->rrp.peers->single || hp->key.len == 0
+        || ngx_stream_upstream_rr_peers_changed(hp->rrp.peers, &hp->rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(hp->rrp.peers);
         return hp->get_rr_peer(pc, &hp->rrp);
     }
@@ -522,10 +689,16 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
     hcf = hp->conf;
 
     points = hcf->points;
-    point = &points->point[0];
+    maglev = hcf->maglev;
 
     for ( ;; ) {
-        server = point[hp->hash % points->number].server;
+
+        if (maglev) {
+            server = maglev->server[maglev->entry[hp->hash % maglev->number]];
+
+        } else {
+            server = points->point[hp->hash % points->number].server;
+        }
 
         ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                        "consistent hash peer:%uD, server:\"%V\"",
@@ -546,7 +719,7 @@ ngx_stream_upstream_get_chash_peer(ngx_peer_connection_t *pc, void *data)
                 continue;
             }
 
-            if (peer->down) {
+            if (peer->down || peer->unhealthy) {
                 continue;
             }
 
@@ -629,6 +802,7 @@ ngx_stream_upstream_hash_create_conf(ngx_conf_t *cf)
     }
 
     conf->points = NULL;
+    conf->maglev = NULL;
 
     return conf;
 }
@@ -675,6 +849,9 @@ ngx_stream_upstream_hash(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     } else if (ngx_strcmp(value[2].data, "consistent") == 0) {
         uscf->peer.init_upstream = ngx_stream_upstream_init_chash;
 
+    } else if (ngx_strcmp(value[2].data, "consistent=maglev") == 0) {
+        uscf->peer.init_upstream = ngx_stream_upstream_init_maglev;
+
     } else {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[2]);
@@ -9,6 +9,12 @@
 #include <ngx_stream.h>
 
 
+#define NGX_STREAM_UPSTREAM_LEAST_TIME_CONNECT     1
+#define NGX_STREAM_UPSTREAM_LEAST_TIME_FIRST_BYTE  2
+
+#define NGX_STREAM_UPSTREAM_EWMA_DECAY         10000 /* 10s */
+
+
 typedef struct {
     ngx_stream_upstream_rr_peer_t          *peer;
     ngx_uint_t                              range;
@@ -17,7 +23,11 @@ typedef struct {
 
 typedef struct {
     ngx_uint_t                              two;
+    ngx_uint_t                              least_time;
     ngx_stream_upstream_random_range_t     *ranges;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    ngx_uint_t                              config;
+#endif
 } ngx_stream_upstream_random_srv_conf_t;
 
 
@@ -26,6 +36,7 @@ typedef struct {
     ngx_stream_upstream_rr_peer_data_t      rrp;
 
     ngx_stream_upstream_random_srv_conf_t  *conf;
+    ngx_stream_session_t                   *session;
     u_char                                  tries;
 } ngx_stream_upstream_random_peer_data_t;
 
@@ -41,6 +52,10 @@ static ngx_int_t ngx_stream_upstream_get_random_peer(ngx_peer_connection_t *pc,
     void *data);
 static ngx_int_t ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc,
     void *data);
+static void ngx_stream_upstream_free_random_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+static uint64_t ngx_stream_upstream_random_cost(
+    ngx_stream_upstream_rr_peer_t *peer);
 static ngx_uint_t ngx_stream_upstream_peek_random_peer(
     ngx_stream_upstream_rr_peers_t *peers,
     ngx_stream_upstream_random_peer_data_t *rp);
@@ -134,6 +149,16 @@ ngx_stream_upstream_update_random(ngx_pool_t *pool,
         return NGX_ERROR;
     }
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (pool == NULL) {
+        if (rcf->ranges) {
+            ngx_free(rcf->ranges);
+        }
+
+        rcf->config = peers->config ? *peers->config : 0;
+    }
+#endif
+
     total_weight = 0;
 
     for (peer = peers->peer, i = 0; peer; peer = peer->next, i++) {
@@ -180,13 +205,21 @@ ngx_stream_upstream_init_random_peer(ngx_stream_session_t *s,
         s->upstream->peer.get = ngx_stream_upstream_get_random_peer;
     }
 
+    if (rcf->least_time) {
+        s->upstream->peer.free = ngx_stream_upstream_free_random_peer;
+    }
+
     rp->conf = rcf;
+    rp->session = s;
     rp->tries = 0;
 
     ngx_stream_upstream_rr_peers_rlock(rp->rrp.peers);
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
-    if (rp->rrp.peers->shpool && rcf->ranges == NULL) {
+    if (rp->rrp.peers->shpool
+        && (rcf->ranges == NULL
+            || ngx_stream_upstream_rr_peers_changed(rp->rrp.peers, rcf)))
+    {
         if (ngx_stream_upstream_update_random(NULL, us) != NGX_OK) {
             ngx_stream_upstream_rr_peers_unlock(rp->rrp.peers);
             return NGX_ERROR;
@@ -220,7 +253,9 @@ ngx_stream_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_rlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single
+        || ngx_stream_upstream_rr_peers_changed(peers, rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(peers);
         return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -245,7 +280,7 @@ ngx_stream_upstream_get_random_peer(ngx_peer_connection_t *pc, void *data)
 
         ngx_stream_upstream_rr_peer_lock(peers, peer);
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             ngx_stream_upstream_rr_peer_unlock(peers, peer);
             goto next;
         }
@@ -314,7 +349,9 @@ ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 
     ngx_stream_upstream_rr_peers_wlock(peers);
 
-    if (rp->tries > 20 || peers->single) {
+    if (rp->tries > 20 || peers->single
+        || ngx_stream_upstream_rr_peers_changed(peers, rrp))
+    {
         ngx_stream_upstream_rr_peers_unlock(peers);
         return ngx_stream_upstream_get_round_robin_peer(pc, rrp);
     }
@@ -347,7 +384,7 @@ ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
             goto next;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             goto next;
         }
 
@@ -363,7 +400,18 @@ ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
         }
 
         if (prev) {
-            if (peer->conns * prev->weight > prev->conns * peer->weight) {
+            if (rp->conf->least_time) {
+                if (ngx_stream_upstream_random_cost(peer) * prev->weight
+                    > ngx_stream_upstream_random_cost(prev) * peer->weight)
+                {
+                    peer = prev;
+                    n = p / (8 * sizeof(uintptr_t));
+                    m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
+                }
+
+            } else if (peer->conns * prev->weight
+                       > prev->conns * peer->weight)
+            {
                 peer = prev;
                 n = p / (8 * sizeof(uintptr_t));
                 m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
@@ -403,6 +451,91 @@ ngx_stream_upstream_get_random2_peer(ngx_peer_connection_t *pc, void *data)
 }
 
 
+static void
+ngx_stream_upstream_free_random_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_stream_upstream_random_peer_data_t  *rp = data;
+
+    ngx_msec_t                      time, now, elapsed;
+    ngx_stream_upstream_state_t    *us;
+    ngx_stream_upstream_rr_peer_t  *peer;
+
+    us = rp->session->upstream->state;
+
+    if ((state & NGX_PEER_FAILED) || us == NULL || rp->rrp.peers->single) {
+        goto done;
+    }
+
+    if (rp->conf->least_time == NGX_STREAM_UPSTREAM_LEAST_TIME_CONNECT) {
+        time = us->connect_time;
+
+    } else {
+        time = us->first_byte_time;
+    }
+
+    if (time == (ngx_msec_t) -1) {
+        goto done;
+    }
+
+    peer = rp->rrp.current;
+
+    /*
+     * peak EWMA, in microseconds: a sample above the average replaces
+     * it immediately, while lower samples are weighted by the time
+     * elapsed since the previous one
+     */
+
+    time *= 1000;
+    now = ngx_current_msec;
+
+    ngx_stream_upstream_rr_peers_rlock(rp->rrp.peers);
+    ngx_stream_upstream_rr_peer_lock(rp->rrp.peers, peer);
+
+    if (time >= peer->ewma) {
+        peer->ewma = time;
+
+    } else {
+        elapsed = now - peer->ewma_time;
+
+        peer->ewma -= (uint64_t) (peer->ewma - time) * elapsed
+                      / (elapsed + NGX_STREAM_UPSTREAM_EWMA_DECAY);
+    }
+
+    peer->ewma_time = now;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
+                   "free random peer, time:%M ewma:%M", time, peer->ewma);
+
+    ngx_stream_upstream_rr_peer_unlock(rp->rrp.peers, peer);
+    ngx_stream_upstream_rr_peers_unlock(rp->rrp.peers);
+
+done:
+
+    ngx_stream_upstream_free_round_robin_peer(pc, data, state);
+}
+
+
+static uint64_t
+ngx_stream_upstream_random_cost(ngx_stream_upstream_rr_peer_t *peer)
+{
+    ngx_msec_t  ewma, elapsed;
+
+    /*
+     * expected latency: the average decays while there are no samples,
+     * so a peer which was slow once is eventually tried again; 1ms is
+     * added for the number of connections to matter without samples
+     */
+
+    elapsed = ngx_current_msec - peer->ewma_time;
+
+    ewma = (uint64_t) peer->ewma * NGX_STREAM_UPSTREAM_EWMA_DECAY
+           / (elapsed + NGX_STREAM_UPSTREAM_EWMA_DECAY);
+
+    return (uint64_t) (ewma + 1000) * (peer->conns + 1);
+}
+
+
 static ngx_uint_t
 ngx_stream_upstream_peek_random_peer(ngx_stream_upstream_rr_peers_t *peers,
     ngx_stream_upstream_random_peer_data_t *rp)
@@ -443,6 +576,7 @@ ngx_stream_upstream_random_create_conf(ngx_conf_t *cf)
      * set by ngx_pcalloc():
      *
      *     conf->two = 0;
+     *     conf->least_time = 0;
      */
 
     return conf;
@@ -492,11 +626,21 @@ ngx_stream_upstream_random(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_OK;
     }
 
-    if (ngx_strcmp(value[2].data, "least_conn") != 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[2]);
-        return NGX_CONF_ERROR;
+    if (ngx_strcmp(value[2].data, "least_conn") == 0) {
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_time=first_byte") == 0) {
+        rcf->least_time = NGX_STREAM_UPSTREAM_LEAST_TIME_FIRST_BYTE;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strcmp(value[2].data, "least_time=connect") == 0) {
+        rcf->least_time = NGX_STREAM_UPSTREAM_LEAST_TIME_CONNECT;
+        return NGX_CONF_OK;
     }
 
-    return NGX_CONF_OK;
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[2]);
+    return NGX_CONF_ERROR;
 }
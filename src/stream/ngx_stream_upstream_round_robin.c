@@ -15,7 +15,7 @@
 
 
 static ngx_stream_upstream_rr_peer_t *ngx_stream_upstream_get_peer(
-    ngx_stream_upstream_rr_peer_data_t *rrp);
+    ngx_stream_upstream_rr_peer_data_t *rrp, ngx_int_t *weights);
 static void ngx_stream_upstream_notify_round_robin_peer(
     ngx_peer_connection_t *pc, void *data, ngx_uint_t state);
 
@@ -109,6 +109,9 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+                peer[n].host = server[i].resolve ? i + 1 : 0;
+#endif
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
@@ -179,6 +182,9 @@ ngx_stream_upstream_init_round_robin(ngx_conf_t *cf,
                 peer[n].fail_timeout = server[i].fail_timeout;
                 peer[n].down = server[i].down;
                 peer[n].server = server[i].name;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+                peer[n].host = server[i].resolve ? i + 1 : 0;
+#endif
 
                 *peerp = &peer[n];
                 peerp = &peer[n].next;
@@ -282,12 +288,22 @@ ngx_stream_upstream_init_round_robin_peer(ngx_stream_session_t *s,
     rrp->current = NULL;
     rrp->config = 0;
 
+    ngx_stream_upstream_rr_peers_rlock(rrp->peers);
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    if (rrp->peers->config) {
+        rrp->config = *rrp->peers->config;
+    }
+#endif
+
     n = rrp->peers->number;
 
     if (rrp->peers->next && rrp->peers->next->number > n) {
         n = rrp->peers->next->number;
     }
 
+    ngx_stream_upstream_rr_peers_unlock(rrp->peers);
+
     if (n <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
         rrp->data = 0;
@@ -442,7 +458,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 {
     ngx_stream_upstream_rr_peer_data_t *rrp = data;
 
-    ngx_int_t                        rc;
+    ngx_int_t                        rc, *weights;
     ngx_uint_t                       i, n;
     ngx_stream_upstream_rr_peer_t   *peer;
     ngx_stream_upstream_rr_peers_t  *peers;
@@ -453,16 +469,49 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->connection = NULL;
 
     peers = rrp->peers;
-    ngx_stream_upstream_rr_peers_wlock(peers);
+    weights = NULL;
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+    /*
+     * with current weights kept per worker process, peers are only
+     * modified under their own locks, and a shared lock is enough;
+     * the weights are replaced along with the list of peers, so they
+     * are only looked at under the lock
+     */
+
+    if (peers->worker_weights) {
+        ngx_stream_upstream_rr_peers_rlock(peers);
+
+        weights = ngx_event_peer_worker_weights(peers->worker_weights,
+                                                peers->number);
+
+    } else
+#endif
+    {
+        ngx_stream_upstream_rr_peers_wlock(peers);
+    }
+
+    if (ngx_stream_upstream_rr_peers_changed(peers, rrp)) {
+
+        /* peers were changed after the session was started */
+
+        ngx_stream_upstream_rr_peers_unlock(peers);
+        goto busy;
+    }
 
     if (peers->single) {
         peer = peers->peer;
 
-        if (peer->down) {
+        ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+        if (peer->down || peer->unhealthy) {
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
             goto failed;
         }
 
         if (peer->max_conns && peer->conns >= peer->max_conns) {
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
             goto failed;
         }
 
@@ -472,7 +521,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
         /* there are several peers */
 
-        peer = ngx_stream_upstream_get_peer(rrp);
+        peer = ngx_stream_upstream_get_peer(rrp, weights);
 
         if (peer == NULL) {
             goto failed;
@@ -489,6 +538,7 @@ ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
 
     peer->conns++;
 
+    ngx_stream_upstream_rr_peer_unlock(peers, peer);
     ngx_stream_upstream_rr_peers_unlock(peers);
 
     return NGX_OK;
@@ -516,11 +566,13 @@ failed:
             return rc;
         }
 
-        ngx_stream_upstream_rr_peers_wlock(peers);
+        ngx_stream_upstream_rr_peers_rlock(peers);
     }
 
     ngx_stream_upstream_rr_peers_unlock(peers);
 
+busy:
+
     pc->name = peers->name;
 
     return NGX_BUSY;
@@ -528,24 +580,31 @@ failed:
 
 
 static ngx_stream_upstream_rr_peer_t *
-ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
+ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp,
+    ngx_int_t *weights)
 {
-    time_t                          now;
-    uintptr_t                       m;
-    ngx_int_t                       total;
-    ngx_uint_t                      i, n, p;
-    ngx_stream_upstream_rr_peer_t  *peer, *best;
+    time_t                           now;
+    uintptr_t                        m;
+    ngx_int_t                        total, *current, *best_current;
+    ngx_uint_t                       i, n, p;
+    ngx_stream_upstream_rr_peer_t   *peer, *best;
+    ngx_stream_upstream_rr_peers_t  *peers;
 
     now = ngx_time();
 
+    peers = rrp->peers;
+
+again:
+
     best = NULL;
     total = 0;
 
 #if (NGX_SUPPRESS_WARN)
     p = 0;
+    best_current = NULL;
 #endif
 
-    for (peer = rrp->peers->peer, i = 0;
+    for (peer = peers->peer, i = 0;
          peer;
          peer = peer->next, i++)
     {
@@ -556,7 +615,7 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        if (peer->down) {
+        if (peer->down || peer->unhealthy) {
             continue;
         }
 
@@ -571,15 +630,24 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
-        peer->current_weight += peer->effective_weight;
+        current = weights ? &weights[i] : &peer->current_weight;
+
+        *current += peer->effective_weight;
         total += peer->effective_weight;
 
         if (peer->effective_weight < peer->weight) {
-            peer->effective_weight++;
+            ngx_stream_upstream_rr_peer_lock(peers, peer);
+
+            if (peer->effective_weight < peer->weight) {
+                peer->effective_weight++;
+            }
+
+            ngx_stream_upstream_rr_peer_unlock(peers, peer);
         }
 
-        if (best == NULL || peer->current_weight > best->current_weight) {
+        if (best == NULL || *current > *best_current) {
             best = peer;
+            best_current = current;
             p = i;
         }
     }
@@ -588,14 +656,24 @@ ngx_stream_upstream_get_peer(ngx_stream_upstream_rr_peer_data_t *rrp)
         return NULL;
     }
 
-    rrp->current = best;
-
     n = p / (8 * sizeof(uintptr_t));
     m = (uintptr_t) 1 << p % (8 * sizeof(uintptr_t));
 
     rrp->tried[n] |= m;
 
-    best->current_weight -= total;
+    *best_current -= total;
+
+    ngx_stream_upstream_rr_peer_lock(peers, best);
+
+    if (best->max_conns && best->conns >= best->max_conns) {
+
+        /* the limit was reached by another worker process */
+
+        ngx_stream_upstream_rr_peer_unlock(peers, best);
+        goto again;
+    }
+
+    rrp->current = best;
 
     if (now - best->checked > best->fail_timeout) {
         best->checked = now;
@@ -613,6 +691,9 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     time_t                          now;
     ngx_stream_upstream_rr_peer_t  *peer;
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    ngx_uint_t                      zombie;
+#endif
 
     ngx_log_debug2(NGX_LOG_DEBUG_STREAM, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
@@ -625,7 +706,18 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     if (rrp->peers->single) {
         peer->conns--;
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+        zombie = (peer->zombie && peer->conns == 0);
+#endif
+
         ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+        if (zombie) {
+            ngx_stream_upstream_zone_free_peer(rrp->peers, peer);
+        }
+#endif
+
         ngx_stream_upstream_rr_peers_unlock(rrp->peers);
 
         pc->tries = 0;
@@ -667,7 +759,22 @@ ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
 
     peer->conns--;
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+    zombie = (peer->zombie && peer->conns == 0);
+#endif
+
     ngx_stream_upstream_rr_peer_unlock(rrp->peers, peer);
+
+#if (NGX_STREAM_UPSTREAM_ZONE)
+
+    /* the peer was removed from the list while in use */
+
+    if (zombie) {
+        ngx_stream_upstream_zone_free_peer(rrp->peers, peer);
+    }
+
+#endif
+
     ngx_stream_upstream_rr_peers_unlock(rrp->peers);
 
     if (pc->tries) {
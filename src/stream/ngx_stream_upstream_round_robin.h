@@ -38,13 +38,22 @@ struct ngx_stream_upstream_rr_peer_s {
     ngx_msec_t                       slow_start;
     ngx_msec_t                       start_time;
 
+    ngx_msec_t                       ewma;
+    ngx_msec_t                       ewma_time;
+
     ngx_uint_t                       down;
+    ngx_uint_t                       unhealthy;
+
+    ngx_uint_t                       check_fails;
+    ngx_uint_t                       check_passes;
 
     void                            *ssl_session;
     int                              ssl_session_len;
 
 #if (NGX_STREAM_UPSTREAM_ZONE)
     ngx_atomic_t                     lock;
+    ngx_uint_t                       host;
+    ngx_uint_t                       zombie;
 #endif
 
     ngx_stream_upstream_rr_peer_t   *next;
@@ -60,6 +69,9 @@ struct ngx_stream_upstream_rr_peers_s {
     ngx_slab_pool_t                 *shpool;
     ngx_atomic_t                     rwlock;
     ngx_stream_upstream_rr_peers_t  *zone_next;
+    ngx_int_t                       *worker_weights;
+    ngx_msec_t                       check_time;
+    ngx_uint_t                      *config;
 #endif
 
     ngx_uint_t                       total_weight;
@@ -109,6 +121,9 @@ struct ngx_stream_upstream_rr_peers_s {
         ngx_rwlock_unlock(&peer->lock);                                       \
     }
 
+#define ngx_stream_upstream_rr_peers_changed(peers, rrp)                      \
+    ((peers)->config && *(peers)->config != (rrp)->config)
+
 #else
 
 #define ngx_stream_upstream_rr_peers_rlock(peers)
@@ -116,6 +131,7 @@ struct ngx_stream_upstream_rr_peers_s {
 #define ngx_stream_upstream_rr_peers_unlock(peers)
 #define ngx_stream_upstream_rr_peer_lock(peers, peer)
 #define ngx_stream_upstream_rr_peer_unlock(peers, peer)
+#define ngx_stream_upstream_rr_peers_changed(peers, rrp)  0
 
 #endif
 
@@ -140,5 +156,10 @@ ngx_int_t ngx_stream_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
 void ngx_stream_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
 
+#if (NGX_STREAM_UPSTREAM_ZONE)
+void ngx_stream_upstream_zone_free_peer(ngx_stream_upstream_rr_peers_t *peers,
+    ngx_stream_upstream_rr_peer_t *peer);
+#endif
+
 
 #endif /* _NGX_STREAM_UPSTREAM_ROUND_ROBIN_H_INCLUDED_ */